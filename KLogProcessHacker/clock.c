@@ -0,0 +1,246 @@
+//----------------------------------------------------------------------------
+// Calibrated clock that produces PCAP-NG timestamps from the performance
+// counter
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+// Per-processor clock state
+// Aligned to a cache line so processors do not share lines.
+struct DECLSPEC_CACHEALIGN CLOCK_CPU {
+    LONGLONG LastTimestamp;  // Last timestamp returned on this processor
+};
+
+typedef struct CLOCK_CPU CLOCK_CPU;
+
+typedef VOID (NTAPI *QUERY_SYSTEM_TIME_PRECISE)(__out PLARGE_INTEGER currentTime);
+
+//----------------------------------------------------------------------------
+// Global variables
+//----------------------------------------------------------------------------
+
+static CLOCK_CALIBRATION          gCalibration;                   // Current calibration
+static volatile LONG              gCalibrationSequence = 0;       // Odd while the calibration is being updated
+static CLOCK_CPU                 *gClockCpus           = NULL;    // State for each processor
+static ULONG                      gClockCpuCount       = 0;       // Number of processors with clock state
+static KDPC                       gClockDpc;                      // DPC to recalibrate the clock
+static const LONG                 gClockPeriod         = 1000;    // Milliseconds between recalibrations
+static KTIMER                     gClockTimer;                    // Timer to trigger recalibration
+static bool                       gClockTimerSet       = false;   // True if the recalibration timer was set
+static LONGLONG                   gClockTolerance      = 0;       // Drift in microseconds to ignore when recalibrating
+static const LONGLONG             gHeadroom            = 64;      // Seconds between calibrations before the fast path overflows
+static QUERY_SYSTEM_TIME_PRECISE  gQueryPreciseTime    = NULL;    // KeQuerySystemTimePrecise if the system has it
+static const LONGLONG             gTimestampConv = 11644473600;   // Number of seconds between 1/1/1601 and 1/1/1970
+
+//----------------------------------------------------------------------------
+// Readers retry if the recalibration DPC updated the calibration while they
+// were copying it
+static inline void ReadCalibration(__out CLOCK_CALIBRATION *calibration)
+{
+    LONG sequence;
+
+    do {
+        sequence = gCalibrationSequence;
+        KeMemoryBarrier();
+        *calibration = gCalibration;
+        KeMemoryBarrier();
+    } while ((sequence & 1) || (sequence != gCalibrationSequence));
+}
+
+//----------------------------------------------------------------------------
+void CalibrateClock(__out CLOCK_CALIBRATION *calibration)
+{
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER systemTime;
+
+    counter = KeQueryPerformanceCounter(&frequency);
+    if (gQueryPreciseTime) {
+        gQueryPreciseTime(&systemTime);
+    } else {
+        KeQuerySystemTime(&systemTime);
+    }
+
+    calibration->BaseCounter = counter.QuadPart;
+    calibration->BaseTime    = systemTime.QuadPart / 10 - gTimestampConv * 1000000;
+    calibration->BaseUptime  = (counter.QuadPart / frequency.QuadPart) * 1000000 +
+            (counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+    SetClockScale(calibration, frequency.QuadPart, gHeadroom);
+}
+
+//----------------------------------------------------------------------------
+void ClockGetTimestamp(
+    __out     LARGE_INTEGER *timestamp,
+    __out_opt UINT32        *tiebreaker)
+{
+    CLOCK_CALIBRATION calibration;
+    LONGLONG          delta;
+    LONGLONG          now;
+    ULONG             cpu;
+
+    ReadCalibration(&calibration);
+    delta = KeQueryPerformanceCounter(NULL).QuadPart - calibration.BaseCounter;
+    if ((delta >= 0) && (delta <= calibration.MaxDelta)) {
+        now = calibration.BaseTime + ScaleCounterDelta(&calibration, delta);
+    } else {
+        // Recalibration stalled for longer than the headroom, so fall back to
+        // the system time
+        LARGE_INTEGER systemTime;
+        KeQuerySystemTime(&systemTime);
+        now = systemTime.QuadPart / 10 - gTimestampConv * 1000000;
+    }
+
+    // Never go backwards or repeat a timestamp on this processor
+    cpu = KeGetCurrentProcessorNumberEx(NULL);
+    if (cpu < gClockCpuCount) {
+        volatile LONGLONG *last = &gClockCpus[cpu].LastTimestamp;
+        for (;;) {
+            const LONGLONG previous = *last;
+            const LONGLONG next     = (now > previous) ? now : previous + 1;
+            if (InterlockedCompareExchange64(last, next, previous) == previous) {
+                now = next;
+                break;
+            }
+        }
+    }
+
+    timestamp->QuadPart = now;
+    if (tiebreaker) {
+        *tiebreaker = cpu;
+    }
+}
+
+//----------------------------------------------------------------------------
+LONGLONG ClockGetUptime(void)
+{
+    CLOCK_CALIBRATION calibration;
+    LARGE_INTEGER     counter;
+    LARGE_INTEGER     frequency;
+    LONGLONG          delta;
+
+    ReadCalibration(&calibration);
+    counter = KeQueryPerformanceCounter(&frequency);
+    delta   = counter.QuadPart - calibration.BaseCounter;
+    if ((delta >= 0) && (delta <= calibration.MaxDelta)) {
+        return calibration.BaseUptime + ScaleCounterDelta(&calibration, delta);
+    }
+    return (counter.QuadPart / frequency.QuadPart) * 1000000 +
+            (counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS DeinitializeClock(void)
+{
+    if (gClockTimerSet) {
+        KeCancelTimer(&gClockTimer);
+        KeFlushQueuedDpcs();
+        gClockTimerSet = false;
+    }
+    if (gClockCpus) {
+        FreePages(gClockCpus, gClockCpuCount * sizeof(CLOCK_CPU), MemoryClock);
+        gClockCpus     = NULL;
+        gClockCpuCount = 0;
+    }
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS InitializeClock(__in DEVICE_OBJECT *device)
+{
+    LARGE_INTEGER dueTime;
+    ULONG         cpuCount;
+
+    UNREFERENCED_PARAMETER(device);
+
+    gQueryPreciseTime = (QUERY_SYSTEM_TIME_PRECISE)KphGetSystemRoutineAddress(
+            L"KeQuerySystemTimePrecise");
+    if (!gQueryPreciseTime) {
+        // The coarse system time only advances once per clock tick
+        gClockTolerance = KeQueryTimeIncrement() / 10;
+    }
+    CalibrateClock(&gCalibration);
+
+    // Allocate state for each processor, rounded up to a whole page so the
+    // state starts on a cache line boundary
+    cpuCount   = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    gClockCpus = AllocatePages(cpuCount * sizeof(CLOCK_CPU), MemoryClock);
+    if (!gClockCpus) {
+        DBGPRINT(D_ERR, "Cannot allocate processor clock state");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(gClockCpus, cpuCount * sizeof(CLOCK_CPU));
+    gClockCpuCount = cpuCount;
+
+    KeInitializeDpc(&gClockDpc, RecalibrateClock, NULL);
+    KeInitializeTimer(&gClockTimer);
+    dueTime.QuadPart = -10000LL * gClockPeriod;
+    KeSetTimerEx(&gClockTimer, dueTime, gClockPeriod, &gClockDpc);
+    gClockTimerSet = true;
+
+    DBGPRINT(D_INFO, "Calibrated clock with multiplier %I64u and shift %u",
+            gCalibration.Multiplier, gCalibration.Shift);
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+// Only this DPC writes the calibration after initialization
+void RecalibrateClock(
+    __in     KDPC *dpc,
+    __in_opt void *context,
+    __in_opt void *arg1,
+    __in_opt void *arg2)
+{
+    CLOCK_CALIBRATION calibration;
+    LONGLONG          delta;
+
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(arg1);
+    UNREFERENCED_PARAMETER(arg2);
+
+    CalibrateClock(&calibration);
+
+    // Keep following the current mapping when it agrees with the system time
+    // to within the system time's resolution.  Otherwise timestamps would jump
+    // by up to a clock tick on every recalibration.
+    delta = calibration.BaseCounter - gCalibration.BaseCounter;
+    if ((delta >= 0) && (delta <= gCalibration.MaxDelta)) {
+        const LONGLONG drift = calibration.BaseTime -
+                (gCalibration.BaseTime + ScaleCounterDelta(&gCalibration, delta));
+        if ((drift > -gClockTolerance) && (drift < gClockTolerance)) {
+            calibration.BaseTime -= drift;
+        }
+    }
+
+    InterlockedIncrement(&gCalibrationSequence);
+    gCalibration = calibration;
+    InterlockedIncrement(&gCalibrationSequence);
+}
+
+#ifdef __cplusplus
+};
+#endif
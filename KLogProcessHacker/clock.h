@@ -0,0 +1,150 @@
+//----------------------------------------------------------------------------
+// Calibrated clock that produces PCAP-NG timestamps from the performance
+// counter
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+// Mapping from the performance counter to microseconds
+// A counter value converts to microseconds as
+//   BaseTime + (((counter - BaseCounter) * Multiplier) >> Shift)
+// as long as counter - BaseCounter is between 0 and MaxDelta.
+struct CLOCK_CALIBRATION {
+    LONGLONG  BaseCounter;  // Performance counter value when calibrated
+    LONGLONG  BaseTime;     // Microseconds since 1970-01-01 when calibrated
+    LONGLONG  BaseUptime;   // Microseconds since the counter started when calibrated
+    ULONGLONG Multiplier;   // Microseconds per counter tick, scaled by 2^Shift
+    ULONG     Shift;        // Number of bits Multiplier is scaled by
+    LONGLONG  MaxDelta;     // Largest counter delta that cannot overflow
+};
+
+typedef struct CLOCK_CALIBRATION CLOCK_CALIBRATION;
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Converts a performance counter delta to microseconds
+///
+/// @param calibration  Calibration to convert with
+/// @param delta        Counter delta, between 0 and the calibration's MaxDelta
+///
+/// @returns Microseconds in the delta, rounded down
+static inline LONGLONG ScaleCounterDelta(
+    __in const CLOCK_CALIBRATION *calibration,
+    __in const LONGLONG           delta)
+{
+    return (LONGLONG)(((ULONGLONG)delta * calibration->Multiplier) >>
+            calibration->Shift);
+}
+
+//----------------------------------------------------------------------------
+/// @brief Sets the multiplier, shift, and largest delta of a calibration
+///
+/// Only uses integer operations, so it behaves the same in and out of the
+/// kernel.  The frequency is fixed at boot, so this is the only place the
+/// clock divides.  The multiplier uses the largest shift up to 32 that
+/// cannot overflow for counter deltas of up to headroom seconds.
+///
+/// @param calibration  Calibration to fill in
+/// @param frequency    Performance counter ticks per second
+/// @param headroom     Seconds of counter deltas that must not overflow
+static inline void SetClockScale(
+    __inout CLOCK_CALIBRATION *calibration,
+    __in    const LONGLONG     frequency,
+    __in    const LONGLONG     headroom)
+{
+    ULONG shift;
+
+    calibration->MaxDelta = frequency * headroom;
+    for (shift = 32; shift > 0; shift--) {
+        const ULONGLONG multiplier = (1000000ULL << shift) / frequency;
+        if (multiplier && ((ULONGLONG)calibration->MaxDelta <= MAXLONGLONG / multiplier)) {
+            break;
+        }
+    }
+    calibration->Shift      = shift;
+    calibration->Multiplier = (1000000ULL << shift) / frequency;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Measures a calibration from the performance counter and system time
+///
+/// @param calibration  Buffer to hold the calibration
+void CalibrateClock(__out CLOCK_CALIBRATION *calibration);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the current time in PCAP-NG format from the calibrated clock
+///
+/// Timestamps taken on the same processor are strictly increasing.  When the
+/// calibrated time has not advanced since the processor's last timestamp, the
+/// clock returns the last timestamp plus one microsecond.  Timestamps taken
+/// on different processors can be equal, so the clock also returns the
+/// processor number to break ties.
+///
+/// @param timestamp   Buffer to hold microseconds since 1970-01-01
+/// @param tiebreaker  Buffer to hold the processor number (NULL if not needed)
+void ClockGetTimestamp(
+    __out     LARGE_INTEGER *timestamp,
+    __out_opt UINT32        *tiebreaker);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the time elapsed since the performance counter started
+///
+/// @returns Microseconds since the performance counter started
+LONGLONG ClockGetUptime(void);
+
+//----------------------------------------------------------------------------
+/// @brief Stops periodic calibration and frees the per-processor state
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS DeinitializeClock(void);
+
+//----------------------------------------------------------------------------
+/// @brief Calibrates the clock and starts periodic calibration
+///
+/// @param device  WDM device object for this driver
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS InitializeClock(__in DEVICE_OBJECT *device);
+
+//----------------------------------------------------------------------------
+/// @brief Recalibrates the clock to follow changes to the system time
+///
+/// @param dpc      DPC object associated with this routine
+/// @param context  Unused
+/// @param arg1     Unused
+/// @param arg2     Unused
+KDEFERRED_ROUTINE RecalibrateClock;
+
+#ifdef __cplusplus
+}; // extern "C"
+#endif
+
+#endif // CLOCK_H
@@ -0,0 +1,201 @@
+//----------------------------------------------------------------------------
+// Converts process command lines into null-separated argv lists
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+UINT16 ConvertCommandLineToArgv(__in char *buffer, __in const UINT16 length)
+{
+    UINT16  inputIndex  = 0;
+    UINT16  outputIndex = 0;
+    UINT16  runEnd;
+    bool    inQuote     = false;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    // Parse first argument (program filename)
+    // If it starts with a double quote, it ends at the next double quote
+    // Otherwise, it ends at the first tab, space, or newline character
+    // Treat all other characters in the first argument literally
+    if (buffer[0] == '"') {
+        inQuote = true;
+        inputIndex++;
+        runEnd = FindCommandLineChar(buffer, inputIndex, length, '"', '"', '"', '"');
+    } else {
+        runEnd = FindCommandLineChar(buffer, inputIndex, length, ' ', '\t', '\n', ' ');
+    }
+    RtlMoveMemory(buffer + outputIndex, buffer + inputIndex, runEnd - inputIndex);
+    outputIndex += runEnd - inputIndex;
+    inputIndex   = runEnd;
+    if (inputIndex < length) {
+        inQuote = false;
+        buffer[outputIndex++] = '\0';
+        inputIndex++;
+    }
+
+    // Parse remaining arguments
+    while (inputIndex < length) {
+        // Skip spaces and tabs
+        while ((inputIndex < length) &&
+                ((buffer[inputIndex] == ' ') || (buffer[inputIndex] == '\t'))) {
+            inputIndex++;
+        }
+        if (inputIndex >= length) {
+            break;
+        }
+
+        // Parse the current argument
+        while (inputIndex < length) {
+            UINT16 backslashes = 0;
+
+            // Copy the run of characters that need no special handling in one
+            // go.  Inside a double-quoted part, spaces and tabs are literal.
+            runEnd = inQuote ?
+                    FindCommandLineChar(buffer, inputIndex, length, '"', '\\', '"', '\\') :
+                    FindCommandLineChar(buffer, inputIndex, length, '"', '\\', ' ', '\t');
+            if (runEnd != inputIndex) {
+                RtlMoveMemory(buffer + outputIndex, buffer + inputIndex,
+                        runEnd - inputIndex);
+                outputIndex += runEnd - inputIndex;
+                inputIndex   = runEnd;
+                if (inputIndex >= length) {
+                    break;
+                }
+            }
+
+            // Count the number of backslashes
+            while ((inputIndex < length) && (buffer[inputIndex] == '\\')) {
+                backslashes++;
+                inputIndex++;
+            }
+
+            if ((inputIndex < length) && (buffer[inputIndex] == '"')) {
+                bool skipChar = false;
+
+                // Check if this double quote follows an even number of backslashes
+                if ((backslashes % 2) == 0) {
+                    // Check if we are currently in a double-quoted part
+                    if (inQuote) {
+                        // This double quote marks the end of a double-quoted part
+                        // If the next character is also a double quote, move to it
+                        // Otherwise, skip this double quote
+                        inQuote = false;
+                        if ((inputIndex + 1 < length) && buffer[inputIndex+1] == '"') {
+                            inputIndex++;
+                        } else {
+                            skipChar = true;
+                        }
+                    } else {
+                        // This double quote marks the start of a double-quoted part, so
+                        // skip this double quote
+                        inQuote  = true;
+                        skipChar = true;
+                    }
+                }
+
+                // Divide the number of preceding backslashes by two, since they are
+                // followed by a double quote
+                backslashes /= 2;
+                RtlFillMemory(buffer + outputIndex, backslashes, '\\');
+                outputIndex += backslashes;
+                if (!skipChar) {
+                    buffer[outputIndex++] = '"';
+                }
+                inputIndex++;
+            } else if (backslashes) {
+                // Backslashes not followed by a double quote are literal.  Let
+                // the next pass handle the character that follows them.
+                RtlFillMemory(buffer + outputIndex, backslashes, '\\');
+                outputIndex += backslashes;
+            } else {
+                // If we're not in a double-quoted part, a space or tab character
+                // marks the end of the argument.  Skip this character, since we'll
+                // be replacing it with a null.
+                inputIndex++;
+                break;
+            }
+        }
+
+        // Mark end of argument with a null character
+        buffer[outputIndex++] = '\0';
+    }
+
+    // Make sure string is null terminated
+    if ((outputIndex == 0) ||
+            ((outputIndex > 0) && (buffer[outputIndex - 1] != '\0'))) {
+        buffer[outputIndex++] = '\0';
+    }
+
+    return outputIndex;
+}
+
+//----------------------------------------------------------------------------
+// Scans a machine word at a time using the "determine if a word has a byte
+// equal to n" trick from
+// http://graphics.stanford.edu/~seander/bithacks.html#ValueInWord
+// The lowest flagged byte of each test is always exact, so the lowest flagged
+// byte of the combined tests is the first matching character.
+UINT16 FindCommandLineChar(
+    __in const char   *buffer,
+    __in UINT16        index,
+    __in const UINT16  length,
+    __in const char    c0,
+    __in const char    c1,
+    __in const char    c2,
+    __in const char    c3)
+{
+    static const UINT64 ones  = 0x0101010101010101ULL;
+    static const UINT64 highs = 0x8080808080808080ULL;
+    const UINT64        m0    = ones * (UINT8)c0;
+    const UINT64        m1    = ones * (UINT8)c1;
+    const UINT64        m2    = ones * (UINT8)c2;
+    const UINT64        m3    = ones * (UINT8)c3;
+
+    while ((UINT32)index + sizeof(UINT64) <= length) {
+        const UINT64 word = *(const UINT64 UNALIGNED *)(buffer + index);
+        const UINT64 x0   = word ^ m0;
+        const UINT64 x1   = word ^ m1;
+        const UINT64 x2   = word ^ m2;
+        const UINT64 x3   = word ^ m3;
+        const UINT64 found = (((x0 - ones) & ~x0) | ((x1 - ones) & ~x1) |
+                ((x2 - ones) & ~x2) | ((x3 - ones) & ~x3)) & highs;
+        if (found) {
+            return index + (UINT16)(RtlFindLeastSignificantBit(found) >> 3);
+        }
+        index += sizeof(UINT64);
+    }
+
+    while (index < length) {
+        const char c = buffer[index];
+        if ((c == c0) || (c == c1) || (c == c2) || (c == c3)) {
+            break;
+        }
+        index++;
+    }
+    return index;
+}
+
+#ifdef __cplusplus
+};
+#endif
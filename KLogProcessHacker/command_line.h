@@ -0,0 +1,72 @@
+//----------------------------------------------------------------------------
+// Converts process command lines into null-separated argv lists
+//
+// The parser only uses plain C, so it can be built outside the kernel.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef COMMAND_LINE_H
+#define COMMAND_LINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Converts a command line string to a null-separated argv list in place
+///
+/// http://msdn.microsoft.com/en-us/library/17w5ykft.aspx documents the
+/// algorithm used by the C runtime and the CommandLineToArgvW function to parse
+/// the command line.  However, there are additional rules for handling double
+/// quotes and parsing the first argument that are not documented in MSDN.  For
+/// a more detailed discussion on the command line parsing algorithm, see
+/// http://www.daviddeley.com/autohotkey/parameters/parameters.htm.
+///
+/// @param buffer  Buffer containing the string to fix up, with room for a
+///                terminating null
+/// @param length  Length of string in bytes, without terminating null
+///
+/// @returns New length of the command line string in bytes
+UINT16 ConvertCommandLineToArgv(__in char *buffer, __in const UINT16 length);
+
+//----------------------------------------------------------------------------
+/// @brief Finds the next occurrence of any of four characters in a string
+///
+/// Pass the same character more than once to search for fewer than four.
+///
+/// @param buffer  String to search
+/// @param index   Index to start searching at
+/// @param length  Length of string in bytes
+/// @param c0      First character to search for
+/// @param c1      Second character to search for
+/// @param c2      Third character to search for
+/// @param c3      Fourth character to search for
+///
+/// @returns Index of the first matching character; length if none match
+UINT16 FindCommandLineChar(
+    __in const char   *buffer,
+    __in UINT16        index,
+    __in const UINT16  length,
+    __in const char    c0,
+    __in const char    c1,
+    __in const char    c2,
+    __in const char    c3);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // COMMAND_LINE_H
@@ -0,0 +1,108 @@
+//----------------------------------------------------------------------------
+// Converts PCAP-NG process blocks into compact process records
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef ARRAY_SIZEOF
+#define ARRAY_SIZEOF(a) (sizeof(a) / sizeof(a[0]))
+#endif
+
+//----------------------------------------------------------------------------
+// A compact record is never longer than the block it comes from.  The compact
+// header and string lengths are shorter than the process header, sequence
+// option, and end option, and each string is no longer than its option.
+UINT32 BuildCompactRecord(
+    __in_bcount(blockLength) const char *blockData,
+    __in                     const UINT32 blockLength,
+    __in                     const UINT64 sequence,
+    __in                     const UINT64 timestamp,
+    __out_bcount(blockLength) char       *record)
+{
+    const PCAP_NG_PROCESS_HEADER *header     = (const PCAP_NG_PROCESS_HEADER*)blockData;
+    const UINT32                  optionsEnd = blockLength - sizeof(UINT32);
+    const char                   *strings[3] = { NULL, NULL, NULL }; // Path, raw args, SID
+    UINT16                        lengths[3] = { 0, 0, 0 };
+    COMPACT_RECORD               *compact    = (COMPACT_RECORD*)record;
+    UINT32                        offset;
+
+    compact->RecordType      = CompactProcessStarted;
+    compact->Flags           = 0;
+    compact->Sequence        = sequence;
+    compact->Timestamp       = timestamp;
+    compact->ProcessId       = header->ProcessId;
+    compact->ParentProcessId = header->ParentPid;
+    compact->ExitStatus      = 0;
+
+    offset = sizeof(PCAP_NG_PROCESS_HEADER);
+    while (offset + sizeof(PCAP_NG_OPTION_HEADER) <= optionsEnd) {
+        const PCAP_NG_OPTION_HEADER *option = (const PCAP_NG_OPTION_HEADER*)(blockData + offset);
+        const char                  *value  = (const char*)(option + 1);
+
+        if (!option->OptionCode ||
+                (offset + sizeof(PCAP_NG_OPTION_HEADER) + option->OptionLength > optionsEnd)) {
+            break; // End of options
+        }
+        switch (option->OptionCode) {
+        case 2:  // Process ended event
+            compact->RecordType = CompactProcessEnded;
+            break;
+        case 3:  // Path
+            strings[0] = value;
+            lengths[0] = option->OptionLength;
+            break;
+        case 10: // SID
+            strings[2] = value;
+            lengths[2] = option->OptionLength;
+            break;
+        case 11: // Raw args
+            strings[1] = value;
+            lengths[1] = option->OptionLength;
+            break;
+        case 12: // Exit status
+            compact->ExitStatus = *(const UINT32*)value;
+            compact->Flags     |= COMPACT_FLAG_EXIT_STATUS;
+            break;
+        case 16: // Subsystem process
+            compact->Flags |= COMPACT_FLAG_SUBSYSTEM;
+            break;
+        }
+        offset += sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(option->OptionLength);
+    }
+
+    offset = sizeof(COMPACT_RECORD);
+    for (UINT32 index = 0; index < ARRAY_SIZEOF(strings); index++) {
+        *(UINT16*)(record + offset) = lengths[index];
+        offset += sizeof(UINT16);
+        if (lengths[index]) {
+            RtlCopyMemory(record + offset, strings[index], lengths[index]);
+            offset += lengths[index];
+        }
+    }
+    RtlZeroMemory(record + offset, PCAP_NG_PADDING(offset) - offset);
+
+    compact->RecordLength = PCAP_NG_PADDING(offset);
+    return compact->RecordLength;
+}
+
+#ifdef __cplusplus
+};
+#endif
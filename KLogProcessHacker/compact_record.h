@@ -0,0 +1,61 @@
+//----------------------------------------------------------------------------
+// Converts PCAP-NG process blocks into compact process records
+//
+// The conversion only uses the structures from ioctls.h and pcap_ng.h and
+// plain C, so it can be built outside the kernel.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef COMPACT_RECORD_H
+#define COMPACT_RECORD_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "ioctls.h"
+#include "pcap_ng.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Converts a process block into a compact record
+///
+/// A compact record is never longer than the block it comes from, so the
+/// record buffer only needs to be as large as the block.
+///
+/// @param blockData    Process block to convert
+/// @param blockLength  Length in bytes of the process block
+/// @param sequence     Sequence number of the process block
+/// @param timestamp    Timestamp of the process block
+/// @param record       Buffer to hold the compact record (at least
+///                     blockLength bytes)
+///
+/// @returns Length in bytes of the compact record, including padding
+UINT32 BuildCompactRecord(
+    __in_bcount(blockLength) const char *blockData,
+    __in                     const UINT32 blockLength,
+    __in                     const UINT64 sequence,
+    __in                     const UINT64 timestamp,
+    __out_bcount(blockLength) char       *record);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // COMPACT_RECORD_H
@@ -0,0 +1,42 @@
+//----------------------------------------------------------------------------
+// Splits blocks between the members of a consumer group
+//
+// Each block goes to the member that its process or connection ID hashes
+// to, so all blocks for an ID reach the same member in order.  The split
+// only depends on the ID and the number of members, so it needs no shared
+// state or locking.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef CONSUMER_GROUP_H
+#define CONSUMER_GROUP_H
+
+#include "kph.h"
+
+//----------------------------------------------------------------------------
+/// @brief Picks the consumer group member that receives the blocks for an ID
+///
+/// Process IDs are multiples of 4, so scramble the ID before using its high
+/// bits.  The multiply maps the hash onto the members without a divide.
+///
+/// @param id         Process ID, or connection ID for blocks without one
+/// @param groupSize  Number of members in the group (at least 1)
+///
+/// @returns Index of the member, from 0 to groupSize - 1
+static inline UINT32 GetConsumerGroupMember(
+    __in const UINT32 id,
+    __in const UINT32 groupSize)
+{
+    return (UINT32)(((UINT64)(id * 0x9E3779B9) * groupSize) >> 32);
+}
+
+#endif  // CONSUMER_GROUP_H
@@ -0,0 +1,152 @@
+//----------------------------------------------------------------------------
+// Open-addressing hash set of process or connection IDs that a reader
+// includes or excludes
+//
+// The set uses linear probing in a power-of-2 table that is at least twice
+// as large as the number of IDs, so lookups stay short even for large lists.
+// Sets are built once and never modified, so lookups need no locking.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef ID_FILTER_H
+#define ID_FILTER_H
+
+#include "kph.h"
+
+//----------------------------------------------------------------------------
+typedef enum ID_FILTER_TYPE {
+    ConnectionIdFilter, // Filter on connection IDs
+    ProcessIdFilter,    // Filter on process IDs
+    NumIdFilterTypes,
+} ID_FILTER_TYPE;
+
+// Slot value for unused slots, which is also the connection ID for blocks
+// without a connection
+#define ID_FILTER_EMPTY 0xFFFFFFFF
+
+struct ID_FILTER {
+    UINT32 Count;     // Number of unique IDs in the set
+    UINT32 Mask;      // Number of slots minus one
+    bool   HasEmpty;  // True if the set holds ID_FILTER_EMPTY, which cannot go in a slot
+    UINT32 Slots[1];  // Hash table slots (ID_FILTER_EMPTY if unused)
+};
+
+typedef struct ID_FILTER ID_FILTER;
+
+//----------------------------------------------------------------------------
+/// @brief Hashes an ID to a slot index
+///
+/// Process IDs are multiples of 4, so fold the high bits of the product back
+/// into the low bits that select the slot.
+///
+/// @param filter  ID filter to hash for
+/// @param id      ID to hash
+///
+/// @returns Index of the first slot to probe
+static inline UINT32 HashFilterId(
+    __in const ID_FILTER *filter,
+    __in const UINT32     id)
+{
+    UINT32 hash = id * 0x9E3779B9;
+    hash ^= hash >> 16;
+    return hash & filter->Mask;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Gets the number of slots for an ID filter
+///
+/// @param numIds  Number of IDs the filter will hold
+///
+/// @returns Number of slots, which is a power of 2
+static inline UINT32 GetIdFilterSlots(__in const UINT32 numIds)
+{
+    UINT32 slots = 2;
+    while (slots < numIds * 2) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Gets the number of bytes to allocate for an ID filter
+///
+/// @param numIds  Number of IDs the filter will hold
+///
+/// @returns Size of the filter in bytes
+static inline UINT32 GetIdFilterSize(__in const UINT32 numIds)
+{
+    return FIELD_OFFSET(ID_FILTER, Slots) + GetIdFilterSlots(numIds) * sizeof(UINT32);
+}
+
+//----------------------------------------------------------------------------
+/// @brief Initializes an ID filter from a list of IDs
+///
+/// @param filter  ID filter to initialize (GetIdFilterSize bytes)
+/// @param ids     List of IDs, which may contain duplicates
+/// @param numIds  Number of IDs in the list
+static inline void InitIdFilter(
+    __out ID_FILTER    *filter,
+    __in const UINT32  *ids,
+    __in const UINT32   numIds)
+{
+    const UINT32 slots = GetIdFilterSlots(numIds);
+
+    filter->Count    = 0;
+    filter->Mask     = slots - 1;
+    filter->HasEmpty = false;
+    RtlFillMemory(filter->Slots, slots * sizeof(UINT32), 0xFF);
+
+    for (UINT32 index = 0; index < numIds; index++) {
+        const UINT32 id = ids[index];
+        UINT32       slot;
+
+        if (id == ID_FILTER_EMPTY) {
+            filter->HasEmpty = true;
+            continue;
+        }
+        slot = HashFilterId(filter, id);
+        while ((filter->Slots[slot] != ID_FILTER_EMPTY) && (filter->Slots[slot] != id)) {
+            slot = (slot + 1) & filter->Mask;
+        }
+        if (filter->Slots[slot] == ID_FILTER_EMPTY) {
+            filter->Slots[slot] = id;
+            filter->Count++;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+/// @brief Checks if an ID filter holds an ID
+///
+/// @param filter  ID filter to check
+/// @param id      ID to look for
+///
+/// @returns True if the filter holds the ID; false otherwise
+static inline bool IsIdInFilter(
+    __in const ID_FILTER *filter,
+    __in const UINT32     id)
+{
+    UINT32 slot;
+
+    if (id == ID_FILTER_EMPTY) {
+        return filter->HasEmpty;
+    }
+    for (slot = HashFilterId(filter, id); filter->Slots[slot] != ID_FILTER_EMPTY;
+            slot = (slot + 1) & filter->Mask) {
+        if (filter->Slots[slot] == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif  // ID_FILTER_H
@@ -12,9 +12,20 @@ typedef _Bool bool;
 #include <kphapi.h>
 #include "llrb_clear.h"
 #include "ring_buffer.h"
+#include "id_filter.h"
+#include "consumer_group.h"
+#include "rule_filter.h"
+#include "timer_wheel.h"
 #include "ioctls.h"
+#include "pcap_ng.h"
+#include "compact_record.h"
+#include "command_line.h"
 #include "debug_print.h"
 #include "system_id.h"
+#include "clock.h"
+#include "latency.h"
+#include "trace.h"
+#include "synthetic.h"
 #include "queue_manager.h"
 
 // Memory
@@ -386,20 +397,45 @@ NTSTATUS KpiReadVirtualMemoryUnsafe(
 typedef bool _Bool;
 #endif
 
+// Open-addressing hash set of interned image path IDs
+struct IMAGE_SET {
+	UINT32  Count;     // Number of IDs in the set
+	UINT32  Capacity;  // Number of slots, a power of 2 (0 if not allocated)
+	UINT32 *Ids;       // Slots holding the IDs (0 marks an empty slot)
+};
+
+typedef struct IMAGE_SET IMAGE_SET;
+
 struct PROCESS_NODE {
-	LLRB_ENTRY(PROCESS_NODE) TreeEntry;    // LLRB tree entry
-	UINT32                   Pid;          // Process ID
-	UINT32                   ParentPid;    // Parent process ID
-	_Bool                    ImageLoaded;  // True if process image loaded in memory
+	LLRB_ENTRY(PROCESS_NODE) TreeEntry;     // LLRB tree entry
+	UINT32                   Pid;           // Process ID
+	UINT32                   ParentPid;     // Parent process ID
+	_Bool                    ImageLoaded;   // True if process image loaded in memory
+	IMAGE_SET                LoadedImages;  // Images already reported for this process
 };
 
 typedef struct PROCESS_NODE PROCESS_NODE;
 
+// Number of slots in each processor's loaded process ID cache (power of 2)
+#define LOADED_PID_CACHE_SLOTS 16
+
+// Per-processor direct-mapped cache of IDs of processes whose image loaded
+// Aligned to a cache line so processors do not share lines.
+struct DECLSPEC_CACHEALIGN LOADED_PID_CACHE {
+	UINT32 Pids[LOADED_PID_CACHE_SLOTS];  // Cached process IDs (0 if empty)
+	UINT64 Hits;                          // Image loads answered by this cache
+	UINT64 Misses;                        // Image loads that searched the process tree
+	UINT64 Bypassed;                      // Image loads that skipped the cache for image events
+};
+
+typedef struct LOADED_PID_CACHE LOADED_PID_CACHE;
+
 // Flags to track components that were successfully initialized
 enum INIT_FLAGS {
 	InitializedLookasideList = 0x0001,
 	InitializedProcessNotifyRoutine = 0x0002,
 	InitializedLoadImageNotifyRoutine = 0x0004,
+	InitializedLoadedPidCache = 0x0008,
 };
 
 __checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
@@ -428,6 +464,32 @@ NTSTATUS StoreProcessInfo(
 
 void CleanupProcessCallback(__in HANDLE pid);
 
+void CacheLoadedPid(__in const UINT32 pid);
+
+void CountLoadedPidCacheBypass(void);
+
+void InvalidateLoadedPid(__in const UINT32 pid);
+
+_Bool IsLoadedPidCached(__in const UINT32 pid);
+
+void GetLoadedPidCacheStatistics(
+	__out UINT64 *hits,
+	__out UINT64 *misses,
+	__out UINT64 *bypassed);
+
+_Bool InsertImageSet(
+	__in IMAGE_SET    *set,
+	__in const UINT32  id);
+
+void FreeImageSet(__in IMAGE_SET *set);
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void ReportImageLoad(
+	__in PUNICODE_STRING  fullImageName,
+	__in const UINT32     pid,
+	__in PIMAGE_INFO      imageInfo,
+	__in PROCESS_NODE    *processNode);
+
 NTSTATUS GetProcessPathArgs(
 	__in const UINT32               pid,
 	__in PROCESS_BASIC_INFORMATION *procBasicInfo,
@@ -467,6 +529,10 @@ NTSTATUS GetProcessSid(
 	__in PROCESS_BASIC_INFORMATION *procBasicInfo,
 	__in UNICODE_STRING            *sid);
 
+NTSTATUS GetProcessExitInfo(
+	__in  const UINT32       pid,
+	__out PROCESS_EXIT_INFO *exitInfo);
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 void ProcessNotifyCallback(
 	__in HANDLE  parentPid,
@@ -479,4 +545,10 @@ void LoadImageNotifyRoutine(
 	__in HANDLE          pid,
 	__in PIMAGE_INFO     imageInfo);
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void HandleImageLoad(
+	__in PUNICODE_STRING fullImageName,
+	__in HANDLE          pid,
+	__in PIMAGE_INFO     imageInfo);
+
 #endif
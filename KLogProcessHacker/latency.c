@@ -0,0 +1,132 @@
+//----------------------------------------------------------------------------
+// Per-processor log-linear latency histograms for the event pipeline
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+// Per-processor histograms
+// Aligned to a cache line so processors do not share lines.
+struct DECLSPEC_CACHEALIGN LATENCY_CPU {
+    UINT64 Histograms[NumLatencyHistograms][LATENCY_BUCKETS]; // Counts for each bucket
+};
+
+typedef struct LATENCY_CPU LATENCY_CPU;
+
+//----------------------------------------------------------------------------
+// Global variables
+//----------------------------------------------------------------------------
+
+static LATENCY_CPU    *gLatencyCpus     = NULL;    // Histograms for each processor
+static ULONG           gLatencyCpuCount = 0;       // Number of processors with histograms
+volatile bool          gLatencyEnabled  = false;   // True while latency tracking is enabled
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS DeinitializeLatency(void)
+{
+    gLatencyEnabled = false;
+    if (gLatencyCpus) {
+        FreePages(gLatencyCpus, gLatencyCpuCount * sizeof(LATENCY_CPU), MemoryLatency);
+        gLatencyCpus     = NULL;
+        gLatencyCpuCount = 0;
+    }
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+void GetLatencyHistograms(__out LATENCY_HISTOGRAMS *histograms)
+{
+    LARGE_INTEGER frequency;
+
+    KeQueryPerformanceCounter(&frequency);
+    RtlZeroMemory(histograms, sizeof(LATENCY_HISTOGRAMS));
+    histograms->Frequency = frequency.QuadPart;
+    histograms->Enabled   = gLatencyEnabled;
+    for (ULONG cpu = 0; cpu < gLatencyCpuCount; cpu++) {
+        for (int histogram = 0; histogram < NumLatencyHistograms; histogram++) {
+            for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+                histograms->Histograms[histogram][bucket] +=
+                        gLatencyCpus[cpu].Histograms[histogram][bucket];
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS InitializeLatency(__in DEVICE_OBJECT *device)
+{
+    ULONG cpuCount;
+
+    UNREFERENCED_PARAMETER(device);
+
+    cpuCount     = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    gLatencyCpus = AllocatePages(cpuCount * sizeof(LATENCY_CPU), MemoryLatency);
+    if (!gLatencyCpus) {
+        DBGPRINT(D_ERR, "Cannot allocate processor latency histograms");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(gLatencyCpus, cpuCount * sizeof(LATENCY_CPU));
+    gLatencyCpuCount = cpuCount;
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+// Callers at passive level can move to another processor before the
+// increment, so the increment is interlocked.  Each processor has its own
+// cache lines, so it is not contended.
+void RecordLatency(
+    __in const UINT32   histogram,
+    __in const LONGLONG ticks)
+{
+    const ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    if ((cpu < gLatencyCpuCount) && (histogram < NumLatencyHistograms) && (ticks >= 0)) {
+        InterlockedIncrement64((volatile LONG64*)
+                &gLatencyCpus[cpu].Histograms[histogram][GetLatencyBucket((UINT64)ticks)]);
+    }
+}
+
+//----------------------------------------------------------------------------
+void RecordLatencySince(
+    __in const UINT32   histogram,
+    __in const LONGLONG start)
+{
+    if (start) {
+        RecordLatency(histogram, KeQueryPerformanceCounter(NULL).QuadPart - start);
+    }
+}
+
+//----------------------------------------------------------------------------
+void ResetLatencyHistograms(void)
+{
+    if (gLatencyCpus) {
+        RtlZeroMemory(gLatencyCpus, gLatencyCpuCount * sizeof(LATENCY_CPU));
+    }
+}
+
+#ifdef __cplusplus
+};
+#endif
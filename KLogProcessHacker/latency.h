@@ -0,0 +1,140 @@
+//----------------------------------------------------------------------------
+// Per-processor log-linear latency histograms for the event pipeline
+//
+// Each histogram counts durations in performance counter ticks.  The first
+// LATENCY_SUB_BUCKETS buckets hold one tick each.  After that, every power of
+// 2 is split into LATENCY_SUB_BUCKETS equal buckets, so the relative error is
+// at most 1 / LATENCY_SUB_BUCKETS no matter how long the duration is.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+//----------------------------------------------------------------------------
+// Global variables
+//----------------------------------------------------------------------------
+
+extern volatile bool gLatencyEnabled; // True while latency tracking is enabled
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Gets the histogram bucket for a duration
+///
+/// Only uses integer operations, so it behaves the same in and out of the
+/// kernel.  Durations too long for the last bucket go in the last bucket.
+///
+/// @param ticks  Duration in performance counter ticks
+///
+/// @returns Index of the bucket that counts the duration
+static inline UINT32 GetLatencyBucket(__in const UINT64 ticks)
+{
+    UINT32 msb = 0;
+    UINT32 bucket;
+
+    if (ticks < LATENCY_SUB_BUCKETS) {
+        return (UINT32)ticks;
+    }
+    while ((ticks >> msb) > 1) {
+        msb++;
+    }
+
+    // Values with their top bit at msb start at bucket
+    // (msb - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS and are split
+    // by the LATENCY_SUB_BUCKET_BITS bits below the top bit
+    bucket = (msb - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+            (UINT32)((ticks >> (msb - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    return (bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS - 1;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Gets the current performance counter if latency tracking is
+/// enabled
+///
+/// @returns Performance counter value, or 0 if latency tracking is disabled
+static inline LONGLONG GetLatencyStart(void)
+{
+    return gLatencyEnabled ? KeQueryPerformanceCounter(NULL).QuadPart : 0;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Frees the per-processor histograms
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS DeinitializeLatency(void);
+
+//----------------------------------------------------------------------------
+/// @brief Sums the per-processor histograms
+///
+/// Fills in the frequency and the global histograms.  The caller fills in any
+/// reader histograms.
+///
+/// @param histograms  Buffer to hold the histograms
+void GetLatencyHistograms(__out LATENCY_HISTOGRAMS *histograms);
+
+//----------------------------------------------------------------------------
+/// @brief Allocates the per-processor histograms
+///
+/// Latency tracking starts disabled.
+///
+/// @param device  WDM device object for this driver
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS InitializeLatency(__in DEVICE_OBJECT *device);
+
+//----------------------------------------------------------------------------
+/// @brief Counts a duration in a histogram on the current processor
+///
+/// @param histogram  Histogram to count the duration in
+/// @param ticks      Duration in performance counter ticks
+void RecordLatency(
+    __in const UINT32   histogram,
+    __in const LONGLONG ticks);
+
+//----------------------------------------------------------------------------
+/// @brief Counts the time since GetLatencyStart in a histogram
+///
+/// Does nothing if latency tracking was disabled when GetLatencyStart was
+/// called.
+///
+/// @param histogram  Histogram to count the duration in
+/// @param start      Value GetLatencyStart returned
+void RecordLatencySince(
+    __in const UINT32   histogram,
+    __in const LONGLONG start);
+
+//----------------------------------------------------------------------------
+/// @brief Clears the global histograms
+///
+/// Durations recorded while clearing may be lost.
+void ResetLatencyHistograms(void);
+
+#ifdef __cplusplus
+}; // extern "C"
+#endif
+
+#endif // LATENCY_H
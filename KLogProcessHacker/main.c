@@ -36,6 +36,9 @@ struct DRIVER_COMPONENT {
 typedef struct DRIVER_COMPONENT DRIVER_COMPONENT;
 
 static const DRIVER_COMPONENT gComponents[] = {
+    { "clock",           InitializeClock,          DeinitializeClock },
+    { "latency",         InitializeLatency,        DeinitializeLatency },
+    { "trace",           InitializeTrace,          DeinitializeTrace },
     { "queue manager",   InitializeQueueManager,   DeinitializeQueueManager },
 { "process monitor", InitializeProcessMonitor, DeinitializeProcessMonitor },
 //{ "network monitor", InitializeNetworkMonitor, DeinitializeNetworkMonitor },
@@ -59,8 +62,10 @@ LLRB_GENERATE(ProcessTree, PROCESS_NODE, TreeEntry, CompareProcessNodes);
 
 LLRB_CLEAR_GENERATE(ProcessTree, PROCESS_NODE, TreeEntry, DeleteProcessNode);
 
-static UINT32            gLastLoadedPid = 0;   // ID of last process whose image was loaded
 static UINT32            gInitializationFlags = 0;   // Components that were initialized successfully
+static IMAGE_SET         gKernelImages = { 0 };      // Drivers already reported as image loads
+static LOADED_PID_CACHE *gLoadedPidCache = NULL;     // Loaded process ID cache for each processor
+static ULONG             gLoadedPidCacheCount = 0;   // Number of processors with a loaded process ID cache
 static KSPIN_LOCK        gProcessTreeLock;           // Locks process trees
 static LOOKASIDE_LIST_EX gLookasideList;             // Lookaside list for allocating LLRB nodes
 static const UINT32      gPoolTag = 'ohpK'; // Tag to use when allocating pool data
@@ -193,6 +198,7 @@ STATUS_UNSUCCESSFUL otherwise.
 
     // Finish initializing read interface
     DriverObject->MajorFunction[IRP_MJ_CREATE] = KphDispatchCreate;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = DispatchCleanup;
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = KphDispatchClose;
     DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = KphDispatchDeviceControl;
     DriverObject->MajorFunction[IRP_MJ_READ] = DispatchRead;
@@ -264,6 +270,7 @@ NTSTATUS DeinitializeProcessMonitor(void)
     DBGPRINT(D_LOCK, "Acquiring process tree lock at %d", __LINE__);
     KeAcquireInStackQueuedSpinLock(&gProcessTreeLock, &lockHandle);
     LLRB_CLEAR(ProcessTree, &gProcessTreeHead);
+    FreeImageSet(&gKernelImages);
     KeReleaseInStackQueuedSpinLock(&lockHandle);
     DBGPRINT(D_LOCK, "Released process tree lock at %d", __LINE__);
 
@@ -271,6 +278,12 @@ NTSTATUS DeinitializeProcessMonitor(void)
         ExDeleteLookasideListEx(&gLookasideList);
     }
 
+    if (gInitializationFlags & InitializedLoadedPidCache) {
+        FreePages(gLoadedPidCache, gLoadedPidCacheCount * sizeof(LOADED_PID_CACHE),
+            MemoryLoadedPidCaches);
+        gLoadedPidCache = NULL;
+    }
+
     return STATUS_SUCCESS;
 }
 
@@ -524,6 +537,10 @@ NTSTATUS KpiGetFeatures(
 __checkReturn
 NTSTATUS CreateProcessCallback(__in HANDLE pid, __in HANDLE parentPid)
 {
+    // A late image load for an earlier process with the same ID may have
+    // cached the ID after that process exited, so clear it again here
+    InvalidateLoadedPid((UINT32)pid);
+
     // We need to wait until the process is loaded into memory to retrieve the
     // path and commandline info.  So here, we collect what we can't collect
     // there (e.g., ppid), and store it for later.
@@ -537,12 +554,18 @@ void ProcessNotifyCallback(
     __in HANDLE  pid,
     __in BOOLEAN create)
 {
+    const LONGLONG start = GetLatencyStart();
+
     if (create) {
         (void)CreateProcessCallback(pid, parentPid);
     }
     else {
+        // Exit notifications run in the exiting process, while its address
+        // space still exists
+        QmUnmapProcessSharedStatistics();
         CleanupProcessCallback(pid);
     }
+    RecordLatencySince(LatencyProcessCallback, start);
 }
 
 //----------------------------------------------------------------------------
@@ -551,6 +574,20 @@ void LoadImageNotifyRoutine(
     __in PUNICODE_STRING fullImageName,
     __in HANDLE          pid,
     __in PIMAGE_INFO     imageInfo)
+{
+    const LONGLONG start = GetLatencyStart();
+
+    HandleImageLoad(fullImageName, pid, imageInfo);
+    RecordLatencySince(LatencyImageCallback, start);
+}
+
+//----------------------------------------------------------------------------
+// Returns early in many places, so LoadImageNotifyRoutine times it
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void HandleImageLoad(
+    __in PUNICODE_STRING fullImageName,
+    __in HANDLE          pid,
+    __in PIMAGE_INFO     imageInfo)
 {
     PROCESS_BASIC_INFORMATION procBasicInfo;
     PROCESS_NODE             *processNode;
@@ -560,26 +597,32 @@ void LoadImageNotifyRoutine(
     UNICODE_STRING            args = { 0 };
     UNICODE_STRING            sid = { 0 };
     KLOCK_QUEUE_HANDLE        lockHandle;
+    _Bool                     imageEvents;
 
-    UNREFERENCED_PARAMETER(fullImageName);
-    UNREFERENCED_PARAMETER(imageInfo);
+    // Image load events are opt-in, so only pay for them if a reader wants them
+    imageEvents = (QmGetNumImageReaders() != 0);
 
     // Check if image is a driver
     if (pid == 0) {
-        // TODO: Handle this.  We get the FullImageName, we just need some
-        // place to store device driver info.  The trick is detecting when a
-        // driver is unloaded.
+        // Drivers are only reported as image load events.  There is no
+        // notification when a driver unloads, so each driver path is reported
+        // once.
+        if (imageEvents) {
+            ReportImageLoad(fullImageName, 0, imageInfo, NULL);
+        }
         return;
     }
 
-    // Check if this is the last process loaded
+    // Check if this process already loaded its image
     // After a process loads, it often loads several DLLs, each of which trigger
-    // this callback.  By caching the ID of the last process loaded, we can
-    // avoid having to lock and search the process tree.
-    if (pid == gLastLoadedPid) {
+    // this callback.  By caching the IDs of processes that already loaded, we
+    // can avoid having to lock and search the process tree.  Image load events
+    // need to see every DLL, so skip the cache while they are enabled.
+    if (imageEvents) {
+        CountLoadedPidCacheBypass();
+    } else if (IsLoadedPidCached((UINT32)pid)) {
         return;
     }
-    gLastLoadedPid = pid;
 
     // Get previously stored information for the process
     // We can safely access the stored information after releasing the spin lock,
@@ -593,7 +636,12 @@ void LoadImageNotifyRoutine(
     DBGPRINT(D_LOCK, "Released process tree lock at %d", __LINE__);
     if (processNode) {
         if (processNode->ImageLoaded) {
-            return; // The image is a DLL, which we currently ignore
+            // The image is a DLL, which is only reported as an image load event
+            CacheLoadedPid((UINT32)pid);
+            if (imageEvents) {
+                ReportImageLoad(fullImageName, (UINT32)pid, imageInfo, processNode);
+            }
+            return;
         }
         else {
             parentPid = processNode->ParentPid;
@@ -605,6 +653,7 @@ void LoadImageNotifyRoutine(
         return;
     }
     processNode->ImageLoaded = true;
+    CacheLoadedPid((UINT32)pid);
 
     // Get process path and arguments and process owner's SID
     GetProcessPathArgs(pid, &procBasicInfo,
@@ -615,6 +664,9 @@ void LoadImageNotifyRoutine(
         path.Buffer);
 
     QmEnqueueProcessBlock(true, (UINT32)pid, parentPid, &path, &args, &sid, NULL);
+    if (imageEvents) {
+        ReportImageLoad(fullImageName, (UINT32)pid, imageInfo, processNode);
+    }
 
     if (sid.Buffer) {
         RtlFreeUnicodeString(&sid);
@@ -641,6 +693,18 @@ NTSTATUS InitializeProcessMonitor(DEVICE_OBJECT *device)
     }
     gInitializationFlags |= InitializedLookasideList;
 
+    // Allocate a loaded process ID cache for each processor, rounded up to a
+    // whole page so the caches start on a cache line boundary
+    gLoadedPidCacheCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    gLoadedPidCache = AllocatePages(gLoadedPidCacheCount * sizeof(LOADED_PID_CACHE),
+        MemoryLoadedPidCaches);
+    if (!gLoadedPidCache) {
+        DBGPRINT(D_ERR, "Cannot allocate loaded process ID caches");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(gLoadedPidCache, gLoadedPidCacheCount * sizeof(LOADED_PID_CACHE));
+    gInitializationFlags |= InitializedLoadedPidCache;
+
     // Register callback function for when a process gets created.
     status = PsSetCreateProcessNotifyRoutine(ProcessNotifyCallback, FALSE);
     if (!NT_SUCCESS(status)) {
@@ -670,6 +734,7 @@ int CompareProcessNodes(PROCESS_NODE *first, PROCESS_NODE *second)
 void DeleteProcessNode(PROCESS_NODE *processNode)
 {
     if (processNode) {
+        FreeImageSet(&processNode->LoadedImages);
         ExFreeToLookasideListEx(&gLookasideList, processNode);
     }
 }
@@ -692,6 +757,7 @@ NTSTATUS StoreProcessInfo(
     processNode->Pid = pid;
     processNode->ParentPid = parentPid;
     processNode->ImageLoaded = imageLoaded;
+    RtlZeroMemory(&processNode->LoadedImages, sizeof(processNode->LoadedImages));
     DBGPRINT(D_LOCK, "Acquiring process tree lock at %d", __LINE__);
     KeAcquireInStackQueuedSpinLock(&gProcessTreeLock, &lockHandle);
     insertNode = LLRB_INSERT(ProcessTree, &gProcessTreeHead, processNode);
@@ -712,8 +778,8 @@ void CleanupProcessCallback(__in HANDLE pid)
     PROCESS_NODE        searchNode;
     KLOCK_QUEUE_HANDLE  lockHandle;
 
-    // Clear the ID of last process loaded, if that process is going away
-    InterlockedCompareExchange(&gLastLoadedPid, 0, pid);
+    // Clear the process ID from the loaded process ID caches
+    InvalidateLoadedPid((UINT32)pid);
 
     // Remove process information from process tree
     searchNode.Pid = pid;
@@ -723,10 +789,14 @@ void CleanupProcessCallback(__in HANDLE pid)
     KeReleaseInStackQueuedSpinLock(&lockHandle);
     DBGPRINT(D_LOCK, "Released process tree lock at %d", __LINE__);
     if (processNode) {
-        DBGPRINT(D_INFO, "Process %u ended: parent %u",
-            (UINT32)pid, processNode->ParentPid);
-        QmEnqueueProcessBlock(false, pid, processNode->ParentPid, NULL, NULL, NULL, NULL);
-        ExFreeToLookasideListEx(&gLookasideList, processNode);
+        PROCESS_EXIT_INFO exitInfo;
+        const NTSTATUS    status = GetProcessExitInfo((UINT32)pid, &exitInfo);
+
+        DBGPRINT(D_INFO, "Process %u ended: parent %u, exit status %08X",
+            (UINT32)pid, processNode->ParentPid, exitInfo.ExitStatus);
+        QmEnqueueProcessBlock(false, pid, processNode->ParentPid, NULL, NULL, NULL, NULL,
+            NT_SUCCESS(status) ? &exitInfo : NULL);
+        DeleteProcessNode(processNode);
     }
     else {
         DBGPRINT(D_WARN, "Received cleanup notification for untracked process %u",
@@ -734,6 +804,179 @@ void CleanupProcessCallback(__in HANDLE pid)
     }
 }
 
+//----------------------------------------------------------------------------
+// Windows process IDs are multiples of 4, so drop the low bits before picking
+// a slot.  The thread may move to another processor while using a cache, but
+// every slot is a single 32-bit value, so that only costs a miss.
+void CacheLoadedPid(__in const UINT32 pid)
+{
+    const ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (cpu < gLoadedPidCacheCount) {
+        gLoadedPidCache[cpu].Pids[(pid >> 2) & (LOADED_PID_CACHE_SLOTS - 1)] = pid;
+    }
+}
+
+//----------------------------------------------------------------------------
+void CountLoadedPidCacheBypass(void)
+{
+    const ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (cpu < gLoadedPidCacheCount) {
+        gLoadedPidCache[cpu].Bypassed++;
+    }
+}
+
+//----------------------------------------------------------------------------
+void InvalidateLoadedPid(__in const UINT32 pid)
+{
+    const UINT32 slot = (pid >> 2) & (LOADED_PID_CACHE_SLOTS - 1);
+    ULONG        cpu;
+
+    for (cpu = 0; cpu < gLoadedPidCacheCount; cpu++) {
+        InterlockedCompareExchange((LONG *)&gLoadedPidCache[cpu].Pids[slot], 0, (LONG)pid);
+    }
+}
+
+//----------------------------------------------------------------------------
+// The hit and miss counts are per processor and updated without interlocked
+// operations, so they can lose an occasional increment if the thread is
+// preempted.  They are only statistics.
+_Bool IsLoadedPidCached(__in const UINT32 pid)
+{
+    const ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (cpu >= gLoadedPidCacheCount) {
+        return false;
+    }
+    if (gLoadedPidCache[cpu].Pids[(pid >> 2) & (LOADED_PID_CACHE_SLOTS - 1)] == pid) {
+        gLoadedPidCache[cpu].Hits++;
+        return true;
+    }
+    gLoadedPidCache[cpu].Misses++;
+    return false;
+}
+
+//----------------------------------------------------------------------------
+void GetLoadedPidCacheStatistics(
+    __out UINT64 *hits,
+    __out UINT64 *misses,
+    __out UINT64 *bypassed)
+{
+    ULONG cpu;
+
+    *hits     = 0;
+    *misses   = 0;
+    *bypassed = 0;
+    for (cpu = 0; cpu < gLoadedPidCacheCount; cpu++) {
+        *hits     += gLoadedPidCache[cpu].Hits;
+        *misses   += gLoadedPidCache[cpu].Misses;
+        *bypassed += gLoadedPidCache[cpu].Bypassed;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Returns true if the ID was not in the set yet.  If the set cannot grow, the
+// ID is not remembered and the caller reports the image again next time.
+_Bool InsertImageSet(
+    __in IMAGE_SET    *set,
+    __in const UINT32  id)
+{
+    UINT32 index;
+
+    if (set->Ids) {
+        index = (id * 0x9E3779B1) & (set->Capacity - 1);
+        while (set->Ids[index]) {
+            if (set->Ids[index] == id) {
+                return false;
+            }
+            index = (index + 1) & (set->Capacity - 1);
+        }
+    }
+
+    // Keep the set at most half full so probe sequences stay short
+    if ((set->Count + 1) * 2 > set->Capacity) {
+        const UINT32  capacity = set->Capacity ? set->Capacity * 2 : 32;
+        UINT32       *ids;
+
+        ids = AllocateMemory(capacity * sizeof(UINT32), MemoryImageSets);
+        if (!ids) {
+            return true;
+        }
+        RtlZeroMemory(ids, capacity * sizeof(UINT32));
+        for (index = 0; index < set->Capacity; index++) {
+            const UINT32 oldId = set->Ids[index];
+            if (oldId) {
+                UINT32 newIndex = (oldId * 0x9E3779B1) & (capacity - 1);
+                while (ids[newIndex]) {
+                    newIndex = (newIndex + 1) & (capacity - 1);
+                }
+                ids[newIndex] = oldId;
+            }
+        }
+        if (set->Ids) {
+            FreeMemory(set->Ids);
+        }
+        set->Ids = ids;
+        set->Capacity = capacity;
+    }
+
+    index = (id * 0x9E3779B1) & (set->Capacity - 1);
+    while (set->Ids[index]) {
+        index = (index + 1) & (set->Capacity - 1);
+    }
+    set->Ids[index] = id;
+    set->Count++;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+void FreeImageSet(__in IMAGE_SET *set)
+{
+    if (set->Ids) {
+        FreeMemory(set->Ids);
+    }
+    RtlZeroMemory(set, sizeof(IMAGE_SET));
+}
+
+//----------------------------------------------------------------------------
+// Pass NULL for processNode to report a driver.  The process tree lock also
+// protects the image sets, since threads in the same process can load images
+// at the same time.
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void ReportImageLoad(
+    __in PUNICODE_STRING  fullImageName,
+    __in const UINT32     pid,
+    __in PIMAGE_INFO      imageInfo,
+    __in PROCESS_NODE    *processNode)
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    UINT32              pathId;
+    _Bool               firstLoad = true;
+
+    if (!fullImageName || !fullImageName->Buffer || !fullImageName->Length) {
+        return;
+    }
+
+    // Suppress repeated loads of the same image, since processes often load
+    // and unload the same DLL many times
+    pathId = QmInternImagePath(fullImageName);
+    if (pathId) {
+        DBGPRINT(D_LOCK, "Acquiring process tree lock at %d", __LINE__);
+        KeAcquireInStackQueuedSpinLock(&gProcessTreeLock, &lockHandle);
+        firstLoad = InsertImageSet(processNode ? &processNode->LoadedImages :
+            &gKernelImages, pathId);
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+        DBGPRINT(D_LOCK, "Released process tree lock at %d", __LINE__);
+    }
+
+    if (firstLoad) {
+        QmEnqueueImageBlock(pid, (UINT64)(ULONG_PTR)imageInfo->ImageBase,
+            (UINT32)imageInfo->ImageSize, imageInfo->SystemModeImage != 0,
+            pathId, fullImageName);
+    }
+}
+
 //----------------------------------------------------------------------------
 // To get the command line, we need to use various undocumented features.
 // Here's the basic idea:
@@ -901,3 +1144,62 @@ Cleanup:
     }
     return status;
 }
+
+//----------------------------------------------------------------------------
+// The process notify routine runs in the context of the last thread to exit
+// the process, so the exit status and final counters can be read through the
+// "current process" handle without opening the process.  The end time is the
+// timestamp of the process ended block itself.
+NTSTATUS GetProcessExitInfo(
+    __in  const UINT32       pid,
+    __out PROCESS_EXIT_INFO *exitInfo)
+{
+    NTSTATUS                           status;
+    PROCESS_EXTENDED_BASIC_INFORMATION procBasicInfo;
+    KERNEL_USER_TIMES                  times;
+    VM_COUNTERS                        vmCounters;
+
+    if (!exitInfo) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    RtlZeroMemory(exitInfo, sizeof(PROCESS_EXIT_INFO));
+
+    if ((UINT32)(ULONG_PTR)PsGetCurrentProcessId() != pid) {
+        DBGPRINT(D_WARN, "Cannot get exit information for process %u from "
+            "process %u", pid, (UINT32)(ULONG_PTR)PsGetCurrentProcessId());
+        return STATUS_INVALID_CID;
+    }
+
+    // The extended information tells apart subsystem processes, but needs
+    // Windows 8.1 or later, so fall back to the basic information
+    RtlZeroMemory(&procBasicInfo, sizeof(procBasicInfo));
+    procBasicInfo.Size = sizeof(procBasicInfo);
+    status = ZwQueryInformationProcess(ZwCurrentProcess(),
+        ProcessBasicInformation, &procBasicInfo,
+        sizeof(PROCESS_EXTENDED_BASIC_INFORMATION), NULL);
+    if (NT_SUCCESS(status)) {
+        exitInfo->Subsystem = procBasicInfo.IsSubsystemProcess;
+    } else {
+        status = ZwQueryInformationProcess(ZwCurrentProcess(),
+            ProcessBasicInformation, &procBasicInfo.BasicInfo,
+            sizeof(PROCESS_BASIC_INFORMATION), NULL);
+    }
+    if (!NT_SUCCESS(status)) {
+        DBGPRINT(D_ERR, "Cannot get exit status for process %u: %08X", pid,
+            status);
+        return status;
+    }
+    exitInfo->ExitStatus = procBasicInfo.BasicInfo.ExitStatus;
+
+    // The counters are optional, so a failure here doesn't fail the call
+    if (NT_SUCCESS(ZwQueryInformationProcess(ZwCurrentProcess(), ProcessTimes,
+            &times, sizeof(KERNEL_USER_TIMES), NULL))) {
+        exitInfo->KernelTime = times.KernelTime;
+        exitInfo->UserTime   = times.UserTime;
+    }
+    if (NT_SUCCESS(ZwQueryInformationProcess(ZwCurrentProcess(),
+            ProcessVmCounters, &vmCounters, sizeof(VM_COUNTERS), NULL))) {
+        exitInfo->PeakWorkingSet = vmCounters.PeakWorkingSetSize;
+    }
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,346 @@
+//----------------------------------------------------------------------------
+// PCAP-NG block formats that the Hone driver produces
+//
+// The formats only use plain C types, so they can be used outside the
+// kernel.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef PCAP_NG_H
+#define PCAP_NG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#ifndef PCAP_NG_PADDING
+#define PCAP_NG_PADDING(x) ((x) + ((4-(x)) & 0x03))
+#endif
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+// Supported PCAP-NG block types
+enum BLOCK_TYPES {
+    ConnectionBlock           = 0x00000102,
+    ImageBlock                = 0x00000103,
+    InterfaceDescriptionBlock = 0x00000001,
+    PacketBlock               = 0x00000006,
+    ProcessBlock              = 0x00000101,
+    SectionHeaderBlock        = 0x0A0D0D0A,
+};
+
+#pragma pack(push, 4) // PCAP-NG structures are 32-bit aligned
+
+// PCAP-NG block option header
+struct PCAP_NG_OPTION_HEADER {
+    UINT16 OptionCode;
+    UINT16 OptionLength;
+};
+
+typedef struct PCAP_NG_OPTION_HEADER PCAP_NG_OPTION_HEADER;
+
+// PCAP-NG sequence number option (option code 259)
+// Connection, image load, packet, and process blocks end with this option,
+// followed by the end of options and the block length, so the queue manager
+// can fill in the sequence number when it enqueues the block.
+struct PCAP_NG_SEQUENCE_OPTION {
+    struct PCAP_NG_OPTION_HEADER Header;
+    UINT64                       Sequence;
+};
+
+typedef struct PCAP_NG_SEQUENCE_OPTION PCAP_NG_SEQUENCE_OPTION;
+
+// PCAP-NG connection block format:
+//
+//     0                   1                   2                   3
+//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                    Block Type = 0x00000102                    |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |                        Connection ID                          |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |                          Process ID                           |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 |                        Timestamp (High)                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 20 |                        Timestamp (Low)                        |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 24 /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_CONNECTION_HEADER {
+    UINT32 BlockType;
+    UINT32 BlockLength;
+    UINT32 ConnectionId;
+    UINT32 ProcessId;
+    UINT32 TimestampHigh;
+    UINT32 TimestampLow;
+    // Options and block length
+};
+
+typedef struct PCAP_NG_CONNECTION_HEADER PCAP_NG_CONNECTION_HEADER;
+
+// PCAP-NG image load block format:
+//
+//     0                   1                   2                   3
+//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                    Block Type = 0x00000103                    |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |                   Process ID (0 for drivers)                  |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |                        Timestamp (High)                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 |                        Timestamp (Low)                        |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 20 |                       Image Base (High)                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 24 |                       Image Base (Low)                        |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 28 |                          Image Size                           |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 32 |                    Path ID (0 if not interned)                |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 36 |                             Flags                             |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 40 /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+// The only option is the image path (code 3, UTF-8).  It is present the first
+// time a reader receives a path ID after enabling image events or restarting,
+// and whenever the path ID is 0.  Readers map later path IDs back to the path.
+struct PCAP_NG_IMAGE_HEADER {
+    UINT32 BlockType;
+    UINT32 BlockLength;
+    UINT32 ProcessId;
+    UINT32 TimestampHigh;
+    UINT32 TimestampLow;
+    UINT32 ImageBaseHigh;
+    UINT32 ImageBaseLow;
+    UINT32 ImageSize;
+    UINT32 PathId;
+    UINT32 Flags;
+    // Options and block length
+};
+
+typedef struct PCAP_NG_IMAGE_HEADER PCAP_NG_IMAGE_HEADER;
+
+// Image load block flags
+enum IMAGE_FLAGS {
+    KernelImage = 0x00000001, // Image is a driver loaded into system space
+};
+
+// PCAP-NG interface description block format:
+//
+//     0                   1                   2                   3
+//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                    Block Type = 0x00000001                    |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |           LinkType            |           Reserved            |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |                            SnapLen                            |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_INTERFACE_DESCRIPTION {
+    UINT32                       BlockType;
+    UINT32                       BlockLength;
+    UINT16                       LinkType;
+    UINT16                       Reserved;
+    UINT32                       SnapLength;
+    struct PCAP_NG_OPTION_HEADER IfDescHeader;
+    char                         IfDesc[28];
+    struct PCAP_NG_OPTION_HEADER OptionEnd;
+    UINT32                       BlockLengthFooter;
+};
+
+typedef struct PCAP_NG_INTERFACE_DESCRIPTION PCAP_NG_INTERFACE_DESCRIPTION;
+
+// PCAP-NG enhanced packet block format:
+//
+//    0                   1                   2                   3
+//    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                    Block Type = 0x00000006                    |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |                         Interface ID                          |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |                        Timestamp (High)                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 |                        Timestamp (Low)                        |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 20 |                         Captured Len                          |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 24 |                          Packet Len                           |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 28 /                                                               /
+//    /                          Packet Data                          /
+//    /           ( variable length, aligned to 32 bits )             /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_PACKET_HEADER {
+    UINT32 BlockType;
+    UINT32 BlockLength;
+    UINT32 InterfaceId;
+    UINT32 TimestampHigh;
+    UINT32 TimestampLow;
+    UINT32 CapturedLength;
+    UINT32 PacketLength;
+    // Block data, options, and block length
+};
+
+typedef struct PCAP_NG_PACKET_HEADER PCAP_NG_PACKET_HEADER;
+
+struct PCAP_NG_PACKET_FOOTER {
+    struct PCAP_NG_OPTION_HEADER ConnectionIdHeader;
+    UINT32                       ConnectionId;
+    struct PCAP_NG_OPTION_HEADER ProcessIdHeader;
+    UINT32                       ProcessId;
+    struct PCAP_NG_OPTION_HEADER FlagsHeader;
+    UINT32                       Flags;
+    struct PCAP_NG_OPTION_HEADER SequenceHeader;
+    UINT64                       Sequence;
+    struct PCAP_NG_OPTION_HEADER OptionEnd;
+    UINT32                       BlockLength;
+};
+
+typedef struct PCAP_NG_PACKET_FOOTER PCAP_NG_PACKET_FOOTER;
+
+// PCAP-NG process event block format:
+//
+//     0                   1                   2                   3
+//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                    Block Type = 0x00000101                    |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |                          Process ID                           |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |                        Timestamp (High)                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 |                        Timestamp (Low)                        |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 20 /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_PROCESS_HEADER {
+    UINT32                       BlockType;
+    UINT32                       BlockLength;
+    UINT32                       ProcessId;
+    UINT32                       TimestampHigh;
+    UINT32                       TimestampLow;
+    struct PCAP_NG_OPTION_HEADER ParentPidHeader;
+    UINT32                       ParentPid;
+    // Options and block length
+};
+
+typedef struct PCAP_NG_PROCESS_HEADER PCAP_NG_PROCESS_HEADER;
+
+// Process block option codes
+//
+//  2  Process ended event (0xFFFFFFFF)
+//  3  Process path (UTF-8)
+//  4  Process arguments as null-separated argv list (UTF-8)
+//  5  Parent process ID (always present in the process header)
+// 10  Process owner security ID (UTF-8)
+// 11  Raw process command line (UTF-8)
+// 12  Process exit status (32-bit NTSTATUS, process ended blocks only)
+// 13  Kernel-mode CPU time in 100ns units (64-bit, process ended blocks only)
+// 14  User-mode CPU time in 100ns units (64-bit, process ended blocks only)
+// 15  Peak working set size in bytes (64-bit, process ended blocks only)
+// 16  Subsystem process (32-bit, always 1, only on process ended blocks of
+//     subsystem processes such as WSL processes, whose exit status is a Linux
+//     wait status with the exit code in bits 8-15)
+// 259 Sequence number (64-bit, always the last option)
+
+// PCAP-NG section header block format:
+//
+//   0                   1                   2                   3
+//    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                   Block Type = 0x0A0D0D0A                     |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |                      Byte-Order Magic                         |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |          Major Version        |         Minor Version         |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 |                                                               |
+//    |                          Section Length                       |
+//    |                                                               |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 24 /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_SECTION_HEADER {
+    UINT32 BlockType;
+    UINT32 BlockLength;
+    UINT32 ByteOrder;
+    UINT16 MajorVersion;
+    UINT16 MinorVersion;
+    UINT64 SectionLength;
+    // Options and block length
+};
+
+typedef struct PCAP_NG_SECTION_HEADER PCAP_NG_SECTION_HEADER;
+#pragma pack(pop)
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // PCAP_NG_H
@@ -39,13 +39,16 @@ extern "C" {
 #pragma warning(push)
 #pragma warning(disable:4706) // LLRB uses assignments in conditional expressions
 LLRB_GENERATE(BlockTree, BLOCK_NODE, TreeEntry, CompareBlockNodes)
+LLRB_GENERATE(ImagePathTree, IMAGE_PATH_NODE, TreeEntry, CompareImagePathNodes)
 LLRB_GENERATE(OconnTree, OCONN_NODE, TreeEntry, CompareOconnNodes)
 #pragma warning(pop)
 
 LLRB_CLEAR_GENERATE(BlockTree, BLOCK_NODE, TreeEntry, QmCleanupBlock)
+LLRB_CLEAR_GENERATE(ImagePathTree, IMAGE_PATH_NODE, TreeEntry, CleanupImagePathNode)
 LLRB_CLEAR_GENERATE(OconnTree, OCONN_NODE, TreeEntry, CleanupOconnNode)
 
 static BLOCK_TREE_HEAD     gConnTreeHead        = LLRB_INITIALIZER(&gConnTreeHead);      // Open connections
+static IMAGE_TREE_HEAD     gImagePathTreeHead   = LLRB_INITIALIZER(&gImagePathTreeHead); // Interned image paths
 static OCONN_TREE_HEAD     gOconnTcp4TreeHead   = LLRB_INITIALIZER(&gOconnTcp4TreeHead); // Previously opened TCP/IPv4 connections
 static OCONN_TREE_HEAD     gOconnTcp6TreeHead   = LLRB_INITIALIZER(&gOconnTcp6TreeHead); // Previously opened TCP/IPv6 connections
 static OCONN_TREE_HEAD     gOconnUdp4TreeHead   = LLRB_INITIALIZER(&gOconnUdp4TreeHead); // Previously opened UDP/IPv4 connections
@@ -55,41 +58,251 @@ static BLOCK_TREE_HEAD     gProcessTreeHead     = LLRB_INITIALIZER(&gProcessTree
 
 static LOOKASIDE_LIST_EX   gBlockNodeLal;                   // Holds memory for the block nodes
 static bool                gBlockNodeLalInit    = false;    // True if lookaside list was initialized
-static KDPC                gConnCloseDpc;                   // DPC to process connection close events
-static KTIMER              gConnCloseTimer;                 // Timer to trigger processing of connection close events
-static LARGE_INTEGER       gConnCloseTimeout;               // Timeout to use for connection close timer
-static LIST_ENTRY          gConnCloseListHead   = {0};      // Head of list of closed connections
-static UINT16              gConnTreeCount       = 0;        // Number of open connections
+static MEMORY_USAGE        gBlockNodeUsage[NumMemoryTags];  // Block nodes in use and bytes in their separate data buffers, by memory tag
+static const LONGLONG      gConnCloseHoldTime   = 1000000;  // Microseconds to keep a closed connection in case more packets arrive (1 second)
+static UINT32              gConnTreeCount       = 0;        // Number of open connections
 static LARGE_INTEGER       gDriverLoadTick      = {0};      // Tick count when driver loaded
+static EXIT_HISTORY_ENTRY *gExitHistory         = NULL;     // Ring of recently exited processes (locked by trees lock)
+static UINT64              gExitHistoryAdded    = 0;        // Number of processes ever added to the exit history
+static UINT64              gExitHistoryBytes    = 0;        // Bytes of blocks held by the exit history
+static UINT32              gExitHistoryCount    = 0;        // Number of processes in the exit history
+static UINT32              gExitHistoryFront    = 0;        // Index of the oldest process in the exit history
+static const LONGLONG      gExitHistoryMaxAge   = 600000000; // Microseconds to keep exited processes (10 minutes)
+static const UINT64        gExitHistoryMaxBytes = 0x100000; // Maximum bytes of blocks held by the exit history
+static const UINT32        gExitHistoryMaxCount = 1024;     // Maximum number of processes in the exit history
+static TIMER_WHEEL_ENTRY   gExitHistoryTimer;               // Expires the oldest process in the exit history (locked by trees lock)
+static const UINT32        gIdFilterMaxCount    = 0x100000; // Maximum number of IDs in an ID filter
+static UINT32              gImagePathCount      = 0;        // Number of interned image paths
+static const UINT32        gImagePathMaxCount   = 0x10000;  // Maximum number of interned image paths
+static const UINT32        gImagePathsSize      = (0x10000 / 32 + 1) * sizeof(UINT32); // Size in bytes of a reader's received image paths bitmap
+static FAST_MUTEX          gImagePathMutex;                 // Locks interned image path tree
+static UINT32              gImageReaders        = 0;        // Number of readers that enabled image load events
+static volatile bool       gLockProfileEnabled  = false;    // True while lock profiling is enabled
 static LOOKASIDE_LIST_EX   gOconnNodeLal;                   // Holds memory for the open connection nodes
 static bool                gOconnNodeLalInit    = false;    // True if lookaside list was initialized
+static UINT64              gNextSequence        = 1;        // Next block sequence number (locked by reader list lock)
+static MEMORY_USAGE        gMemoryUsage[NumMemoryTags];     // Memory in use for each pool tag
+static const LONGLONG      gPacketHoldMaxAge    = 30000000; // Microseconds to hold packets for a connection with no known process (30 seconds)
 static UINT16              gPacketTreeCount     = 0;        // Number of held packets
-static const UINT32        gPoolTagBlockNode    = 'bQpK';   // Tag to use when allocating block nodes from lookaside list
-static const UINT32        gPoolTagConnection   = 'cQpK';   // Tag to use when allocating connection block buffers
-static const UINT32        gPoolTagInterface    = 'iQpK';   // Tag to use when allocating interface description block buffers
-static const UINT32        gPoolTagPacket       = 'kQpK';   // Tag to use when allocating packet block buffers
-static const UINT32        gPoolTagOconnNode    = 'oQpK';   // Tag to use when allocating open connection nodes from lookaside list
-static const UINT32        gPoolTagProcess      = 'pQpK';   // Tag to use when allocating process block buffers
-static const UINT32        gPoolTagRingBuffer   = 'rQpK';   // Tag to use when allocating initial blocks ring buffer
-static const UINT32        gPoolTagSection      = 'sQpK';   // Tag to use when allocating section header block buffers
-static UINT16              gProcessTreeCount    = 0;        // Number of running processes
+static UINT32              gProcessTreeCount    = 0;        // Number of running processes
 static LIST_ENTRY          gReaderListHead      = {0};      // Head of list of registered readers
-static KSPIN_LOCK          gReaderListLock;                 // Locks list of registered readers
+static QUEUE_LOCK          gReaderListLock;                 // Locks list of registered readers
 static LARGE_INTEGER       gReaderTick          = {0};      // Tick count when first register registered
+static UINT32              gRuleReaders         = 0;        // Number of readers with a rule program (locked by reader list lock)
 static BLOCK_NODE         *gSectionHeaderBlock  = NULL;     // PCAP-NG section header block
+static SNAPSHOT           *gSharedSnapshot      = NULL;     // Snapshot readers can share (locked by trees lock, NULL if none)
+static SHARED_STATISTICS  *gSharedStatistics    = NULL;     // Statistics page clients map read-only (written under the reader list lock)
+static KDPC                gSharedStatisticsDpc;            // DPC to update the shared statistics page
+static LONG                gSharedStatisticsMaps = 0;       // Number of mappings of the shared statistics page (locked by mutex)
+static LIST_ENTRY          gSharedStatisticsMappings;       // Processes the shared statistics page is mapped into (locked by mutex)
+static PMDL                gSharedStatisticsMdl = NULL;     // MDL describing the shared statistics page
+static FAST_MUTEX          gSharedStatisticsMutex;          // Serializes mapping and unmapping the shared statistics page
+static const LONG          gSharedStatisticsPeriod = 100;   // Milliseconds between shared statistics updates
+static KTIMER              gSharedStatisticsTimer;          // Timer to trigger shared statistics updates
+static const UINT32        gSnapshotChunkSize   = 256;      // Maximum tree nodes or exit history entries to visit per trees lock hold
+static LIST_ENTRY          gSnapshotListHead    = {0};      // Head of list of readers receiving initial blocks (locked by trees lock)
+static const LONGLONG      gSnapshotShareTime   = 1000000;  // Microseconds readers can share a snapshot (1 second)
 static STATISTICS          gStatistics    = {HONE_VERSION}; // Driver statistics;
+static STATISTICS_CPU     *gStatisticsCpus      = NULL;     // Event counters for each processor
+static ULONG               gStatisticsCpuCount  = 0;        // Number of processors with event counters
+static TIMER_WHEEL         gTimerWheel;                     // Expires closed connections, held packets, and exit history (locked by trees lock)
+static KDPC                gTimerWheelDpc;                  // DPC to advance the timer wheel
+static const LONG          gTimerWheelPeriod    = 10;       // Milliseconds per timer wheel tick
+static bool                gTimerWheelRunning   = false;    // True while the timer wheel timer is set (locked by trees lock)
+static KTIMER              gTimerWheelTimer;                // Periodic timer that advances the timer wheel
 static const LONGLONG      gTimestampConv = 11644473600;    // Number of seconds between 1/1/1601 and 1/1/1970
-static KSPIN_LOCK          gTreesLock;                      // Locks connection and process LLRB trees
+static QUEUE_LOCK          gTreesLock;                      // Locks connection and process LLRB trees
+
+// Pool tag for each memory tag type, in the same order as MEMORY_TAG_TYPE
+static const UINT32 gPoolTags[NumMemoryTags] = {
+    'bQpK', // Block nodes from the lookaside list
+    'cQpK', // Connection block buffers
+    'hQpK', // Exit history
+    'fQpK', // ID filters
+    'mQpK', // Image load block buffers
+    'nQpK', // Interned image path nodes
+    'iQpK', // Interface description block buffers
+    'oQpK', // Open connection nodes from the lookaside list
+    'kQpK', // Packet block buffers
+    'pQpK', // Process block buffers
+    'rQpK', // Ring buffers
+    'uQpK', // Reader rule programs
+    'sQpK', // Section header block buffers
+    'wQpK', // Shared statistics page
+    'tQpK', // Shared snapshots
+    'vQpK', // Processor event counters
+    'eQpK', // Reader compact record buffers
+    'gQpK', // Processor clock state
+    'jQpK', // Reported kernel image sets
+    'qQpK', // Processor latency histograms
+    'dQpK', // Processor loaded process ID caches
+    'xQpK', // Processor trace rings
+};
 
 // Ring buffer size registry key and value
 static wchar_t *gBufferSizeKeyPath   = L"\\Registry\\Machine\\SOFTWARE\\PNNL\\Hone";
 static wchar_t *gBufferSizeValueName = L"RingBufferSize";
 
+//----------------------------------------------------------------------------
+// Peaks are raised with a compare and swap, since another processor may raise
+// the same peak at the same time
+void AccountMemory(
+    __inout  MEMORY_USAGE *usage,
+    __in     const LONG64  bytes,
+    __in     const LONG    allocations)
+{
+    const LONG64 liveBytes       = InterlockedExchangeAdd64(&usage->Bytes, bytes) + bytes;
+    const LONG   liveAllocations = InterlockedExchangeAdd(&usage->Allocations, allocations) +
+            allocations;
+    LONG64       peakBytes;
+    LONG         peakAllocations;
+
+    while (liveBytes > (peakBytes = usage->PeakBytes)) {
+        if (InterlockedCompareExchange64(&usage->PeakBytes, liveBytes, peakBytes) == peakBytes) {
+            break;
+        }
+    }
+    while (liveAllocations > (peakAllocations = usage->PeakAllocations)) {
+        if (InterlockedCompareExchange(&usage->PeakAllocations, liveAllocations,
+                peakAllocations) == peakAllocations) {
+            break;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+void AcquireQueueLock(
+    __in  QUEUE_LOCK         *lock,
+    __out KLOCK_QUEUE_HANDLE *lockHandle,
+    __in  const UINT32        line)
+{
+    const LONGLONG start     = GetLatencyStart();
+    LONGLONG       spinStart = 0;
+    bool           contended = false;
+
+    // A queued spin lock holds the last waiter's queue entry, so it is only
+    // zero if nobody holds or waits for it
+    if (gLockProfileEnabled) {
+        contended = (*(volatile KSPIN_LOCK*)&lock->Lock != 0);
+        spinStart = start ? start : KeQueryPerformanceCounter(NULL).QuadPart;
+    }
+
+    KeAcquireInStackQueuedSpinLock(&lock->Lock, lockHandle);
+    if (start) {
+        lock->AcquiredCounter = KeQueryPerformanceCounter(NULL).QuadPart;
+        RecordLatency(lock->WaitHistogram, lock->AcquiredCounter - start);
+    } else {
+        lock->AcquiredCounter = 0;
+    }
+    if (spinStart) {
+        lock->ProfileCounter = start ? lock->AcquiredCounter :
+                KeQueryPerformanceCounter(NULL).QuadPart;
+        lock->AcquiredSite   = ProfileLockAcquired(lock, line, contended,
+                lock->ProfileCounter - spinStart);
+    } else {
+        lock->AcquiredSite   = NULL;
+    }
+    TraceEvent(TraceLockAcquired, lock->TraceId, line, 0, 0);
+}
+
+//----------------------------------------------------------------------------
+void AddExitHistory(
+    __in_opt BLOCK_NODE *startBlock,
+    __in     BLOCK_NODE *endBlock)
+{
+    EXIT_HISTORY_ENTRY *entry;
+
+    InvalidateSharedSnapshot();
+    if (!gExitHistory) {
+        QmCleanupBlock(startBlock);
+        return;
+    }
+
+    // Make room for the new process first, then trim again in case the new
+    // process pushed the history over its byte limit
+    TrimExitHistory(gExitHistoryMaxCount - 1);
+    entry = &gExitHistory[(gExitHistoryFront + gExitHistoryCount) % gExitHistoryMaxCount];
+    InterlockedIncrement(&endBlock->RefCount);
+    entry->StartBlock  = startBlock;
+    entry->EndBlock    = endBlock;
+    gExitHistoryBytes += endBlock->BlockLength +
+            (startBlock ? startBlock->BlockLength : 0);
+    gExitHistoryCount++;
+    gExitHistoryAdded++;
+    TrimExitHistory(gExitHistoryMaxCount);
+    if (!IsTimerWheelEntryScheduled(&gExitHistoryTimer)) {
+        ScheduleExitHistoryTimer();
+    }
+}
+
+//----------------------------------------------------------------------------
+void AddLargestBlock(
+    __inout  LARGEST_BLOCKS   *blocks,
+    __in     const UINT32      maxBlocks,
+    __in     const BLOCK_NODE *blockNode,
+    __in     const UINT32      location)
+{
+    UINT32         index = min(blocks->NumBlocks, maxBlocks);
+    LARGEST_BLOCK *block;
+
+    blocks->TotalBlocks++;
+
+    // Shift smaller blocks down to make room, dropping the smallest if full
+    while ((index > 0) && (blocks->Blocks[index - 1].BlockLength < blockNode->BlockLength)) {
+        if (index < maxBlocks) {
+            blocks->Blocks[index] = blocks->Blocks[index - 1];
+        }
+        index--;
+    }
+    if (index >= maxBlocks) {
+        return;
+    }
+    if (blocks->NumBlocks < maxBlocks) {
+        blocks->NumBlocks++;
+    }
+
+    block               = &blocks->Blocks[index];
+    block->BlockType    = blockNode->BlockType;
+    block->BlockLength  = blockNode->BlockLength;
+    block->ProcessId    = blockNode->ProcessId;
+    block->ConnectionId = blockNode->ConnectionId;
+    block->Location     = location;
+    block->RefCount     = blockNode->RefCount;
+    block->Tag          = gPoolTags[blockNode->Buffer ? blockNode->MemoryTag : MemoryBlockNodes];
+    block->Reserved     = 0;
+    block->Sequence     = blockNode->Sequence;
+}
+
+//----------------------------------------------------------------------------
+// Stops the periodic timer once the wheel is empty, so an idle driver does not
+// wake the processor every tick.  SetQueueTimer starts it again.
+void AdvanceQueueTimers(
+    __in     KDPC *dpc,
+    __in_opt void *context,
+    __in_opt void *arg1,
+    __in_opt void *arg2)
+{
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(arg1);
+    UNREFERENCED_PARAMETER(arg2);
+
+    KLOCK_QUEUE_HANDLE lockHandle;
+
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+    AdvanceTimerWheel(&gTimerWheel, GetTimerWheelTick());
+    if (!gTimerWheel.Count && gTimerWheelRunning) {
+        KeCancelTimer(&gTimerWheelTimer);
+        gTimerWheelRunning = false;
+    }
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+}
+
 //----------------------------------------------------------------------------
 __checkReturn
 BLOCK_NODE* AllocateBlockNode(
     __in const UINT32 blockLength,
-    __in const UINT32 poolTag)
+    __in const UINT32 memoryTag)
 {
     BLOCK_NODE *blockNode = ExAllocateFromLookasideListEx(&gBlockNodeLal);
     if (!blockNode) {
@@ -99,16 +312,19 @@ BLOCK_NODE* AllocateBlockNode(
     // Zero block node header, but not the data
     RtlZeroMemory(blockNode, sizeof(BLOCK_NODE) - sizeof(blockNode->Data));
     blockNode->ConnectionId = 0xFFFFFFFF;
+    blockNode->MemoryTag    = memoryTag;
 
     // Allocate separate data buffer if the block node isn't large enough to
     // hold all of the data
     if (blockLength > sizeof(blockNode->Data)) {
-        blockNode->Buffer = ExAllocatePoolWithTag(NonPagedPool, blockLength, poolTag);
+        blockNode->Buffer = AllocateMemory(blockLength, memoryTag);
         if (!blockNode->Buffer) {
             ExFreeToLookasideListEx(&gBlockNodeLal, blockNode);
             return NULL;
         }
     }
+    AccountMemory(&gMemoryUsage[MemoryBlockNodes], sizeof(BLOCK_NODE), 1);
+    AccountMemory(&gBlockNodeUsage[memoryTag], blockNode->Buffer ? blockLength : 0, 1);
 
     blockNode->RefCount    = 1; // Hold a reference to the block
     blockNode->BlockLength = blockLength;
@@ -116,29 +332,117 @@ BLOCK_NODE* AllocateBlockNode(
 }
 
 //----------------------------------------------------------------------------
+__checkReturn
+void* AllocatePages(
+    __in const SIZE_T size,
+    __in const UINT32 memoryTag)
+{
+    void *buffer = ExAllocatePoolWithTag(NonPagedPool, ROUND_TO_PAGES(size),
+            gPoolTags[memoryTag]);
+    if (!buffer) {
+        return NULL;
+    }
+    AccountMemory(&gMemoryUsage[memoryTag], ROUND_TO_PAGES(size), 1);
+    return buffer;
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+void* AllocateMemory(
+    __in const SIZE_T size,
+    __in const UINT32 memoryTag)
+{
+    MEMORY_HEADER *header = ExAllocatePoolWithTag(NonPagedPool, sizeof(MEMORY_HEADER) + size,
+            gPoolTags[memoryTag]);
+    if (!header) {
+        return NULL;
+    }
+    header->Size      = (UINT32)size;
+    header->MemoryTag = memoryTag;
+    AccountMemory(&gMemoryUsage[memoryTag], size, 1);
+    return header + 1;
+}
+
+//----------------------------------------------------------------------------
+void CalculateConsumerGroups(void)
+{
+    LIST_ENTRY *entry;
+
+    // There are only ever a few readers, so count the members of each group
+    // by walking the list again for every reader
+    for (entry = gReaderListHead.Flink; entry != &gReaderListHead; entry = entry->Flink) {
+        READER_INFO *reader = CONTAINING_RECORD(entry, READER_INFO, ListEntry);
+        LIST_ENTRY  *other;
+
+        reader->GroupMember = 0;
+        reader->GroupSize   = 0;
+        if (!reader->ConsumerGroup) {
+            continue;
+        }
+        for (other = gReaderListHead.Flink; other != &gReaderListHead; other = other->Flink) {
+            const READER_INFO *otherReader = CONTAINING_RECORD(other, READER_INFO, ListEntry);
+
+            if (otherReader->ConsumerGroup == reader->ConsumerGroup) {
+                if (other == entry) {
+                    reader->GroupMember = reader->GroupSize;
+                }
+                reader->GroupSize++;
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Also gives each reader with a snap length the index of the trimmed packet
+// blocks it shares with readers that have the same snap length
 void CalculateMaxSnapLength(void)
 {
     LIST_ENTRY *entry      = gReaderListHead.Flink;
     UINT32      maxSnapLen = 0;
+    UINT32      snapLengths[MAX_SNAP_VIEWS];
+    UINT32      numSnapLengths = 0;
 
     while (entry != &gReaderListHead) {
-        const READER_INFO *reader = CONTAINING_RECORD(entry, READER_INFO, ListEntry);
+        READER_INFO *reader = CONTAINING_RECORD(entry, READER_INFO, ListEntry);
+
+        reader->SnapViewIndex = MAX_SNAP_VIEWS;
         if ((reader->SnapLength == 0) || (reader->SnapLength == _UI32_MAX)) {
             maxSnapLen = _UI32_MAX;
-            break;
-        } else if (reader->SnapLength > maxSnapLen) {
-            maxSnapLen = reader->SnapLength;
+        } else {
+            UINT32 index = 0;
+
+            if (reader->SnapLength > maxSnapLen) {
+                maxSnapLen = reader->SnapLength;
+            }
+            while ((index < numSnapLengths) && (snapLengths[index] != reader->SnapLength)) {
+                index++;
+            }
+            if ((index == numSnapLengths) && (numSnapLengths < MAX_SNAP_VIEWS)) {
+                snapLengths[numSnapLengths++] = reader->SnapLength;
+            }
+            if (index < numSnapLengths) {
+                reader->SnapViewIndex = index;
+            }
         }
         entry = entry->Flink;
     }
     gStatistics.MaxSnapLength = maxSnapLen;
 }
 
+//----------------------------------------------------------------------------
+void CleanupImagePathNode(__in IMAGE_PATH_NODE *pathNode)
+{
+    if (pathNode) {
+        FreeMemory(pathNode);
+    }
+}
+
 //----------------------------------------------------------------------------
 void CleanupOconnNode(__in OCONN_NODE *oconnNode)
 {
     if (oconnNode) {
         ExFreeToLookasideListEx(&gOconnNodeLal, oconnNode);
+        AccountMemory(&gMemoryUsage[MemoryOpenConnections], -(LONG64)sizeof(OCONN_NODE), -1);
     }
 }
 
@@ -147,15 +451,29 @@ void CleanupReader(__in READER_INFO *reader)
 {
     if (reader->BlocksBuffer.Buffer) {
         CleanupRingBuffer(&reader->BlocksBuffer);
-        ExFreePool(reader->BlocksBuffer.Buffer);
+        FreeMemory(reader->BlocksBuffer.Buffer);
+    }
+    if (reader->Sequences) {
+        FreeMemory(reader->Sequences);
     }
     if (reader->InitialBuffer.Buffer) {
         CleanupRingBuffer(&reader->InitialBuffer);
-        ExFreePool(reader->InitialBuffer.Buffer);
+        FreeMemory(reader->InitialBuffer.Buffer);
     }
     if (reader->DataEvent) {
         ObDereferenceObject(reader->DataEvent);
     }
+    for (int filterType = 0; filterType < NumIdFilterTypes; filterType++) {
+        if (reader->IdFilters[filterType]) {
+            FreeMemory(reader->IdFilters[filterType]);
+        }
+    }
+    if (reader->RuleProgram) {
+        FreeMemory(reader->RuleProgram);
+    }
+    if (reader->ImagePaths) {
+        FreeMemory(reader->ImagePaths);
+    }
 }
 
 //----------------------------------------------------------------------------
@@ -174,159 +492,32 @@ void CleanupRingBuffer(__in RING_BUFFER *buffer)
 //----------------------------------------------------------------------------
 int CompareBlockNodes(PBLOCK_NODE first, PBLOCK_NODE second)
 {
-    return first->SortId - second->SortId;
+    // Do not subtract, since connection IDs can be more than 2^31 apart
+    if (first->SortId != second->SortId) {
+        return (first->SortId < second->SortId) ? -1 : 1;
+    }
+    return 0;
 }
 
 //----------------------------------------------------------------------------
-int CompareOconnNodes(OCONN_NODE *first, OCONN_NODE *second)
+int CompareImagePathNodes(IMAGE_PATH_NODE *first, IMAGE_PATH_NODE *second)
 {
-    return first->Port - second->Port;
+    if (first->Hash != second->Hash) {
+        return (first->Hash < second->Hash) ? -1 : 1;
+    }
+    return RtlCompareUnicodeString(&first->Path, &second->Path, TRUE);
 }
 
 //----------------------------------------------------------------------------
-UINT16 ConvertCommandLineToArgv(__in char *buffer, __in const UINT16 length)
+int CompareOconnNodes(OCONN_NODE *first, OCONN_NODE *second)
 {
-    UINT16  inputIndex  = 0;
-    UINT16  outputIndex = 0;
-    bool    inQuote     = false;
-
-    if (length == 0) {
-        return 0;
-    }
-
-    // Parse first argument (program filename)
-    // If it starts with a double quote, it ends at the next double quote
-    // Otherwise, it ends at the first tab, space, or newline character
-    // Treat all other characters in the first argument literally
-    if (buffer[0] == '"') {
-        inQuote = true;
-        inputIndex++;
-    }
-    while (inputIndex < length) {
-        if ((inQuote && (buffer[inputIndex] == '"')) ||
-                (!inQuote && ((buffer[inputIndex] == ' ') ||
-                (buffer[inputIndex] == '\t') ||
-                (buffer[inputIndex] == '\n')))) {
-            inQuote = false;
-            buffer[outputIndex++] = '\0';
-            inputIndex++;
-            break;
-        }
-        buffer[outputIndex++] = buffer[inputIndex++];
-    }
-
-    // Parse remaining arguments
-    while (inputIndex < length) {
-        bool inArg = true;
-
-        // Skip spaces and tabs
-        while ((inputIndex < length) &&
-                ((buffer[inputIndex] == ' ') || (buffer[inputIndex] == '\t'))) {
-            inputIndex++;
-        }
-        if (inputIndex >= length) {
-            break;
-        }
-
-        // Parse the current argument
-        while (inArg && (inputIndex < length)) {
-            UINT16  backslashes = 0;
-            bool    skipChar    = false;
-
-            // Count the number of backslashes
-            while ((inputIndex < length) && (buffer[inputIndex] == '\\')) {
-                backslashes++;
-                inputIndex++;
-            }
-
-            // Write out the backslashes if at the end of the argument string
-            if (inputIndex >= length) {
-                while (backslashes > 0) {
-                    buffer[outputIndex++] = '\\';
-                    backslashes--;
-                }
-                inArg = false;
-                break;
-            }
-
-            // Check if next character is a double quote
-            if (buffer[inputIndex] == '"') {
-                // Check if this double quote follows an even number of backslashes
-                if ((backslashes % 2) == 0) {
-                    // Check if we are currently in a double-quoted part
-                    if (inQuote) {
-                        // This double quote marks the end of a double-quoted part
-                        // If the next character is also a double quote, move to it
-                        // Otherwise, skip this double quote
-                        inQuote = false;
-                        if ((inputIndex + 1 < length) && buffer[inputIndex+1] == '"') {
-                            inputIndex++;
-                        } else {
-                            skipChar = true;
-                        }
-                    } else {
-                        // This double quote marks the start of a double-quoted part, so
-                        // skip this double quote
-                        inQuote  = true;
-                        skipChar = true;
-                    }
-                }
-
-                // Divide the number of preceding backslashes by two, since they are
-                // followed by a double quote
-                backslashes /= 2;
-            } else {
-                // If we're not in a double-quoted part, a space or tab character marks
-                // the end of the argument
-                if (!inQuote &&
-                        ((buffer[inputIndex] == ' ') || (buffer[inputIndex] == '\t'))) {
-                    // Skip this character, since we'll be replacing it with a null
-                    inArg    = false;
-                    skipChar = true;
-                }
-            }
-
-            // Write out backslashes
-            while (backslashes > 0) {
-                buffer[outputIndex++] = '\\';
-                backslashes--;
-            }
-
-            // Copy the character, unless we're skipping it
-            if (!skipChar) {
-                buffer[outputIndex++] = buffer[inputIndex];
-            }
-            inputIndex++;
-        }
-
-        // Mark end of argument with a null character
-        buffer[outputIndex++] = '\0';
-    }
-
-    // Make sure string is null terminated
-    if ((outputIndex == 0) ||
-            ((outputIndex > 0) && (buffer[outputIndex - 1] != '\0'))) {
-        buffer[outputIndex++] = '\0';
-    }
-
-    return outputIndex;
+    return first->Port - second->Port;
 }
 
 //----------------------------------------------------------------------------
 void ConvertKeTime(__in const LARGE_INTEGER *in, __out LARGE_INTEGER *out)
 {
-    LARGE_INTEGER perfCounterTime;
-    LARGE_INTEGER timeFreq;
-    LONG          sec;
-    LONG          usec;
-
-    perfCounterTime = KeQueryPerformanceCounter(&timeFreq);
-    sec             = (LONG)(in->QuadPart / 10000000 - gTimestampConv);
-    usec            = (LONG)((in->QuadPart % 10000000) / 10);
-    sec            -= (ULONG)(perfCounterTime.QuadPart / timeFreq.QuadPart);
-    usec           -= (LONG)((perfCounterTime.QuadPart % timeFreq.QuadPart)
-            * 1000000 / timeFreq.QuadPart);
-    out->QuadPart = (LONGLONG)sec * 1000000 + usec;
+    out->QuadPart = in->QuadPart / 10 - gTimestampConv * 1000000 - ClockGetUptime();
 }
 
 //----------------------------------------------------------------------------
@@ -336,24 +527,23 @@ NTSTATUS DeinitializeQueueManager(__in void)
     KLOCK_QUEUE_HANDLE  lockHandle;
     LIST_ENTRY         *entry;
 
-    KeCancelTimer(&gConnCloseTimer);
+    KeCancelTimer(&gTimerWheelTimer);
+    KeCancelTimer(&gSharedStatisticsTimer);
+    KeFlushQueuedDpcs();
 
     entry = gReaderListHead.Flink;
     while (entry != &gReaderListHead) {
         READER_INFO *reader = CONTAINING_RECORD(entry, READER_INFO, ListEntry);
         entry = entry->Flink;
+        if (reader->Snapshot.Active) {
+            FreeSnapshot(ReleaseSnapshot(reader->Snapshot.Snapshot));
+        }
         CleanupReader(reader);
     }
 
-    entry = gConnCloseListHead.Flink;
-    while (entry != &gConnCloseListHead) {
-        BLOCK_NODE *blockNode = CONTAINING_RECORD(entry, BLOCK_NODE, ListEntry);
-        entry = entry->Flink;
-        QmCleanupBlock(blockNode);
-    }
-
-    DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+    // Closed connections waiting to expire are still in the tree, which holds
+    // their reference, so the timer wheel can just be abandoned
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
     LLRB_CLEAR(BlockTree, &gConnTreeHead);
     LLRB_CLEAR(BlockTree, &gPacketTreeHead);
     LLRB_CLEAR(BlockTree, &gProcessTreeHead);
@@ -361,8 +551,33 @@ NTSTATUS DeinitializeQueueManager(__in void)
     LLRB_CLEAR(OconnTree, &gOconnTcp6TreeHead);
     LLRB_CLEAR(OconnTree, &gOconnUdp4TreeHead);
     LLRB_CLEAR(OconnTree, &gOconnUdp6TreeHead);
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+    TrimExitHistory(0);
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+
+    if (gExitHistory) {
+        FreeMemory(gExitHistory);
+        gExitHistory = NULL;
+    }
+    if (gStatisticsCpus) {
+        FreePages(gStatisticsCpus, gStatisticsCpuCount * sizeof(STATISTICS_CPU),
+                MemoryStatistics);
+        gStatisticsCpus     = NULL;
+        gStatisticsCpuCount = 0;
+    }
+    if (gSharedStatisticsMdl) {
+        IoFreeMdl(gSharedStatisticsMdl);
+        gSharedStatisticsMdl = NULL;
+    }
+    if (gSharedStatistics) {
+        ExFreePool(gSharedStatistics);
+        AccountMemory(&gMemoryUsage[MemorySharedStatistics], -(LONG64)PAGE_SIZE, -1);
+        gSharedStatistics = NULL;
+    }
+
+    ExAcquireFastMutex(&gImagePathMutex);
+    LLRB_CLEAR(ImagePathTree, &gImagePathTreeHead);
+    gImagePathCount = 0;
+    ExReleaseFastMutex(&gImagePathMutex);
 
     if (gBlockNodeLalInit) {
         ExDeleteLookasideListEx(&gBlockNodeLal);
@@ -377,44 +592,444 @@ NTSTATUS DeinitializeQueueManager(__in void)
 
 //----------------------------------------------------------------------------
 __checkReturn
-void EnqueueBlock(__in BLOCK_NODE *blockNode)
+void EnqueueBlock(
+    __in     BLOCK_NODE       *blockNode,
+    __in_opt const BLOCK_NODE *ruleBlock)
 {
     KLOCK_QUEUE_HANDLE  lockHandle;
-    LIST_ENTRY         *entry = gReaderListHead.Flink;
+    LIST_ENTRY         *entry     = gReaderListHead.Flink;
+    char               *buffer    = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+    RULE_EVENT          event;
+    const RULE_EVENT   *ruleEvent = NULL;
+    BLOCK_NODE         *snapViews[MAX_SNAP_VIEWS] = { NULL }; // Trimmed packet blocks shared by readers
+    BLOCK_NODE         *pathlessView = NULL; // Image load block without its path shared by readers
+    UINT32              capturedLength = 0;
+    UINT32              pathId         = 0;
 
     if (!gStatistics.NumReaders) {
         return;
     }
 
-    DBGPRINT(D_LOCK, "Acquiring reader list lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gReaderListLock, &lockHandle);
+    // Parse the process attributes once for all readers.  A reader that sets
+    // a rule program after this check receives the block.
+    if (ruleBlock && gRuleReaders) {
+        GetRuleEvent(ruleBlock, &event);
+        ruleEvent = &event;
+    }
 
-    // Increment packet counts inside the spin lock
+    // Count packets in this processor's counters before taking the lock
     if (blockNode->BlockType == PacketBlock) {
-        char                  *buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
-        PCAP_NG_PACKET_HEADER *header = buffer;
+        STATISTICS_CPU *statistics = GetStatisticsCpu();
 
-        gStatistics.CapturedPackets++;
-        gStatistics.CapturedPacketBytes += header->CapturedLength;
+        capturedLength = ((PCAP_NG_PACKET_HEADER *)buffer)->CapturedLength;
+        InterlockedIncrement64(&statistics->CapturedPackets);
+        InterlockedExchangeAdd64(&statistics->CapturedPacketBytes, capturedLength);
     }
 
+    // Only image load blocks that carry their path can leave it out
+    if ((blockNode->BlockType == ImageBlock) &&
+            (blockNode->BlockLength > sizeof(PCAP_NG_IMAGE_HEADER) +
+            sizeof(PCAP_NG_SEQUENCE_OPTION) + sizeof(PCAP_NG_OPTION_HEADER) + sizeof(UINT32))) {
+        pathId = ((PCAP_NG_IMAGE_HEADER *)buffer)->PathId;
+        if (pathId > gImagePathMaxCount) {
+            pathId = 0;
+        }
+    }
+
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+
+    // Assign the sequence number inside the spin lock, so sequence numbers are
+    // in the same order as the blocks in every reader's ring buffer
+    blockNode->Sequence       = gNextSequence++;
+    blockNode->EnqueueCounter = GetLatencyStart();
+    *(UINT64 *)(buffer + blockNode->BlockLength - sizeof(UINT32) -
+            sizeof(PCAP_NG_OPTION_HEADER) - sizeof(UINT64)) = blockNode->Sequence;
+
     while (entry != &gReaderListHead) {
-        READER_INFO *reader = CONTAINING_RECORD(entry, READER_INFO, ListEntry);
-        const bool empty = IsRingBufferEmpty(&reader->BlocksBuffer);
-        InterlockedIncrement(&blockNode->RefCount);
-        if (RingBufferEnqueue(&reader->BlocksBuffer, blockNode)) {
+        READER_INFO  *reader       = CONTAINING_RECORD(entry, READER_INFO, ListEntry);
+        const UINT32  back         = reader->BlocksBuffer.Back;
+        BLOCK_NODE   *readerBlock  = blockNode;
+        BLOCK_NODE   *unsharedView = NULL;
+        bool          sendsPath    = false;
+        UINT32        count;
+        bool          empty;
+
+        entry = entry->Flink;
+
+        // Image load blocks are only sent to readers that asked for them
+        if ((blockNode->BlockType == ImageBlock) && !reader->ImageEvents) {
+            continue;
+        }
+
+        // Drop filtered blocks here, so they do not take up ring buffer slots
+        if (IsBlockFiltered(reader, blockNode)) {
+            continue;
+        }
+        if (ruleEvent && reader->RuleProgram &&
+                IsRuleEventDropped(reader->RuleProgram, ruleEvent)) {
+            continue;
+        }
+
+        // Trim packets to the reader's snap length once for all readers with
+        // the same snap length, so reads are a plain copy.  If the trimmed
+        // block cannot be allocated, send the whole block rather than lose it.
+        if (reader->SnapLength && (reader->SnapLength < capturedLength)) {
+            if (reader->SnapViewIndex < MAX_SNAP_VIEWS) {
+                BLOCK_NODE **view = &snapViews[reader->SnapViewIndex];
+                if (!*view) {
+                    *view = GetTrimmedPacketBlock(blockNode, reader->SnapLength);
+                }
+                readerBlock = *view;
+            } else {
+                unsharedView = GetTrimmedPacketBlock(blockNode, reader->SnapLength);
+                readerBlock  = unsharedView;
+            }
+            if (!readerBlock) {
+                readerBlock = blockNode;
+            }
+        }
+
+        // Send each path only until the reader has received it.  If the block
+        // without the path cannot be allocated, send the whole block.
+        if (pathId && reader->ImagePaths) {
+            if (reader->ImagePaths[pathId / 32] & (1u << (pathId % 32))) {
+                if (!pathlessView) {
+                    pathlessView = GetPathlessImageBlock(blockNode);
+                }
+                if (pathlessView) {
+                    readerBlock = pathlessView;
+                }
+            } else {
+                sendsPath = true;
+            }
+        }
+
+        count = back - reader->BlocksBuffer.Front;
+        empty = (count == 0);
+        InterlockedIncrement(&readerBlock->RefCount);
+        if (RingBufferEnqueue(&reader->BlocksBuffer, readerBlock)) {
+            // Only this function adds blocks, so the block went into the slot
+            // at the back index read above
+            reader->Sequences[back % reader->BlocksBuffer.Length] = blockNode->Sequence;
+            reader->NewestSequence = blockNode->Sequence;
+            if (count + 1 > reader->PeakBlocks) {
+                reader->PeakBlocks = count + 1;
+            }
+
+            // Only mark the path received once it is in the ring buffer, so a
+            // dropped block does not lose the path
+            if (sendsPath) {
+                reader->ImagePaths[pathId / 32] |= 1u << (pathId % 32);
+            }
+
             // Only signal the reader if the buffer was empty
             if (empty && reader->DataEvent) {
                 KeSetEvent(reader->DataEvent, 1, FALSE);
             }
+
+            // Likewise, only queue the read DPC once per trip past the
+            // watermark.  The count can skip past the watermark, for example
+            // when the watermark is lowered, so do not wait for it to be equal.
+            if (reader->ReadDpc && !reader->ReadDpcQueued &&
+                    (count + 1 >= reader->ReadWatermark)) {
+                reader->ReadDpcQueued = true;
+                KeInsertQueueDpc(reader->ReadDpc, NULL, NULL);
+            }
         } else {
-            InterlockedDecrement(&blockNode->RefCount);
+            const UINT32 statisticsType = GetStatisticsBlockType(blockNode->BlockType);
+
+            reader->DroppedSequence = blockNode->Sequence;
+            if (statisticsType < NumStatisticsBlockTypes) {
+                reader->DroppedBlocks[statisticsType]++;
+            }
+            TraceEvent(TraceBlockDropped, reader->Id, blockNode->BlockType,
+                    (UINT32)blockNode->Sequence, (UINT32)(blockNode->Sequence >> 32));
+            InterlockedDecrement(&readerBlock->RefCount);
         }
-        entry = entry->Flink;
+        QmCleanupBlock(unsharedView);
     }
 
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+
+    // Release our hold on the trimmed blocks
+    for (int index = 0; index < MAX_SNAP_VIEWS; index++) {
+        QmCleanupBlock(snapViews[index]);
+    }
+    QmCleanupBlock(pathlessView);
+}
+
+//----------------------------------------------------------------------------
+void EnqueueInitialBlock(
+    __in     READER_INFO      *reader,
+    __in     RING_BUFFER      *ringBuffer,
+    __in     BLOCK_NODE       *blockNode,
+    __in_opt const BLOCK_NODE *ruleBlock)
+{
+    if (!IsSnapshotBlock(&reader->Snapshot, blockNode) || IsBlockFiltered(reader, blockNode)) {
+        return;
+    }
+    if (ruleBlock && reader->RuleProgram) {
+        RULE_EVENT event;
+
+        GetRuleEvent(ruleBlock, &event);
+        if (IsRuleEventDropped(reader->RuleProgram, &event)) {
+            return;
+        }
+    }
+    InterlockedIncrement(&blockNode->RefCount);
+    if (!RingBufferEnqueue(ringBuffer, blockNode)) {
+        InterlockedDecrement(&blockNode->RefCount);
+        reader->Snapshot.DroppedBlocks++;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Readers would otherwise never receive a running process or open connection
+// that left its tree before their snapshot reached it, since they only
+// receive its ended or closed block live.  Appending it to the snapshot
+// rather than the initial blocks buffer means no number of removals between
+// reads can overflow the buffer.
+void EnqueueRemovedInitialBlock(__in BLOCK_NODE *blockNode)
+{
+    LIST_ENTRY *entry;
+
+    for (entry = gSnapshotListHead.Flink; entry != &gSnapshotListHead; entry = entry->Flink) {
+        READER_INFO  *reader   = CONTAINING_RECORD(entry, READER_INFO, Snapshot.ListEntry);
+        SNAPSHOT     *snapshot = reader->Snapshot.Snapshot;
+        const UINT64  nextId   = (blockNode->BlockType == ProcessBlock) ?
+                snapshot->NextProcessId : snapshot->NextConnectionId;
+
+        // Every reader sharing the snapshot comes up, but it only needs the
+        // block once
+        if ((blockNode->SortId < nextId) ||
+                (snapshot->Count && (snapshot->Entries[snapshot->Count - 1] == blockNode))) {
+            continue;
+        }
+        if (!ReserveSnapshotEntries(snapshot, 1)) {
+            reader->Snapshot.DroppedBlocks++;
+            continue;
+        }
+        InterlockedIncrement(&blockNode->RefCount);
+        snapshot->Entries[snapshot->Count++] = blockNode;
+    }
+}
+
+//----------------------------------------------------------------------------
+void ExpireConnectionBlock(__in TIMER_WHEEL_ENTRY *entry)
+{
+    BLOCK_NODE *blockNode = CONTAINING_RECORD(entry, BLOCK_NODE, TimerEntry);
+
+    TraceEvent(TraceConnectionRemoved, blockNode->ConnectionId, 0, 0, 0);
+    if (LLRB_REMOVE(BlockTree, &gConnTreeHead, blockNode)) {
+        gConnTreeCount--;
+        InvalidateSharedSnapshot();
+        EnqueueRemovedInitialBlock(blockNode);
+    }
+    InterlockedDecrement(&GetStatisticsCpu()->NumConnections);
+    QmCleanupBlock(blockNode);
+}
+
+//----------------------------------------------------------------------------
+void ExpireExitHistory(__in TIMER_WHEEL_ENTRY *entry)
+{
+    UNREFERENCED_PARAMETER(entry);
+
+    TrimExitHistory(gExitHistoryMaxCount);
+    ScheduleExitHistoryTimer();
+}
+
+//----------------------------------------------------------------------------
+// The process ID stays unknown, but readers still get the packets
+void ExpireHeldPackets(__in TIMER_WHEEL_ENTRY *entry)
+{
+    BLOCK_NODE *blockNode = CONTAINING_RECORD(entry, BLOCK_NODE, TimerEntry);
+
+    if (LLRB_REMOVE(BlockTree, &gPacketTreeHead, blockNode)) {
+        ReleaseHeldPackets(blockNode, _UI32_MAX);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Visits at most gSnapshotChunkSize tree nodes, so the trees lock is only held
+// briefly no matter how many processes there are.  If the entries cannot
+// grow, end the snapshot early rather than leave readers waiting on it.
+void ExtendSnapshot(__in SNAPSHOT *snapshot)
+{
+    BLOCK_NODE *procBlock;
+    BLOCK_NODE *connBlock;
+    UINT32      visited = 0;
+
+    if (!ReserveSnapshotEntries(snapshot, gSnapshotChunkSize)) {
+        DBGPRINT(D_ERR, "Cannot grow snapshot past %u blocks", snapshot->Count);
+        snapshot->NextProcessId    = (UINT64)_UI32_MAX + 1;
+        snapshot->NextConnectionId = (UINT64)_UI32_MAX + 1;
+        return;
+    }
+
+    // Add process and connection blocks by comparing timestamps
+    procBlock = FindBlockNode(&gProcessTreeHead, snapshot->NextProcessId);
+    connBlock = FindBlockNode(&gConnTreeHead, snapshot->NextConnectionId);
+    while ((procBlock || connBlock) && (visited < gSnapshotChunkSize)) {
+        BLOCK_NODE *blockNode;
+
+        if (procBlock && (!connBlock ||
+                (procBlock->Timestamp.QuadPart < connBlock->Timestamp.QuadPart) ||
+                ((procBlock->Timestamp.QuadPart == connBlock->Timestamp.QuadPart) &&
+                (procBlock->Tiebreaker < connBlock->Tiebreaker)))) {
+            blockNode               = procBlock;
+            snapshot->NextProcessId = (UINT64)procBlock->SortId + 1;
+            procBlock               = LLRB_NEXT(BlockTree, &gProcessTreeHead, procBlock);
+        } else {
+            blockNode                  = connBlock;
+            snapshot->NextConnectionId = (UINT64)connBlock->SortId + 1;
+            connBlock                  = LLRB_NEXT(BlockTree, &gConnTreeHead, connBlock);
+        }
+        InterlockedIncrement(&blockNode->RefCount);
+        snapshot->Entries[snapshot->Count++] = blockNode;
+        visited++;
+    }
+    if (!procBlock) {
+        snapshot->NextProcessId = (UINT64)_UI32_MAX + 1;
+    }
+    if (!connBlock) {
+        snapshot->NextConnectionId = (UINT64)_UI32_MAX + 1;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Sends at most gSnapshotChunkSize snapshot entries or exit history entries,
+// so the trees lock is only held briefly.  The reader furthest along extends
+// the snapshot for everyone sharing it.
+void FillInitialBuffer(__in READER_INFO *reader)
+{
+    SNAPSHOT_CURSOR    *cursor   = &reader->Snapshot;
+    SNAPSHOT           *snapshot = cursor->Snapshot;
+    SNAPSHOT           *finished = NULL;
+    RING_BUFFER        *ring     = &reader->InitialBuffer;
+    UINT32              visited  = 0;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+
+    if (!cursor->Active) {
+        // The reader deregistered or the snapshot already finished
+    } else if ((cursor->NextEntry < snapshot->Count) ||
+            (snapshot->NextProcessId <= _UI32_MAX) || (snapshot->NextConnectionId <= _UI32_MAX)) {
+        if (cursor->NextEntry == snapshot->Count) {
+            ExtendSnapshot(snapshot);
+        }
+        while ((cursor->NextEntry < snapshot->Count) && (visited < gSnapshotChunkSize)) {
+            BLOCK_NODE *blockNode = snapshot->Entries[cursor->NextEntry++];
+            EnqueueInitialBlock(reader, ring, blockNode,
+                    (blockNode->BlockType == ProcessBlock) ? blockNode : NULL);
+            visited++;
+        }
+    } else {
+        // Replay recently exited processes after the running ones, oldest
+        // first.  Skip any that were trimmed since the last chunk.
+        const UINT64 firstEntry = gExitHistoryAdded - gExitHistoryCount;
+
+        if (cursor->NextExitEntry < firstEntry) {
+            cursor->NextExitEntry = firstEntry;
+        }
+        while ((cursor->NextExitEntry < snapshot->EndExitEntry) && (visited < gSnapshotChunkSize)) {
+            const EXIT_HISTORY_ENTRY *entry = &gExitHistory[(gExitHistoryFront +
+                    (UINT32)(cursor->NextExitEntry - firstEntry)) % gExitHistoryMaxCount];
+            BLOCK_NODE               *blocks[2] = { entry->StartBlock, entry->EndBlock };
+            const BLOCK_NODE         *ruleBlock = entry->StartBlock ? entry->StartBlock : entry->EndBlock;
+
+            for (int block = 0; block < 2; block++) {
+                if (blocks[block]) {
+                    EnqueueInitialBlock(reader, ring, blocks[block], ruleBlock);
+                }
+            }
+            cursor->NextExitEntry++;
+            visited++;
+        }
+        if (cursor->NextExitEntry >= snapshot->EndExitEntry) {
+            cursor->Active   = false;
+            cursor->Snapshot = NULL;
+            RemoveEntryList(&cursor->ListEntry);
+            finished = ReleaseSnapshot(snapshot);
+        }
+    }
+
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+
+    // Free the snapshot outside the lock, since it may hold many blocks
+    FreeSnapshot(finished);
+}
+
+//----------------------------------------------------------------------------
+BLOCK_NODE* FindBlockNode(
+    __in BLOCK_TREE_HEAD *treeHead,
+    __in const UINT64     sortId)
+{
+    BLOCK_NODE *blockNode = LLRB_ROOT(treeHead);
+    BLOCK_NODE *found     = NULL;
+
+    if (sortId > _UI32_MAX) {
+        return NULL;
+    }
+    while (blockNode) {
+        if (blockNode->SortId >= sortId) {
+            found     = blockNode;
+            blockNode = LLRB_LEFT(blockNode, TreeEntry);
+        } else {
+            blockNode = LLRB_RIGHT(blockNode, TreeEntry);
+        }
+    }
+    return found;
+}
+
+//----------------------------------------------------------------------------
+SHARED_STATISTICS_MAPPING* FindSharedStatisticsMapping(__in const PEPROCESS process)
+{
+    LIST_ENTRY *entry;
+
+    for (entry = gSharedStatisticsMappings.Flink; entry != &gSharedStatisticsMappings;
+            entry = entry->Flink) {
+        SHARED_STATISTICS_MAPPING *mapping = CONTAINING_RECORD(entry,
+                SHARED_STATISTICS_MAPPING, ListEntry);
+        if (mapping->Process == process) {
+            return mapping;
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+void FreeMemory(__in void *buffer)
+{
+    MEMORY_HEADER *header = (MEMORY_HEADER*)buffer - 1;
+
+    AccountMemory(&gMemoryUsage[header->MemoryTag], -(LONG64)header->Size, -1);
+    ExFreePool(header);
+}
+
+//----------------------------------------------------------------------------
+void FreePages(
+    __in void         *buffer,
+    __in const SIZE_T  size,
+    __in const UINT32  memoryTag)
+{
+    AccountMemory(&gMemoryUsage[memoryTag], -(LONG64)ROUND_TO_PAGES(size), -1);
+    ExFreePool(buffer);
+}
+
+//----------------------------------------------------------------------------
+void FreeSnapshot(__in_opt SNAPSHOT *snapshot)
+{
+    if (snapshot) {
+        for (UINT32 index = 0; index < snapshot->Count; index++) {
+            QmCleanupBlock(snapshot->Entries[index]);
+        }
+        if (snapshot->Entries) {
+            FreeMemory(snapshot->Entries);
+        }
+        QmCleanupBlock(snapshot->InterfaceDescriptionBlock);
+        FreeMemory(snapshot);
+    }
 }
 
 //----------------------------------------------------------------------------
@@ -432,12 +1047,13 @@ BLOCK_NODE* GetConnectionBlock(
     UINT32                     blockOffset;
     static const UINT32        connectionClosedEvent = 0xFFFFFFFF;
 
-    blockLength = sizeof(PCAP_NG_CONNECTION_HEADER) + sizeof(UINT32);
+    blockLength = sizeof(PCAP_NG_CONNECTION_HEADER) +
+            sizeof(PCAP_NG_SEQUENCE_OPTION) + sizeof(PCAP_NG_OPTION_HEADER) +
+            sizeof(UINT32);
     if (!opened) {
-        blockLength += sizeof(PCAP_NG_OPTION_HEADER) +
-                sizeof(connectionClosedEvent) + sizeof(PCAP_NG_OPTION_HEADER);
+        blockLength += sizeof(PCAP_NG_OPTION_HEADER) + sizeof(connectionClosedEvent);
     }
-    blockNode = AllocateBlockNode(blockLength, gPoolTagConnection);
+    blockNode = AllocateBlockNode(blockLength, MemoryConnectionBlocks);
     if (!blockNode) {
         return NULL;
     }
@@ -452,7 +1068,7 @@ BLOCK_NODE* GetConnectionBlock(
     if (timestamp) {
         ConvertKeTime(timestamp, &blockNode->Timestamp);
     } else {
-        GetTimestamp(&blockNode->Timestamp);
+        ClockGetTimestamp(&blockNode->Timestamp, &blockNode->Tiebreaker);
     }
 
     buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
@@ -467,8 +1083,9 @@ BLOCK_NODE* GetConnectionBlock(
     if (!opened) {
         blockOffset = SetOption(buffer, blockOffset, 2, &connectionClosedEvent,
                 sizeof(connectionClosedEvent));
-        RtlZeroMemory(buffer + blockOffset, sizeof(PCAP_NG_OPTION_HEADER)); // End
     }
+    blockOffset = SetSequenceOption(buffer, blockOffset);
+    RtlZeroMemory(buffer + blockOffset, sizeof(PCAP_NG_OPTION_HEADER)); // End
     UINT32 *tmp = (UINT32 *)(buffer + blockNode->BlockLength - sizeof(UINT32));
     *tmp = blockNode->BlockLength;
     //*reinterpret_cast<UINT32*>(buffer + blockNode->BlockLength - sizeof(UINT32)) =
@@ -476,6 +1093,61 @@ BLOCK_NODE* GetConnectionBlock(
     return blockNode;
 }
 
+//----------------------------------------------------------------------------
+__checkReturn
+BLOCK_NODE* GetImageBlock(
+    __in const UINT32          pid,
+    __in const UINT64          imageBase,
+    __in const UINT32          imageSize,
+    __in const bool            kernelImage,
+    __in const UINT32          pathId,
+    __in const UNICODE_STRING *path)
+{
+    BLOCK_NODE           *blockNode;
+    char                 *buffer;
+    PCAP_NG_IMAGE_HEADER *header;
+    UINT32                blockLength;
+    UINT32                blockOffset;
+    ULONG                 pathLength = 0;
+
+    blockLength = sizeof(PCAP_NG_IMAGE_HEADER) + sizeof(PCAP_NG_SEQUENCE_OPTION) +
+            sizeof(PCAP_NG_OPTION_HEADER) + sizeof(UINT32);
+    if (path && path->Buffer && path->Length) {
+        RtlUnicodeToUTF8N(NULL, 0, &pathLength, path->Buffer, path->Length);
+        blockLength += sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(pathLength);
+    }
+
+    blockNode = AllocateBlockNode(blockLength, MemoryImageBlocks);
+    if (!blockNode) {
+        return NULL;
+    }
+
+    blockNode->BlockType = ImageBlock;
+    blockNode->SortId    = pid;
+    blockNode->ProcessId = pid;
+    ClockGetTimestamp(&blockNode->Timestamp, &blockNode->Tiebreaker);
+
+    buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+    header = (PCAP_NG_IMAGE_HEADER *)buffer;
+    header->BlockType     = blockNode->BlockType;
+    header->BlockLength   = blockNode->BlockLength;
+    header->ProcessId     = pid;
+    header->TimestampHigh = blockNode->Timestamp.HighPart;
+    header->TimestampLow  = blockNode->Timestamp.LowPart;
+    header->ImageBaseHigh = (UINT32)(imageBase >> 32);
+    header->ImageBaseLow  = (UINT32)imageBase;
+    header->ImageSize     = imageSize;
+    header->PathId        = pathId;
+    header->Flags         = kernelImage ? KernelImage : 0;
+    blockOffset = SetUtf8Option(buffer, sizeof(PCAP_NG_IMAGE_HEADER), 3, path,
+            (UINT16)pathLength, NULL);
+    blockOffset = SetSequenceOption(buffer, blockOffset);
+    RtlZeroMemory(buffer + blockOffset, sizeof(PCAP_NG_OPTION_HEADER)); // End
+    UINT32 *tmp = (UINT32 *)(buffer + blockNode->BlockLength - sizeof(UINT32));
+    *tmp = blockNode->BlockLength;
+    return blockNode;
+}
+
 //----------------------------------------------------------------------------
 __checkReturn
 BLOCK_NODE* GetInterfaceDescriptionBlock(void)
@@ -486,7 +1158,7 @@ BLOCK_NODE* GetInterfaceDescriptionBlock(void)
     static const char             *ifdesc = "Hone Capture Pseudo-device\0\0";
 
     blockNode = AllocateBlockNode(sizeof(PCAP_NG_INTERFACE_DESCRIPTION),
-            gPoolTagInterface);
+            MemoryInterfaceBlocks);
     if (!blockNode) {
         return NULL;
     }
@@ -508,16 +1180,53 @@ BLOCK_NODE* GetInterfaceDescriptionBlock(void)
     return blockNode;
 }
 
+//----------------------------------------------------------------------------
+// Called after the sequence number is set, so the copied options already hold
+// it
+__checkReturn
+BLOCK_NODE* GetPathlessImageBlock(__in const BLOCK_NODE *blockNode)
+{
+    const char   *blockData   = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+    const UINT32  endLength   = sizeof(PCAP_NG_SEQUENCE_OPTION) +
+            sizeof(PCAP_NG_OPTION_HEADER) + sizeof(UINT32);
+    const UINT32  blockLength = sizeof(PCAP_NG_IMAGE_HEADER) + endLength;
+    BLOCK_NODE   *view;
+    char         *buffer;
+
+    view = AllocateBlockNode(blockLength, MemoryImageBlocks);
+    if (!view) {
+        return NULL;
+    }
+    view->BlockType    = blockNode->BlockType;
+    view->SortId       = blockNode->SortId;
+    view->ConnectionId = blockNode->ConnectionId;
+    view->ProcessId    = blockNode->ProcessId;
+    view->Timestamp    = blockNode->Timestamp;
+    view->Tiebreaker   = blockNode->Tiebreaker;
+    view->Sequence     = blockNode->Sequence;
+    view->EnqueueCounter = blockNode->EnqueueCounter;
+
+    // Keep the header and the sequence and end options, and drop the path
+    buffer = view->Buffer ? view->Buffer : view->Data;
+    RtlCopyMemory(buffer, blockData, sizeof(PCAP_NG_IMAGE_HEADER));
+    RtlCopyMemory(buffer + sizeof(PCAP_NG_IMAGE_HEADER),
+            blockData + blockNode->BlockLength - endLength, endLength);
+    ((PCAP_NG_IMAGE_HEADER *)buffer)->BlockLength = blockLength;
+    *(UINT32 *)(buffer + blockLength - sizeof(UINT32)) = blockLength;
+    return view;
+}
+
 //----------------------------------------------------------------------------
 __checkReturn
 BLOCK_NODE* GetProcessBlock(
-    __in const bool           started,
-    __in const UINT32         pid,
-    __in const UINT32         parentPid,
-    __in UNICODE_STRING      *path,
-    __in UNICODE_STRING      *args,
-    __in UNICODE_STRING      *sid,
-    __in const LARGE_INTEGER *timestamp)
+    __in const bool               started,
+    __in const UINT32             pid,
+    __in const UINT32             parentPid,
+    __in UNICODE_STRING          *path,
+    __in UNICODE_STRING          *args,
+    __in UNICODE_STRING          *sid,
+    __in const LARGE_INTEGER     *timestamp,
+    __in const PROCESS_EXIT_INFO *exitInfo)
 {
     BLOCK_NODE             *blockNode;
     char                   *buffer;
@@ -527,19 +1236,27 @@ BLOCK_NODE* GetProcessBlock(
     ULONG                   argsLength        = 0;
     ULONG                   argvLength        = 0;
     ULONG                   sidLength         = 0;
+    UINT32                  blockOffset;
     UINT16                  bytesRemoved      = 0;
-    UINT16                  optionsCount      = 0;
     static const UINT32     processEndedEvent = 0xFFFFFFFF;
 
-    blockLength = sizeof(PCAP_NG_PROCESS_HEADER) + sizeof(UINT32);
+    blockLength = sizeof(PCAP_NG_PROCESS_HEADER) + sizeof(PCAP_NG_SEQUENCE_OPTION) +
+            sizeof(PCAP_NG_OPTION_HEADER) + sizeof(UINT32);
     if (!started) {
         blockLength += sizeof(PCAP_NG_OPTION_HEADER) + sizeof(processEndedEvent);
-        optionsCount++;
+        if (exitInfo) {
+            blockLength += sizeof(PCAP_NG_OPTION_HEADER) + sizeof(exitInfo->ExitStatus) +
+                    sizeof(PCAP_NG_OPTION_HEADER) + sizeof(exitInfo->KernelTime) +
+                    sizeof(PCAP_NG_OPTION_HEADER) + sizeof(exitInfo->UserTime) +
+                    sizeof(PCAP_NG_OPTION_HEADER) + sizeof(exitInfo->PeakWorkingSet);
+            if (exitInfo->Subsystem) {
+                blockLength += sizeof(PCAP_NG_OPTION_HEADER) + sizeof(exitInfo->Subsystem);
+            }
+        }
     }
     if (path && path->Buffer && path->Length) {
         RtlUnicodeToUTF8N(NULL, 0, &pathLength, path->Buffer, path->Length);
         blockLength += sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(pathLength);
-        optionsCount++;
     }
     if (args && args->Buffer && args->Length) {
         // Since we store the arguments as an null-sparated array (like Unix), and
@@ -551,18 +1268,13 @@ BLOCK_NODE* GetProcessBlock(
             argvLength++; // Add one byte for NULL terminator if necessary
         }
         blockLength += sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(argvLength);
-        optionsCount += 2;
     }
     if (sid && sid->Buffer && sid->Length) {
         RtlUnicodeToUTF8N(NULL, 0, &sidLength, sid->Buffer, sid->Length);
         blockLength += sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(sidLength);
-        optionsCount++;
-    }
-    if (optionsCount) {
-        blockLength += sizeof(PCAP_NG_OPTION_HEADER);
     }
 
-    blockNode = AllocateBlockNode(blockLength, gPoolTagProcess);
+    blockNode = AllocateBlockNode(blockLength, MemoryProcessBlocks);
     if (!blockNode) {
         return NULL;
     }
@@ -573,7 +1285,7 @@ BLOCK_NODE* GetProcessBlock(
     if (timestamp) {
         ConvertKeTime(timestamp, &blockNode->Timestamp);
     } else {
-        GetTimestamp(&blockNode->Timestamp);
+        ClockGetTimestamp(&blockNode->Timestamp, &blockNode->Tiebreaker);
     }
     buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
     header = buffer;
@@ -584,22 +1296,35 @@ BLOCK_NODE* GetProcessBlock(
     header->ParentPidHeader.OptionCode   = 5;
     header->ParentPidHeader.OptionLength = sizeof(header->ParentPid);
     header->ParentPid                    = parentPid;
-    if (optionsCount) {
-        UINT32 blockOffset = sizeof(PCAP_NG_PROCESS_HEADER);
-        if (!started) {
-            blockOffset = SetOption(buffer, blockOffset, 2, &processEndedEvent,
-            sizeof(processEndedEvent));
-        }
-        blockOffset = SetUtf8Option(buffer, blockOffset, 3, path,
-                (UINT16)pathLength, NULL);
-        blockOffset = SetUtf8Option(buffer, blockOffset, 4, args,  // Parsed args
-                (UINT16)argvLength, &bytesRemoved);
-        blockOffset = SetUtf8Option(buffer, blockOffset, 11, args, // Raw args
-                (UINT16)argsLength, NULL);
-        blockOffset = SetUtf8Option(buffer, blockOffset, 10, sid,
-                (UINT16)sidLength,  NULL);
-        RtlZeroMemory(buffer + blockOffset, sizeof(PCAP_NG_OPTION_HEADER)); // End
+    blockOffset = sizeof(PCAP_NG_PROCESS_HEADER);
+    if (!started) {
+        blockOffset = SetOption(buffer, blockOffset, 2, &processEndedEvent,
+        sizeof(processEndedEvent));
+        if (exitInfo) {
+            blockOffset = SetOption(buffer, blockOffset, 12,
+                    &exitInfo->ExitStatus, sizeof(exitInfo->ExitStatus));
+            blockOffset = SetOption(buffer, blockOffset, 13,
+                    &exitInfo->KernelTime, sizeof(exitInfo->KernelTime));
+            blockOffset = SetOption(buffer, blockOffset, 14,
+                    &exitInfo->UserTime, sizeof(exitInfo->UserTime));
+            blockOffset = SetOption(buffer, blockOffset, 15,
+                    &exitInfo->PeakWorkingSet, sizeof(exitInfo->PeakWorkingSet));
+            if (exitInfo->Subsystem) {
+                blockOffset = SetOption(buffer, blockOffset, 16,
+                        &exitInfo->Subsystem, sizeof(exitInfo->Subsystem));
+            }
+        }
     }
+    blockOffset = SetUtf8Option(buffer, blockOffset, 3, path,
+            (UINT16)pathLength, NULL);
+    blockOffset = SetUtf8Option(buffer, blockOffset, 4, args,  // Parsed args
+            (UINT16)argvLength, &bytesRemoved);
+    blockOffset = SetUtf8Option(buffer, blockOffset, 11, args, // Raw args
+            (UINT16)argsLength, NULL);
+    blockOffset = SetUtf8Option(buffer, blockOffset, 10, sid,
+            (UINT16)sidLength,  NULL);
+    blockOffset = SetSequenceOption(buffer, blockOffset);
+    RtlZeroMemory(buffer + blockOffset, sizeof(PCAP_NG_OPTION_HEADER)); // End
 
     // Adjust the length since it may have shrunk when parsing the argument list
     blockNode->BlockLength = blockLength - bytesRemoved;
@@ -622,8 +1347,7 @@ UINT32 GetProcessIdForConnectionId(
     KLOCK_QUEUE_HANDLE  lockHandle;
 
     searchNode.SortId = connectionId;
-    DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
 
     blockNode = LLRB_FIND(BlockTree, &gConnTreeHead, &searchNode);
     if (blockNode) {
@@ -660,15 +1384,15 @@ UINT32 GetProcessIdForConnectionId(
                 &oconnNode->Timestamp);
             if (blockNode) {
                 LLRB_INSERT(BlockTree, &gConnTreeHead, blockNode);
-                EnqueueBlock(blockNode);
+                InvalidateSharedSnapshot();
+                EnqueueBlock(blockNode, NULL);
             }
         } else {
             processId = _UI32_MAX;
         }
     }
 
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
     return processId;
 }
 
@@ -730,6 +1454,51 @@ NTSTATUS GetRingBufferSizeQueryRoutine(
     return STATUS_OBJECT_NAME_NOT_FOUND;
 }
 
+//----------------------------------------------------------------------------
+// Strings from UNICODE_STRINGs that counted their terminator keep it, so drop
+// trailing nulls before rules compare against the end of the string
+void GetRuleEvent(
+    __in  const BLOCK_NODE *blockNode,
+    __out RULE_EVENT       *event)
+{
+    const char                   *blockData  = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+    const PCAP_NG_PROCESS_HEADER *header     = (const PCAP_NG_PROCESS_HEADER*)blockData;
+    const UINT32                  optionsEnd = blockNode->BlockLength - sizeof(UINT32);
+    UINT32                        offset     = sizeof(PCAP_NG_PROCESS_HEADER);
+
+    RtlZeroMemory(event, sizeof(RULE_EVENT));
+    event->ParentPid = header->ParentPid;
+
+    while (offset + sizeof(PCAP_NG_OPTION_HEADER) <= optionsEnd) {
+        const PCAP_NG_OPTION_HEADER *option = (const PCAP_NG_OPTION_HEADER*)(blockData + offset);
+        const char                  *value  = (const char*)(option + 1);
+        UINT32                       length = option->OptionLength;
+
+        if (!option->OptionCode) {
+            break; // End of options
+        }
+        while (length && !value[length - 1]) {
+            length--;
+        }
+        switch (option->OptionCode) {
+        case 3:  // Path
+            event->Path       = value;
+            event->PathLength = length;
+            break;
+        case 10: // SID
+            event->Sid       = value;
+            event->SidLength = length;
+            break;
+        case 11: // Raw args
+            event->CommandLine       = value;
+            event->CommandLineLength = length;
+            break;
+        }
+        offset += sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(option->OptionLength);
+    }
+    event->PathHash = HashRulePath(event->Path, event->PathLength);
+}
+
 //----------------------------------------------------------------------------
 __checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
 BLOCK_NODE* GetSectionHeaderBlock(void)
@@ -850,38 +1619,140 @@ BLOCK_NODE* GetSectionHeaderBlock(void)
         blockLength += sizeof(PCAP_NG_OPTION_HEADER) +
                 PCAP_NG_PADDING(systemIdLen);
     }
-    blockNode = AllocateBlockNode(blockLength, gPoolTagSection);
+    blockNode = AllocateBlockNode(blockLength, MemorySectionBlocks);
     if (!blockNode) {
         return NULL;
     }
-
-    blockNode->BlockType = SectionHeaderBlock;
-    buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
-    header = (PCAP_NG_SECTION_HEADER *)buffer;
-    header->BlockType     = blockNode->BlockType;
-    header->BlockLength   = blockNode->BlockLength;
-    header->ByteOrder     = 0x1A2B3C4D;
-    header->MajorVersion  = 1;
-    header->MinorVersion  = 0;
-    header->SectionLength = _UI64_MAX;
-    blockOffset = sizeof(PCAP_NG_SECTION_HEADER);
-    blockOffset = SetOption(buffer, blockOffset, 2, hardware,    hardwareLen);
-    blockOffset = SetOption(buffer, blockOffset, 3, os,          osLen);
-    blockOffset = SetOption(buffer, blockOffset, 4, application, applicationLen);
-    blockOffset = SetOption(buffer, blockOffset, 257, &systemId, systemIdLen);
-    RtlZeroMemory(buffer + blockOffset, sizeof(PCAP_NG_OPTION_HEADER)); // End
-    UINT32 *tmp = (UINT32 *)(buffer + blockNode->BlockLength - sizeof(UINT32));
-    *tmp = blockNode->BlockLength;
-    return blockNode;
+
+    blockNode->BlockType = SectionHeaderBlock;
+    buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+    header = (PCAP_NG_SECTION_HEADER *)buffer;
+    header->BlockType     = blockNode->BlockType;
+    header->BlockLength   = blockNode->BlockLength;
+    header->ByteOrder     = 0x1A2B3C4D;
+    header->MajorVersion  = 1;
+    header->MinorVersion  = 0;
+    header->SectionLength = _UI64_MAX;
+    blockOffset = sizeof(PCAP_NG_SECTION_HEADER);
+    blockOffset = SetOption(buffer, blockOffset, 2, hardware,    hardwareLen);
+    blockOffset = SetOption(buffer, blockOffset, 3, os,          osLen);
+    blockOffset = SetOption(buffer, blockOffset, 4, application, applicationLen);
+    blockOffset = SetOption(buffer, blockOffset, 257, &systemId, systemIdLen);
+    RtlZeroMemory(buffer + blockOffset, sizeof(PCAP_NG_OPTION_HEADER)); // End
+    UINT32 *tmp = (UINT32 *)(buffer + blockNode->BlockLength - sizeof(UINT32));
+    *tmp = blockNode->BlockLength;
+    return blockNode;
+}
+
+//----------------------------------------------------------------------------
+// A snapshot started less than gSnapshotShareTime ago is only still shared if
+// nothing changed the trees or exit history since, so a reader that joins it
+// sees the same blocks it would see in a snapshot of its own
+__checkReturn
+SNAPSHOT* GetSharedSnapshot(void)
+{
+    SNAPSHOT       *snapshot = gSharedSnapshot;
+    const LONGLONG  now      = ClockGetUptime();
+
+    if (snapshot && (now - snapshot->Created < gSnapshotShareTime)) {
+        return snapshot;
+    }
+    gSharedSnapshot = NULL;
+
+    snapshot = AllocateMemory(sizeof(SNAPSHOT), MemorySnapshots);
+    if (!snapshot) {
+        return NULL;
+    }
+    RtlZeroMemory(snapshot, sizeof(SNAPSHOT));
+    snapshot->InterfaceDescriptionBlock = GetInterfaceDescriptionBlock();
+    if (!snapshot->InterfaceDescriptionBlock) {
+        FreeMemory(snapshot);
+        return NULL;
+    }
+    snapshot->Created = now;
+    TrimExitHistory(gExitHistoryMaxCount);
+    snapshot->FirstExitEntry = gExitHistoryAdded - gExitHistoryCount;
+    snapshot->EndExitEntry   = gExitHistoryAdded;
+    gSharedSnapshot = snapshot;
+    return snapshot;
+}
+
+//----------------------------------------------------------------------------
+UINT32 GetStatisticsBlockType(__in const UINT32 blockType)
+{
+    switch (blockType) {
+    case ConnectionBlock: return StatisticsConnectionBlocks;
+    case ImageBlock:      return StatisticsImageBlocks;
+    case PacketBlock:     return StatisticsPacketBlocks;
+    case ProcessBlock:    return StatisticsProcessBlocks;
+    default:              return NumStatisticsBlockTypes;
+    }
+}
+
+//----------------------------------------------------------------------------
+STATISTICS_CPU* GetStatisticsCpu(void)
+{
+    const ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+    return &gStatisticsCpus[(cpu < gStatisticsCpuCount) ? cpu : 0];
+}
+
+//----------------------------------------------------------------------------
+UINT64 GetTimerWheelTick(void)
+{
+    return (UINT64)ClockGetUptime() / (gTimerWheelPeriod * 1000);
+}
+
+//----------------------------------------------------------------------------
+// Called after the sequence number is set, so the copied footer already holds
+// it
+__checkReturn
+BLOCK_NODE* GetTrimmedPacketBlock(
+    __in const BLOCK_NODE *blockNode,
+    __in const UINT32      snapLength)
+{
+    const char            *blockData   = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+    const UINT32           blockLength = sizeof(PCAP_NG_PACKET_HEADER) +
+            PCAP_NG_PADDING(snapLength) + sizeof(PCAP_NG_PACKET_FOOTER);
+    BLOCK_NODE            *view;
+    char                  *buffer;
+    PCAP_NG_PACKET_HEADER *header;
+    PCAP_NG_PACKET_FOOTER *footer;
+
+    view = AllocateBlockNode(blockLength, MemoryPacketBlocks);
+    if (!view) {
+        return NULL;
+    }
+    view->BlockType    = blockNode->BlockType;
+    view->SortId       = blockNode->SortId;
+    view->ConnectionId = blockNode->ConnectionId;
+    view->ProcessId    = blockNode->ProcessId;
+    view->Timestamp    = blockNode->Timestamp;
+    view->Tiebreaker   = blockNode->Tiebreaker;
+    view->Sequence     = blockNode->Sequence;
+    view->EnqueueCounter = blockNode->EnqueueCounter;
+
+    buffer = view->Buffer ? view->Buffer : view->Data;
+    header = (PCAP_NG_PACKET_HEADER*)buffer;
+    footer = (PCAP_NG_PACKET_FOOTER*)(buffer + blockLength - sizeof(PCAP_NG_PACKET_FOOTER));
+    RtlCopyMemory(buffer, blockData, sizeof(PCAP_NG_PACKET_HEADER) + snapLength);
+    RtlZeroMemory(buffer + sizeof(PCAP_NG_PACKET_HEADER) + snapLength,
+            PCAP_NG_PADDING(snapLength) - snapLength);
+    RtlCopyMemory(footer, blockData + blockNode->BlockLength - sizeof(PCAP_NG_PACKET_FOOTER),
+            sizeof(PCAP_NG_PACKET_FOOTER));
+    header->BlockLength    = blockLength;
+    header->CapturedLength = snapLength;
+    footer->BlockLength    = blockLength;
+    return view;
 }
 
 //----------------------------------------------------------------------------
-void GetTimestamp(__out LARGE_INTEGER *timestamp)
+__drv_requiresIRQL(PASSIVE_LEVEL)
+ULONG HashImagePath(__in const UNICODE_STRING *path)
 {
-    LARGE_INTEGER systemTime;
+    ULONG hash = 0;
 
-    KeQuerySystemTime(&systemTime);
-    timestamp->QuadPart = systemTime.QuadPart / 10 - gTimestampConv * 1000000;
+    RtlHashUnicodeString(path, TRUE, HASH_STRING_ALGORITHM_DEFAULT, &hash);
+    return hash;
 }
 
 //----------------------------------------------------------------------------
@@ -890,11 +1761,9 @@ void HoldPacketBlock(__in BLOCK_NODE *blockNode)
     BLOCK_NODE         *existing;
     KLOCK_QUEUE_HANDLE  lockHandle;
 
-    DBGPRINT(D_INFO, "Holding packet block for connection %08X",
-            blockNode->ConnectionId);
+    TraceEvent(TracePacketHeld, blockNode->ConnectionId, 0, 0, 0);
 
-    DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
     InterlockedIncrement(&blockNode->RefCount);
     existing = LLRB_INSERT(BlockTree, &gPacketTreeHead, blockNode);
     if (existing) {
@@ -902,10 +1771,10 @@ void HoldPacketBlock(__in BLOCK_NODE *blockNode)
         InsertTailList(&existing->ListEntry, &blockNode->ListEntry);
     } else {
         InitializeListHead(&blockNode->ListEntry);
+        SetQueueTimer(&blockNode->TimerEntry, gPacketHoldMaxAge, ExpireHeldPackets);
     }
     gPacketTreeCount++;
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
 }
 
 //----------------------------------------------------------------------------
@@ -918,10 +1787,10 @@ NTSTATUS InitializeQueueManager(DEVICE_OBJECT *device)
 
     KeQueryTickCount(&gDriverLoadTick);
     InitializeListHead(&gReaderListHead);
-    InitializeListHead(&gConnCloseListHead);
+    InitializeListHead(&gSnapshotListHead);
 
     status = ExInitializeLookasideListEx(&gBlockNodeLal, NULL, NULL,
-            NonPagedPool, 0, sizeof(BLOCK_NODE), gPoolTagBlockNode, 0);
+            NonPagedPool, 0, sizeof(BLOCK_NODE), gPoolTags[MemoryBlockNodes], 0);
     if (!NT_SUCCESS(status)) {
         DBGPRINT(D_ERR, "Cannot create block node lookaside list");
         return status;
@@ -929,63 +1798,136 @@ NTSTATUS InitializeQueueManager(DEVICE_OBJECT *device)
     gBlockNodeLalInit = true;
 
     status = ExInitializeLookasideListEx(&gOconnNodeLal, NULL, NULL,
-            NonPagedPool, 0, sizeof(BLOCK_NODE), gPoolTagOconnNode, 0);
+            NonPagedPool, 0, sizeof(OCONN_NODE), gPoolTags[MemoryOpenConnections], 0);
     if (!NT_SUCCESS(status)) {
         DBGPRINT(D_ERR, "Cannot create open connection node lookaside list");
         return status;
     }
     gOconnNodeLalInit = true;
 
-    KeInitializeDpc(&gConnCloseDpc, ProcessConnectionCloseEvents, NULL);
-    KeInitializeTimer(&gConnCloseTimer);
-    gConnCloseTimeout.QuadPart = -10000;
+    gExitHistory = AllocateMemory(gExitHistoryMaxCount * sizeof(EXIT_HISTORY_ENTRY),
+            MemoryExitHistory);
+    if (!gExitHistory) {
+        DBGPRINT(D_ERR, "Cannot allocate exit history");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(gExitHistory, gExitHistoryMaxCount * sizeof(EXIT_HISTORY_ENTRY));
+
+    // Round the event counters up to a whole page so they start on a cache
+    // line boundary
+    gStatisticsCpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    gStatisticsCpus     = AllocatePages(gStatisticsCpuCount * sizeof(STATISTICS_CPU),
+            MemoryStatistics);
+    if (!gStatisticsCpus) {
+        DBGPRINT(D_ERR, "Cannot allocate processor event counters");
+        gStatisticsCpuCount = 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(gStatisticsCpus, gStatisticsCpuCount * sizeof(STATISTICS_CPU));
 
-    KeInitializeSpinLock(&gReaderListLock);
-    KeInitializeSpinLock(&gTreesLock);
+    // Allocations of a page or more are page aligned, so the statistics page
+    // never shares a physical page with other pool allocations
+    C_ASSERT(sizeof(SHARED_STATISTICS) <= PAGE_SIZE);
+    gSharedStatistics = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE,
+            gPoolTags[MemorySharedStatistics]);
+    if (!gSharedStatistics) {
+        DBGPRINT(D_ERR, "Cannot allocate shared statistics page");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    AccountMemory(&gMemoryUsage[MemorySharedStatistics], PAGE_SIZE, 1);
+    RtlZeroMemory(gSharedStatistics, PAGE_SIZE);
+    gSharedStatistics->Version      = SHARED_STATISTICS_VERSION;
+    gSharedStatistics->Length       = sizeof(SHARED_STATISTICS);
+    gSharedStatistics->UpdatePeriod = gSharedStatisticsPeriod;
+    gSharedStatisticsMdl = IoAllocateMdl(gSharedStatistics, PAGE_SIZE, FALSE, FALSE, NULL);
+    if (!gSharedStatisticsMdl) {
+        DBGPRINT(D_ERR, "Cannot allocate shared statistics MDL");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    MmBuildMdlForNonPagedPool(gSharedStatisticsMdl);
+    KeInitializeDpc(&gSharedStatisticsDpc, UpdateSharedStatistics, NULL);
+    KeInitializeTimer(&gSharedStatisticsTimer);
+    ExInitializeFastMutex(&gSharedStatisticsMutex);
+    InitializeListHead(&gSharedStatisticsMappings);
+
+    InitTimerWheel(&gTimerWheel, GetTimerWheelTick());
+    KeInitializeDpc(&gTimerWheelDpc, AdvanceQueueTimers, NULL);
+    KeInitializeTimer(&gTimerWheelTimer);
+
+    ExInitializeFastMutex(&gImagePathMutex);
+    KeInitializeSpinLock(&gReaderListLock.Lock);
+    KeInitializeSpinLock(&gTreesLock.Lock);
+    gReaderListLock.WaitHistogram = LatencyReaderListLockWait;
+    gReaderListLock.HoldHistogram = LatencyReaderListLockHold;
+    gTreesLock.WaitHistogram      = LatencyTreesLockWait;
+    gTreesLock.HoldHistogram      = LatencyTreesLockHold;
+    gReaderListLock.TraceId       = TraceLockReaderList;
+    gTreesLock.TraceId            = TraceLockTrees;
     return status;
 }
 
 //----------------------------------------------------------------------------
-void ProcessConnectionCloseEvents(
-    __in     KDPC *dpc,
-    __in_opt void *context,
-    __in_opt void *arg1,
-    __in_opt void *arg2)
+void InvalidateSharedSnapshot(void)
 {
-    UNREFERENCED_PARAMETER(dpc);
-    UNREFERENCED_PARAMETER(context);
-    UNREFERENCED_PARAMETER(arg1);
-    UNREFERENCED_PARAMETER(arg2);
+    gSharedSnapshot = NULL;
+}
 
-    KLOCK_QUEUE_HANDLE  lockHandle;
-    LIST_ENTRY         *entry;
-    LARGE_INTEGER       timestamp;
+//----------------------------------------------------------------------------
+bool IsBlockFiltered(
+    __in const READER_INFO *reader,
+    __in const BLOCK_NODE  *blockNode)
+{
+    const ID_FILTER *filter;
 
-    GetTimestamp(&timestamp);
+    // Compact readers only read process blocks
+    if (reader->ProcessBlocksOnly && (blockNode->BlockType != ProcessBlock) &&
+            (blockNode->BlockType != SectionHeaderBlock) &&
+            (blockNode->BlockType != InterfaceDescriptionBlock)) {
+        return true;
+    }
 
-    DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+    // Split blocks between consumer group members by process ID, so each
+    // member sees all blocks for its processes in order
+    if ((reader->GroupSize > 1) && (blockNode->BlockType != SectionHeaderBlock) &&
+            (blockNode->BlockType != InterfaceDescriptionBlock)) {
+        const UINT32 id = (blockNode->ProcessId != ID_FILTER_EMPTY) ?
+                blockNode->ProcessId : blockNode->ConnectionId;
 
-    entry = gConnCloseListHead.Flink;
-    while (entry != &gConnCloseListHead) {
-        BLOCK_NODE *blockNode = CONTAINING_RECORD(entry, BLOCK_NODE, ListEntry);
+        if (GetConsumerGroupMember(id, reader->GroupSize) != reader->GroupMember) {
+            return true;
+        }
+    }
 
-        entry = entry->Flink;
-        if (timestamp.QuadPart > (blockNode->Timestamp.QuadPart + 1000)) {
-            // This connection is old enough that we can remove it from the tree
-            DBGPRINT(D_INFO, "Removing closed connection %08X",
-                    blockNode->ConnectionId);
-            if (LLRB_REMOVE(BlockTree, &gConnTreeHead, blockNode)) {
-                gConnTreeCount--;
-            }
-            InterlockedDecrement(&gStatistics.NumConnections);
-            RemoveEntryList(&blockNode->ListEntry);
-            QmCleanupBlock(blockNode);
+    // Section header and interface description blocks have no IDs
+    filter = reader->IdFilters[ProcessIdFilter];
+    if (filter && (blockNode->BlockType != SectionHeaderBlock) &&
+            (blockNode->BlockType != InterfaceDescriptionBlock)) {
+        const bool listed = IsIdInFilter(filter, blockNode->ProcessId);
+        if (listed != (reader->IdFilterModes[ProcessIdFilter] == FilterModeInclude)) {
+            return true;
+        }
+    }
+
+    // Only connection and packet blocks have connection IDs
+    filter = reader->IdFilters[ConnectionIdFilter];
+    if (filter && (blockNode->ConnectionId != ID_FILTER_EMPTY)) {
+        const bool listed = IsIdInFilter(filter, blockNode->ConnectionId);
+        if (listed != (reader->IdFilterModes[ConnectionIdFilter] == FilterModeInclude)) {
+            return true;
         }
     }
+    return false;
+}
 
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+//----------------------------------------------------------------------------
+bool IsSnapshotBlock(
+    __in const SNAPSHOT_CURSOR *cursor,
+    __in const BLOCK_NODE      *blockNode)
+{
+    // Blocks are enqueued before they are stored, so only blocks stored while
+    // there were no readers lack a sequence number, and no reader received
+    // those live
+    return !blockNode->Sequence || (blockNode->Sequence < cursor->Sequence);
 }
 
 //----------------------------------------------------------------------------
@@ -999,7 +1941,7 @@ BLOCK_NODE *QmAllocatePacketBlock(
 
     blockLength = sizeof(PCAP_NG_PACKET_HEADER) + PCAP_NG_PADDING(dataLength) +
             sizeof(PCAP_NG_PACKET_FOOTER);
-    blockNode = AllocateBlockNode(blockLength, gPoolTagPacket);
+    blockNode = AllocateBlockNode(blockLength, MemoryPacketBlocks);
     if (!blockNode) {
         return NULL;
     }
@@ -1015,9 +1957,16 @@ bool QmCleanupBlock(__in BLOCK_NODE *blockNode)
     if (blockNode) {
         const LONG refCount = InterlockedDecrement(&blockNode->RefCount);
         if (refCount == 0) { // Free memory if reference count is 0
+            LONG64 bufferSize = 0;
+
+            // Use the allocated size, since process blocks can shrink after
+            // they are built
             if (blockNode->Buffer) {
-                ExFreePool(blockNode->Buffer);
+                bufferSize = ((MEMORY_HEADER*)blockNode->Buffer - 1)->Size;
+                FreeMemory(blockNode->Buffer);
             }
+            AccountMemory(&gMemoryUsage[MemoryBlockNodes], -(LONG64)sizeof(BLOCK_NODE), -1);
+            AccountMemory(&gBlockNodeUsage[blockNode->MemoryTag], -bufferSize, -1);
             ExFreeToLookasideListEx(&gBlockNodeLal, blockNode);
             freed = true;
         }
@@ -1033,14 +1982,27 @@ BLOCK_NODE* QmDequeueBlock(__in READER_INFO *reader)
 
     // No need to lock, since we're using a lock-free ring buffer
     if (reader) {
+        // Send all initial blocks before any live blocks
+        while (reader->Snapshot.Active && IsRingBufferEmpty(&reader->InitialBuffer)) {
+            FillInitialBuffer(reader);
+        }
         if (reader->InitialBuffer.Buffer) {
             blockNode = (BLOCK_NODE *)(RingBufferDequeue(&reader->InitialBuffer));
-            if (IsRingBufferEmpty(&reader->InitialBuffer)) {
-                ExFreePool(reader->InitialBuffer.Buffer);
-                reader->InitialBuffer.Buffer = NULL;
-            }
-        } else {
+        }
+        if (!blockNode) {
             blockNode = (BLOCK_NODE *)(RingBufferDequeue(&reader->BlocksBuffer));
+            if (blockNode && blockNode->EnqueueCounter && gLatencyEnabled) {
+                const LONGLONG ticks = KeQueryPerformanceCounter(NULL).QuadPart -
+                        blockNode->EnqueueCounter;
+                reader->ReadLatency[GetLatencyBucket((UINT64)max(ticks, 0))]++;
+            }
+        }
+
+        // Only the reader dequeues, so the counters need no lock
+        if (blockNode) {
+            reader->ReadBlocks++;
+            reader->ReadBytes   += blockNode->BlockLength;
+            reader->LastReadTime = ClockGetUptime();
         }
     }
     return blockNode;
@@ -1051,15 +2013,33 @@ __checkReturn
 NTSTATUS QmDeregisterReader(__in READER_INFO *reader)
 {
     KLOCK_QUEUE_HANDLE  lockHandle;
+    KLOCK_QUEUE_HANDLE  treesLockHandle;
+    SNAPSHOT           *snapshot = NULL;
 
     if (!reader) {
         return STATUS_INVALID_PARAMETER;
     }
 
-    DBGPRINT(D_LOCK, "Acquiring reader list lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gReaderListLock, &lockHandle);
+    // Hold the trees lock too, so the reader stops receiving initial blocks
+    // and its consumer group is renumbered for the live and initial blocks at
+    // the same time
+    AcquireQueueLock(&gTreesLock, &treesLockHandle, __LINE__);
+    if (reader->Snapshot.Active) {
+        snapshot                  = ReleaseSnapshot(reader->Snapshot.Snapshot);
+        reader->Snapshot.Active   = false;
+        reader->Snapshot.Snapshot = NULL;
+        RemoveEntryList(&reader->Snapshot.ListEntry);
+    }
+
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
 
     gStatistics.NumReaders--;
+    if (reader->ImageEvents) {
+        gImageReaders--;
+    }
+    if (reader->RuleProgram) {
+        gRuleReaders--;
+    }
     if (gStatistics.NumReaders == 0) {
         LARGE_INTEGER tickCount;
         KeQueryTickCount(&tickCount);
@@ -1068,12 +2048,19 @@ NTSTATUS QmDeregisterReader(__in READER_INFO *reader)
     }
     DBGPRINT(D_INFO, "Deregistered reader %d, total registered readers %d",
             reader->Id, gStatistics.NumReaders);
-    CleanupReader(reader);
     RemoveEntryList(&reader->ListEntry);
     CalculateMaxSnapLength();
+    if (reader->ConsumerGroup) {
+        CalculateConsumerGroups();
+    }
+
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    ReleaseQueueLock(&gTreesLock, &treesLockHandle, __LINE__);
 
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
+    // Nothing can reach the reader once it is off both lists, so free its
+    // blocks and buffers without holding up event callbacks
+    CleanupReader(reader);
+    FreeSnapshot(snapshot);
 
     return STATUS_SUCCESS;
 }
@@ -1096,61 +2083,96 @@ NTSTATUS QmEnqueueConnectionBlock(
     // If connection closed, set timer to delete the block node, if one exists
     searchNode.SortId = connectionId;
     if (opened) {
-        DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-        KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+        AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
         blockNode = LLRB_FIND(BlockTree, &gConnTreeHead, &searchNode);
-        KeReleaseInStackQueuedSpinLock(&lockHandle);
-        DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+        ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
         if (blockNode) {
             return STATUS_SUCCESS; // Already enqueued open block for this connection
         }
-        InterlockedIncrement(&gStatistics.ConnectionOpenEvents);
-        InterlockedIncrement(&gStatistics.NumConnections);
+        STATISTICS_CPU *statistics = GetStatisticsCpu();
+
+        InterlockedIncrement(&statistics->ConnectionOpenEvents);
+        InterlockedIncrement(&statistics->NumConnections);
     } else {
         bool held = false;
-        DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-        KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+        AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
         blockNode = LLRB_FIND(BlockTree, &gConnTreeHead, &searchNode);
-        if (blockNode && (blockNode->ListEntry.Flink == 0)) {
+        if (blockNode && !IsTimerWheelEntryScheduled(&blockNode->TimerEntry)) {
             // Hold the connection block for one second in case more packets arrive
-            DBGPRINT(D_INFO, "Holding closed connection %08X for 1 second", connectionId);
-            InsertTailList(&gConnCloseListHead, &blockNode->ListEntry);
-            KeSetTimer(&gConnCloseTimer, gConnCloseTimeout, &gConnCloseDpc);
+            TraceEvent(TraceConnectionHeld, connectionId, 0, 0, 0);
+            SetQueueTimer(&blockNode->TimerEntry, gConnCloseHoldTime, ExpireConnectionBlock);
             held = true;
         }
-        KeReleaseInStackQueuedSpinLock(&lockHandle);
-        DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+        ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
         if (blockNode && !held) {
             return STATUS_SUCCESS; // Already enqueued close block for this connection
         }
         blockNode = NULL; // So we don't free the block in the code below
-        InterlockedIncrement(&gStatistics.ConnectionCloseEvents);
+        InterlockedIncrement(&GetStatisticsCpu()->ConnectionCloseEvents);
     }
 
     // Create a block if there are readers or need to save connection information
     if (gStatistics.NumReaders || opened) {
+        const LONGLONG buildStart = GetLatencyStart();
+
         blockNode = GetConnectionBlock(opened, connectionId, processId, NULL);
+        RecordLatencySince(LatencyBlockBuild, buildStart);
         if (!blockNode) {
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         if (opened) {
-            // Store the connection opened block
-            DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-            KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+            // Enqueue the connection opened block before storing it, so a
+            // snapshot never finds it without its sequence number and sends
+            // it to readers that also receive it live
+            AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+            EnqueueBlock(blockNode, NULL);
             InterlockedIncrement(&blockNode->RefCount);
             if (LLRB_INSERT(BlockTree, &gConnTreeHead, blockNode)) {
                 // Already stored the block
                 InterlockedDecrement(&blockNode->RefCount);
             } else {
                 gConnTreeCount++;
+                InvalidateSharedSnapshot();
             }
-            KeReleaseInStackQueuedSpinLock(&lockHandle);
-            DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+            ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+        } else {
+            EnqueueBlock(blockNode, NULL);
         }
+    }
+
+    // Release our hold on the block
+    QmCleanupBlock(blockNode);
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmEnqueueImageBlock(
+    __in const UINT32          pid,
+    __in const UINT64          imageBase,
+    __in const UINT32          imageSize,
+    __in const bool            kernelImage,
+    __in const UINT32          pathId,
+    __in const UNICODE_STRING *path)
+{
+    BLOCK_NODE *blockNode;
+    LONGLONG    buildStart;
+
+    if (!gImageReaders) {
+        return STATUS_SUCCESS;
+    }
 
-        EnqueueBlock(blockNode);
+    // Always build the block with the path.  EnqueueBlock() leaves the path
+    // out for each reader that has already received it.
+    buildStart = GetLatencyStart();
+    blockNode  = GetImageBlock(pid, imageBase, imageSize, kernelImage, pathId,
+            path);
+    RecordLatencySince(LatencyBlockBuild, buildStart);
+    if (!blockNode) {
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
+    EnqueueBlock(blockNode, NULL);
 
     // Release our hold on the block
     QmCleanupBlock(blockNode);
@@ -1191,7 +2213,7 @@ NTSTATUS QmEnqueuePacketBlock(
         blockNode->SortId       = connectionId;
         blockNode->ConnectionId = connectionId;
         blockNode->ProcessId    = processId;
-        GetTimestamp(&blockNode->Timestamp);
+        ClockGetTimestamp(&blockNode->Timestamp, &blockNode->Tiebreaker);
         buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
         header = (PCAP_NG_PACKET_HEADER*)buffer;
         header->BlockType      = blockNode->BlockType;
@@ -1213,6 +2235,9 @@ NTSTATUS QmEnqueuePacketBlock(
         footer->FlagsHeader.OptionCode          = 2;
         footer->FlagsHeader.OptionLength        = sizeof(footer->Flags);
         footer->Flags                           = direction;
+        footer->SequenceHeader.OptionCode       = 259;
+        footer->SequenceHeader.OptionLength     = sizeof(footer->Sequence);
+        footer->Sequence                        = 0;
         footer->OptionEnd.OptionCode            = 0;
         footer->OptionEnd.OptionLength          = 0;
         footer->BlockLength                     = blockNode->BlockLength;
@@ -1220,7 +2245,7 @@ NTSTATUS QmEnqueuePacketBlock(
         if (processId == _UI32_MAX) {
             HoldPacketBlock(blockNode);
         } else {
-            EnqueueBlock(blockNode);
+            EnqueueBlock(blockNode, NULL);
         }
     }
 
@@ -1238,74 +2263,86 @@ NTSTATUS QmEnqueuePacketBlock(
 //   Augmented-PCAP-Next-Generation-Dump-File-Format
 __checkReturn
 NTSTATUS QmEnqueueProcessBlock(
-    __in const _Bool          started,
-    __in const UINT32         pid,
-    __in const UINT32         parentPid,
-    __in UNICODE_STRING      *path,
-    __in UNICODE_STRING      *args,
-    __in UNICODE_STRING      *sid,
-    __in const LARGE_INTEGER *timestamp)
+    __in const _Bool              started,
+    __in const UINT32             pid,
+    __in const UINT32             parentPid,
+    __in UNICODE_STRING          *path,
+    __in UNICODE_STRING          *args,
+    __in UNICODE_STRING          *sid,
+    __in const LARGE_INTEGER     *timestamp,
+    __in const PROCESS_EXIT_INFO *exitInfo)
 {
-    BLOCK_NODE         *blockNode = NULL;
+    BLOCK_NODE         *blockNode  = NULL;
+    BLOCK_NODE         *startBlock = NULL;
     BLOCK_NODE          searchNode;
     KLOCK_QUEUE_HANDLE  lockHandle;
+    LONGLONG            buildStart;
 
     // If process started, get the block node, if one already exists
-    // If process ended, delete the block node, if one exists
+    // If process ended, remove the block node, if one exists, so it can move
+    // to the exit history
     searchNode.SortId = pid;
     if (started) {
-        DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-        KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+        AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
         blockNode = LLRB_FIND(BlockTree, &gProcessTreeHead, &searchNode);
-        KeReleaseInStackQueuedSpinLock(&lockHandle);
-        DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+        ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
         if (blockNode) {
             return STATUS_SUCCESS; // Readers already have a block for this process
         }
-        InterlockedIncrement(&gStatistics.ProcessStartEvents);
-        InterlockedIncrement(&gStatistics.NumProcesses);
+        STATISTICS_CPU *statistics = GetStatisticsCpu();
+
+        InterlockedIncrement(&statistics->ProcessStartEvents);
+        InterlockedIncrement(&statistics->NumProcesses);
     } else {
-        DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-        KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
-        blockNode = LLRB_REMOVE(BlockTree, &gProcessTreeHead, &searchNode);
-        if (blockNode) {
+        AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+        startBlock = LLRB_REMOVE(BlockTree, &gProcessTreeHead, &searchNode);
+        if (startBlock) {
             // In case we get multiple process close events, we only want to
             // decrement these counts one time
             gProcessTreeCount--;
-            InterlockedDecrement(&gStatistics.NumProcesses);
+            InterlockedDecrement(&GetStatisticsCpu()->NumProcesses);
+            InvalidateSharedSnapshot();
+            EnqueueRemovedInitialBlock(startBlock);
         }
-        KeReleaseInStackQueuedSpinLock(&lockHandle);
-        DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
-        QmCleanupBlock(blockNode);
-        blockNode = NULL; // So we don't free the block in the code below
-        InterlockedIncrement(&gStatistics.ProcessEndEvents);
+        ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+        InterlockedIncrement(&GetStatisticsCpu()->ProcessEndEvents);
     }
 
-    // Create a block if there are readers or need to save process information
-    if (gStatistics.NumReaders || started) {
-        blockNode = GetProcessBlock(started, pid, parentPid, path, args, sid,
-                timestamp);
-        if (!blockNode) {
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+    // Always create the block, since process started blocks are stored for
+    // the initial blocks and process ended blocks are stored in the exit
+    // history, even if there are no readers
+    buildStart = GetLatencyStart();
+    blockNode  = GetProcessBlock(started, pid, parentPid, path, args, sid,
+            timestamp, exitInfo);
+    RecordLatencySince(LatencyBlockBuild, buildStart);
+    if (!blockNode) {
+        QmCleanupBlock(startBlock);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-        // Store the process started block
-        if (started) {
-            DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-            KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
-            InterlockedIncrement(&blockNode->RefCount);
-            if (LLRB_INSERT(BlockTree, &gProcessTreeHead, blockNode)) {
-                // Already stored the block
-                InterlockedDecrement(&blockNode->RefCount);
-            } else {
-                gProcessTreeCount++;
-            }
-            KeReleaseInStackQueuedSpinLock(&lockHandle);
-            DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+    // Store the process started block or move the process to the exit
+    // history.  Enqueue the block first, so a snapshot or exit history query
+    // never finds it without its sequence number, or while the sequence
+    // option is being written.
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+    if (started) {
+        EnqueueBlock(blockNode, blockNode);
+        InterlockedIncrement(&blockNode->RefCount);
+        if (LLRB_INSERT(BlockTree, &gProcessTreeHead, blockNode)) {
+            // Already stored the block
+            InterlockedDecrement(&blockNode->RefCount);
+        } else {
+            gProcessTreeCount++;
+            InvalidateSharedSnapshot();
         }
-
-        EnqueueBlock(blockNode);
+    } else {
+        // Process ended blocks often lack the path and SID, so match rules
+        // against the process started block when there is one.  The exit
+        // history takes over our hold on the process started block.
+        EnqueueBlock(blockNode, startBlock ? startBlock : blockNode);
+        AddExitHistory(startBlock, blockNode);
     }
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
 
     // Release our hold on the block
     QmCleanupBlock(blockNode);
@@ -1313,22 +2350,86 @@ NTSTATUS QmEnqueueProcessBlock(
 }
 
 //----------------------------------------------------------------------------
+// Only references the selected blocks while holding the trees lock, and
+// copies them after releasing it, so event callbacks do not wait on the copy
+NTSTATUS QmGetExitHistory(
+    __in const EXIT_HISTORY_QUERY *query,
+    __out_bcount(length) char     *buffer,
+    __in const UINT32              length,
+    __out UINT32                  *bytesWritten)
+{
+    NTSTATUS            status    = STATUS_SUCCESS;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    const LONGLONG      startTime = (LONGLONG)query->StartTime;
+    const LONGLONG      endTime   = (LONGLONG)query->EndTime;
+    UINT32              offset    = 0;
+    UINT32              numBlocks = 0;
+    BLOCK_NODE        **blocks;
+
+    *bytesWritten = 0;
+    blocks = AllocateMemory(2 * gExitHistoryMaxCount * sizeof(BLOCK_NODE*), MemoryExitHistory);
+    if (!blocks) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+    TrimExitHistory(gExitHistoryMaxCount);
+    for (UINT32 index = 0; index < gExitHistoryCount; index++) {
+        const EXIT_HISTORY_ENTRY *entry =
+                &gExitHistory[(gExitHistoryFront + index) % gExitHistoryMaxCount];
+        const LONGLONG            exitTime  = entry->EndBlock->Timestamp.QuadPart;
+        UINT32                    pairLength;
+
+        if ((exitTime < startTime) || (exitTime > endTime)) {
+            continue;
+        }
+        pairLength = entry->EndBlock->BlockLength +
+                (entry->StartBlock ? entry->StartBlock->BlockLength : 0);
+        if (pairLength > length - offset) {
+            status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+        if (entry->StartBlock) {
+            InterlockedIncrement(&entry->StartBlock->RefCount);
+            blocks[numBlocks++] = entry->StartBlock;
+        }
+        InterlockedIncrement(&entry->EndBlock->RefCount);
+        blocks[numBlocks++] = entry->EndBlock;
+        offset += pairLength;
+    }
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+
+    offset = 0;
+    for (UINT32 block = 0; block < numBlocks; block++) {
+        RtlCopyMemory(buffer + offset, blocks[block]->Buffer ?
+                blocks[block]->Buffer : blocks[block]->Data,
+                blocks[block]->BlockLength);
+        offset += blocks[block]->BlockLength;
+        QmCleanupBlock(blocks[block]);
+    }
+    FreeMemory(blocks);
+
+    *bytesWritten = offset;
+    return status;
+}
+
+//----------------------------------------------------------------------------
+// Only sets up the reader's cursor.  QmDequeueBlock sends the process,
+// connection, and exit history blocks a chunk at a time.
 __checkReturn
-NTSTATUS QmGetInitialBlocks(
-    __in READER_INFO *reader,
-    __in const bool   useBlocksBuffer)
+NTSTATUS QmGetInitialBlocks(__in READER_INFO *reader)
 {
     NTSTATUS             status = STATUS_SUCCESS;
     KLOCK_QUEUE_HANDLE   lockHandle;
-    BLOCK_NODE          *connBlock                 = NULL;
-    BLOCK_NODE          *procBlock                 = NULL;
-    BLOCK_NODE          *interfaceDescriptionBlock = NULL;
-    BLOCK_NODE          *sectionHeaderBlock        = NULL;
-    RING_BUFFER         *ringBuffer                = NULL;
+    SNAPSHOT_CURSOR     *cursor;
+    SNAPSHOT            *snapshot;
+    SNAPSHOT            *oldSnapshot        = NULL;
+    BLOCK_NODE          *sectionHeaderBlock = NULL;
 
     if (!reader) {
         return STATUS_INVALID_PARAMETER;
     }
+    cursor = &reader->Snapshot;
 
     // Allocate a section header block, if there isn't one yet
     // Since the system ID in the section header block is stored in the registry,
@@ -1342,7 +2443,7 @@ NTSTATUS QmGetInitialBlocks(
     if (!sectionHeaderBlock && (KeGetCurrentIrql() == PASSIVE_LEVEL)) {
         BLOCK_NODE *newSectionHeaderBlock = GetSectionHeaderBlock();
         if (!newSectionHeaderBlock) {
-            status = STATUS_INSUFFICIENT_RESOURCES;
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         // Cache the section header block for later use
@@ -1354,86 +2455,153 @@ NTSTATUS QmGetInitialBlocks(
             sectionHeaderBlock = newSectionHeaderBlock;
         }
     }
-
-    // Clean up previous initial blocks buffer if it's still allocated
-    if (reader->InitialBuffer.Buffer) {
-        CleanupRingBuffer(&reader->InitialBuffer);
-        ExFreePool(reader->InitialBuffer.Buffer);
-        reader->InitialBuffer.Buffer = NULL;
+    if (!sectionHeaderBlock) {
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
-
-    if (useBlocksBuffer) {
-        ringBuffer = &reader->BlocksBuffer;
-    } else {
-        // Allocate new initial blocks buffer
-        const UINT32 bufferSize = (gConnTreeCount + gProcessTreeCount + 2) *
-                sizeof(void*);
-        void **buffer = ExAllocatePoolWithTag(NonPagedPool, bufferSize, gPoolTagRingBuffer);
+    // The initial blocks buffer only ever holds a few chunks, so keep it for
+    // later restarts
+    if (!reader->InitialBuffer.Buffer) {
+        const UINT32 bufferSize = gSnapshotChunkSize * 4 * sizeof(void*);
+        void **buffer = AllocateMemory(bufferSize, MemoryRingBuffers);
         if (!buffer) {
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            goto Cleanup;
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
         RtlZeroMemory(buffer, bufferSize);
         InitRingBuffer(&reader->InitialBuffer, buffer, bufferSize);
-        ringBuffer = &reader->InitialBuffer;
     }
 
-    // Enqueue section header and interface description blocks
-    interfaceDescriptionBlock = GetInterfaceDescriptionBlock();
-    if (!interfaceDescriptionBlock) {
+    // The reader starts over, so send each path again the next time its ID
+    // appears.  A restarting reader already receives blocks live, so only
+    // the blocks enqueued from here on are left out of the initial blocks.
+    // The first time, that is every block enqueued since it registered.
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    if (reader->ImagePaths) {
+        RtlZeroMemory(reader->ImagePaths, gImagePathsSize);
+    }
+    if (cursor->Started) {
+        cursor->Sequence = gNextSequence;
+    }
+    cursor->Started = true;
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+
+    // Drop what is left of an earlier snapshot and start over
+    CleanupRingBuffer(&reader->InitialBuffer);
+    if (cursor->Active) {
+        oldSnapshot      = ReleaseSnapshot(cursor->Snapshot);
+        cursor->Active   = false;
+        cursor->Snapshot = NULL;
+        RemoveEntryList(&cursor->ListEntry);
+    }
+
+    snapshot = GetSharedSnapshot();
+    if (!snapshot) {
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto Cleanup;
     }
+    snapshot->NumReaders++;
     InterlockedIncrement(&sectionHeaderBlock->RefCount);
-    RingBufferEnqueue(ringBuffer, sectionHeaderBlock);
-    RingBufferEnqueue(ringBuffer, interfaceDescriptionBlock);
-
-    // Enqueue process and connection blocks by comparing timestamps
-    connBlock = LLRB_MIN(BlockTree, &gConnTreeHead);
-    procBlock = LLRB_MIN(BlockTree, &gProcessTreeHead);
-    while (connBlock && procBlock) {
-        if (procBlock->Timestamp.QuadPart < connBlock->Timestamp.QuadPart) {
-            InterlockedIncrement(&procBlock->RefCount);
-            RingBufferEnqueue(ringBuffer, procBlock);
-            procBlock = LLRB_NEXT(BlockTree, &gProcessTreeHead, procBlock);
-        } else {
-            InterlockedIncrement(&connBlock->RefCount);
-            RingBufferEnqueue(ringBuffer, connBlock);
-            connBlock = LLRB_NEXT(BlockTree, &gConnTreeHead, connBlock);
-        }
+    RingBufferEnqueue(&reader->InitialBuffer, sectionHeaderBlock);
+    InterlockedIncrement(&snapshot->InterfaceDescriptionBlock->RefCount);
+    RingBufferEnqueue(&reader->InitialBuffer, snapshot->InterfaceDescriptionBlock);
+
+    cursor->Active        = true;
+    cursor->Snapshot      = snapshot;
+    cursor->NextEntry     = 0;
+    cursor->NextExitEntry = snapshot->FirstExitEntry;
+    InsertTailList(&gSnapshotListHead, &cursor->ListEntry);
+
+Cleanup:
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+    FreeSnapshot(oldSnapshot);
+
+    // Set event after releasing the spin lock
+    if (NT_SUCCESS(status) && reader->DataEvent) {
+        KeSetEvent(reader->DataEvent, 1, FALSE);
     }
+    return status;
+}
+
+//----------------------------------------------------------------------------
+UINT32 QmGetLargestBlocks(
+    __out LARGEST_BLOCKS *blocks,
+    __in  const UINT32    length)
+{
+    const UINT32        maxBlocks = (length - FIELD_OFFSET(LARGEST_BLOCKS, Blocks)) /
+            sizeof(LARGEST_BLOCK);
+    BLOCK_NODE         *blockNode;
+    KLOCK_QUEUE_HANDLE  lockHandle;
 
-    // Enqueue remaining process or connection entries
-    while (procBlock) {
-        InterlockedIncrement(&procBlock->RefCount);
-        RingBufferEnqueue(ringBuffer, procBlock);
-        procBlock = LLRB_NEXT(BlockTree, &gProcessTreeHead, procBlock);
+    blocks->NumBlocks   = 0;
+    blocks->TotalBlocks = 0;
+
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+    LLRB_FOREACH(blockNode, BlockTree, &gProcessTreeHead) {
+        AddLargestBlock(blocks, maxBlocks, blockNode, LargestBlockProcessTree);
     }
-    while (connBlock) {
-        InterlockedIncrement(&connBlock->RefCount);
-        RingBufferEnqueue(ringBuffer, connBlock);
-        connBlock = LLRB_NEXT(BlockTree, &gConnTreeHead, connBlock);
+    LLRB_FOREACH(blockNode, BlockTree, &gConnTreeHead) {
+        AddLargestBlock(blocks, maxBlocks, blockNode, LargestBlockConnectionTree);
     }
 
-Cleanup:
-    // Release the spin lock here so it gets released when cleaning up
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+    // Held packets for the same connection hang off the tree node's list
+    LLRB_FOREACH(blockNode, BlockTree, &gPacketTreeHead) {
+        LIST_ENTRY *entry = &blockNode->ListEntry;
+        do {
+            AddLargestBlock(blocks, maxBlocks,
+                    CONTAINING_RECORD(entry, BLOCK_NODE, ListEntry), LargestBlockPacketTree);
+            entry = entry->Flink;
+        } while (entry != &blockNode->ListEntry);
+    }
+    for (UINT32 index = 0; gExitHistory && (index < gExitHistoryCount); index++) {
+        const EXIT_HISTORY_ENTRY *entry =
+                &gExitHistory[(gExitHistoryFront + index) % gExitHistoryMaxCount];
+        if (entry->StartBlock) {
+            AddLargestBlock(blocks, maxBlocks, entry->StartBlock, LargestBlockExitHistory);
+        }
+        AddLargestBlock(blocks, maxBlocks, entry->EndBlock, LargestBlockExitHistory);
+    }
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
 
-    if (NT_SUCCESS(status)) {
-        // Set event after releasing the spin lock
-        if (reader->DataEvent) {
-            KeSetEvent(reader->DataEvent, 1, FALSE);
+    return FIELD_OFFSET(LARGEST_BLOCKS, Blocks) + blocks->NumBlocks * sizeof(LARGEST_BLOCK);
+}
+
+//----------------------------------------------------------------------------
+UINT32 QmGetLockProfile(
+    __out LOCK_PROFILE *profile,
+    __in  const UINT32  length)
+{
+    QUEUE_LOCK   *locks[]  = { &gTreesLock, &gReaderListLock };
+    const UINT32  maxSites = (length - FIELD_OFFSET(LOCK_PROFILE, Sites)) /
+            sizeof(LOCK_SITE_PROFILE);
+    LARGE_INTEGER frequency;
+
+    KeQueryPerformanceCounter(&frequency);
+    profile->Frequency = frequency.QuadPart;
+    profile->NumSites  = 0;
+    profile->LostSites = 0;
+
+    // Take one lock at a time, so profiling does not change the lock order
+    for (UINT32 index = 0; index < RTL_NUMBER_OF(locks); index++) {
+        QUEUE_LOCK         *lock = locks[index];
+        KLOCK_QUEUE_HANDLE  lockHandle;
+
+        AcquireQueueLock(lock, &lockHandle, __LINE__);
+        profile->LostSites += lock->LostSites;
+        for (UINT32 slot = 0; slot < LOCK_PROFILE_MAX_SITES; slot++) {
+            if (!lock->Sites[slot].Line) {
+                continue;
+            }
+            if (profile->NumSites < maxSites) {
+                profile->Sites[profile->NumSites++] = lock->Sites[slot];
+            } else {
+                profile->LostSites++;
+            }
         }
-    } else if (!useBlocksBuffer && reader->InitialBuffer.Buffer) {
-        CleanupRingBuffer(&reader->InitialBuffer);
-        ExFreePool(reader->InitialBuffer.Buffer);
-        reader->InitialBuffer.Buffer = NULL;
+        ReleaseQueueLock(lock, &lockHandle, __LINE__);
     }
-    return status;
+    return FIELD_OFFSET(LOCK_PROFILE, Sites) + profile->NumSites * sizeof(LOCK_SITE_PROFILE);
 }
 
 //----------------------------------------------------------------------------
@@ -1442,6 +2610,12 @@ UINT32 QmGetMaxSnapLen(void)
     return gStatistics.MaxSnapLength;
 }
 
+//----------------------------------------------------------------------------
+UINT32 QmGetNumImageReaders(void)
+{
+    return gImageReaders;
+}
+
 //----------------------------------------------------------------------------
 UINT32 QmGetNumReaders(void)
 {
@@ -1449,26 +2623,271 @@ UINT32 QmGetNumReaders(void)
 }
 
 //----------------------------------------------------------------------------
-void QmGetStatistics(__in STATISTICS *statistics, __in READER_INFO *reader)
+// Gathering snapshot entries here does no extra work, since the reader needs
+// them next anyway
+UINT32 QmGetReaderBlockCount(
+    __in READER_INFO  *reader,
+    __in const UINT32  limit)
+{
+    SNAPSHOT_CURSOR    *cursor    = &reader->Snapshot;
+    UINT32              count     = GetRingBufferCount(&reader->BlocksBuffer);
+    UINT32              remaining = 0;
+    bool                extended;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    if (reader->InitialBuffer.Buffer) {
+        count += GetRingBufferCount(&reader->InitialBuffer);
+    }
+    if ((count >= limit) || !cursor->Active) {
+        return count;
+    }
+
+    do {
+        AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+        remaining = 0;
+        extended  = false;
+        if (cursor->Active) {
+            SNAPSHOT *snapshot = cursor->Snapshot;
+
+            if ((snapshot->NextProcessId <= _UI32_MAX) || (snapshot->NextConnectionId <= _UI32_MAX)) {
+                if (count + snapshot->Count - cursor->NextEntry < limit) {
+                    ExtendSnapshot(snapshot);
+                    extended = true;
+                }
+            } else {
+                // Skip exit history entries that were trimmed, like
+                // FillInitialBuffer does
+                const UINT64 nextExitEntry = max(cursor->NextExitEntry,
+                        gExitHistoryAdded - gExitHistoryCount);
+
+                if (snapshot->EndExitEntry > nextExitEntry) {
+                    remaining = (UINT32)(snapshot->EndExitEntry - nextExitEntry);
+                }
+            }
+            remaining += snapshot->Count - cursor->NextEntry;
+        }
+        ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+    } while (extended && (count + remaining < limit));
+    return count + remaining;
+}
+
+//----------------------------------------------------------------------------
+UINT32 QmGetReaderDrops(
+    __out_ecount(maxReaders) READER_DROPS *drops,
+    __in                     const UINT32  maxReaders)
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    LIST_ENTRY         *entry;
+    UINT32              numReaders = 0;
+
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    for (entry = gReaderListHead.Flink; (entry != &gReaderListHead) &&
+            (numReaders < maxReaders); entry = entry->Flink) {
+        const READER_INFO *reader = CONTAINING_RECORD(entry, READER_INFO, ListEntry);
+
+        drops[numReaders].ReaderId      = reader->Id;
+        drops[numReaders].Reserved      = 0;
+        drops[numReaders].DroppedBlocks = 0;
+        for (int type = 0; type < NumStatisticsBlockTypes; type++) {
+            drops[numReaders].DroppedBlocks += reader->DroppedBlocks[type];
+        }
+        numReaders++;
+    }
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    return numReaders;
+}
+
+//----------------------------------------------------------------------------
+void QmGetReaderLatency(
+    __in  READER_INFO *reader,
+    __out UINT64      *histogram)
+{
+    // Only the reader updates its histogram, so copy it without a lock
+    RtlCopyMemory(histogram, reader->ReadLatency, sizeof(reader->ReadLatency));
+}
+
+//----------------------------------------------------------------------------
+void QmGetSequenceRange(__out SEQUENCE_RANGE *range, __in READER_INFO *reader)
+{
+    KLOCK_QUEUE_HANDLE lockHandle;
+    UINT32             front;
+
+    // Hold the lock so no blocks are added while reading the range.  The
+    // reader may remove blocks meanwhile, but removing a block leaves its
+    // slot's sequence number in place until the slot is reused.
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    front          = reader->BlocksBuffer.Front;
+    range->Newest  = reader->NewestSequence;
+    range->Dropped = reader->DroppedSequence;
+    if (front == reader->BlocksBuffer.Back) {
+        range->Oldest = range->Newest + 1;
+    } else {
+        range->Oldest = reader->Sequences[front % reader->BlocksBuffer.Length];
+    }
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+}
+
+//----------------------------------------------------------------------------
+void QmGetStatistics(__in STATISTICS *statistics, __in READER_INFO *reader)
+{
+    SumStatistics(statistics);
+    statistics->ReaderBufferSize = reader->RingBufferSize;
+    statistics->ReaderId         = reader->Id;
+    statistics->ReaderSnapLength = reader->SnapLength;
+
+    // Both _UI32_MAX and 0 indicate unlimited snap length,
+    // but we'll use 0 for consistency
+    if (statistics->ReaderSnapLength == _UI32_MAX) {
+        statistics->ReaderSnapLength = 0;
+    }
+}
+
+//----------------------------------------------------------------------------
+void QmGetStatisticsV2(__out STATISTICS_V2 *statistics, __in READER_INFO *reader)
+{
+    KLOCK_QUEUE_HANDLE lockHandle;
+
+    RtlZeroMemory(statistics, sizeof(STATISTICS_V2));
+    statistics->Version             = STATISTICS_V2_VERSION;
+    statistics->ReaderId            = reader->Id;
+    statistics->ReaderBufferSize    = reader->RingBufferSize;
+    statistics->ReaderReadBlocks    = reader->ReadBlocks;
+    statistics->ReaderReadBytes     = reader->ReadBytes;
+    statistics->ReaderIdleTime      = ClockGetUptime() - reader->LastReadTime;
+    statistics->AllocatedBlocks = gMemoryUsage[MemoryBlockNodes].Allocations;
+    for (UINT32 memoryTag = 0; memoryTag < NumMemoryTags; memoryTag++) {
+        MEMORY_TAG_STATISTICS *memory = &statistics->Memory[memoryTag];
+
+        memory->Tag             = gPoolTags[memoryTag];
+        memory->Bytes           = gMemoryUsage[memoryTag].Bytes;
+        memory->PeakBytes       = gMemoryUsage[memoryTag].PeakBytes;
+        memory->Allocations     = gMemoryUsage[memoryTag].Allocations;
+        memory->PeakAllocations = gMemoryUsage[memoryTag].PeakAllocations;
+        memory->BlockNodes      = gBlockNodeUsage[memoryTag].Allocations;
+        memory->PeakBlockNodes  = gBlockNodeUsage[memoryTag].PeakAllocations;
+        statistics->AllocatedBlockBytes += gBlockNodeUsage[memoryTag].Bytes;
+    }
+    GetLoadedPidCacheStatistics(&statistics->LoadedPidCacheHits,
+            &statistics->LoadedPidCacheMisses, &statistics->LoadedPidCacheBypassed);
+
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
+    statistics->ProcessTreeCount      = gProcessTreeCount;
+    statistics->ConnectionTreeCount   = gConnTreeCount;
+    statistics->ExitHistoryCount      = gExitHistoryCount;
+    statistics->ReaderSnapshotDropped = reader->Snapshot.DroppedBlocks;
+    if (reader->Snapshot.Active) {
+        statistics->ReaderSnapshotBlocks = reader->Snapshot.Snapshot->Count;
+        statistics->ReaderSnapshotSent   = reader->Snapshot.NextEntry;
+    }
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+
+    // Hold the reader list lock so the counters do not change while copying
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    statistics->ReaderQueuedBlocks     = reader->BlocksBuffer.Back - reader->BlocksBuffer.Front;
+    statistics->ReaderPeakQueuedBlocks = reader->PeakBlocks;
+    RtlCopyMemory(statistics->ReaderDroppedBlocks, reader->DroppedBlocks,
+            sizeof(statistics->ReaderDroppedBlocks));
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+}
+
+//----------------------------------------------------------------------------
+__drv_requiresIRQL(PASSIVE_LEVEL)
+UINT32 QmInternImagePath(__in const UNICODE_STRING *path)
+{
+    IMAGE_PATH_NODE *pathNode;
+    IMAGE_PATH_NODE  searchNode;
+    UINT32           pathId = 0;
+
+    if (!path || !path->Buffer || !path->Length) {
+        return 0;
+    }
+
+    searchNode.Hash = HashImagePath(path);
+    searchNode.Path = *path;
+    ExAcquireFastMutex(&gImagePathMutex);
+
+    pathNode = LLRB_FIND(ImagePathTree, &gImagePathTreeHead, &searchNode);
+    if (pathNode) {
+        pathId = pathNode->Id;
+    } else if (gImagePathCount < gImagePathMaxCount) {
+        // Store the path right after the node, so one allocation holds both
+        pathNode = AllocateMemory(sizeof(IMAGE_PATH_NODE) + path->Length, MemoryImagePaths);
+        if (pathNode) {
+            RtlZeroMemory(pathNode, sizeof(IMAGE_PATH_NODE));
+            pathNode->Hash               = searchNode.Hash;
+            pathNode->Id                 = ++gImagePathCount;
+            pathNode->Path.Buffer        = (wchar_t *)(pathNode + 1);
+            pathNode->Path.Length        = path->Length;
+            pathNode->Path.MaximumLength = path->Length;
+            RtlCopyMemory(pathNode->Path.Buffer, path->Buffer, path->Length);
+            LLRB_INSERT(ImagePathTree, &gImagePathTreeHead, pathNode);
+            pathId = pathNode->Id;
+        }
+    }
+
+    ExReleaseFastMutex(&gImagePathMutex);
+    return pathId;
+}
+
+//----------------------------------------------------------------------------
+// The page is only mapped read-only, which needs the MdlMappingNoWrite flag
+// that Windows 8 added
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmMapSharedStatistics(__out void **address)
 {
-    LARGE_INTEGER tickCount;
+    NTSTATUS                   status  = STATUS_SUCCESS;
+    const PEPROCESS            process = PsGetCurrentProcess();
+    SHARED_STATISTICS_MAPPING *mapping;
 
-    KeQueryTickCount(&tickCount);
-    memcpy(statistics, &gStatistics, sizeof(STATISTICS));
-    statistics->LoadedTime       = TickDiffToSeconds(&gDriverLoadTick, &tickCount);
-    statistics->LoggingTime     += TickDiffToSeconds(&gReaderTick, &tickCount);
-    statistics->ReaderBufferSize = reader->RingBufferSize;
-    statistics->ReaderId         = reader->Id;
-    statistics->ReaderSnapLength = reader->SnapLength;
+    *address = NULL;
+    if (!RtlIsNtDdiVersionAvailable(NTDDI_WIN8)) {
+        return STATUS_NOT_SUPPORTED;
+    }
 
-    // Both _UI32_MAX and 0 indicate unlimited snap length,
-    // but we'll use 0 for consistency
-    if (statistics->MaxSnapLength == _UI32_MAX) {
-        statistics->MaxSnapLength = 0;
+    ExAcquireFastMutex(&gSharedStatisticsMutex);
+
+    // Handles in the same process share one mapping
+    mapping = FindSharedStatisticsMapping(process);
+    if (mapping) {
+        mapping->Handles++;
+        *address = mapping->Address;
+        ExReleaseFastMutex(&gSharedStatisticsMutex);
+        return STATUS_SUCCESS;
     }
-    if (statistics->ReaderSnapLength == _UI32_MAX) {
-        statistics->ReaderSnapLength = 0;
+
+    mapping = AllocateMemory(sizeof(SHARED_STATISTICS_MAPPING), MemorySharedStatistics);
+    if (!mapping) {
+        ExReleaseFastMutex(&gSharedStatisticsMutex);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    __try {
+        *address = MmMapLockedPagesSpecifyCache(gSharedStatisticsMdl, UserMode, MmCached,
+                NULL, FALSE, NormalPagePriority | MdlMappingNoWrite | MdlMappingNoExecute);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        *address = NULL;
+    }
+    if (!*address) {
+        DBGPRINT(D_ERR, "Cannot map shared statistics page");
+        FreeMemory(mapping);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    } else {
+        ObReferenceObject(process);
+        mapping->Process = process;
+        mapping->Address = *address;
+        mapping->Handles = 1;
+        InsertTailList(&gSharedStatisticsMappings, &mapping->ListEntry);
+        if (++gSharedStatisticsMaps == 1) {
+            LARGE_INTEGER dueTime;
+
+            // Start updating the page, and update it now so it is never stale
+            dueTime.QuadPart = -10000LL * gSharedStatisticsPeriod;
+            KeSetTimerEx(&gSharedStatisticsTimer, dueTime, gSharedStatisticsPeriod,
+                    &gSharedStatisticsDpc);
+            KeInsertQueueDpc(&gSharedStatisticsDpc, NULL, NULL);
+        }
     }
+    ExReleaseFastMutex(&gSharedStatisticsMutex);
+    return status;
 }
 
 //----------------------------------------------------------------------------
@@ -1480,22 +2899,26 @@ NTSTATUS QmRegisterReader(__in READER_INFO *reader)
     const UINT32        bufferSize = GetRingBufferSize();
     void              **buffer;
 
-    buffer = (void**)(ExAllocatePoolWithTag(
-                NonPagedPool, bufferSize, gPoolTagRingBuffer));
+    buffer = (void**)(AllocateMemory(bufferSize, MemoryRingBuffers));
     if (!buffer) {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
     RtlZeroMemory(buffer, bufferSize);
 
     InitRingBuffer(&reader->BlocksBuffer, buffer, bufferSize);
-    status = QmGetInitialBlocks(reader, true);
-    if (!NT_SUCCESS(status)) {
-        return status;
+    reader->Sequences = (UINT64*)(AllocateMemory(
+                reader->BlocksBuffer.Length * sizeof(UINT64), MemoryRingBuffers));
+    if (!reader->Sequences) {
+        FreeMemory(buffer);
+        reader->BlocksBuffer.Buffer = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    DBGPRINT(D_LOCK, "Acquiring reader list lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gReaderListLock, &lockHandle);
+    // Add the reader before starting its snapshot, since the snapshot leaves
+    // every block enqueued after the reader is added to reach it live
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
     InsertTailList(&gReaderListHead, &reader->ListEntry);
+    reader->Snapshot.Sequence = gNextSequence;
     if (gStatistics.NumReaders == 0) {
         KeQueryTickCount(&gReaderTick);
     }
@@ -1503,25 +2926,60 @@ NTSTATUS QmRegisterReader(__in READER_INFO *reader)
     gStatistics.NumReaders++;
     gStatistics.TotalReaders++;
     reader->SnapLength     = 0;
+    reader->SnapViewIndex  = MAX_SNAP_VIEWS;
+    reader->ImageEvents    = false;
     reader->RingBufferSize = bufferSize;
     reader->Id             = gStatistics.TotalReaders;
+    reader->LastReadTime   = ClockGetUptime();
     DBGPRINT(D_INFO, "Registered reader %d with ring buffer size of %d, "
             "total registered readers %d", reader->Id, bufferSize,
             gStatistics.NumReaders);
     gStatistics.MaxSnapLength = _UI32_MAX; // Unlimited snap length by default
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+
+    status = QmGetInitialBlocks(reader);
+    if (!NT_SUCCESS(status)) {
+        QmDeregisterReader(reader);
+    }
     return status;
 }
 
+//----------------------------------------------------------------------------
+void QmResetReaderLatency(__in READER_INFO *reader)
+{
+    RtlZeroMemory(reader->ReadLatency, sizeof(reader->ReadLatency));
+}
+
+//----------------------------------------------------------------------------
+UINT32 QmSetLockProfiling(__in const UINT32 flags)
+{
+    const UINT32 oldFlags = gLockProfileEnabled ? LOCK_PROFILE_FLAG_ENABLE : 0;
+
+    if (flags & LOCK_PROFILE_FLAG_RESET) {
+        QUEUE_LOCK *locks[] = { &gTreesLock, &gReaderListLock };
+
+        for (UINT32 index = 0; index < RTL_NUMBER_OF(locks); index++) {
+            QUEUE_LOCK         *lock = locks[index];
+            KLOCK_QUEUE_HANDLE  lockHandle;
+
+            AcquireQueueLock(lock, &lockHandle, __LINE__);
+            RtlZeroMemory(lock->Sites, sizeof(lock->Sites));
+            lock->LostSites    = 0;
+            lock->AcquiredSite = NULL; // Do not charge this hold to a cleared site
+            ReleaseQueueLock(lock, &lockHandle, __LINE__);
+        }
+    }
+    gLockProfileEnabled = (flags & LOCK_PROFILE_FLAG_ENABLE) ? true : false;
+    return oldFlags;
+}
+
 //----------------------------------------------------------------------------
 void QmSetOpenConnections(__in CONNECTIONS *connections)
 {
     UINT32              index;
     KLOCK_QUEUE_HANDLE  lockHandle;
 
-    DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
     LLRB_CLEAR(OconnTree, &gOconnTcp4TreeHead);
     LLRB_CLEAR(OconnTree, &gOconnTcp6TreeHead);
     LLRB_CLEAR(OconnTree, &gOconnUdp4TreeHead);
@@ -1533,6 +2991,7 @@ void QmSetOpenConnections(__in CONNECTIONS *connections)
         if (!oconnNode) {
             break;
         }
+        AccountMemory(&gMemoryUsage[MemoryOpenConnections], sizeof(OCONN_NODE), 1);
         RtlZeroMemory(oconnNode, sizeof(OCONN_NODE));
         oconnNode->Port      = connections->Records[index].Port;
         oconnNode->ProcessId = connections->Records[index].ProcessId;
@@ -1553,12 +3012,29 @@ void QmSetOpenConnections(__in CONNECTIONS *connections)
         }
 
         if (LLRB_INSERT(OconnTree, treeHead, oconnNode)) {
-            ExFreeToLookasideListEx(&gOconnNodeLal, oconnNode);
+            CleanupOconnNode(oconnNode);
         }
     }
 
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+}
+
+//----------------------------------------------------------------------------
+void QmSetReaderConsumerGroup(
+    __in READER_INFO  *reader,
+    __in const UINT32  consumerGroup)
+{
+    KLOCK_QUEUE_HANDLE readerLockHandle;
+    KLOCK_QUEUE_HANDLE treesLockHandle;
+
+    // Hold both locks while renumbering, for the same reasons as the ID
+    // filters
+    AcquireQueueLock(&gTreesLock, &treesLockHandle, __LINE__);
+    AcquireQueueLock(&gReaderListLock, &readerLockHandle, __LINE__);
+    reader->ConsumerGroup = consumerGroup;
+    CalculateConsumerGroups();
+    ReleaseQueueLock(&gReaderListLock, &readerLockHandle, __LINE__);
+    ReleaseQueueLock(&gTreesLock, &treesLockHandle, __LINE__);
 }
 
 //----------------------------------------------------------------------------
@@ -1580,8 +3056,7 @@ NTSTATUS QmSetReaderDataEvent(
         }
     }
 
-    DBGPRINT(D_LOCK, "Acquiring reader list lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gReaderListLock, &lockHandle);
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
 
     // Release old object before setting the new one
     if (reader->DataEvent) {
@@ -1589,8 +3064,177 @@ NTSTATUS QmSetReaderDataEvent(
     }
     reader->DataEvent = kernelEvent;
 
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS QmSetReaderIdFilter(
+    __in READER_INFO          *reader,
+    __in const ID_FILTER_TYPE  filterType,
+    __in const UINT32         *ids,
+    __in const UINT32          numIds)
+{
+    KLOCK_QUEUE_HANDLE  readerLockHandle;
+    KLOCK_QUEUE_HANDLE  treesLockHandle;
+    ID_FILTER          *filter = NULL;
+    ID_FILTER          *oldFilter;
+
+    if (numIds > gIdFilterMaxCount) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (numIds) {
+        filter = AllocateMemory(GetIdFilterSize(numIds), MemoryIdFilters);
+        if (!filter) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        InitIdFilter(filter, ids, numIds);
+    }
+
+    // Hold both locks while swapping filters, since EnqueueBlock uses them
+    // inside the reader list lock and QmGetInitialBlocks uses them inside the
+    // trees lock
+    AcquireQueueLock(&gTreesLock, &treesLockHandle, __LINE__);
+    AcquireQueueLock(&gReaderListLock, &readerLockHandle, __LINE__);
+    oldFilter                     = reader->IdFilters[filterType];
+    reader->IdFilters[filterType] = filter;
+    ReleaseQueueLock(&gReaderListLock, &readerLockHandle, __LINE__);
+    ReleaseQueueLock(&gTreesLock, &treesLockHandle, __LINE__);
+
+    if (oldFilter) {
+        FreeMemory(oldFilter);
+    }
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+void QmSetReaderIdFilterMode(
+    __in READER_INFO          *reader,
+    __in const ID_FILTER_TYPE  filterType,
+    __in const UINT32          mode)
+{
+    KLOCK_QUEUE_HANDLE lockHandle;
+
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    reader->IdFilterModes[filterType] = mode;
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS QmSetReaderImageEvents(
+    __in READER_INFO *reader,
+    __in const bool   enabled)
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    UINT32             *imagePaths = NULL;
+
+    // A reader that enables image events has not received any paths yet
+    if (enabled) {
+        imagePaths = AllocateMemory(gImagePathsSize, MemoryImagePaths);
+        if (!imagePaths) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlZeroMemory(imagePaths, gImagePathsSize);
+    }
+
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    if (reader->ImageEvents != enabled) {
+        UINT32 *oldImagePaths = reader->ImagePaths;
+
+        reader->ImageEvents = enabled;
+        reader->ImagePaths  = imagePaths;
+        imagePaths          = oldImagePaths;
+        if (enabled) {
+            gImageReaders++;
+        } else {
+            gImageReaders--;
+        }
+    }
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+
+    if (imagePaths) {
+        FreeMemory(imagePaths);
+    }
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+void QmSetReaderProcessBlocksOnly(
+    __in READER_INFO *reader,
+    __in const bool   enabled)
+{
+    KLOCK_QUEUE_HANDLE lockHandle;
+
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    reader->ProcessBlocksOnly = enabled;
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+}
+
+//----------------------------------------------------------------------------
+void QmSetReaderReadDpc(
+    __in     READER_INFO  *reader,
+    __in_opt KDPC         *dpc,
+    __in     const UINT32  watermark)
+{
+    KLOCK_QUEUE_HANDLE lockHandle;
+
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    reader->ReadDpc       = dpc;
+    reader->ReadWatermark = watermark;
+
+    // Blocks already past the watermark will not trigger the DPC when they are
+    // added, so queue it now
+    reader->ReadDpcQueued = dpc && (GetRingBufferCount(&reader->BlocksBuffer) >= watermark);
+    if (reader->ReadDpcQueued) {
+        KeInsertQueueDpc(dpc, NULL, NULL);
+    }
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS QmSetReaderRuleProgram(
+    __in                READER_INFO        *reader,
+    __in_bcount(length) const RULE_PROGRAM *program,
+    __in                const UINT32        length)
+{
+    KLOCK_QUEUE_HANDLE  readerLockHandle;
+    KLOCK_QUEUE_HANDLE  treesLockHandle;
+    RULE_PROGRAM       *copy = NULL;
+    RULE_PROGRAM       *oldProgram;
+
+    if (length) {
+        // Validate the copy, so user mode cannot change the program afterward
+        copy = AllocateMemory(length, MemoryRulePrograms);
+        if (!copy) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlCopyMemory(copy, program, length);
+        if (!ValidateRuleProgram(copy, length)) {
+            FreeMemory(copy);
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    // Hold both locks while swapping programs, for the same reasons as the ID
+    // filters
+    AcquireQueueLock(&gTreesLock, &treesLockHandle, __LINE__);
+    AcquireQueueLock(&gReaderListLock, &readerLockHandle, __LINE__);
+    oldProgram          = reader->RuleProgram;
+    reader->RuleProgram = copy;
+    if (oldProgram && !copy) {
+        gRuleReaders--;
+    } else if (!oldProgram && copy) {
+        gRuleReaders++;
+    }
+    ReleaseQueueLock(&gReaderListLock, &readerLockHandle, __LINE__);
+    ReleaseQueueLock(&gTreesLock, &treesLockHandle, __LINE__);
+
+    if (oldProgram) {
+        FreeMemory(oldProgram);
+    }
     return STATUS_SUCCESS;
 }
 
@@ -1602,16 +3246,132 @@ NTSTATUS QmSetReaderSnapLength(
 {
     KLOCK_QUEUE_HANDLE lockHandle;
 
-    DBGPRINT(D_LOCK, "Acquiring reader list lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gReaderListLock, &lockHandle);
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
     reader->SnapLength = snapLength;
     CalculateMaxSnapLength();
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
 
     return STATUS_SUCCESS;
 }
 
+//----------------------------------------------------------------------------
+// Process exit notifications run in the exiting process before its address
+// space is torn down, so the page can still be unmapped here
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void QmUnmapProcessSharedStatistics(void)
+{
+    SHARED_STATISTICS_MAPPING *mapping;
+
+    ExAcquireFastMutex(&gSharedStatisticsMutex);
+    mapping = FindSharedStatisticsMapping(PsGetCurrentProcess());
+    if (mapping) {
+        UnmapSharedStatistics(mapping);
+    }
+    ExReleaseFastMutex(&gSharedStatisticsMutex);
+}
+
+//----------------------------------------------------------------------------
+// The mapping is only in the list while the process has not finished exiting,
+// so attaching to it here always finds its address space intact
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void QmUnmapSharedStatistics(__in const PEPROCESS process)
+{
+    SHARED_STATISTICS_MAPPING *mapping;
+
+    ExAcquireFastMutex(&gSharedStatisticsMutex);
+    mapping = FindSharedStatisticsMapping(process);
+    if (mapping && (--mapping->Handles == 0)) {
+        if (process == PsGetCurrentProcess()) {
+            UnmapSharedStatistics(mapping);
+        } else {
+            KAPC_STATE apcState;
+
+            KeStackAttachProcess(process, &apcState);
+            UnmapSharedStatistics(mapping);
+            KeUnstackDetachProcess(&apcState);
+        }
+    }
+    ExReleaseFastMutex(&gSharedStatisticsMutex);
+}
+
+//----------------------------------------------------------------------------
+LOCK_SITE_PROFILE* ProfileLockAcquired(
+    __in QUEUE_LOCK     *lock,
+    __in const UINT32    line,
+    __in const bool      contended,
+    __in const LONGLONG  spinTicks)
+{
+    LOCK_SITE_PROFILE *site = NULL;
+    UINT32             slot = line * 0x9E3779B9;
+
+    slot ^= slot >> 16;
+
+    // Linear probing, since sites are never removed except by a reset
+    for (UINT32 probe = 0; probe < LOCK_PROFILE_MAX_SITES; probe++) {
+        LOCK_SITE_PROFILE *candidate = &lock->Sites[(slot + probe) % LOCK_PROFILE_MAX_SITES];
+
+        if (candidate->Line == line) {
+            site = candidate;
+            break;
+        }
+        if (!candidate->Line) {
+            site       = candidate;
+            site->Lock = lock->TraceId;
+            site->Line = line;
+            break;
+        }
+    }
+    if (!site) {
+        lock->LostSites++;
+        return NULL;
+    }
+
+    site->Acquisitions++;
+    if (contended) {
+        site->ContendedAcquisitions++;
+    }
+    site->SpinTicks += spinTicks;
+    if ((UINT64)spinTicks > site->MaxSpinTicks) {
+        site->MaxSpinTicks = spinTicks;
+    }
+    return site;
+}
+
+//----------------------------------------------------------------------------
+void ReleaseHeldPackets(
+    __in BLOCK_NODE   *blockNode,
+    __in const UINT32  processId)
+{
+    LIST_ENTRY *head = &blockNode->ListEntry;
+    LIST_ENTRY *entry;
+
+    CancelTimerWheelEntry(&gTimerWheel, &blockNode->TimerEntry);
+    do {
+        // Set the process ID in the packet block and enqueue it
+        char                  *buffer;
+        PCAP_NG_PACKET_HEADER *header;
+        PCAP_NG_PACKET_FOOTER *footer;
+        UINT32                 blockOffset;
+        BLOCK_NODE            *previousBlockNode;
+
+        buffer      = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+        header      = (PCAP_NG_PACKET_HEADER*)buffer;
+        blockOffset = sizeof(PCAP_NG_PACKET_HEADER) +
+                PCAP_NG_PADDING(header->CapturedLength);
+        footer = (PCAP_NG_PACKET_FOOTER*)(buffer + blockOffset);
+        footer->ProcessId = processId;
+        EnqueueBlock(blockNode, NULL);
+
+        // Release our hold on this block after getting the next block in the list
+        TraceEvent(TracePacketReleased, blockNode->ConnectionId, 0, 0, 0);
+        previousBlockNode = blockNode;
+        entry             = blockNode->ListEntry.Flink;
+        blockNode         = CONTAINING_RECORD(entry, BLOCK_NODE, ListEntry);
+        QmCleanupBlock(previousBlockNode);
+        gPacketTreeCount--;
+    } while (entry != head);
+}
+
 //----------------------------------------------------------------------------
 void ReleasePacketBlocks(
     __in const UINT32 connectionId,
@@ -1622,43 +3382,95 @@ void ReleasePacketBlocks(
     KLOCK_QUEUE_HANDLE  lockHandle;
 
     searchNode.SortId = connectionId;
-    DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-    KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+    AcquireQueueLock(&gTreesLock, &lockHandle, __LINE__);
 
     blockNode = LLRB_REMOVE(BlockTree, &gPacketTreeHead, &searchNode);
     if (blockNode) {
-        LIST_ENTRY *head  = &blockNode->ListEntry;
-        LIST_ENTRY *entry;
+        ReleaseHeldPackets(blockNode, processId);
+    }
 
-        do {
-            // Set the process ID in the packet block and enqueue it
-            char                  *buffer;
-            PCAP_NG_PACKET_HEADER *header;
-            PCAP_NG_PACKET_FOOTER *footer;
-            UINT32                 blockOffset;
-            BLOCK_NODE            *previousBlockNode;
+    ReleaseQueueLock(&gTreesLock, &lockHandle, __LINE__);
+}
+
+//----------------------------------------------------------------------------
+void ReleaseQueueLock(
+    __in QUEUE_LOCK         *lock,
+    __in KLOCK_QUEUE_HANDLE *lockHandle,
+    __in const UINT32        line)
+{
+    // Read the acquire time before releasing, since the next holder sets it
+    const LONGLONG     acquired = lock->AcquiredCounter;
+    LOCK_SITE_PROFILE *site     = lock->AcquiredSite;
+
+    if (site) {
+        const UINT64 holdTicks = KeQueryPerformanceCounter(NULL).QuadPart - lock->ProfileCounter;
+
+        site->HoldTicks += holdTicks;
+        if (holdTicks > site->MaxHoldTicks) {
+            site->MaxHoldTicks = holdTicks;
+        }
+    }
+
+    TraceEvent(TraceLockReleased, lock->TraceId, line, 0, 0);
+    KeReleaseInStackQueuedSpinLock(lockHandle);
+    RecordLatencySince(lock->HoldHistogram, acquired);
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+SNAPSHOT* ReleaseSnapshot(__in SNAPSHOT *snapshot)
+{
+    if (--snapshot->NumReaders) {
+        return NULL;
+    }
+    if (gSharedSnapshot == snapshot) {
+        gSharedSnapshot = NULL;
+    }
+    return snapshot;
+}
 
-            buffer      = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
-            header      = (PCAP_NG_PACKET_HEADER*)buffer;
-            blockOffset = sizeof(PCAP_NG_PACKET_HEADER) +
-                    PCAP_NG_PADDING(header->CapturedLength);
-            footer = (PCAP_NG_PACKET_FOOTER*)(buffer + blockOffset);
-            footer->ProcessId = processId;
-            EnqueueBlock(blockNode);
+//----------------------------------------------------------------------------
+__checkReturn
+bool ReserveSnapshotEntries(
+    __in SNAPSHOT     *snapshot,
+    __in const UINT32  count)
+{
+    UINT32       capacity;
+    BLOCK_NODE **entries;
 
-            // Release our hold on this block after getting the next block in the list
-            DBGPRINT(D_INFO, "Releasing packet block for connection %08X",
-                    blockNode->ConnectionId);
-            previousBlockNode = blockNode;
-            entry             = blockNode->ListEntry.Flink;
-            blockNode         = CONTAINING_RECORD(entry, BLOCK_NODE, ListEntry);
-            QmCleanupBlock(previousBlockNode);
-            gPacketTreeCount--;
-        } while (entry != head);
+    if (snapshot->Capacity - snapshot->Count >= count) {
+        return true;
+    }
+    capacity = max(snapshot->Capacity * 2, snapshot->Count + max(count, gSnapshotChunkSize));
+    entries  = AllocateMemory(capacity * sizeof(BLOCK_NODE*), MemorySnapshots);
+    if (!entries) {
+        return false;
+    }
+    if (snapshot->Entries) {
+        RtlCopyMemory(entries, snapshot->Entries, snapshot->Count * sizeof(BLOCK_NODE*));
+        FreeMemory(snapshot->Entries);
     }
+    snapshot->Entries  = entries;
+    snapshot->Capacity = capacity;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// Processes only age out of the exit history one at a time, so a single timer
+// for the oldest one is enough
+void ScheduleExitHistoryTimer(void)
+{
+    LARGE_INTEGER now;
+    LONGLONG      delay;
 
-    KeReleaseInStackQueuedSpinLock(&lockHandle);
-    DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+    if (!gExitHistoryCount) {
+        CancelTimerWheelEntry(&gTimerWheel, &gExitHistoryTimer);
+        return;
+    }
+    ClockGetTimestamp(&now, NULL);
+    delay = gExitHistory[gExitHistoryFront].EndBlock->Timestamp.QuadPart + gExitHistoryMaxAge -
+            now.QuadPart;
+    SetQueueTimer(&gExitHistoryTimer, max(delay, 0), ExpireExitHistory);
 }
 
 //----------------------------------------------------------------------------
@@ -1681,6 +3493,36 @@ UINT32 SetOption(
     return offset;
 }
 
+//----------------------------------------------------------------------------
+void SetQueueTimer(
+    __inout TIMER_WHEEL_ENTRY   *entry,
+    __in    const LONGLONG       delay,
+    __in    TIMER_WHEEL_ROUTINE *routine)
+{
+    const UINT64 period = gTimerWheelPeriod * 1000;
+
+    // Round up so the timer never expires early
+    ScheduleTimerWheelEntry(&gTimerWheel, entry, GetTimerWheelTick() + (delay + period - 1) / period,
+            routine);
+    if (!gTimerWheelRunning) {
+        LARGE_INTEGER dueTime;
+
+        dueTime.QuadPart = -10000LL * gTimerWheelPeriod;
+        KeSetTimerEx(&gTimerWheelTimer, dueTime, gTimerWheelPeriod, &gTimerWheelDpc);
+        gTimerWheelRunning = true;
+    }
+}
+
+//----------------------------------------------------------------------------
+UINT32 SetSequenceOption(__in char *buffer, __in UINT32 offset)
+{
+    PCAP_NG_SEQUENCE_OPTION *option = (PCAP_NG_SEQUENCE_OPTION*)(buffer + offset);
+    option->Header.OptionCode   = 259;
+    option->Header.OptionLength = sizeof(option->Sequence);
+    option->Sequence            = 0;
+    return offset + sizeof(PCAP_NG_SEQUENCE_OPTION);
+}
+
 //----------------------------------------------------------------------------
 UINT32 SetUtf8Option(
     __in char                 *buffer,
@@ -1719,6 +3561,38 @@ UINT32 SetUtf8Option(
     return offset;
 }
 
+//----------------------------------------------------------------------------
+void SumStatistics(__out STATISTICS *statistics)
+{
+    LARGE_INTEGER tickCount;
+
+    KeQueryTickCount(&tickCount);
+    memcpy(statistics, &gStatistics, sizeof(STATISTICS));
+
+    // Sum the event counters.  Counters can change while summing, so the
+    // totals may not agree with each other exactly.
+    for (ULONG cpu = 0; cpu < gStatisticsCpuCount; cpu++) {
+        const STATISTICS_CPU *counters = &gStatisticsCpus[cpu];
+
+        statistics->CapturedPackets       += counters->CapturedPackets;
+        statistics->CapturedPacketBytes   += counters->CapturedPacketBytes;
+        statistics->ProcessStartEvents    += counters->ProcessStartEvents;
+        statistics->NumProcesses          += counters->NumProcesses;
+        statistics->ProcessEndEvents      += counters->ProcessEndEvents;
+        statistics->ConnectionOpenEvents  += counters->ConnectionOpenEvents;
+        statistics->NumConnections        += counters->NumConnections;
+        statistics->ConnectionCloseEvents += counters->ConnectionCloseEvents;
+    }
+    statistics->LoadedTime   = TickDiffToSeconds(&gDriverLoadTick, &tickCount);
+    statistics->LoggingTime += TickDiffToSeconds(&gReaderTick, &tickCount);
+
+    // Both _UI32_MAX and 0 indicate unlimited snap length,
+    // but we'll use 0 for consistency
+    if (statistics->MaxSnapLength == _UI32_MAX) {
+        statistics->MaxSnapLength = 0;
+    }
+}
+
 //----------------------------------------------------------------------------
 UINT32 TickDiffToSeconds(const LARGE_INTEGER *start, const LARGE_INTEGER *end)
 {
@@ -1726,6 +3600,90 @@ UINT32 TickDiffToSeconds(const LARGE_INTEGER *start, const LARGE_INTEGER *end)
             KeQueryTimeIncrement()) / 10000000);
 }
 
+//----------------------------------------------------------------------------
+void TrimExitHistory(__in const UINT32 maxCount)
+{
+    LARGE_INTEGER now;
+
+    ClockGetTimestamp(&now, NULL);
+    while (gExitHistoryCount) {
+        EXIT_HISTORY_ENTRY *entry = &gExitHistory[gExitHistoryFront];
+        if ((gExitHistoryCount <= maxCount) &&
+                (gExitHistoryBytes <= gExitHistoryMaxBytes) &&
+                ((now.QuadPart - entry->EndBlock->Timestamp.QuadPart) <= gExitHistoryMaxAge)) {
+            break;
+        }
+        gExitHistoryBytes -= entry->EndBlock->BlockLength +
+                (entry->StartBlock ? entry->StartBlock->BlockLength : 0);
+        QmCleanupBlock(entry->StartBlock);
+        QmCleanupBlock(entry->EndBlock);
+        entry->StartBlock = NULL;
+        entry->EndBlock   = NULL;
+        gExitHistoryFront = (gExitHistoryFront + 1) % gExitHistoryMaxCount;
+        gExitHistoryCount--;
+    }
+}
+
+//----------------------------------------------------------------------------
+void UnmapSharedStatistics(__in SHARED_STATISTICS_MAPPING *mapping)
+{
+    MmUnmapLockedPages(mapping->Address, gSharedStatisticsMdl);
+    RemoveEntryList(&mapping->ListEntry);
+    ObDereferenceObject(mapping->Process);
+    FreeMemory(mapping);
+    if (--gSharedStatisticsMaps == 0) {
+        KeCancelTimer(&gSharedStatisticsTimer);
+    }
+}
+
+//----------------------------------------------------------------------------
+// The update runs under the reader list lock, which keeps the reader list
+// stable and serializes updates from the timer with the update a new mapping
+// queues.  The page therefore only ever has one writer.
+void UpdateSharedStatistics(
+    __in     KDPC *dpc,
+    __in_opt void *context,
+    __in_opt void *arg1,
+    __in_opt void *arg2)
+{
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    LIST_ENTRY         *entry;
+    STATISTICS          statistics;
+    UINT32              numReaders = 0;
+
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(arg1);
+    UNREFERENCED_PARAMETER(arg2);
+
+    SumStatistics(&statistics);
+
+    AcquireQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+    InterlockedIncrement(&gSharedStatistics->Sequence);
+    gSharedStatistics->UpdateTime = ClockGetUptime();
+    gSharedStatistics->Statistics = statistics;
+    for (entry = gReaderListHead.Flink; (entry != &gReaderListHead) &&
+            (numReaders < SHARED_STATISTICS_MAX_READERS); entry = entry->Flink) {
+        const READER_INFO        *reader = CONTAINING_RECORD(entry, READER_INFO, ListEntry);
+        SHARED_READER_STATISTICS *shared = &gSharedStatistics->Readers[numReaders++];
+
+        shared->ReaderId         = reader->Id;
+        shared->BufferSize       = reader->RingBufferSize;
+        shared->QueuedBlocks     = reader->BlocksBuffer.Back - reader->BlocksBuffer.Front;
+        shared->PeakQueuedBlocks = reader->PeakBlocks;
+        shared->DroppedBlocks    = 0;
+        for (int type = 0; type < NumStatisticsBlockTypes; type++) {
+            shared->DroppedBlocks += reader->DroppedBlocks[type];
+        }
+        shared->ReadBlocks       = reader->ReadBlocks;
+        shared->ReadBytes        = reader->ReadBytes;
+        shared->LastReadTime     = reader->LastReadTime;
+    }
+    gSharedStatistics->NumReaders = numReaders;
+    InterlockedIncrement(&gSharedStatistics->Sequence);
+    ReleaseQueueLock(&gReaderListLock, &lockHandle, __LINE__);
+}
+
 #ifdef __cplusplus
 };
 #endif
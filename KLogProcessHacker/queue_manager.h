@@ -25,236 +25,10 @@
 extern "C" {
 #endif
 
-//----------------------------------------------------------------------------
-// Defines
-//----------------------------------------------------------------------------
-
-#ifndef PCAP_NG_PADDING
-#define PCAP_NG_PADDING(x) ((x) + ((4-(x)) & 0x03))
-#endif
-
 //----------------------------------------------------------------------------
 // Structures and enumerations
 //----------------------------------------------------------------------------
 
-// Supported PCAP-NG block types
-enum BLOCK_TYPES {
-    ConnectionBlock           = 0x00000102,
-    InterfaceDescriptionBlock = 0x00000001,
-    PacketBlock               = 0x00000006,
-    ProcessBlock              = 0x00000101,
-    SectionHeaderBlock        = 0x0A0D0D0A,
-};
-
-#pragma pack(push, 4) // PCAP-NG structures are 32-bit aligned
-
-// PCAP-NG block option header
-struct PCAP_NG_OPTION_HEADER {
-    UINT16 OptionCode;
-    UINT16 OptionLength;
-};
-
-typedef struct PCAP_NG_OPTION_HEADER PCAP_NG_OPTION_HEADER;
-
-// PCAP-NG connection block format:
-//
-//     0                   1                   2                   3
-//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                    Block Type = 0x00000102                    |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |                        Connection ID                          |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |                          Process ID                           |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 |                        Timestamp (High)                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 20 |                        Timestamp (Low)                        |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 24 /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_CONNECTION_HEADER {
-    UINT32 BlockType;
-    UINT32 BlockLength;
-    UINT32 ConnectionId;
-    UINT32 ProcessId;
-    UINT32 TimestampHigh;
-    UINT32 TimestampLow;
-    // Options and block length
-};
-
-typedef struct PCAP_NG_CONNECTION_HEADER PCAP_NG_CONNECTION_HEADER;
-
-// PCAP-NG interface description block format:
-//
-//     0                   1                   2                   3
-//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                    Block Type = 0x00000001                    |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |           LinkType            |           Reserved            |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |                            SnapLen                            |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_INTERFACE_DESCRIPTION {
-    UINT32                       BlockType;
-    UINT32                       BlockLength;
-    UINT16                       LinkType;
-    UINT16                       Reserved;
-    UINT32                       SnapLength;
-    struct PCAP_NG_OPTION_HEADER IfDescHeader;
-    char                         IfDesc[28];
-    struct PCAP_NG_OPTION_HEADER OptionEnd;
-    UINT32                       BlockLengthFooter;
-};
-
-typedef struct PCAP_NG_INTERFACE_DESCRIPTION PCAP_NG_INTERFACE_DESCRIPTION;
-
-// PCAP-NG enhanced packet block format:
-//
-//    0                   1                   2                   3
-//    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                    Block Type = 0x00000006                    |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |                         Interface ID                          |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |                        Timestamp (High)                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 |                        Timestamp (Low)                        |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 20 |                         Captured Len                          |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 24 |                          Packet Len                           |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 28 /                                                               /
-//    /                          Packet Data                          /
-//    /           ( variable length, aligned to 32 bits )             /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_PACKET_HEADER {
-    UINT32 BlockType;
-    UINT32 BlockLength;
-    UINT32 InterfaceId;
-    UINT32 TimestampHigh;
-    UINT32 TimestampLow;
-    UINT32 CapturedLength;
-    UINT32 PacketLength;
-    // Block data, options, and block length
-};
-
-typedef struct PCAP_NG_PACKET_HEADER PCAP_NG_PACKET_HEADER;
-
-struct PCAP_NG_PACKET_FOOTER {
-    struct PCAP_NG_OPTION_HEADER ConnectionIdHeader;
-    UINT32                       ConnectionId;
-    struct PCAP_NG_OPTION_HEADER ProcessIdHeader;
-    UINT32                       ProcessId;
-    struct PCAP_NG_OPTION_HEADER FlagsHeader;
-    UINT32                       Flags;
-    struct PCAP_NG_OPTION_HEADER OptionEnd;
-    UINT32                       BlockLength;
-};
-
-typedef struct PCAP_NG_PACKET_FOOTER PCAP_NG_PACKET_FOOTER;
-
-// PCAP-NG process event block format:
-//
-//     0                   1                   2                   3
-//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                    Block Type = 0x00000101                    |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |                          Process ID                           |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |                        Timestamp (High)                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 |                        Timestamp (Low)                        |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 20 /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_PROCESS_HEADER {
-    UINT32                       BlockType;
-    UINT32                       BlockLength;
-    UINT32                       ProcessId;
-    UINT32                       TimestampHigh;
-    UINT32                       TimestampLow;
-    struct PCAP_NG_OPTION_HEADER ParentPidHeader;
-    UINT32                       ParentPid;
-    // Options and block length
-};
-
-typedef struct PCAP_NG_PROCESS_HEADER PCAP_NG_PROCESS_HEADER;
-
-// PCAP-NG section header block format:
-//
-//   0                   1                   2                   3
-//    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                   Block Type = 0x0A0D0D0A                     |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |                      Byte-Order Magic                         |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |          Major Version        |         Minor Version         |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 |                                                               |
-//    |                          Section Length                       |
-//    |                                                               |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 24 /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_SECTION_HEADER {
-    UINT32 BlockType;
-    UINT32 BlockLength;
-    UINT32 ByteOrder;
-    UINT16 MajorVersion;
-    UINT16 MinorVersion;
-    UINT64 SectionLength;
-    // Options and block length
-};
-
-typedef struct PCAP_NG_SECTION_HEADER PCAP_NG_SECTION_HEADER;
-#pragma pack(pop)
-
 // An LLRB tree node that holds a PCAP-NG block
 // The PCAP-NG data is in the Data member if the block is large enough to
 // contain all of it.  Otherwise, it is in the buffer pointed to by Buffer.
@@ -262,6 +36,7 @@ typedef struct PCAP_NG_SECTION_HEADER PCAP_NG_SECTION_HEADER;
 struct BLOCK_NODE {
     LLRB_ENTRY(BLOCK_NODE) TreeEntry;    // LLRB tree entry
     LIST_ENTRY             ListEntry;    // Doubly-linked list of blocks
+    TIMER_WHEEL_ENTRY      TimerEntry;   // Expires a closed connection or held packets (locked by trees lock)
     LONG                   RefCount;     // Block reference count
     UINT32                 BlockType;    // Block type to aid in debugging
     UINT32                 BlockLength;  // Block data length in bytes
@@ -269,21 +44,77 @@ struct BLOCK_NODE {
     UINT32                 ConnectionId; // Connection ID (0 if none)
     UINT32                 ProcessId;    // Process ID (0xFFFFFFFF if none, since 0 is a valid PID)
     LARGE_INTEGER          Timestamp;    // Block timestamp in milliseconds since 1970-01-01
+    UINT32                 Tiebreaker;   // Processor that took the timestamp, to order equal timestamps
+    UINT32                 MemoryTag;    // Memory tag type the block node is accounted under
+    UINT64                 Sequence;     // Sequence number assigned when enqueued (0 if not enqueued to any reader)
+    LONGLONG               EnqueueCounter; // Performance counter when enqueued (0 if latency tracking was disabled)
     char                  *Buffer;       // Buffer to use if this block isn't large enough, NULL otherwise
     char                   Data[512];    // Block data
 };
 
 typedef struct BLOCK_NODE BLOCK_NODE, *PBLOCK_NODE;
 
+// Information collected when a process exits
+struct PROCESS_EXIT_INFO {
+    NTSTATUS      ExitStatus;      // Process exit status
+    LARGE_INTEGER KernelTime;      // Time spent in kernel mode in 100ns units
+    LARGE_INTEGER UserTime;        // Time spent in user mode in 100ns units
+    UINT64        PeakWorkingSet;  // Peak working set size in bytes
+    UINT32        Subsystem;       // 1 for subsystem processes, such as WSL processes, whose exit status is a Linux wait status
+};
+
+typedef struct PROCESS_EXIT_INFO PROCESS_EXIT_INFO;
+
+struct SNAPSHOT;
+
+// Position of a reader in its initial blocks, which the queue manager sends a
+// chunk at a time as the reader reads them
+// The queue manager changes the cursor with the trees lock held.
+struct SNAPSHOT_CURSOR {
+    LIST_ENTRY       ListEntry;      // List of readers receiving initial blocks
+    bool             Active;         // True while the reader has initial blocks left to receive
+    struct SNAPSHOT *Snapshot;       // Snapshot the reader is receiving (NULL if not active)
+    UINT32           NextEntry;      // Index of the next snapshot entry to send
+    UINT64           NextExitEntry;  // Number of the next exit history entry to send
+    UINT64           Sequence;       // Sequence number of the first block the reader receives live
+    bool             Started;        // True once the reader got its first initial blocks
+    UINT64           DroppedBlocks;  // Initial blocks lost because they could not be queued
+};
+
+typedef struct SNAPSHOT_CURSOR SNAPSHOT_CURSOR;
+
 // Information about a registered reader
 struct READER_INFO {
     LIST_ENTRY   ListEntry;       // Doubly-linked list of readers
     RING_BUFFER  BlocksBuffer;    // Ring buffer that holds PCAP-NG blocks for normal processing
-    RING_BUFFER  InitialBuffer;   // Ring buffer that holds initial PCAP-NG blocks when resetting
+    RING_BUFFER  InitialBuffer;   // Ring buffer that holds the next chunk of initial PCAP-NG blocks
+    SNAPSHOT_CURSOR Snapshot;     // Position in the initial blocks
     UINT32       SnapLength;      // Number of bytes to capture (0 if none, 0xFFFFFFFF if unlimited)
+    UINT32       SnapViewIndex;   // Index of the trimmed packet blocks shared with readers with the same snap length
     UINT32       Id;              // Unique ID for this reader
     UINT32       RingBufferSize;  // Size of blocks ring buffer
     KEVENT      *DataEvent;       // Event to signal when data is available (NULL if none)
+    bool         ImageEvents;     // True if reader receives image load blocks
+    bool         ProcessBlocksOnly; // True if the reader only receives process blocks, for compact records
+    UINT32      *ImagePaths;      // Bitmap of the path IDs the reader has received a path for (NULL unless image events are enabled)
+    UINT64      *Sequences;       // Sequence number of the block in each blocks ring buffer slot
+    UINT64       NewestSequence;  // Sequence number of the last block added to the blocks ring buffer
+    UINT64       DroppedSequence; // Sequence number of the last block dropped because the ring buffer was full
+    KDPC        *ReadDpc;         // DPC to queue when the blocks ring buffer reaches the watermark (NULL if none)
+    UINT32       ReadWatermark;   // Number of blocks in the ring buffer that queues the read DPC
+    bool         ReadDpcQueued;   // True once the ring buffer reached the watermark and queued the read DPC
+    ID_FILTER   *IdFilters[NumIdFilterTypes];     // Connection and process IDs to filter (NULL if none)
+    UINT32       IdFilterModes[NumIdFilterTypes]; // Filter modes for the ID filters
+    RULE_PROGRAM *RuleProgram;    // Rule program that selects process blocks (NULL if none)
+    UINT32       ConsumerGroup;   // Consumer group that splits blocks between its readers (0 if none)
+    UINT32       GroupMember;     // Index of this reader in its consumer group
+    UINT32       GroupSize;       // Number of readers in the consumer group
+    UINT32       PeakBlocks;      // Most blocks the blocks ring buffer has held at once
+    UINT64       DroppedBlocks[NumStatisticsBlockTypes]; // Blocks dropped because the ring buffer was full, by type
+    UINT64       ReadBlocks;      // Number of blocks dequeued
+    UINT64       ReadBytes;       // Number of bytes in the blocks dequeued
+    LONGLONG     LastReadTime;    // Uptime in microseconds of the last dequeue or of registration
+    UINT64       ReadLatency[LATENCY_BUCKETS]; // Histogram of the time from enqueue to dequeue
 };
 
 typedef struct READER_INFO READER_INFO;
@@ -297,6 +128,37 @@ typedef enum _PACKET_DIRECTION {
 // Function prototypes
 //----------------------------------------------------------------------------
 
+//----------------------------------------------------------------------------
+/// @brief Allocates whole pages of nonpaged memory and accounts them under a
+/// memory tag type
+///
+/// Per-processor arrays use this rather than AllocateMemory, since the pages
+/// start on a cache line boundary.  Free the memory with FreePages.
+///
+/// @param size       Number of bytes to allocate, which is rounded up to
+///                   whole pages
+/// @param memoryTag  Memory tag type, which selects the pool tag
+///
+/// @returns Pointer to the memory, or NULL if the allocation failed
+__checkReturn
+void* AllocatePages(
+    __in const SIZE_T size,
+    __in const UINT32 memoryTag);
+
+//----------------------------------------------------------------------------
+/// @brief Allocates nonpaged memory and accounts it under a memory tag type
+///
+/// Free the memory with FreeMemory
+///
+/// @param size       Number of bytes to allocate
+/// @param memoryTag  Memory tag type, which selects the pool tag
+///
+/// @returns Pointer to the memory, or NULL if the allocation failed
+__checkReturn
+void* AllocateMemory(
+    __in const SIZE_T size,
+    __in const UINT32 memoryTag);
+
 //----------------------------------------------------------------------------
 /// @brief Deinitializes the queues
 ///
@@ -304,6 +166,23 @@ typedef enum _PACKET_DIRECTION {
 __checkReturn
 NTSTATUS DeinitializeQueueManager(void);
 
+//----------------------------------------------------------------------------
+/// @brief Frees memory that AllocateMemory allocated
+///
+/// @param buffer  Memory to free
+void FreeMemory(__in void *buffer);
+
+//----------------------------------------------------------------------------
+/// @brief Frees memory that AllocatePages allocated
+///
+/// @param buffer     Memory to free
+/// @param size       Number of bytes passed to AllocatePages
+/// @param memoryTag  Memory tag type passed to AllocatePages
+void FreePages(
+    __in void         *buffer,
+    __in const SIZE_T  size,
+    __in const UINT32  memoryTag);
+
 //----------------------------------------------------------------------------
 /// @brief Initializes the queues
 ///
@@ -365,6 +244,31 @@ NTSTATUS QmEnqueueConnectionBlock(
     __in const UINT32 connectionId,
     __in const UINT32 processId);
 
+//----------------------------------------------------------------------------
+/// @brief Enqueues an image load block for readers that enabled image events
+///
+/// Pass the path ID from QmInternImagePath() along with the path itself.  Each
+/// reader only receives the path until a block with the path is in its ring
+/// buffer, counting from when it enabled image events or last restarted.  A
+/// block with path ID 0 always carries the path.
+///
+/// @param pid          ID of the process that loaded the image (0 for drivers)
+/// @param imageBase    Base address of the image
+/// @param imageSize    Size of the image in bytes
+/// @param kernelImage  True if the image is a driver loaded into system space
+/// @param pathId       Interned path ID (0 if none)
+/// @param path         Image path string
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmEnqueueImageBlock(
+    __in const UINT32          pid,
+    __in const UINT64          imageBase,
+    __in const UINT32          imageSize,
+    __in const bool            kernelImage,
+    __in const UINT32          pathId,
+    __in const UNICODE_STRING *path);
+
 //----------------------------------------------------------------------------
 /// @brief Enqueues a packet block
 ///
@@ -401,35 +305,100 @@ NTSTATUS QmEnqueuePacketBlock(
 /// @param args       Process argument string (NULL if none)
 /// @param sid        Process owner security ID string (NULL if none)
 /// @param timestamp  Process start kernel timestamp (NULL for current time)
+/// @param exitInfo   Process exit information (NULL if none)
 ///
 /// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
 __checkReturn
 NTSTATUS QmEnqueueProcessBlock(
-    __in const _Bool            started,
-    __in const UINT32          pid,
-    __in const UINT32          parentPid,
-    __in UNICODE_STRING       *path,
-    __in UNICODE_STRING       *args,
-    __in UNICODE_STRING       *sid,
-    __in const LARGE_INTEGER  *timestamp);
+    __in const _Bool               started,
+    __in const UINT32              pid,
+    __in const UINT32              parentPid,
+    __in UNICODE_STRING           *path,
+    __in UNICODE_STRING           *args,
+    __in UNICODE_STRING           *sid,
+    __in const LARGE_INTEGER      *timestamp,
+    __in const PROCESS_EXIT_INFO  *exitInfo);
 
 //----------------------------------------------------------------------------
-/// @brief Gets all open process and connection blocks
+/// @brief Copies exited processes from the exit history into a buffer
 ///
-/// When the reader is initializing and hasn't been added to the reader list,
-/// you can set useBlocksBuffer to true to use the already allocated blocks
-/// buffer.  Afterwards, you need to set useBlocksBuffer to false to allocate
-/// a separate buffer to store the initial blocks, since the driver may be
-/// enqueuing other blocks on the blocks buffer at the same time.
+/// @param query         Time range of the process ended blocks to copy
+/// @param buffer        Buffer to hold the process started and ended blocks
+/// @param length        Length of buffer in bytes
+/// @param bytesWritten  Number of bytes copied into buffer
 ///
-/// @param reader           Reader to get blocks for
-/// @param useBlocksBuffer  Use blocks buffer if true, initial buffer if false
+/// @returns STATUS_SUCCESS if successful; STATUS_BUFFER_OVERFLOW if buffer
+///          could not hold every selected process
+NTSTATUS QmGetExitHistory(
+    __in const EXIT_HISTORY_QUERY *query,
+    __out_bcount(length) char     *buffer,
+    __in const UINT32              length,
+    __out UINT32                  *bytesWritten);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the number of readers that enabled image load events
+///
+/// Image load blocks are opt-in, so callers should check this before doing
+/// any work to report an image load.
+///
+/// @returns Number of readers that enabled image load events
+UINT32 QmGetNumImageReaders(void);
+
+//----------------------------------------------------------------------------
+/// @brief Starts sending all running process, open connection, and recently
+/// exited process blocks to the specified reader
+///
+/// QmDequeueBlock returns the initial blocks before any other blocks.  It
+/// walks the trees a chunk at a time, so the trees lock is never held for
+/// long.  Blocks the reader receives live while the initial blocks are being
+/// sent are not sent again.  Readers that call this within a second of each
+/// other while nothing changes share one snapshot of the trees.
+///
+/// @param reader  Reader to get blocks for
 ///
 /// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
 __checkReturn
-NTSTATUS QmGetInitialBlocks(
-    __in READER_INFO *reader,
-    __in const bool   useBlocksBuffer);
+NTSTATUS QmGetInitialBlocks(__in READER_INFO *reader);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the largest blocks in the process, connection, and packet
+/// trees and the exit history
+///
+/// Holds the trees lock while walking every block, so only use this for
+/// debugging.
+///
+/// @param blocks  Buffer to hold the largest blocks
+/// @param length  Length of the buffer in bytes, which must hold at least the
+///                largest blocks header
+///
+/// @returns Number of bytes filled in
+UINT32 QmGetLargestBlocks(
+    __out LARGEST_BLOCKS *blocks,
+    __in  const UINT32    length);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the total number of blocks dropped for each registered reader
+///
+/// @param drops       Array to hold the drops for each reader
+/// @param maxReaders  Number of entries in the array
+///
+/// @returns Number of entries filled in
+UINT32 QmGetReaderDrops(
+    __out_ecount(maxReaders) READER_DROPS *drops,
+    __in                     const UINT32  maxReaders);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the call site profiles for the trees lock and the reader list
+/// lock
+///
+/// @param profile  Buffer to hold the profiles
+/// @param length   Length of the buffer in bytes, which must hold at least the
+///                 lock profile header
+///
+/// @returns Number of bytes filled in
+UINT32 QmGetLockProfile(
+    __out LOCK_PROFILE *profile,
+    __in  const UINT32  length);
 
 //----------------------------------------------------------------------------
 /// @brief Gets maximum snap length for all registered readers
@@ -443,6 +412,42 @@ UINT32 QmGetMaxSnapLen(void);
 /// @returns Number of registered readers
 UINT32 QmGetNumReaders(void);
 
+//----------------------------------------------------------------------------
+/// @brief Gets the number of blocks waiting to be read by the specified reader
+///
+/// While the reader is receiving initial blocks, the count includes the
+/// snapshot entries the reader has not received yet, counting each exited
+/// process once.  The snapshot is only gathered far enough to reach the
+/// limit, a chunk per trees lock hold, so the count can stop short of the
+/// limit only if the reader really has fewer blocks waiting.
+///
+/// @param reader  Reader to count blocks for
+/// @param limit   Number of blocks that is enough
+///
+/// @returns Number of blocks waiting for the reader, up to about the limit
+UINT32 QmGetReaderBlockCount(
+    __in READER_INFO  *reader,
+    __in const UINT32  limit);
+
+//----------------------------------------------------------------------------
+/// @brief Copies the specified reader's enqueue to dequeue latency histogram
+///
+/// Call this from the reader's own thread, since the reader updates the
+/// histogram as it dequeues blocks.
+///
+/// @param reader     Reader to get latency histogram for
+/// @param histogram  Buffer to hold LATENCY_BUCKETS counts
+void QmGetReaderLatency(
+    __in  READER_INFO *reader,
+    __out UINT64      *histogram);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the range of sequence numbers in the reader's ring buffer
+///
+/// @param range   Structure to hold the sequence range
+/// @param reader  Reader to get the sequence range for
+void QmGetSequenceRange(__out SEQUENCE_RANGE *range, __in READER_INFO *reader);
+
 //----------------------------------------------------------------------------
 /// @brief Gets driver and reader statistics
 ///
@@ -450,11 +455,46 @@ UINT32 QmGetNumReaders(void);
 /// @param reader      Reader to get reader statistics for
 void QmGetStatistics(__in STATISTICS *statistics, __in READER_INFO *reader);
 
+//----------------------------------------------------------------------------
+/// @brief Gets extended reader health and driver memory statistics
+///
+/// Fills in every field except Length, which depends on the caller's buffer.
+///
+/// @param statistics  Structure to hold statistics
+/// @param reader      Reader to get reader statistics for
+void QmGetStatisticsV2(__out STATISTICS_V2 *statistics, __in READER_INFO *reader);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the interned ID for an image path, adding the path if necessary
+///
+/// Paths compare case-insensitively.  IDs stay valid until the driver unloads.
+///
+/// @param path  Image path string
+///
+/// @returns Path ID if successful; 0 if the path cannot be interned
+__drv_requiresIRQL(PASSIVE_LEVEL)
+UINT32 QmInternImagePath(__in const UNICODE_STRING *path);
+
+//----------------------------------------------------------------------------
+/// @brief Maps the shared statistics page read-only into the current process
+///
+/// The queue manager updates the page while any mapping exists.  Every call
+/// from the same process returns the same address, so release each one with
+/// QmUnmapSharedStatistics.
+///
+/// @param address  Stores the user-mode address of the page (NULL on failure)
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmMapSharedStatistics(__out void **address);
+
 //----------------------------------------------------------------------------
 /// @brief Registers a reader to receive blocks
 ///
-/// Allocates memory for the reader's ring buffers and copies all initial
-/// records into the reader's initial records ring buffer
+/// Allocates memory for the reader's ring buffers, adds the reader to the
+/// reader list, and starts sending it initial blocks like QmGetInitialBlocks.
+/// Initial blocks leave out every block enqueued after the reader was added,
+/// since the reader receives those live.
 ///
 /// @param reader  Reader to register
 ///
@@ -462,6 +502,21 @@ void QmGetStatistics(__in STATISTICS *statistics, __in READER_INFO *reader);
 __checkReturn
 NTSTATUS QmRegisterReader(__in READER_INFO *reader);
 
+//----------------------------------------------------------------------------
+/// @brief Clears the specified reader's enqueue to dequeue latency histogram
+///
+/// @param reader  Reader to clear latency histogram for
+void QmResetReaderLatency(__in READER_INFO *reader);
+
+//----------------------------------------------------------------------------
+/// @brief Enables, disables, or resets lock profiling
+///
+/// @param flags  Lock profiling flags (LOCK_PROFILE_FLAG_*)
+///
+/// @returns Flags for the previous state (LOCK_PROFILE_FLAG_ENABLE if
+///          profiling was enabled)
+UINT32 QmSetLockProfiling(__in const UINT32 flags);
+
 //----------------------------------------------------------------------------
 /// @brief Provides a list of currently open connections
 ///
@@ -475,6 +530,18 @@ NTSTATUS QmRegisterReader(__in READER_INFO *reader);
 /// @param connections  List of currently open connections
 void QmSetOpenConnections(__in CONNECTIONS *connections);
 
+//----------------------------------------------------------------------------
+/// @brief Sets the consumer group the specified reader belongs to
+///
+/// Readers in the same group each receive a share of the blocks, split by
+/// process ID, instead of every block.
+///
+/// @param reader         Reader to set consumer group for
+/// @param consumerGroup  Consumer group ID (0 to leave the group)
+void QmSetReaderConsumerGroup(
+    __in READER_INFO  *reader,
+    __in const UINT32  consumerGroup);
+
 //----------------------------------------------------------------------------
 /// @brief Sets the specified reader's data notify event handle
 ///
@@ -487,6 +554,94 @@ NTSTATUS QmSetReaderDataEvent(
     __in READER_INFO  *reader,
     __in const HANDLE  userEvent);
 
+//----------------------------------------------------------------------------
+/// @brief Sets the connection or process IDs to filter for the specified
+/// reader
+///
+/// @param reader      Reader to set ID filter for
+/// @param filterType  Type of IDs to filter
+/// @param ids         List of IDs to filter
+/// @param numIds      Number of IDs in the list (0 to disable filtering)
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS QmSetReaderIdFilter(
+    __in READER_INFO          *reader,
+    __in const ID_FILTER_TYPE  filterType,
+    __in const UINT32         *ids,
+    __in const UINT32          numIds);
+
+//----------------------------------------------------------------------------
+/// @brief Sets whether the specified reader's ID filter includes or excludes
+/// the listed IDs
+///
+/// @param reader      Reader to set ID filter mode for
+/// @param filterType  Type of IDs the filter holds
+/// @param mode        FilterModeExclude or FilterModeInclude
+void QmSetReaderIdFilterMode(
+    __in READER_INFO          *reader,
+    __in const ID_FILTER_TYPE  filterType,
+    __in const UINT32          mode);
+
+//----------------------------------------------------------------------------
+/// @brief Enables or disables image load blocks for the specified reader
+///
+/// @param reader   Reader to set image load events for
+/// @param enabled  True to enable image load blocks, false to disable them
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS QmSetReaderImageEvents(
+    __in READER_INFO *reader,
+    __in const bool   enabled);
+
+//----------------------------------------------------------------------------
+/// @brief Sets whether the specified reader only receives process blocks
+///
+/// Readers that read compact records set this, so other blocks are not
+/// queued for them only to be dropped when they are read.  The section
+/// header and interface description blocks are still queued.
+///
+/// @param reader   Reader to set the block types for
+/// @param enabled  True to only queue process blocks, false to queue all
+void QmSetReaderProcessBlocksOnly(
+    __in READER_INFO *reader,
+    __in const bool   enabled);
+
+//----------------------------------------------------------------------------
+/// @brief Sets the DPC to queue when the specified reader has blocks to read
+///
+/// The queue manager queues the DPC when a new block brings the reader's
+/// ring buffer up to the watermark.  It also queues the DPC right away if the
+/// ring buffer is already at or above the watermark.  After that, it does not
+/// queue the DPC again until this is called again, so call it whenever the
+/// reader is left waiting for more blocks.
+///
+/// @param reader     Reader to set read DPC for
+/// @param dpc        Initialized DPC to queue (NULL to disable)
+/// @param watermark  Number of blocks in the ring buffer that queues the DPC
+void QmSetReaderReadDpc(
+    __in     READER_INFO  *reader,
+    __in_opt KDPC         *dpc,
+    __in     const UINT32  watermark);
+
+//----------------------------------------------------------------------------
+/// @brief Sets the rule program that selects which process blocks the
+/// specified reader receives
+///
+/// The queue manager validates and keeps its own copy of the program.
+///
+/// @param reader   Reader to set rule program for
+/// @param program  Rule program from user mode
+/// @param length   Size of the program in bytes (0 to remove the program)
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS QmSetReaderRuleProgram(
+    __in                READER_INFO        *reader,
+    __in_bcount(length) const RULE_PROGRAM *program,
+    __in                const UINT32        length);
+
 //----------------------------------------------------------------------------
 /// @brief Sets the specified reader's snap length
 ///
@@ -499,6 +654,26 @@ NTSTATUS QmSetReaderSnapLength(
     __in READER_INFO  *reader,
     __in const UINT32  snapLength);
 
+//----------------------------------------------------------------------------
+/// @brief Unmaps the shared statistics page from the current process when it
+/// exits
+///
+/// Call from the process exit notification, even if the process still has
+/// reader handles open from other processes.  Later calls to
+/// QmUnmapSharedStatistics for the process do nothing.
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void QmUnmapProcessSharedStatistics(void);
+
+//----------------------------------------------------------------------------
+/// @brief Releases one QmMapSharedStatistics call made from a process
+///
+/// The page is unmapped once every call from the process is released.  This
+/// can be called from any process.
+///
+/// @param process  Process that called QmMapSharedStatistics
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void QmUnmapSharedStatistics(__in const PEPROCESS process);
+
 #ifdef __cplusplus
 };
 #endif
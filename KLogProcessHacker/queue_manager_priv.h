@@ -35,6 +35,21 @@ extern "C" {
 // Structures and enumerations
 //----------------------------------------------------------------------------
 
+// Number of distinct snap lengths whose readers share trimmed packet blocks
+// Readers past this limit get their own trimmed copy of each packet.
+#define MAX_SNAP_VIEWS 8
+
+// An LLRB tree node that holds an interned image path
+// The path buffer immediately follows the node in the same allocation.
+struct IMAGE_PATH_NODE {
+    LLRB_ENTRY(IMAGE_PATH_NODE) TreeEntry;   // LLRB tree entry
+    ULONG                       Hash;        // Case-insensitive hash of the path
+    UINT32                      Id;          // Interned path ID
+    UNICODE_STRING              Path;        // Image path
+};
+
+typedef struct IMAGE_PATH_NODE IMAGE_PATH_NODE;
+
 // An LLRB tree node that holds information for an open connection
 struct OCONN_NODE {
     LLRB_ENTRY(OCONN_NODE) TreeEntry;   // LLRB tree entry
@@ -45,14 +60,173 @@ struct OCONN_NODE {
 
 typedef struct OCONN_NODE OCONN_NODE;
 
+// A process that exited, kept so readers that register later still see it
+// The entry holds a reference to each block.
+struct EXIT_HISTORY_ENTRY {
+    BLOCK_NODE *StartBlock;  // Process started block (NULL if the driver never saw the start)
+    BLOCK_NODE *EndBlock;    // Process ended block
+};
+
+typedef struct EXIT_HISTORY_ENTRY EXIT_HISTORY_ENTRY;
+
+// Header that AllocateMemory puts in front of each buffer, so FreeMemory
+// knows what to subtract from the memory usage
+// The size keeps the buffer that follows 16-byte aligned.
+struct MEMORY_HEADER {
+    UINT32 Size;       // Size of the buffer that follows in bytes
+    UINT32 MemoryTag;  // Memory tag type (MEMORY_TAG_TYPE)
+    UINT64 Reserved;   // Pads the header to 16 bytes
+};
+
+typedef struct MEMORY_HEADER MEMORY_HEADER;
+
+// Live and peak memory use for one memory tag type
+struct MEMORY_USAGE {
+    volatile LONG64 Bytes;            // Bytes currently allocated
+    volatile LONG64 PeakBytes;        // Most bytes ever allocated at once
+    volatile LONG   Allocations;      // Allocations currently live
+    volatile LONG   PeakAllocations;  // Most allocations ever live at once
+};
+
+typedef struct MEMORY_USAGE MEMORY_USAGE;
+
+// The shared statistics page mapped into one process, shared by the reader
+// handles that mapped it from that process
+// The mapping holds a reference to the process.
+struct SHARED_STATISTICS_MAPPING {
+    LIST_ENTRY  ListEntry;  // Entry in the list of mappings
+    PEPROCESS   Process;    // Process the page is mapped into
+    void       *Address;    // User-mode address of the page in the process
+    UINT32      Handles;    // Number of reader handles that mapped the page from the process
+};
+
+typedef struct SHARED_STATISTICS_MAPPING SHARED_STATISTICS_MAPPING;
+
+// Running process and open connection blocks, shared by readers that get
+// their initial blocks close together
+// Readers extend the snapshot a chunk at a time as they need more blocks,
+// with the trees lock held.  Entries are only ever appended, so each reader
+// only needs its index into them.  The snapshot stops being shared once the
+// trees or exit history change.
+struct SNAPSHOT {
+    UINT32       NumReaders;         // Number of readers receiving the snapshot
+    LONGLONG     Created;            // Uptime in microseconds when the snapshot started
+    UINT64       NextProcessId;      // Lowest process ID not yet visited (above 0xFFFFFFFF when done)
+    UINT64       NextConnectionId;   // Lowest connection ID not yet visited (above 0xFFFFFFFF when done)
+    UINT64       FirstExitEntry;     // Number of the oldest exit history entry when the snapshot started
+    UINT64       EndExitEntry;       // Number of the first exit history entry added after the snapshot started
+    BLOCK_NODE  *InterfaceDescriptionBlock; // Interface description block sent to every reader
+    UINT32       Count;              // Number of entries
+    UINT32       Capacity;           // Number of entries allocated
+    BLOCK_NODE **Entries;            // Blocks in the order readers receive them
+};
+
+typedef struct SNAPSHOT SNAPSHOT;
+
+// Queued spin lock that records how long callers wait for and hold it, and
+// adds trace events when it is acquired and released
+// The call site profiles are only changed with the lock held.
+struct QUEUE_LOCK {
+    KSPIN_LOCK         Lock;             // Spin lock
+    LONGLONG           AcquiredCounter;  // Performance counter when the holder acquired the lock (0 if not tracked)
+    UINT32             WaitHistogram;    // Latency histogram for the time spent waiting
+    UINT32             HoldHistogram;    // Latency histogram for the time spent holding the lock
+    UINT32             TraceId;          // Lock ID for lock trace events
+    LOCK_SITE_PROFILE *AcquiredSite;     // Profile of the call site that acquired the lock (NULL if not profiled)
+    LONGLONG           ProfileCounter;   // Performance counter when a profiled call site acquired the lock
+    UINT32             LostSites;        // Call sites not profiled because the table was full
+    LOCK_SITE_PROFILE  Sites[LOCK_PROFILE_MAX_SITES]; // Call site profiles, hashed by line (Line is 0 if unused)
+};
+
+typedef struct QUEUE_LOCK QUEUE_LOCK;
+
+// Per-processor event counters, which QmGetStatistics sums
+// Aligned to a cache line so processors do not share lines.
+struct DECLSPEC_CACHEALIGN STATISTICS_CPU {
+    LONG64 CapturedPackets;        // PCAP-NG packet blocks captured
+    LONG64 CapturedPacketBytes;    // Packet bytes captured
+    LONG   ProcessStartEvents;     // Process start events
+    LONG   NumProcesses;           // Processes started minus processes removed
+    LONG   ProcessEndEvents;       // Process end events
+    LONG   ConnectionOpenEvents;   // Connection open events
+    LONG   NumConnections;         // Connections opened minus connections removed
+    LONG   ConnectionCloseEvents;  // Connection close events
+};
+
+typedef struct STATISTICS_CPU STATISTICS_CPU;
+
 // LLRB tree structures
 typedef LLRB_HEAD(BlockTree, BLOCK_NODE) BLOCK_TREE_HEAD;
+typedef LLRB_HEAD(ImagePathTree, IMAGE_PATH_NODE) IMAGE_TREE_HEAD;
 typedef LLRB_HEAD(OconnTree, OCONN_NODE) OCONN_TREE_HEAD;
 
 //----------------------------------------------------------------------------
 // Function prototypes
 //----------------------------------------------------------------------------
 
+//----------------------------------------------------------------------------
+/// @brief Adds bytes and allocations to a memory usage, raising its peaks
+///
+/// @param usage        Memory usage to update
+/// @param bytes        Bytes allocated (negative if freed)
+/// @param allocations  Allocations made (negative if freed)
+void AccountMemory(
+    __inout  MEMORY_USAGE *usage,
+    __in     const LONG64  bytes,
+    __in     const LONG    allocations);
+
+//----------------------------------------------------------------------------
+/// @brief Acquires a queue manager lock, recording the wait if latency
+/// tracking is enabled
+///
+/// @param lock        Lock to acquire
+/// @param lockHandle  Buffer to hold the in-stack queued spin lock handle
+/// @param line        Source line of the caller, for the trace event and the
+///                    lock profile
+void AcquireQueueLock(
+    __in  QUEUE_LOCK         *lock,
+    __out KLOCK_QUEUE_HANDLE *lockHandle,
+    __in  const UINT32        line);
+
+//----------------------------------------------------------------------------
+/// @brief Adds an exited process to the exit history
+///
+/// The caller must hold the trees lock.  The history takes over the caller's
+/// reference to the process started block and adds its own reference to the
+/// process ended block.
+///
+/// @param startBlock  Process started block (NULL if none)
+/// @param endBlock    Process ended block
+void AddExitHistory(
+    __in_opt BLOCK_NODE *startBlock,
+    __in     BLOCK_NODE *endBlock);
+
+//----------------------------------------------------------------------------
+/// @brief Adds a block to the largest blocks if it is large enough
+///
+/// Keeps the blocks sorted from largest to smallest
+///
+/// @param blocks     Largest blocks to add to
+/// @param maxBlocks  Number of blocks that fit in the buffer
+/// @param blockNode  Block to add
+/// @param location   Where the queue manager holds the block (LARGEST_BLOCK_LOCATION)
+void AddLargestBlock(
+    __inout  LARGEST_BLOCKS   *blocks,
+    __in     const UINT32      maxBlocks,
+    __in     const BLOCK_NODE *blockNode,
+    __in     const UINT32      location);
+
+//----------------------------------------------------------------------------
+/// @brief Advances the timer wheel to the current tick
+///
+/// Stops the periodic timer once no timers are left.
+///
+/// @param dpc      DPC object associated with this routine
+/// @param context  Unused
+/// @param arg1     Unused
+/// @param arg2     Unused
+KDEFERRED_ROUTINE AdvanceQueueTimers;
+
 //----------------------------------------------------------------------------
 /// @brief Allocates memory for a block node
 ///
@@ -60,16 +234,33 @@ typedef LLRB_HEAD(OconnTree, OCONN_NODE) OCONN_TREE_HEAD;
 /// count to 1, but does not clear the memory for the block itself
 ///
 /// @brief dataLength  Length of the block data in bytes
-/// @brief poolTag     Tag to use if allocating additional memory for data buffer
+/// @brief memoryTag   Memory tag type to account the block node and any
+///                    additional memory for the data buffer under
 __checkReturn
 BLOCK_NODE* AllocateBlockNode(
     __in const UINT32 dataLength,
-    __in const UINT32 poolTag);
+    __in const UINT32 memoryTag);
+
+//----------------------------------------------------------------------------
+/// @brief Numbers the readers in each consumer group
+///
+/// Call this with the trees lock and reader list lock held, since both the
+/// live and initial blocks split blocks between group members.
+void CalculateConsumerGroups(void);
 
 //----------------------------------------------------------------------------
-/// @brief Calculates the maximum snap length of all registered readers
+/// @brief Calculates the maximum snap length of all registered readers and
+/// groups readers with the same snap length
+///
+/// Call this with the reader list lock held.
 void CalculateMaxSnapLength(void);
 
+//----------------------------------------------------------------------------
+/// @brief Frees a node in the interned image path tree
+///
+/// @param pathNode  Node to clean up
+void CleanupImagePathNode(__in IMAGE_PATH_NODE *pathNode);
+
 //----------------------------------------------------------------------------
 /// @brief Frees a node in an open connection tree
 ///
@@ -79,6 +270,9 @@ void CleanupOconnNode(__in OCONN_NODE *oconnNode);
 //----------------------------------------------------------------------------
 /// @brief Frees resources held by a reader
 ///
+/// Call this without the locks held, once the reader is off the reader and
+/// snapshot lists, since releasing every queued block can take a while.
+///
 /// @param reader  Reader to clean up
 void CleanupReader(__in READER_INFO *reader);
 
@@ -99,6 +293,19 @@ void CleanupRingBuffer(__in RING_BUFFER *buffer);
 ///          >0 if first node's block ID is greater than second
 int CompareBlockNodes(PBLOCK_NODE first, PBLOCK_NODE second);
 
+//----------------------------------------------------------------------------
+/// @brief Compare two image path nodes for sorting the LLRB tree
+///
+/// Sorts by hash first, so full path comparisons only happen on collisions.
+///
+/// @param first   First image path node to compare
+/// @param second  Second image path node to compare
+///
+/// @returns <0 if first node's path sorts before second;
+///           0 if nodes' paths are equal, ignoring case
+///          >0 if first node's path sorts after second
+int CompareImagePathNodes(IMAGE_PATH_NODE *first, IMAGE_PATH_NODE *second);
+
 //----------------------------------------------------------------------------
 /// @brief Compare two open connection nodes for sorting the LLRB tree
 ///
@@ -110,22 +317,6 @@ int CompareBlockNodes(PBLOCK_NODE first, PBLOCK_NODE second);
 ///          >0 if first node's port is greater than second
 int CompareOconnNodes(OCONN_NODE *first, OCONN_NODE *second);
 
-//----------------------------------------------------------------------------
-/// @brief Converts a command line string to a null-separated argv list in place
-///
-/// http://msdn.microsoft.com/en-us/library/17w5ykft.aspx documents the
-/// algorithm used by the C runtime and the CommandLineToArgvW function to parse
-/// the command line.  However, there are additional rules for handling double
-/// quotes and parsing the first argument that are not documented in MSDN.  For
-/// a more detailed discussion on the command line parsing algorithm, see
-/// http://www.daviddeley.com/autohotkey/parameters/parameters.htm.
-///
-/// @param buffer  Buffer containing the string to fix up
-/// @param length  Length of string in bytes, without terminating null
-///
-/// @returns New length of the command line string in bytes
-UINT16 ConvertCommandLineToArgv(__in char *buffer, __in const UINT16 length);
-
 //----------------------------------------------------------------------------
 /// @brief Converts windows kernel timestamp to PCAP-NG timestamp
 ///
@@ -159,9 +350,123 @@ DRIVER_INITIALIZE DriverEntry;
 //----------------------------------------------------------------------------
 /// @brief Enqueues a block on all reader ring buffers
 ///
+/// Assigns the block's sequence number and writes it into the block's
+/// sequence option.  Call this before storing the block in a tree or the
+/// exit history, with the trees lock held, so snapshots and exit history
+/// queries never copy a block while its sequence option is being written.
+///
 /// @param blockNode  Block to enqueue
+/// @param ruleBlock  Process block that rule programs match against (NULL if
+///                   rule programs do not apply to the block)
 __checkReturn
-void EnqueueBlock(__in BLOCK_NODE *blockNode);
+void EnqueueBlock(
+    __in     BLOCK_NODE       *blockNode,
+    __in_opt const BLOCK_NODE *ruleBlock);
+
+//----------------------------------------------------------------------------
+/// @brief Adds a block to a reader's initial blocks unless the reader filters
+/// it or received it live
+///
+/// Call this with the trees lock held, so the reader's ID filters and rule
+/// program cannot change.
+///
+/// @param reader      Reader to add block for
+/// @param ringBuffer  Ring buffer to add block to
+/// @param blockNode   Block to add
+/// @param ruleBlock   Process block that rule programs match against (NULL if
+///                    rule programs do not apply to the block)
+void EnqueueInitialBlock(
+    __in     READER_INFO      *reader,
+    __in     RING_BUFFER      *ringBuffer,
+    __in     BLOCK_NODE       *blockNode,
+    __in_opt const BLOCK_NODE *ruleBlock);
+
+//----------------------------------------------------------------------------
+/// @brief Adds a block that is leaving its tree to the snapshots that have
+/// not reached it yet
+///
+/// Call this with the trees lock held.  Counts the block as dropped for each
+/// reader of a snapshot that cannot grow.
+///
+/// @param blockNode  Process or connection block being removed
+void EnqueueRemovedInitialBlock(__in BLOCK_NODE *blockNode);
+
+//----------------------------------------------------------------------------
+/// @brief Removes a closed connection from the connection tree once its hold
+/// time is up
+///
+/// Called by the timer wheel with the trees lock held.
+///
+/// @param entry  Timer embedded in the connection block
+TIMER_WHEEL_ROUTINE ExpireConnectionBlock;
+
+//----------------------------------------------------------------------------
+/// @brief Trims processes that are too old from the exit history and
+/// schedules the timer for the next oldest one
+///
+/// Called by the timer wheel with the trees lock held.
+///
+/// @param entry  Exit history timer
+TIMER_WHEEL_ROUTINE ExpireExitHistory;
+
+//----------------------------------------------------------------------------
+/// @brief Releases held packets whose connection never got a process ID
+///
+/// Called by the timer wheel with the trees lock held.  The packets are
+/// enqueued with an unknown process ID.
+///
+/// @param entry  Timer embedded in the first held packet block
+TIMER_WHEEL_ROUTINE ExpireHeldPackets;
+
+//----------------------------------------------------------------------------
+/// @brief Appends the next chunk of tree blocks to a snapshot
+///
+/// Call this with the trees lock held.  Each appended entry holds a reference
+/// to its block.
+///
+/// @param snapshot  Snapshot to extend
+void ExtendSnapshot(__in SNAPSHOT *snapshot);
+
+//----------------------------------------------------------------------------
+/// @brief Adds the next chunk of initial blocks to a reader's initial blocks
+/// ring buffer
+///
+/// The chunk may be empty if the reader filters every block in it.  The
+/// cursor goes inactive and lets go of its snapshot once every block has been
+/// sent.
+///
+/// @param reader  Reader to add blocks for
+void FillInitialBuffer(__in READER_INFO *reader);
+
+//----------------------------------------------------------------------------
+/// @brief Finds the block with the lowest sort ID at or above a sort ID
+///
+/// @param treeHead  Tree to search
+/// @param sortId    Lowest sort ID to return
+///
+/// @returns The block if found; NULL otherwise
+BLOCK_NODE* FindBlockNode(
+    __in BLOCK_TREE_HEAD *treeHead,
+    __in const UINT64     sortId);
+
+//----------------------------------------------------------------------------
+/// @brief Finds the shared statistics mapping for a process
+///
+/// The caller must hold the shared statistics mutex.
+///
+/// @param process  Process to find the mapping for
+///
+/// @returns The mapping; NULL if the page is not mapped into the process
+SHARED_STATISTICS_MAPPING* FindSharedStatisticsMapping(__in const PEPROCESS process);
+
+//----------------------------------------------------------------------------
+/// @brief Frees a snapshot that ReleaseSnapshot returned
+///
+/// Call this without the trees lock held, since releasing every entry's
+/// block can take a while.
+///
+/// @param snapshot  Snapshot to free (NULL if none)
+void FreeSnapshot(__in_opt SNAPSHOT *snapshot);
 
 //----------------------------------------------------------------------------
 /// @brief Allocates and populates PCAP-NG connection block
@@ -181,6 +486,28 @@ BLOCK_NODE* GetConnectionBlock(
     __in const UINT32          processId,
     __in const LARGE_INTEGER  *timestamp);
 
+//----------------------------------------------------------------------------
+/// @brief Allocates and populates PCAP-NG image load block
+///
+/// The block's reference count is already set to 1
+///
+/// @param pid          ID of the process that loaded the image (0 for drivers)
+/// @param imageBase    Base address of the image
+/// @param imageSize    Size of the image in bytes
+/// @param kernelImage  True if the image is a driver loaded into system space
+/// @param pathId       Interned path ID (0 if none)
+/// @param path         Image path string to include (NULL if none)
+///
+/// @returns The block if successful; NULL otherwise
+__checkReturn
+BLOCK_NODE* GetImageBlock(
+    __in const UINT32          pid,
+    __in const UINT64          imageBase,
+    __in const UINT32          imageSize,
+    __in const bool            kernelImage,
+    __in const UINT32          pathId,
+    __in const UNICODE_STRING *path);
+
 //----------------------------------------------------------------------------
 /// @brief Allocates and populates PCAP-NG interface description block
 ///
@@ -190,6 +517,17 @@ BLOCK_NODE* GetConnectionBlock(
 __checkReturn
 BLOCK_NODE* GetInterfaceDescriptionBlock(void);
 
+//----------------------------------------------------------------------------
+/// @brief Copies an image load block without its path option
+///
+/// The copy's reference count is already set to 1
+///
+/// @param blockNode  Image load block with a path option
+///
+/// @returns The copy if successful; NULL otherwise
+__checkReturn
+BLOCK_NODE* GetPathlessImageBlock(__in const BLOCK_NODE *blockNode);
+
 //----------------------------------------------------------------------------
 /// @brief Allocates and populates PCAP-NG process block
 ///
@@ -202,17 +540,19 @@ BLOCK_NODE* GetInterfaceDescriptionBlock(void);
 /// @param args       Process argument string (NULL if none)
 /// @param sid        Process owner security ID string (NULL if none)
 /// @param timestamp  Process start kernel timestamp (NULL for current time)
+/// @param exitInfo   Process exit information (NULL if none)
 ///
 /// @returns The block if successful; NULL otherwise
 __checkReturn
 BLOCK_NODE* GetProcessBlock(
-    __in const bool            started,
-    __in const UINT32          pid,
-    __in const UINT32          parentPid,
-    __in UNICODE_STRING       *path,
-    __in UNICODE_STRING       *args,
-    __in UNICODE_STRING       *sid,
-    __in const LARGE_INTEGER  *timestamp);
+    __in const bool                started,
+    __in const UINT32              pid,
+    __in const UINT32              parentPid,
+    __in UNICODE_STRING           *path,
+    __in UNICODE_STRING           *args,
+    __in UNICODE_STRING           *sid,
+    __in const LARGE_INTEGER      *timestamp,
+    __in const PROCESS_EXIT_INFO  *exitInfo);
 
 //----------------------------------------------------------------------------
 /// @brief Gets the process ID associated with a connection ID
@@ -253,6 +593,16 @@ UINT32 GetRingBufferSize(void);
 /// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
 RTL_QUERY_REGISTRY_ROUTINE GetRingBufferSizeQueryRoutine;
 
+//----------------------------------------------------------------------------
+/// @brief Gets the attributes of a process block that rule programs match
+/// against
+///
+/// @param blockNode  Process block to parse
+/// @param event      Buffer to hold the attributes, which point into the block
+void GetRuleEvent(
+    __in  const BLOCK_NODE *blockNode,
+    __out RULE_EVENT       *event);
+
 //----------------------------------------------------------------------------
 /// @brief Allocates and populates PCAP-NG section header block
 ///
@@ -263,10 +613,63 @@ __checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
 BLOCK_NODE* GetSectionHeaderBlock(void);
 
 //----------------------------------------------------------------------------
-/// @brief Gets the current timestamp in PCAP-NG format
+/// @brief Gets the shared snapshot, starting a new one if there is none or
+/// it is too old to join
 ///
-/// @param timestamp  Buffer to hold current timestamp
-void GetTimestamp(__out LARGE_INTEGER *timestamp);
+/// Call this with the trees lock held.  The caller must increment the
+/// snapshot's reader count.
+///
+/// @returns The snapshot if successful; NULL otherwise
+__checkReturn
+SNAPSHOT* GetSharedSnapshot(void);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the extended statistics index for a block type
+///
+/// @param blockType  PCAP-NG block type
+///
+/// @returns Statistics block type, or NumStatisticsBlockTypes if the block
+/// type is not counted separately
+UINT32 GetStatisticsBlockType(__in const UINT32 blockType);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the event counters for the current processor
+///
+/// Callers below DISPATCH_LEVEL can move to another processor while updating
+/// the counters, so update them with interlocked operations.  The counters
+/// are almost never contended, so these stay cheap.
+///
+/// @returns Event counters for the current processor
+STATISTICS_CPU* GetStatisticsCpu(void);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the current timer wheel tick
+///
+/// @returns Number of timer wheel periods since the driver started
+UINT64 GetTimerWheelTick(void);
+
+//----------------------------------------------------------------------------
+/// @brief Copies a packet block, trimming the packet data to a snap length
+///
+/// @param blockNode   Packet block to copy
+/// @param snapLength  Number of bytes of packet data to keep, which must be
+///                    less than the block's captured length
+///
+/// @returns The trimmed block with its reference count set to 1 if
+/// successful; NULL otherwise
+__checkReturn
+BLOCK_NODE* GetTrimmedPacketBlock(
+    __in const BLOCK_NODE *blockNode,
+    __in const UINT32      snapLength);
+
+//----------------------------------------------------------------------------
+/// @brief Calculates the case-insensitive hash of an image path
+///
+/// @param path  Image path string
+///
+/// @returns Hash of the path
+__drv_requiresIRQL(PASSIVE_LEVEL)
+ULONG HashImagePath(__in const UNICODE_STRING *path);
 
 //----------------------------------------------------------------------------
 /// @brief Holds a packet block until its connection event is received
@@ -275,13 +678,72 @@ void GetTimestamp(__out LARGE_INTEGER *timestamp);
 void HoldPacketBlock(__in BLOCK_NODE *blockNode);
 
 //----------------------------------------------------------------------------
-/// @brief Processes all deferred connection close events
+/// @brief Stops sharing the current snapshot after the trees or exit history
+/// change
 ///
-/// @param dpc      DPC object associated with this routine
-/// @param context  Unused
-/// @param arg1     Unused
-/// @param arg2     Unused
-KDEFERRED_ROUTINE ProcessConnectionCloseEvents;
+/// Call this with the trees lock held.  Readers already receiving the
+/// snapshot keep receiving it.
+void InvalidateSharedSnapshot(void);
+
+//----------------------------------------------------------------------------
+/// @brief Checks if a reader's block types, consumer group, or connection and
+/// process ID filters drop a block
+///
+/// Call this with the reader list lock or trees lock held, so the reader's
+/// consumer group and ID filters cannot change.
+///
+/// @param reader     Reader to check filters for
+/// @param blockNode  Block to check
+///
+/// @returns True if the reader filters the block; false otherwise
+bool IsBlockFiltered(
+    __in const READER_INFO *reader,
+    __in const BLOCK_NODE  *blockNode);
+
+//----------------------------------------------------------------------------
+/// @brief Checks if a stored block belongs in a snapshot
+///
+/// Readers share snapshots but not their live blocks, so this compares
+/// against the reader's own sequence number rather than the snapshot's.
+///
+/// @param cursor     Reader's position in the initial blocks
+/// @param blockNode  Block from a tree or the exit history
+///
+/// @returns True if the reader did not receive the block live; false
+/// otherwise
+bool IsSnapshotBlock(
+    __in const SNAPSHOT_CURSOR *cursor,
+    __in const BLOCK_NODE      *blockNode);
+
+//----------------------------------------------------------------------------
+/// @brief Counts a profiled acquisition of a lock for its call site
+///
+/// Call this with the lock held.  Claims a free slot in the lock's call site
+/// table the first time a line acquires the lock.
+///
+/// @param lock       Lock that was acquired
+/// @param line       Source line of the caller
+/// @param contended  True if the lock was held or had waiters before queueing
+/// @param spinTicks  Performance counter ticks spent waiting for the lock
+///
+/// @returns Profile of the call site, or NULL if the table is full
+LOCK_SITE_PROFILE* ProfileLockAcquired(
+    __in QUEUE_LOCK     *lock,
+    __in const UINT32    line,
+    __in const bool      contended,
+    __in const LONGLONG  spinTicks);
+
+//----------------------------------------------------------------------------
+/// @brief Enqueues and releases a connection's held packet blocks
+///
+/// Call this with the trees lock held, after removing the first block from
+/// the held packets tree.
+///
+/// @param blockNode  First held packet block, which heads the list of the rest
+/// @param processId  ID of the process that owns the connection
+void ReleaseHeldPackets(
+    __in BLOCK_NODE   *blockNode,
+    __in const UINT32  processId);
 
 //----------------------------------------------------------------------------
 /// @brief Releases all packet blocks for a connection
@@ -292,6 +754,52 @@ void ReleasePacketBlocks(
     __in const UINT32 connectionId,
     __in const UINT32 processId);
 
+//----------------------------------------------------------------------------
+/// @brief Releases a queue manager lock, recording the hold time if latency
+/// tracking was enabled when it was acquired
+///
+/// @param lock        Lock to release
+/// @param lockHandle  Handle AcquireQueueLock filled in
+/// @param line        Source line of the caller, for the trace event
+void ReleaseQueueLock(
+    __in QUEUE_LOCK         *lock,
+    __in KLOCK_QUEUE_HANDLE *lockHandle,
+    __in const UINT32        line);
+
+//----------------------------------------------------------------------------
+/// @brief Removes a reader from a snapshot
+///
+/// Call this with the trees lock held.
+///
+/// @param snapshot  Snapshot the reader was receiving
+///
+/// @returns The snapshot if this was its last reader, which the caller must
+/// free with FreeSnapshot after releasing the trees lock; NULL otherwise
+__checkReturn
+SNAPSHOT* ReleaseSnapshot(__in SNAPSHOT *snapshot);
+
+//----------------------------------------------------------------------------
+/// @brief Makes room for more entries in a snapshot
+///
+/// Call this with the trees lock held.
+///
+/// @param snapshot  Snapshot to grow
+/// @param count     Number of entries to make room for
+///
+/// @returns True if the snapshot has room; false if it cannot grow
+__checkReturn
+bool ReserveSnapshotEntries(
+    __in SNAPSHOT     *snapshot,
+    __in const UINT32  count);
+
+//----------------------------------------------------------------------------
+/// @brief Schedules the exit history timer for when the oldest process in the
+/// exit history gets too old
+///
+/// Call this with the trees lock held.  Cancels the timer if the exit history
+/// is empty.
+void ScheduleExitHistoryTimer(void);
+
 //----------------------------------------------------------------------------
 /// @brief Sets PCAP-NG option parameters and copies option data
 ///
@@ -309,6 +817,33 @@ UINT32 SetOption(
     __in const void   *data,
     __in const UINT16  length);
 
+//----------------------------------------------------------------------------
+/// @brief Schedules a timer on the queue manager's timer wheel
+///
+/// Call this with the trees lock held.  Starts the periodic timer that
+/// advances the wheel if it is not running.  The timer expires on the first
+/// tick at least the delay from now.
+///
+/// @param entry    Timer to schedule, rescheduling it if it is scheduled
+/// @param delay    Microseconds until the timer expires
+/// @param routine  Routine to call with the trees lock held when it expires
+void SetQueueTimer(
+    __inout TIMER_WHEEL_ENTRY   *entry,
+    __in    const LONGLONG       delay,
+    __in    TIMER_WHEEL_ROUTINE *routine);
+
+//----------------------------------------------------------------------------
+/// @brief Sets a PCAP-NG sequence number option with sequence number 0
+///
+/// EnqueueBlock fills in the sequence number, which it finds from the end of
+/// the block, so this must be the last option before the end of options.
+///
+/// @param buffer  Buffer to hold the option
+/// @param offset  Offset to start of the option
+///
+/// @returns Offset to next byte after the option
+UINT32 SetSequenceOption(__in char *buffer, __in UINT32 offset);
+
 //----------------------------------------------------------------------------
 /// @brief Sets UTF-8 string PCAP-NG option parameters and copies option data
 ///
@@ -332,6 +867,15 @@ UINT32 SetUtf8Option(
     __in UINT16                length,
     __in UINT16               *bytesRemoved);
 
+//----------------------------------------------------------------------------
+/// @brief Copies the driver statistics and adds up the processor event
+/// counters
+///
+/// The reader fields are left as they are in the driver statistics.
+///
+/// @param statistics  Structure to hold statistics
+void SumStatistics(__out STATISTICS *statistics);
+
 //----------------------------------------------------------------------------
 /// @brief Calculates seconds elapsed between start and end tick counts
 ///
@@ -341,6 +885,34 @@ UINT32 SetUtf8Option(
 /// @returns Seconds elapsed between start and end tick counts
 UINT32 TickDiffToSeconds(const LARGE_INTEGER *start, const LARGE_INTEGER *end);
 
+//----------------------------------------------------------------------------
+/// @brief Removes the oldest processes from the exit history until it is
+/// within its limits
+///
+/// The caller must hold the trees lock.
+///
+/// @param maxCount  Maximum number of processes to keep
+void TrimExitHistory(__in const UINT32 maxCount);
+
+//----------------------------------------------------------------------------
+/// @brief Unmaps the shared statistics page from a process and frees the
+/// mapping
+///
+/// The caller must hold the shared statistics mutex and be attached to the
+/// mapping's process.
+///
+/// @param mapping  Mapping to remove
+void UnmapSharedStatistics(__in SHARED_STATISTICS_MAPPING *mapping);
+
+//----------------------------------------------------------------------------
+/// @brief Updates the shared statistics page
+///
+/// @param dpc      DPC object associated with this routine
+/// @param context  Unused
+/// @param arg1     Unused
+/// @param arg2     Unused
+KDEFERRED_ROUTINE UpdateSharedStatistics;
+
 #ifdef __cplusplus
 };
 #endif
@@ -38,13 +38,56 @@ static const IOCTL_PARAMS gIoctlParams[] =
     { sizeof(UINT32), 0,     sizeof(UINT64), 0     }, // IoctlSetDataEvent
     { sizeof(UINT32), 0,     sizeof(UINT32), 0     }, // IoctlOpenConnections
     { 0, sizeof(STATISTICS), 0, sizeof(STATISTICS) }, // IoctlGetStatistics
+    { sizeof(UINT32), 0,     sizeof(UINT32), 0     }, // IoctlSetImageEvents
+    { 0, sizeof(SEQUENCE_RANGE), 0, sizeof(SEQUENCE_RANGE) }, // IoctlGetSequenceRange
+    { sizeof(EXIT_HISTORY_QUERY), 0, sizeof(EXIT_HISTORY_QUERY), 0 }, // IoctlGetExitHistory
+    { sizeof(UINT32), 0,     sizeof(UINT32), 0     }, // IoctlSetReadWatermark
+    { sizeof(UINT32), 0,     sizeof(UINT32), 0     }, // IoctlSetRecordFormat
+    { sizeof(FILTER_MODES), 0, sizeof(FILTER_MODES), 0 }, // IoctlSetFilterModes
+    { 0,              0,     0,              0     }, // IoctlSetRuleProgram
+    { sizeof(UINT32), 0,     sizeof(UINT32), 0     }, // IoctlSetConsumerGroup
+    { 0, 2 * sizeof(UINT32), 0, 2 * sizeof(UINT32) }, // IoctlGetStatisticsV2
+    { sizeof(UINT32), 0,     sizeof(UINT32), 0     }, // IoctlSetLatencyTracking
+    { 0,              0,     0,              0     }, // IoctlGetLatency
+    { 0,              0,     0,              0     }, // IoctlGetTrace
+    { sizeof(SYNTHETIC_EVENTS_REQUEST), 0, sizeof(SYNTHETIC_EVENTS_REQUEST), 0 }, // IoctlGenerateSyntheticEvents
+    { 0, sizeof(UINT64),     0, sizeof(UINT64)     }, // IoctlMapSharedStatistics
+    { 0,              0,     0,              0     }, // IoctlGetLargestBlocks
+    { sizeof(UINT32), 0,     sizeof(UINT32), 0     }, // IoctlSetLockProfiling
+    { 0,              0,     0,              0     }, // IoctlGetLockProfile
 };
 
 static LOOKASIDE_LIST_EX gLookasideList;              // Holds memory for netbuffer storage
 static bool              gLookasideListInit = false;  // True if lookaside list was initialized
-static const UINT32      gPoolTagIds        = 'ihpK'; // Tag to use when allocating ID lists
 static const UINT32      gPoolTagLookaside  = 'LHpK'; // Tag to use when allocating lookaside buffers
 
+//----------------------------------------------------------------------------
+// Pending reads complete once the reader has restarted, has part of a block
+// left over from the last read, or has reached the watermark
+static inline bool IsReadReady(__in READER_CONTEXT *context)
+{
+    return (context->RestartState != RestartStateNormal) ||
+            context->RestartRequested || context->CurrentBlock ||
+            (QmGetReaderBlockCount(&context->Reader, context->ReadWatermark) >=
+            context->ReadWatermark);
+}
+
+//----------------------------------------------------------------------------
+void AcquirePendedReadsLock(__in IO_CSQ *csq, __out KIRQL *irql)
+{
+    READER_CONTEXT *context = CONTAINING_RECORD(csq, READER_CONTEXT, PendedReadsCsq);
+    KeAcquireSpinLock(&context->PendedReadsLock, irql);
+}
+
+//----------------------------------------------------------------------------
+void CompleteCanceledRead(__in IO_CSQ *csq, __in IRP *irp)
+{
+    UNREFERENCED_PARAMETER(csq);
+    irp->IoStatus.Status      = STATUS_CANCELLED;
+    irp->IoStatus.Information = 0;
+    IoCompleteRequest(irp, IO_NO_INCREMENT);
+}
+
 //----------------------------------------------------------------------------
 static inline NTSTATUS CompleteIrp(
     __in PIRP      irp,
@@ -57,6 +100,63 @@ static inline NTSTATUS CompleteIrp(
     return status;
 }
 
+//----------------------------------------------------------------------------
+void CompletePendedReads(
+    __in     KDPC *dpc,
+    __in_opt void *deferredContext,
+    __in_opt void *arg1,
+    __in_opt void *arg2)
+{
+    READER_CONTEXT *context = (READER_CONTEXT*)deferredContext;
+    IRP            *irp;
+
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(arg1);
+    UNREFERENCED_PARAMETER(arg2);
+
+    while ((irp = IoCsqRemoveNextIrp(&context->PendedReadsCsq, NULL)) != NULL) {
+        KLOCK_QUEUE_HANDLE  lockHandle;
+        NTSTATUS            status    = STATUS_SUCCESS;
+        UINT32              bytesRead = 0;
+        bool                eof       = false;
+
+        KeAcquireInStackQueuedSpinLock(&context->ReadLock, &lockHandle);
+        if (context->Closing) {
+            status = STATUS_CANCELLED;
+        } else if (context->RestartState == RestartStateInit) {
+            // The section header block can only be created at passive level,
+            // so the work item starts sending initial blocks and queues this
+            // DPC again when it is done
+            if (!context->RestartWorkQueued) {
+                context->RestartWorkQueued = true;
+                KeClearEvent(&context->RestartWorkIdle);
+                IoQueueWorkItem(context->RestartWorkItem, StartPendedRestart,
+                        DelayedWorkQueue, context);
+            }
+        } else if (IsReadReady(context)) {
+            bytesRead = ReadBlocks(context, (UINT8*)irp->AssociatedIrp.SystemBuffer,
+                    IoGetCurrentIrpStackLocation(irp)->Parameters.Read.Length, &eof);
+        } else {
+            // Let the next block that brings the ring buffer up to the
+            // watermark queue this DPC again
+            QmSetReaderReadDpc(&context->Reader, &context->ReadDpc, context->ReadWatermark);
+        }
+        if (NT_SUCCESS(status) && !bytesRead && !eof) {
+            // Put the read back at the front of the queue to wait for more
+            // blocks.  Do this inside the read lock, so DispatchCleanup cannot
+            // miss it.
+            IoCsqInsertIrpEx(&context->PendedReadsCsq, irp, NULL, irp);
+            irp = NULL;
+        }
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+        if (!irp) {
+            break;
+        }
+        CompleteIrp(irp, status, bytesRead);
+    }
+}
+
 //----------------------------------------------------------------------------
 __checkReturn
 NTSTATUS DeinitializeReadInterface(void)
@@ -67,6 +167,43 @@ NTSTATUS DeinitializeReadInterface(void)
     return STATUS_SUCCESS;
 }
 
+//----------------------------------------------------------------------------
+NTSTATUS DispatchCleanup(__in PDEVICE_OBJECT deviceObject, __inout PIRP irp)
+{
+    IO_STACK_LOCATION *irpSp = IoGetCurrentIrpStackLocation(irp);
+    READER_CONTEXT    *context;
+
+    UNREFERENCED_PARAMETER(deviceObject);
+    context = (READER_CONTEXT*)(irpSp->FileObject->FsContext2);
+    if (context) {
+        KLOCK_QUEUE_HANDLE  lockHandle;
+        IRP                *pendedIrp;
+
+        // Stop the read DPC from putting reads back in the queue, then cancel
+        // the reads that are still waiting for blocks
+        KeAcquireInStackQueuedSpinLock(&context->ReadLock, &lockHandle);
+        context->Closing = true;
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+        KeWaitForSingleObject(&context->RestartWorkIdle, Executive, KernelMode, FALSE, NULL);
+        while ((pendedIrp = IoCsqRemoveNextIrp(&context->PendedReadsCsq, NULL)) != NULL) {
+            CompleteIrp(pendedIrp, STATUS_CANCELLED, NULL);
+        }
+
+        // A duplicated handle can be closed last from another process, or
+        // after the process that mapped the statistics page exited, so let the
+        // queue manager find the mapping
+        ExAcquireFastMutex(&context->SharedStatisticsMutex);
+        if (context->SharedStatisticsProcess) {
+            QmUnmapSharedStatistics(context->SharedStatisticsProcess);
+            ObDereferenceObject(context->SharedStatisticsProcess);
+            context->SharedStatistics        = NULL;
+            context->SharedStatisticsProcess = NULL;
+        }
+        ExReleaseFastMutex(&context->SharedStatisticsMutex);
+    }
+    return CompleteIrp(irp, STATUS_SUCCESS, NULL);
+}
+
 //----------------------------------------------------------------------------
 NTSTATUS DispatchClose(__in PDEVICE_OBJECT deviceObject, __inout PIRP irp)
 {
@@ -80,15 +217,17 @@ NTSTATUS DispatchClose(__in PDEVICE_OBJECT deviceObject, __inout PIRP irp)
     }
 
     QmDeregisterReader(&context->Reader);
+
+    // The queue manager no longer queues the read DPC, so wait for any queued
+    // DPC to finish before freeing the context
+    KeFlushQueuedDpcs();
     if (context->CurrentBlock) {
         QmCleanupBlock(context->CurrentBlock);
     }
-    if (context->FilteredConnectionIds) {
-        ExFreePool(context->FilteredConnectionIds);
-    }
-    if (context->FilteredProcessIds) {
-        ExFreePool(context->FilteredProcessIds);
+    if (context->CompactRecord) {
+        FreeMemory(context->CompactRecord);
     }
+    IoFreeWorkItem(context->RestartWorkItem);
     ExFreeToLookasideListEx(&gLookasideList, context);
     return CompleteIrp(irp, STATUS_SUCCESS, NULL);
 }
@@ -128,6 +267,24 @@ NTSTATUS DispatchCreate(__in PDEVICE_OBJECT deviceObject, __inout PIRP irp)
 
     RtlZeroMemory(context, sizeof(READER_CONTEXT));
     context->DeviceExtension = devExt;
+    context->ReadWatermark   = 1;
+    InitializeListHead(&context->PendedReads);
+    KeInitializeSpinLock(&context->PendedReadsLock);
+    KeInitializeSpinLock(&context->ReadLock);
+    KeInitializeDpc(&context->ReadDpc, CompletePendedReads, context);
+    KeInitializeEvent(&context->RestartWorkIdle, NotificationEvent, TRUE);
+    ExInitializeFastMutex(&context->SharedStatisticsMutex);
+    context->RestartWorkItem = IoAllocateWorkItem(deviceObject);
+    if (context->RestartWorkItem == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+    status = IoCsqInitializeEx(&context->PendedReadsCsq, InsertPendedRead,
+            RemovePendedRead, PeekPendedRead, AcquirePendedReadsLock,
+            ReleasePendedReadsLock, CompleteCanceledRead);
+    if (!NT_SUCCESS(status)) {
+        goto Cleanup;
+    }
     status = QmRegisterReader(&context->Reader);
     if (!NT_SUCCESS(status)) {
         goto Cleanup;
@@ -138,6 +295,9 @@ Cleanup:
     if (!NT_SUCCESS(status)) {
         DBGPRINT(D_WARN, "Open reader failed: %08X", status);
         if (context) {
+            if (context->RestartWorkItem) {
+                IoFreeWorkItem(context->RestartWorkItem);
+            }
             ExFreeToLookasideListEx(&gLookasideList, context);
         }
     }
@@ -173,7 +333,7 @@ NTSTATUS DispatchDeviceControl(
             ioctl, inBufLen, outBufLen);
 
     // Check buffer sizes
-    if (function > ARRAY_SIZEOF(gIoctlParams)) {
+    if (function >= ARRAY_SIZEOF(gIoctlParams)) {
         return CompleteIrp(irp, STATUS_INVALID_DEVICE_REQUEST, NULL);
     }
     if (is64Bit) {
@@ -192,14 +352,17 @@ NTSTATUS DispatchDeviceControl(
 
     switch (irpSp->Parameters.DeviceIoControl.IoControlCode) {
     case IOCTL_KPH_FILTER_CONNECTIONS:
-        SetIdList(context, ConnectionIdList, buffer, inBufLen);
+        status = SetIdList(context, ConnectionIdFilter, buffer, inBufLen);
         break;
     case IOCTL_KPH_FILTER_PROCESSES:
-        SetIdList(context, ProcessIdList, buffer, inBufLen);
+        status = SetIdList(context, ProcessIdFilter, buffer, inBufLen);
         break;
     case IOCTL_KPH_MARK_RESTART:
         context->RestartRequested = 1;
         DBGPRINT(D_INFO, "Restarting reader %d", context->Reader.Id);
+
+        // Complete a pending read so the reader sees the restart
+        KeInsertQueueDpc(&context->ReadDpc, NULL, NULL);
         break;
     case IOCTL_KPH_SET_SNAP_LENGTH:
     {
@@ -207,8 +370,7 @@ NTSTATUS DispatchDeviceControl(
         if (context->SnapLength != snapLength) {
             // Notify the queue manager of the snap length change so it can
             // recalculate its maximum snap length
-            context->SnapLength    = snapLength;
-            context->SnapLengthPad = PCAP_NG_PADDING(snapLength) - snapLength;
+            context->SnapLength = snapLength;
             QmSetReaderSnapLength(&context->Reader, context->SnapLength);
         }
         DBGPRINT(D_INFO, "Set snap length to %08X (%d) for reader %d",
@@ -244,6 +406,25 @@ NTSTATUS DispatchDeviceControl(
         break;
     }
 #endif
+    case IOCTL_KPH_MAP_SHARED_STATISTICS:
+        // The address is only valid in the process that mapped the page, so
+        // reject the handle's other processes
+        ExAcquireFastMutex(&context->SharedStatisticsMutex);
+        if (!context->SharedStatisticsProcess) {
+            status = QmMapSharedStatistics(&context->SharedStatistics);
+            if (NT_SUCCESS(status)) {
+                context->SharedStatisticsProcess = PsGetCurrentProcess();
+                ObReferenceObject(context->SharedStatisticsProcess);
+            }
+        } else if (context->SharedStatisticsProcess != PsGetCurrentProcess()) {
+            status = STATUS_ACCESS_DENIED;
+        }
+        if (NT_SUCCESS(status)) {
+            *(UINT64*)buffer = (UINT64)(ULONG_PTR)context->SharedStatistics;
+            bytesOut = sizeof(UINT64);
+        }
+        ExReleaseFastMutex(&context->SharedStatisticsMutex);
+        break;
     case IOCTL_KPH_SET_OPEN_CONNECTIONS:
         QmSetOpenConnections((CONNECTIONS*)buffer);
         break;
@@ -251,6 +432,183 @@ NTSTATUS DispatchDeviceControl(
         QmGetStatistics((STATISTICS*)buffer, &context->Reader);
         bytesOut = outBufLenReq;
         break;
+    case IOCTL_KPH_SET_IMAGE_EVENTS:
+    {
+        const bool enabled = (*(const UINT32*)buffer != 0);
+        status = QmSetReaderImageEvents(&context->Reader, enabled);
+        DBGPRINT(D_INFO, "%s image load events for reader %d", enabled ?
+                "Enabling" : "Disabling", context->Reader.Id);
+        break;
+    }
+    case IOCTL_KPH_GET_STATISTICS_V2:
+    {
+        STATISTICS_V2 statistics;
+
+        QmGetStatisticsV2(&statistics, &context->Reader);
+        bytesOut = (UINT32)min(outBufLen, sizeof(STATISTICS_V2));
+        statistics.Length = bytesOut;
+        memcpy(buffer, &statistics, bytesOut);
+        break;
+    }
+    case IOCTL_KPH_SET_LATENCY_TRACKING:
+    {
+        const UINT32 flags = *(const UINT32*)buffer;
+        if (flags & LATENCY_FLAG_RESET) {
+            ResetLatencyHistograms();
+            QmResetReaderLatency(&context->Reader);
+        }
+        gLatencyEnabled = (flags & LATENCY_FLAG_ENABLE) ? true : false;
+        DBGPRINT(D_INFO, "Set latency tracking flags to %u for reader %d",
+                flags, context->Reader.Id);
+        break;
+    }
+    case IOCTL_KPH_GET_LATENCY:
+        // The histograms are too large for the buffer size table
+        if (outBufLen < sizeof(LATENCY_HISTOGRAMS)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        if (!buffer) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        GetLatencyHistograms((LATENCY_HISTOGRAMS*)buffer);
+        QmGetReaderLatency(&context->Reader, ((LATENCY_HISTOGRAMS*)buffer)->ReaderDequeue);
+        bytesOut = sizeof(LATENCY_HISTOGRAMS);
+        break;
+    case IOCTL_KPH_GET_TRACE:
+        // The records are too large for the buffer size table
+        if (outBufLen < FIELD_OFFSET(TRACE_DUMP, Records)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        if (!buffer) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        bytesOut = GetTraceDump((TRACE_DUMP*)buffer, outBufLen);
+        break;
+    case IOCTL_KPH_GET_LARGEST_BLOCKS:
+        // The blocks are too large for the buffer size table
+        if (outBufLen < FIELD_OFFSET(LARGEST_BLOCKS, Blocks)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        if (!buffer) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        bytesOut = QmGetLargestBlocks((LARGEST_BLOCKS*)buffer, outBufLen);
+        break;
+    case IOCTL_KPH_SET_LOCK_PROFILING:
+    {
+        const UINT32 flags = *(const UINT32*)buffer;
+        QmSetLockProfiling(flags);
+        DBGPRINT(D_INFO, "Set lock profiling flags to %u for reader %d",
+                flags, context->Reader.Id);
+        break;
+    }
+    case IOCTL_KPH_GET_LOCK_PROFILE:
+        // The call sites are too large for the buffer size table
+        if (outBufLen < FIELD_OFFSET(LOCK_PROFILE, Sites)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        if (!buffer) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        bytesOut = QmGetLockProfile((LOCK_PROFILE*)buffer, outBufLen);
+        break;
+#ifdef KPH_CONFIG_SYNTHETIC_EVENTS
+    case IOCTL_KPH_GENERATE_SYNTHETIC_EVENTS:
+    {
+        // The results overwrite the request, since both use the system buffer
+        const SYNTHETIC_EVENTS_REQUEST request = *(const SYNTHETIC_EVENTS_REQUEST*)buffer;
+
+        // The results are too large for the buffer size table
+        if (outBufLen < sizeof(SYNTHETIC_EVENTS_RESULT)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        status = GenerateSyntheticEvents(&request, (SYNTHETIC_EVENTS_RESULT*)buffer);
+        if (NT_SUCCESS(status)) {
+            bytesOut = sizeof(SYNTHETIC_EVENTS_RESULT);
+        }
+        break;
+    }
+#endif
+    case IOCTL_KPH_GET_SEQUENCE_RANGE:
+        QmGetSequenceRange((SEQUENCE_RANGE*)buffer, &context->Reader);
+        bytesOut = outBufLenReq;
+        break;
+    case IOCTL_KPH_GET_EXIT_HISTORY:
+    {
+        // The blocks overwrite the query, since both use the system buffer
+        const EXIT_HISTORY_QUERY query = *(const EXIT_HISTORY_QUERY*)buffer;
+        status = QmGetExitHistory(&query, (char*)buffer, outBufLen, &bytesOut);
+        DBGPRINT(D_INFO, "Copied %u bytes of exit history for reader %d",
+                bytesOut, context->Reader.Id);
+        break;
+    }
+    case IOCTL_KPH_SET_READ_WATERMARK:
+    {
+        KLOCK_QUEUE_HANDLE lockHandle;
+        const UINT32       watermark = max(*(const UINT32*)buffer, 1);
+
+        KeAcquireInStackQueuedSpinLock(&context->ReadLock, &lockHandle);
+        context->ReadWatermark = watermark;
+        if (context->ReadDpcSet) {
+            QmSetReaderReadDpc(&context->Reader, &context->ReadDpc, watermark);
+        }
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+        DBGPRINT(D_INFO, "Set read watermark to %u blocks for reader %d",
+                watermark, context->Reader.Id);
+
+        // Complete pending reads that the lower watermark satisfies
+        KeInsertQueueDpc(&context->ReadDpc, NULL, NULL);
+        break;
+    }
+    case IOCTL_KPH_SET_RECORD_FORMAT:
+    {
+        const UINT32 format = *(const UINT32*)buffer;
+        if ((format != RecordFormatPcapNg) && (format != RecordFormatCompact)) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        context->RecordFormat = format;
+        QmSetReaderProcessBlocksOnly(&context->Reader, format == RecordFormatCompact);
+        DBGPRINT(D_INFO, "Set record format to %u for reader %d",
+                format, context->Reader.Id);
+        break;
+    }
+    case IOCTL_KPH_SET_FILTER_MODES:
+    {
+        const FILTER_MODES *modes = (const FILTER_MODES*)buffer;
+        if ((modes->ConnectionIdMode > FilterModeInclude) ||
+                (modes->ProcessIdMode > FilterModeInclude)) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        QmSetReaderIdFilterMode(&context->Reader, ConnectionIdFilter, modes->ConnectionIdMode);
+        QmSetReaderIdFilterMode(&context->Reader, ProcessIdFilter, modes->ProcessIdMode);
+        DBGPRINT(D_INFO, "Set filter modes to %u (connections) and %u (processes) for reader %d",
+                modes->ConnectionIdMode, modes->ProcessIdMode, context->Reader.Id);
+        break;
+    }
+    case IOCTL_KPH_SET_RULE_PROGRAM:
+        status = QmSetReaderRuleProgram(&context->Reader,
+                (const RULE_PROGRAM*)buffer, inBufLen);
+        if (NT_SUCCESS(status)) {
+            DBGPRINT(D_INFO, "Set %u byte rule program for reader %d", inBufLen,
+                    context->Reader.Id);
+        }
+        break;
+    case IOCTL_KPH_SET_CONSUMER_GROUP:
+        QmSetReaderConsumerGroup(&context->Reader, *(const UINT32*)buffer);
+        DBGPRINT(D_INFO, "Set consumer group to %u for reader %d",
+                *(const UINT32*)buffer, context->Reader.Id);
+        break;
     default:
         status = STATUS_INVALID_DEVICE_REQUEST;
         break;
@@ -264,13 +622,12 @@ NTSTATUS DispatchRead(
     __in PDEVICE_OBJECT deviceObject,
     __inout PIRP        irp)
 {
-    BLOCK_NODE        *blockNode    = NULL;
-    UINT32             blockOffset  = 0;
-    IO_STACK_LOCATION *irpSp        = IoGetCurrentIrpStackLocation(irp);
-    READER_CONTEXT    *context      = NULL;
-    UINT8             *readBuffer   = NULL;
-    UINT32             readLength   = 0;
-    UINT32             readOffset   = 0;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+    IO_STACK_LOCATION  *irpSp      = IoGetCurrentIrpStackLocation(irp);
+    READER_CONTEXT     *context    = NULL;
+    UINT8              *readBuffer = NULL;
+    UINT32              readOffset = 0;
+    bool                eof;
 
     UNREFERENCED_PARAMETER(deviceObject);
 
@@ -284,22 +641,109 @@ NTSTATUS DispatchRead(
         return CompleteIrp(irp, STATUS_INVALID_PARAMETER, NULL);
     }
 
+    // Overlapped reads wait in the cancel-safe queue instead of returning zero
+    // bytes.  The read DPC completes them once the reader has enough blocks.
+    if (!IoIsOperationSynchronous(irp)) {
+        IoCsqInsertIrp(&context->PendedReadsCsq, irp, NULL);
+        KeAcquireInStackQueuedSpinLock(&context->ReadLock, &lockHandle);
+        if (!context->ReadDpcSet) {
+            QmSetReaderReadDpc(&context->Reader, &context->ReadDpc,
+                    context->ReadWatermark);
+            context->ReadDpcSet = true;
+        }
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+        // Complete the read right away if there are already enough blocks
+        KeInsertQueueDpc(&context->ReadDpc, NULL, NULL);
+        return STATUS_PENDING;
+    }
+
+    // Reads on a synchronous handle never pend, so the read DPC never reads
+    // for this reader.  Skip the read lock to stay at passive level, which
+    // QmGetInitialBlocks needs to create the section header block.
+    readOffset = ReadBlocks(context, readBuffer, irpSp->Parameters.Read.Length, &eof);
+    return CompleteIrp(irp, STATUS_SUCCESS, readOffset);
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS InitializeReadInterface(DEVICE_OBJECT *device)
+{
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(device);
+    status = ExInitializeLookasideListEx(&gLookasideList, NULL, NULL,
+            NonPagedPool, 0, sizeof(READER_CONTEXT), gPoolTagLookaside, 0);
+    if (!NT_SUCCESS(status)) {
+        DBGPRINT(D_ERR, "Cannot create lookaside list");
+        return status;
+    }
+    gLookasideListInit = true;
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS InsertPendedRead(
+    __in     IO_CSQ *csq,
+    __in     IRP    *irp,
+    __in_opt void   *insertContext)
+{
+    READER_CONTEXT *context = CONTAINING_RECORD(csq, READER_CONTEXT, PendedReadsCsq);
+
+    if (insertContext) {
+        InsertHeadList(&context->PendedReads, &irp->Tail.Overlay.ListEntry);
+    } else {
+        InsertTailList(&context->PendedReads, &irp->Tail.Overlay.ListEntry);
+    }
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+IRP* PeekPendedRead(
+    __in     IO_CSQ *csq,
+    __in_opt IRP    *irp,
+    __in_opt void   *peekContext)
+{
+    READER_CONTEXT *context = CONTAINING_RECORD(csq, READER_CONTEXT, PendedReadsCsq);
+    LIST_ENTRY     *entry;
+
+    UNREFERENCED_PARAMETER(peekContext);
+    entry = irp ? irp->Tail.Overlay.ListEntry.Flink : context->PendedReads.Flink;
+    if (entry == &context->PendedReads) {
+        return NULL;
+    }
+    return CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+}
+
+//----------------------------------------------------------------------------
+UINT32 ReadBlocks(
+    __in  READER_CONTEXT *context,
+    __out UINT8          *readBuffer,
+    __in  const UINT32    readLength,
+    __out bool           *eof)
+{
+    BLOCK_NODE *blockNode   = NULL;
+    UINT32      blockOffset = 0;
+    UINT32      readOffset  = 0;
+
+    *eof = false;
+
     // Check restart state
     switch (context->RestartState) {
     case RestartStateSendEof:
         // Return zero bytes to tell reader it's at a block boundary
         context->RestartState = RestartStateInit;
-        return CompleteIrp(irp, STATUS_SUCCESS, NULL);
+        *eof = true;
+        return 0;
     case RestartStateInit:
         // Get initial PCAP-NG blocks
-        QmGetInitialBlocks(&context->Reader, false);
+        QmGetInitialBlocks(&context->Reader);
         context->RestartState = RestartStateNormal;
         break;
     case RestartStateNormal:
         break;
     }
 
-    readLength  = irpSp->Parameters.Read.Length;
     blockNode   = context->CurrentBlock;
     blockOffset = context->CurrentBlockOffset;
     while (readOffset < readLength) {
@@ -310,8 +754,13 @@ NTSTATUS DispatchRead(
         if (!blockNode) {
             // Handle restart request now that we're at a block boundary
             if (InterlockedCompareExchange(&context->RestartRequested, 0, 1) == 1) {
-                context->RestartState = readOffset ?
-                        RestartStateSendEof : RestartStateInit;
+                if (readOffset) {
+                    context->RestartState = RestartStateSendEof;
+                } else {
+                    // Return zero bytes to tell reader it's at a block boundary
+                    context->RestartState = RestartStateInit;
+                    *eof = true;
+                }
                 break;
             }
 
@@ -320,133 +769,34 @@ NTSTATUS DispatchRead(
             if (!blockNode) {
                 break;  // No more blocks
             }
-            context->ModifiedHeader.BlockType = 0; // Not trimming packet block
-
-            if (blockNode->BlockType == PacketBlock) {
-                PCAP_NG_PACKET_HEADER *header;
-
-                // Filter this block if filtering the connection or process ID
-                bool filter = false;
-                if (context->FilteredProcessIds) {
-                    for (UINT32 index = 1; index <= context->FilteredProcessIds[0]; index++) {
-                        DBGPRINT(D_DBG, "Checking filter %d of %d: block process ID %d (%08X), filter process ID %d (%08X)",
-                                index, context->FilteredProcessIds[0],
-                                blockNode->ProcessId, blockNode->ProcessId,
-                                context->FilteredProcessIds[index], context->FilteredProcessIds[index]);
-                        if (context->FilteredProcessIds[index] == blockNode->ProcessId) {
-                            filter = true;
-                            break;
-                        }
-                    }
-                }
-                if (!filter && context->FilteredConnectionIds) {
-                    for (UINT32 index = 1; index <= context->FilteredConnectionIds[0]; index++) {
-                        DBGPRINT(D_DBG, "Checking filter %d of %d: block connection ID %d (%08X), filter connection ID %d (%08X)",
-                                index, context->FilteredConnectionIds[0],
-                                blockNode->ConnectionId, blockNode->ConnectionId,
-                                context->FilteredConnectionIds[index], context->FilteredConnectionIds[index]);
-                        if (context->FilteredConnectionIds[index] == blockNode->ConnectionId) {
-                            filter = true;
-                            break;
-                        }
-                    }
-                }
-                if (filter) {
-                    DBGPRINT(D_INFO, "Filtering packet for process %08X, connection %08X",
-                            blockNode->ProcessId, blockNode->ConnectionId);
+            context->CompactRecordLength = 0; // Not converting block
+
+            if (context->RecordFormat == RecordFormatCompact) {
+                // Compact records only describe processes
+                if ((blockNode->BlockType != ProcessBlock) ||
+                        !SetCompactRecord(context, blockNode)) {
                     QmCleanupBlock(blockNode);
                     blockNode = NULL;
                     continue;
                 }
-
-                // Trim block to snap length
-                blockData = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
-                header    = (PCAP_NG_PACKET_HEADER*)blockData;
-                if (context->SnapLength && (header->CapturedLength > context->SnapLength)) {
-                    // Fix up packet header and footer
-                    context->DataEndOffset        = sizeof(PCAP_NG_PACKET_HEADER) + context->SnapLength;
-                    context->ModifiedFooterOffset = context->DataEndOffset + context->SnapLengthPad;
-                    context->OriginalFooterOffset = header->BlockLength - sizeof(PCAP_NG_PACKET_FOOTER);
-                    RtlCopyMemory(&context->ModifiedHeader, blockData, sizeof(PCAP_NG_PACKET_HEADER));
-                    RtlCopyMemory(&context->ModifiedFooter, blockData + context->OriginalFooterOffset, sizeof(PCAP_NG_PACKET_FOOTER));
-                    context->ModifiedHeader.BlockLength    = context->ModifiedFooterOffset + sizeof(PCAP_NG_PACKET_FOOTER);
-                    context->ModifiedHeader.CapturedLength = context->SnapLength;
-                    context->ModifiedFooter.BlockLength    = context->ModifiedHeader.BlockLength;
-                }
             }
         }
 
-        // Handle truncated packet blocks
-        blockData   = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
-        blockLength = blockNode->BlockLength;
-        if (context->ModifiedHeader.BlockType) {
-            // Copy fixed-up packet header
-            if (blockOffset < sizeof(PCAP_NG_PACKET_HEADER)) {
-                bytesToCopy = min(readLength - readOffset,
-                        sizeof(PCAP_NG_PACKET_HEADER) - blockOffset);
-                DBGPRINT(D_DBG,
-                        "Copying %08X bytes of packet header from %08X/%08X to %08X/%08X",
-                        bytesToCopy, blockOffset, blockLength, readOffset, readLength);
-                RtlCopyMemory(readBuffer + readOffset, (UINT8*)(&context->ModifiedHeader) + blockOffset, bytesToCopy);
-                readOffset  += bytesToCopy;
-                blockOffset += bytesToCopy;
-            }
-
-            // Copy truncated packet data
-            if ((blockOffset >= sizeof(PCAP_NG_PACKET_HEADER)) &&
-                    (blockOffset < context->DataEndOffset) &&
-                    (readOffset  < readLength)) {
-                bytesToCopy = min(readLength - readOffset,
-                        context->DataEndOffset - blockOffset);
-                DBGPRINT(D_DBG,
-                        "Copying %08X bytes of packet data from %08X/%08X to %08X/%08X",
-                        bytesToCopy, blockOffset, blockLength, readOffset, readLength);
-                RtlCopyMemory(readBuffer + readOffset, blockData + blockOffset,
-                        bytesToCopy);
-                readOffset  += bytesToCopy;
-                blockOffset += bytesToCopy;
-            }
-
-            // Pad truncated packet data
-            if ((blockOffset >= context->DataEndOffset) &&
-                    (blockOffset < context->OriginalFooterOffset) &&
-                    (readOffset  < readLength)) {
-                bytesToCopy = min(readLength - readOffset,
-                        context->ModifiedFooterOffset - blockOffset);
-                DBGPRINT(D_DBG, "Copying %08X bytes of padding to %08X/%08X",
-                        bytesToCopy, readOffset, readLength);
-                RtlZeroMemory(readBuffer + readOffset, bytesToCopy);
-                readOffset  += bytesToCopy;
-                blockOffset += bytesToCopy;
-
-                // Skip rest of packet data
-                if (blockOffset >= context->ModifiedFooterOffset) {
-                    blockOffset = context->OriginalFooterOffset;
-                }
-            }
-
-            // Copy fixed-up packet footer
-            if ((blockOffset >= context->OriginalFooterOffset) &&
-                    (readOffset  < readLength)) {
-                bytesToCopy = min(readLength - readOffset, blockLength - blockOffset);
-                DBGPRINT(D_DBG,
-                        "Copying %08X bytes of packet footer from %08X/%08X to %08X/%08X",
-                        bytesToCopy, blockOffset, blockLength, readOffset, readLength);
-                RtlCopyMemory(readBuffer + readOffset,
-                        (UINT8*)(&context->ModifiedFooter) +
-                        (blockOffset - context->OriginalFooterOffset), bytesToCopy);
-                readOffset  += bytesToCopy;
-                blockOffset += bytesToCopy;
-            }
+        // The queue manager already trimmed packet blocks to the snap length
+        if (context->CompactRecordLength) {
+            blockData   = context->CompactRecord;
+            blockLength = context->CompactRecordLength;
         } else {
-            bytesToCopy = min(readLength - readOffset, blockLength - blockOffset);
-            DBGPRINT(D_DBG, "Copying %08X bytes from %08X/%08X to %08X/%08X",
-                    bytesToCopy, blockOffset, blockLength, readOffset, readLength);
-            RtlCopyMemory(readBuffer + readOffset, blockData + blockOffset,
-                    bytesToCopy);
-            readOffset  += bytesToCopy;
-            blockOffset += bytesToCopy;
+            blockData   = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+            blockLength = blockNode->BlockLength;
         }
+        bytesToCopy = min(readLength - readOffset, blockLength - blockOffset);
+        DBGPRINT(D_DBG, "Copying %08X bytes from %08X/%08X to %08X/%08X",
+                bytesToCopy, blockOffset, blockLength, readOffset, readLength);
+        RtlCopyMemory(readBuffer + readOffset, blockData + blockOffset,
+                bytesToCopy);
+        readOffset  += bytesToCopy;
+        blockOffset += bytesToCopy;
 
         if (blockOffset >= blockLength) {
             QmCleanupBlock(blockNode);
@@ -457,64 +807,91 @@ NTSTATUS DispatchRead(
 
     context->CurrentBlock       = blockNode;
     context->CurrentBlockOffset = blockOffset;
-    return CompleteIrp(irp, STATUS_SUCCESS, readOffset);
+    return readOffset;
 }
 
 //----------------------------------------------------------------------------
-__checkReturn
-NTSTATUS InitializeReadInterface(DEVICE_OBJECT *device)
+void ReleasePendedReadsLock(__in IO_CSQ *csq, __in KIRQL irql)
 {
-    NTSTATUS status;
+    READER_CONTEXT *context = CONTAINING_RECORD(csq, READER_CONTEXT, PendedReadsCsq);
+    KeReleaseSpinLock(&context->PendedReadsLock, irql);
+}
 
-    UNREFERENCED_PARAMETER(device);
-    status = ExInitializeLookasideListEx(&gLookasideList, NULL, NULL,
-            NonPagedPool, 0, sizeof(READER_CONTEXT), gPoolTagLookaside, 0);
-    if (!NT_SUCCESS(status)) {
-        DBGPRINT(D_ERR, "Cannot create lookaside list");
-        return status;
-    }
-    gLookasideListInit = true;
-    return STATUS_SUCCESS;
+//----------------------------------------------------------------------------
+void RemovePendedRead(__in IO_CSQ *csq, __in IRP *irp)
+{
+    UNREFERENCED_PARAMETER(csq);
+    RemoveEntryList(&irp->Tail.Overlay.ListEntry);
 }
 
 //----------------------------------------------------------------------------
-void SetIdList(
-        READER_CONTEXT     *context,
-        const ID_LIST_TYPE  idListType,
-        const void         *buffer,
-        const UINT32        bufferLen)
+bool SetCompactRecord(
+    __in READER_CONTEXT   *context,
+    __in const BLOCK_NODE *blockNode)
 {
-    const char  *label;
-    const char  *labelPs;
-    void       **target;
-    if (idListType == ConnectionIdList) {
-        label = "connection";
-        labelPs = "connection(s)";
-        target = (void**)(&context->FilteredConnectionIds);
-    } else {
-        label = "process";
-        labelPs = "process(es)";
-        target = (void**)(&context->FilteredProcessIds);
-    }
-
-    UINT32       *ids    = NULL;
-    const UINT32  numIds = bufferLen / sizeof(UINT32);
-    DBGPRINT(D_INFO, "Filtering %d %s for reader %d", numIds, labelPs, context->Reader.Id);
-    if (numIds) {
-        ids = (UINT32*)(ExAllocatePoolWithTag(NonPagedPool, (numIds + 1) * sizeof(UINT32), gPoolTagIds));
-        ids[0] = numIds;
-        const UINT32 *newIds = (const UINT32*)buffer;
-        for (UINT32 index = 0; index < numIds; index++) {
-            const UINT32 id = newIds[index];
-            DBGPRINT(D_INFO, "Filtering %s %08X (%d) for reader %d", label, id, id, context->Reader.Id);
-            ids[index + 1] = id;
+    // A compact record is never longer than its block, so a buffer as large
+    // as the block always holds it
+    if (context->CompactRecordSize < blockNode->BlockLength) {
+        char *buffer = (char*)AllocateMemory(blockNode->BlockLength, MemoryCompactRecords);
+        if (!buffer) {
+            DBGPRINT(D_ERR, "Cannot allocate compact record for reader %d",
+                    context->Reader.Id);
+            return false;
+        }
+        if (context->CompactRecord) {
+            FreeMemory(context->CompactRecord);
         }
+        context->CompactRecord     = buffer;
+        context->CompactRecordSize = blockNode->BlockLength;
     }
 
-    UINT32 *currentIds = (UINT32*)(InterlockedExchangePointer(target, ids));
-    if (currentIds) {
-        ExFreePool(currentIds);
+    context->CompactRecordLength = BuildCompactRecord(
+            blockNode->Buffer ? blockNode->Buffer : blockNode->Data,
+            blockNode->BlockLength, blockNode->Sequence,
+            blockNode->Timestamp.QuadPart, context->CompactRecord);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS SetIdList(
+        READER_CONTEXT       *context,
+        const ID_FILTER_TYPE  filterType,
+        const void           *buffer,
+        const UINT32          bufferLen)
+{
+    const UINT32 numIds = bufferLen / sizeof(UINT32);
+
+    DBGPRINT(D_INFO, "Filtering %d %s for reader %d", numIds,
+            (filterType == ConnectionIdFilter) ? "connection(s)" : "process(es)",
+            context->Reader.Id);
+    return QmSetReaderIdFilter(&context->Reader, filterType, (const UINT32*)buffer, numIds);
+}
+
+//----------------------------------------------------------------------------
+// Pending reads wait while the restart state is RestartStateInit, and
+// synchronous reads never run on a handle with pending reads, so nothing else
+// touches the restart state until this sets it back to normal
+void StartPendedRestart(
+    __in     DEVICE_OBJECT *deviceObject,
+    __in_opt void          *workContext)
+{
+    READER_CONTEXT     *context = (READER_CONTEXT*)workContext;
+    KLOCK_QUEUE_HANDLE  lockHandle;
+
+    UNREFERENCED_PARAMETER(deviceObject);
+
+    if (!context->Closing) {
+        QmGetInitialBlocks(&context->Reader);
     }
+    KeAcquireInStackQueuedSpinLock(&context->ReadLock, &lockHandle);
+    context->RestartState      = RestartStateNormal;
+    context->RestartWorkQueued = false;
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    // Complete the reads that were waiting for the initial blocks
+    KeInsertQueueDpc(&context->ReadDpc, NULL, NULL);
+    KeSetEvent(&context->RestartWorkIdle, IO_NO_INCREMENT, FALSE);
 }
 
 #ifdef __cplusplus
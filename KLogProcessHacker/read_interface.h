@@ -37,6 +37,15 @@ extern "C" {
 __checkReturn
 NTSTATUS DeinitializeReadInterface(void);
 
+//----------------------------------------------------------------------------
+/// @brief Cancels pending reads when the last handle to a device is closed
+///
+/// @param deviceObject  The target device for the operation
+/// @param irp           I/O request packet for the operation
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__drv_dispatchType(IRP_MJ_CLEANUP) DRIVER_DISPATCH DispatchCleanup;
+
 //----------------------------------------------------------------------------
 /// @brief Closes an open device
 ///
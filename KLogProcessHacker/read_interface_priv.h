@@ -61,15 +61,25 @@ struct READER_CONTEXT {
     LONG                   RestartRequested;      // Non-zero if reader requested a restart
     BLOCK_NODE            *CurrentBlock;          // PCAP-NG block currently being read
     UINT32                 CurrentBlockOffset;    // Offset into current PCAP-NG block
-    UINT32                *FilteredConnectionIds; // List of connection IDs being filtered (NULL if none)
-    UINT32                *FilteredProcessIds;    // List of processes IDs being filtered (NULL if none)
     UINT32                 SnapLength;            // Number of bytes to capture (0 or 0xFFFFFFFF for unlimited)
-    UINT32                 SnapLengthPad;         // Bytes of padding needed based on snap length
-    PCAP_NG_PACKET_HEADER  ModifiedHeader;        // Modified packet header for truncated blocks
-    PCAP_NG_PACKET_FOOTER  ModifiedFooter;        // Modified packet footer for truncated blocks
-    UINT32                 DataEndOffset;         // Offset to end of unpadded data
-    UINT32                 ModifiedFooterOffset;  // Offset to start of modified packet footer
-    UINT32                 OriginalFooterOffset;  // Offset to start of original packet footer
+    IO_CSQ                 PendedReadsCsq;        // Cancel-safe queue of pending overlapped reads
+    LIST_ENTRY             PendedReads;           // List of pending overlapped reads
+    KSPIN_LOCK             PendedReadsLock;       // Locks list of pending overlapped reads
+    KSPIN_LOCK             ReadLock;              // Serializes reads between DispatchRead and the read DPC
+    KDPC                   ReadDpc;               // DPC that completes pending overlapped reads
+    bool                   ReadDpcSet;            // True if the queue manager queues the read DPC
+    UINT32                 ReadWatermark;         // Number of blocks that complete pending overlapped reads
+    bool                   Closing;               // True once the reader closed its handle
+    IO_WORKITEM           *RestartWorkItem;       // Work item that sends initial blocks for pending reads at passive level
+    bool                   RestartWorkQueued;     // True while the restart work item is queued (locked by read lock)
+    KEVENT                 RestartWorkIdle;       // Signaled while the restart work item is not queued
+    UINT32                 RecordFormat;          // Format to read blocks in
+    char                  *CompactRecord;         // Compact record for the current block
+    UINT32                 CompactRecordSize;     // Size in bytes of the compact record buffer
+    UINT32                 CompactRecordLength;   // Length of the compact record for the current block (0 if none)
+    void                  *SharedStatistics;      // User-mode address of the shared statistics page in SharedStatisticsProcess
+    PEPROCESS              SharedStatisticsProcess; // Process the shared statistics page is mapped into (NULL if not mapped)
+    FAST_MUTEX             SharedStatisticsMutex; // Serializes mapping the shared statistics page
 };
 
 typedef struct READER_CONTEXT READER_CONTEXT;
@@ -83,29 +93,123 @@ struct IOCTL_PARAMS {
 
 typedef struct IOCTL_PARAMS IOCTL_PARAMS;
 
-typedef enum ID_LIST_TYPE {
-    ConnectionIdList, // List of connection IDs
-    ProcessIdList,    // List of process IDs
-} ID_LIST_TYPE;
-
 //----------------------------------------------------------------------------
 // Function prototypes
 //----------------------------------------------------------------------------
 
 //----------------------------------------------------------------------------
-/// @brief Sets a new connection or process ID list in the reader context
-/// structure
+/// @brief Acquires the lock for the list of pending overlapped reads
+///
+/// @param csq   Cancel-safe queue of pending overlapped reads
+/// @param irql  Buffer to hold the previous IRQL
+IO_CSQ_ACQUIRE_LOCK AcquirePendedReadsLock;
+
+//----------------------------------------------------------------------------
+/// @brief Completes an overlapped read that the reader canceled
+///
+/// @param csq  Cancel-safe queue of pending overlapped reads
+/// @param irp  Canceled read
+IO_CSQ_COMPLETE_CANCELED_IRP CompleteCanceledRead;
+
+//----------------------------------------------------------------------------
+/// @brief Completes pending overlapped reads once the reader has enough blocks
+///
+/// @param dpc      DPC object associated with this routine
+/// @param context  Reader context
+/// @param arg1     Unused
+/// @param arg2     Unused
+KDEFERRED_ROUTINE CompletePendedReads;
+
+//----------------------------------------------------------------------------
+/// @brief Adds an overlapped read to the list of pending overlapped reads
+///
+/// @param csq            Cancel-safe queue of pending overlapped reads
+/// @param irp            Read to add
+/// @param insertContext  Non-NULL to add the read at the front of the list
+///
+/// @returns STATUS_SUCCESS
+IO_CSQ_INSERT_IRP_EX InsertPendedRead;
+
+//----------------------------------------------------------------------------
+/// @brief Finds the next pending overlapped read
+///
+/// @param csq          Cancel-safe queue of pending overlapped reads
+/// @param irp          Read to start after (NULL to start at the front)
+/// @param peekContext  Unused
+///
+/// @returns Next pending read; NULL if there are none
+IO_CSQ_PEEK_NEXT_IRP PeekPendedRead;
+
+//----------------------------------------------------------------------------
+/// @brief Copies blocks into a read buffer
+///
+/// The caller must hold the reader context's read lock if the reader can
+/// have pending overlapped reads.
+///
+/// @param context     Reader context
+/// @param readBuffer  Buffer to copy blocks into
+/// @param readLength  Length in bytes of the read buffer
+/// @param eof         Buffer to hold true if the read ends at a restart
+///
+/// @returns Number of bytes copied
+UINT32 ReadBlocks(
+    __in  READER_CONTEXT *context,
+    __out UINT8          *readBuffer,
+    __in  const UINT32    readLength,
+    __out bool           *eof);
+
+//----------------------------------------------------------------------------
+/// @brief Releases the lock for the list of pending overlapped reads
+///
+/// @param csq   Cancel-safe queue of pending overlapped reads
+/// @param irql  IRQL returned when acquiring the lock
+IO_CSQ_RELEASE_LOCK ReleasePendedReadsLock;
+
+//----------------------------------------------------------------------------
+/// @brief Removes an overlapped read from the list of pending overlapped reads
+///
+/// @param csq  Cancel-safe queue of pending overlapped reads
+/// @param irp  Read to remove
+IO_CSQ_REMOVE_IRP RemovePendedRead;
+
+//----------------------------------------------------------------------------
+/// @brief Converts a process block into a compact record in the reader
+/// context's compact record buffer
+///
+/// @param context    Reader context
+/// @param blockNode  Process block to convert
+///
+/// @returns True if successful; false if the buffer cannot be allocated
+bool SetCompactRecord(
+    __in READER_CONTEXT   *context,
+    __in const BLOCK_NODE *blockNode);
+
+//----------------------------------------------------------------------------
+/// @brief Sets a new connection or process ID list for the reader
 ///
 /// @brief context     Reader context
-/// @brief idListType  Type of ID list to set
+/// @brief filterType  Type of ID list to set
 /// @brief buffer      Buffer that holds the ID list
 /// @brief bufferLen   Length in bytes of buffer that holds the ID list
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS SetIdList(
+        READER_CONTEXT       *context,
+        const ID_FILTER_TYPE  filterType,
+        const void           *buffer,
+        const UINT32          bufferLen);
 
-void SetIdList(
-        READER_CONTEXT     *context,
-        const ID_LIST_TYPE  idListType,
-        const void         *buffer,
-        const UINT32        bufferLen);
+//----------------------------------------------------------------------------
+/// @brief Starts sending initial blocks to a reader with pending reads that
+/// restarted
+///
+/// Called from a work item, since creating the section header block needs
+/// passive level.  Queues the read DPC when done.
+///
+/// @param deviceObject  Unused
+/// @param workContext   Reader context
+IO_WORKITEM_ROUTINE StartPendedRestart;
 
 #ifdef __cplusplus
 };
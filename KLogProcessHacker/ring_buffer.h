@@ -48,6 +48,17 @@ static inline void InitRingBuffer(
     queue->Length = size / sizeof(void*);
 }
 
+//----------------------------------------------------------------------------
+/// @brief Gets the number of blocks in the ring buffer
+///
+/// @param ring  Ring buffer to check
+///
+/// @returns Number of blocks in the ring buffer
+static inline UINT32 GetRingBufferCount(__in RING_BUFFER *ring)
+{
+    return ring->Back - ring->Front;
+}
+
 //----------------------------------------------------------------------------
 /// @brief Checks if ring buffer is empty
 ///
@@ -87,9 +98,10 @@ static inline void* RingBufferDequeue(__in RING_BUFFER *ring)
             return NULL;
         }
 
-        // Check if our slot contains anything yet
+        // Check if our slot contains anything yet.  A writer may have taken
+        // the slot without filling it, so read it again on every pass.
         void **slot = ring->Buffer + (front % ring->Length);
-        block = *slot;
+        block = *(void * volatile *)slot;
         if (!block) {
             continue;
         }
@@ -0,0 +1,196 @@
+//----------------------------------------------------------------------------
+// Rule programs that select which process blocks a reader receives
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Global variables
+//----------------------------------------------------------------------------
+
+static const UINT32 gFnvOffsetBasis = 0x811C9DC5;  // FNV-1a 32-bit offset basis
+static const UINT32 gFnvPrime       = 0x01000193;  // FNV-1a 32-bit prime
+
+//----------------------------------------------------------------------------
+static inline char FoldRuleChar(__in const char ch)
+{
+    return ((ch >= 'A') && (ch <= 'Z')) ? (char)(ch - 'A' + 'a') : ch;
+}
+
+//----------------------------------------------------------------------------
+static inline bool CompareRuleString(
+    __in const char   *left,
+    __in const char   *right,
+    __in const UINT32  length,
+    __in const bool    ignoreCase)
+{
+    UINT32 index;
+
+    for (index = 0; index < length; index++) {
+        if (ignoreCase ? (FoldRuleChar(left[index]) != FoldRuleChar(right[index])) :
+                (left[index] != right[index])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+static bool IsRuleMatched(
+    __in const RULE_PROGRAM *program,
+    __in const RULE         *rule,
+    __in const RULE_EVENT   *event)
+{
+    const char *string       = (const char*)program + rule->StringOffset;
+    const bool  ignoreCase   = (rule->Flags & RULE_FLAG_IGNORE_CASE) != 0;
+    const char *value;
+    UINT32      valueLength;
+    UINT32      offset;
+
+    switch (rule->Field) {
+    case RuleFieldPath:
+        value       = event->Path;
+        valueLength = event->PathLength;
+        break;
+    case RuleFieldCommandLine:
+        value       = event->CommandLine;
+        valueLength = event->CommandLineLength;
+        break;
+    case RuleFieldSid:
+        value       = event->Sid;
+        valueLength = event->SidLength;
+        break;
+    case RuleFieldParentPid:
+        return event->ParentPid == rule->Value;
+    case RuleFieldPathHash:
+        return event->PathHash == rule->Value;
+    default:
+        return false;
+    }
+
+    if (rule->StringLength > valueLength) {
+        return false;
+    }
+    switch (rule->Match) {
+    case RuleMatchEquals:
+        return (rule->StringLength == valueLength) &&
+                CompareRuleString(value, string, valueLength, ignoreCase);
+    case RuleMatchPrefix:
+        return CompareRuleString(value, string, rule->StringLength, ignoreCase);
+    case RuleMatchSuffix:
+        return CompareRuleString(value + valueLength - rule->StringLength, string,
+                rule->StringLength, ignoreCase);
+    case RuleMatchContains:
+        for (offset = 0; offset <= valueLength - rule->StringLength; offset++) {
+            if (CompareRuleString(value + offset, string, rule->StringLength, ignoreCase)) {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+//----------------------------------------------------------------------------
+UINT32 HashRulePath(
+    __in_bcount(length) const char   *path,
+    __in                const UINT32  length)
+{
+    UINT32 hash = gFnvOffsetBasis;
+    UINT32 index;
+
+    for (index = 0; index < length; index++) {
+        hash ^= (UINT8)FoldRuleChar(path[index]);
+        hash *= gFnvPrime;
+    }
+    return hash;
+}
+
+//----------------------------------------------------------------------------
+// A group of rules joined with RULE_FLAG_AND_NEXT stops at the first rule
+// that does not match, and the next group starts after the group's last rule
+bool IsRuleEventDropped(
+    __in const RULE_PROGRAM *program,
+    __in const RULE_EVENT   *event)
+{
+    UINT32 index = 0;
+
+    while (index < program->NumRules) {
+        const RULE *rule = &program->Rules[index];
+
+        if (!IsRuleMatched(program, rule, event)) {
+            // Skip the rest of the group
+            while (program->Rules[index].Flags & RULE_FLAG_AND_NEXT) {
+                index++;
+            }
+            index++;
+        } else if (rule->Flags & RULE_FLAG_AND_NEXT) {
+            index++;
+        } else {
+            return rule->Action == RuleActionDrop;
+        }
+    }
+    return program->DefaultAction == RuleActionDrop;
+}
+
+//----------------------------------------------------------------------------
+// Checks the rule count before the rules so the rules are known to be inside
+// the buffer, and requires the last rule to end its group so evaluation
+// never runs past the end of the rules
+__checkReturn
+bool ValidateRuleProgram(
+    __in_bcount(length) const RULE_PROGRAM *program,
+    __in                const UINT32        length)
+{
+    UINT32 index;
+
+    if ((length < FIELD_OFFSET(RULE_PROGRAM, Rules)) || (length > RULE_PROGRAM_MAX_LENGTH)) {
+        return false;
+    }
+    if ((program->NumRules > RULE_PROGRAM_MAX_RULES) ||
+            (FIELD_OFFSET(RULE_PROGRAM, Rules) + program->NumRules * sizeof(RULE) > length)) {
+        return false;
+    }
+    if (program->DefaultAction > RuleActionDrop) {
+        return false;
+    }
+    for (index = 0; index < program->NumRules; index++) {
+        const RULE *rule = &program->Rules[index];
+
+        if ((rule->Field > RuleFieldPathHash) || (rule->Match > RuleMatchContains) ||
+                (rule->Action > RuleActionDrop) ||
+                (rule->Flags & ~(RULE_FLAG_IGNORE_CASE | RULE_FLAG_AND_NEXT))) {
+            return false;
+        }
+        if ((rule->StringOffset > length) || (rule->StringLength > length - rule->StringOffset)) {
+            return false;
+        }
+    }
+    if (program->NumRules && (program->Rules[program->NumRules - 1].Flags & RULE_FLAG_AND_NEXT)) {
+        return false;
+    }
+    return true;
+}
+
+#ifdef __cplusplus
+};
+#endif
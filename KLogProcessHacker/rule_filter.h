@@ -0,0 +1,96 @@
+//----------------------------------------------------------------------------
+// Rule programs that select which process blocks a reader receives
+//
+// The evaluator only uses the structures from ioctls.h and plain C, so it
+// can be built outside the kernel.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef RULE_FILTER_H
+#define RULE_FILTER_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "ioctls.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+#define RULE_PROGRAM_MAX_RULES  1024     // Maximum number of rules in a program
+#define RULE_PROGRAM_MAX_LENGTH 0x10000  // Maximum size of a program in bytes
+
+// Process attributes that rules match against
+// Strings point into the process block and are not NUL-terminated.  Missing
+// strings have a length of zero.
+struct RULE_EVENT {
+    const char *Path;               // Executable path
+    UINT32      PathLength;         // Length of the executable path in bytes
+    const char *CommandLine;        // Raw command line
+    UINT32      CommandLineLength;  // Length of the raw command line in bytes
+    const char *Sid;                // User SID
+    UINT32      SidLength;          // Length of the user SID in bytes
+    UINT32      ParentPid;          // Parent process ID
+    UINT32      PathHash;           // Hash of the executable path
+};
+
+typedef struct RULE_EVENT RULE_EVENT;
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Hashes an executable path for RuleFieldPathHash
+///
+/// @param path    UTF-8 path to hash
+/// @param length  Length of the path in bytes
+///
+/// @returns 32-bit FNV-1a hash of the path with ASCII letters in lower case
+UINT32 HashRulePath(
+    __in_bcount(length) const char   *path,
+    __in                const UINT32  length);
+
+//----------------------------------------------------------------------------
+/// @brief Checks if a rule program drops a process block
+///
+/// @param program  Validated rule program
+/// @param event    Attributes of the process
+///
+/// @returns True if the reader should not receive the block; false otherwise
+bool IsRuleEventDropped(
+    __in const RULE_PROGRAM *program,
+    __in const RULE_EVENT   *event);
+
+//----------------------------------------------------------------------------
+/// @brief Checks that a rule program from user mode is safe to evaluate
+///
+/// @param program  Rule program to check
+/// @param length   Size of the program in bytes
+///
+/// @returns True if the program is valid; false otherwise
+__checkReturn
+bool ValidateRuleProgram(
+    __in_bcount(length) const RULE_PROGRAM *program,
+    __in                const UINT32        length);
+
+#ifdef __cplusplus
+}; // extern "C"
+#endif
+
+#endif // RULE_FILTER_H
@@ -0,0 +1,314 @@
+//----------------------------------------------------------------------------
+// Generates synthetic process, connection, and packet events for load
+// testing the queue manager
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+
+#ifdef KPH_CONFIG_SYNTHETIC_EVENTS
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Global variables
+//----------------------------------------------------------------------------
+
+static UNICODE_STRING gSyntheticArgs      = RTL_CONSTANT_STRING(L"synthetic.exe --load-test");
+static UNICODE_STRING gSyntheticPath      = RTL_CONSTANT_STRING(L"\\SystemRoot\\synthetic.exe");
+static const UINT32   gPoolTagSynthetic   = 'ySpK';  // Tag to use when allocating generator threads
+static const UINT32   gSyntheticIdBase    = 0xF0000000;  // High bits of every synthetic process and connection ID
+static const UINT16   gSyntheticPort      = 9;       // Local port for synthetic packets
+
+//----------------------------------------------------------------------------
+// Synthetic IDs hold the thread index above an 18-bit counter, so threads
+// never reuse each other's IDs.  Process IDs are multiples of 4 like real ones.
+static inline UINT32 GetSyntheticId(
+    __inout SYNTHETIC_THREAD *thread,
+    __in    const bool        processId)
+{
+    const UINT32 counter = thread->NextId++ & 0x3FFFF;
+    return gSyntheticIdBase | (thread->Index << 20) | (processId ? counter << 2 : counter);
+}
+
+//----------------------------------------------------------------------------
+static inline UINT32 GetSyntheticRandom(__inout SYNTHETIC_THREAD *thread)
+{
+    // Numerical Recipes linear congruential generator
+    thread->Random = thread->Random * 1664525 + 1013904223;
+    return thread->Random >> 8;
+}
+
+//----------------------------------------------------------------------------
+// Alternates between starting and ending one process, so the process tree
+// stays small however long the run is
+static void GenerateProcessEvent(__inout SYNTHETIC_THREAD *thread)
+{
+    NTSTATUS status;
+
+    if (thread->ProcessId) {
+        status = QmEnqueueProcessBlock(false, thread->ProcessId, 4, NULL, NULL, NULL,
+                NULL, NULL);
+        thread->ProcessId = 0;
+    } else {
+        thread->ProcessId = GetSyntheticId(thread, true);
+        status = QmEnqueueProcessBlock(true, thread->ProcessId, 4, &gSyntheticPath,
+                &gSyntheticArgs, NULL, NULL, NULL);
+    }
+    if (NT_SUCCESS(status)) {
+        thread->Events[SyntheticProcess]++;
+    } else {
+        thread->FailedEvents++;
+    }
+}
+
+//----------------------------------------------------------------------------
+static void GenerateConnectionEvent(__inout SYNTHETIC_THREAD *thread)
+{
+    NTSTATUS status;
+
+    if (thread->ConnectionId) {
+        status = QmEnqueueConnectionBlock(false, thread->ConnectionId, thread->OwnerId);
+        thread->ConnectionId = 0;
+    } else {
+        thread->ConnectionId = GetSyntheticId(thread, false);
+        status = QmEnqueueConnectionBlock(true, thread->ConnectionId, thread->OwnerId);
+    }
+    if (NT_SUCCESS(status)) {
+        thread->Events[SyntheticConnection]++;
+    } else {
+        thread->FailedEvents++;
+    }
+}
+
+//----------------------------------------------------------------------------
+static void GeneratePacketEvent(__inout SYNTHETIC_THREAD *thread)
+{
+    const UINT32  length = thread->Request->PacketLength;
+    BLOCK_NODE   *blockNode;
+    char         *data;
+
+    blockNode = QmAllocatePacketBlock(length, &data);
+    if (!blockNode) {
+        thread->FailedEvents++;
+        return;
+    }
+    RtlZeroMemory(data, length);
+    if (NT_SUCCESS(QmEnqueuePacketBlock(blockNode, Outbound, length, length,
+            thread->PacketConnection, AF_INET, IPPROTO_TCP, gSyntheticPort))) {
+        thread->Events[SyntheticPacket]++;
+    } else {
+        thread->FailedEvents++;
+    }
+}
+
+//----------------------------------------------------------------------------
+void CloseSyntheticThread(__inout SYNTHETIC_THREAD *thread)
+{
+    if (thread->ConnectionId) {
+        GenerateConnectionEvent(thread);
+    }
+    if (thread->ProcessId) {
+        GenerateProcessEvent(thread);
+    }
+    if (!NT_SUCCESS(QmEnqueueConnectionBlock(false, thread->PacketConnection, thread->OwnerId))) {
+        thread->FailedEvents++;
+    }
+    if (!NT_SUCCESS(QmEnqueueProcessBlock(false, thread->OwnerId, 4, NULL, NULL, NULL, NULL,
+            NULL))) {
+        thread->FailedEvents++;
+    }
+}
+
+//----------------------------------------------------------------------------
+void GenerateSyntheticEvent(__inout SYNTHETIC_THREAD *thread)
+{
+    const SYNTHETIC_EVENTS_REQUEST *request = thread->Request;
+    const UINT32                    pick    = GetSyntheticRandom(thread) %
+            (request->ProcessWeight + request->ConnectionWeight + request->PacketWeight);
+
+    if (pick < request->ProcessWeight) {
+        GenerateProcessEvent(thread);
+    } else if (pick < request->ProcessWeight + request->ConnectionWeight) {
+        GenerateConnectionEvent(thread);
+    } else {
+        GeneratePacketEvent(thread);
+    }
+}
+
+//----------------------------------------------------------------------------
+bool InitializeSyntheticThread(
+    __out SYNTHETIC_THREAD               *thread,
+    __in  const SYNTHETIC_EVENTS_REQUEST *request,
+    __in  const UINT32                    index,
+    __in  const LONGLONG                  startTime)
+{
+    RtlZeroMemory(thread, sizeof(SYNTHETIC_THREAD));
+    thread->Request = request;
+    thread->Index   = index;
+    thread->EndTime = startTime + (LONGLONG)request->Duration * 1000;
+    thread->Rate    = request->Rate / request->NumThreads +
+            ((index < request->Rate % request->NumThreads) ? 1 : 0);
+    thread->Random  = (UINT32)startTime ^ (index * 0x9E3779B9);
+    return !request->Rate || thread->Rate;
+}
+
+//----------------------------------------------------------------------------
+// Each thread owns a process that the connections belong to, and one
+// connection that stays open for the whole run to carry packets
+void OpenSyntheticThread(__inout SYNTHETIC_THREAD *thread)
+{
+    thread->OwnerId = GetSyntheticId(thread, true);
+    if (!NT_SUCCESS(QmEnqueueProcessBlock(true, thread->OwnerId, 4, &gSyntheticPath,
+            &gSyntheticArgs, NULL, NULL, NULL))) {
+        thread->FailedEvents++;
+    }
+    thread->PacketConnection = GetSyntheticId(thread, false);
+    if (!NT_SUCCESS(QmEnqueueConnectionBlock(true, thread->PacketConnection, thread->OwnerId))) {
+        thread->FailedEvents++;
+    }
+}
+
+//----------------------------------------------------------------------------
+// The thread paces itself against its share of the rate once per millisecond
+static void SyntheticThread(__in void *context)
+{
+    SYNTHETIC_THREAD *thread    = (SYNTHETIC_THREAD*)context;
+    const LONGLONG    startTime = ClockGetUptime();
+    UINT64            events    = 0;
+    LARGE_INTEGER     delay;
+
+    delay.QuadPart = -10000; // 1 millisecond
+    OpenSyntheticThread(thread);
+    for (;;) {
+        const LONGLONG now = ClockGetUptime();
+
+        if (now >= thread->EndTime) {
+            break;
+        }
+        if (thread->Rate && (events * 1000000 >= (UINT64)(now - startTime) * thread->Rate)) {
+            KeDelayExecutionThread(KernelMode, FALSE, &delay);
+            continue;
+        }
+
+        // Run a batch between clock reads, since reading the clock costs about
+        // as much as enqueuing a small block
+        for (int batch = 0; batch < 16; batch++) {
+            GenerateSyntheticEvent(thread);
+            events++;
+        }
+    }
+    CloseSyntheticThread(thread);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+//----------------------------------------------------------------------------
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS GenerateSyntheticEvents(
+    __in  const SYNTHETIC_EVENTS_REQUEST *request,
+    __out SYNTHETIC_EVENTS_RESULT        *result)
+{
+    READER_DROPS      startDrops[SYNTHETIC_MAX_READERS];
+    UINT32            numStartDrops;
+    UINT32            lockProfileFlags = 0;
+    SYNTHETIC_THREAD *threads;
+    LONGLONG          startTime;
+    NTSTATUS          status = STATUS_SUCCESS;
+
+    RtlZeroMemory(result, sizeof(SYNTHETIC_EVENTS_RESULT));
+    if (!request->NumThreads || (request->NumThreads > SYNTHETIC_MAX_THREADS) ||
+            (request->Duration > SYNTHETIC_MAX_DURATION) ||
+            !(request->ProcessWeight + request->ConnectionWeight + request->PacketWeight)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    threads = ExAllocatePoolWithTag(NonPagedPool,
+            request->NumThreads * sizeof(SYNTHETIC_THREAD), gPoolTagSynthetic);
+    if (!threads) {
+        DBGPRINT(D_ERR, "Cannot allocate synthetic event threads");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(threads, request->NumThreads * sizeof(SYNTHETIC_THREAD));
+
+    if (request->Flags & SYNTHETIC_FLAG_PROFILE_LOCKS) {
+        lockProfileFlags = QmSetLockProfiling(LOCK_PROFILE_FLAG_ENABLE | LOCK_PROFILE_FLAG_RESET);
+    }
+    numStartDrops = QmGetReaderDrops(startDrops, SYNTHETIC_MAX_READERS);
+    startTime     = ClockGetUptime();
+    for (UINT32 index = 0; index < request->NumThreads; index++) {
+        SYNTHETIC_THREAD *thread = &threads[index];
+
+        if (!InitializeSyntheticThread(thread, request, index, startTime)) {
+            // More threads than events per second, so this thread has no share
+            continue;
+        }
+        status = PsCreateSystemThread(&thread->Handle, THREAD_ALL_ACCESS, NULL, NULL,
+                NULL, SyntheticThread, thread);
+        if (!NT_SUCCESS(status)) {
+            DBGPRINT(D_ERR, "Cannot create synthetic event thread %u: %08X", index, status);
+            thread->Handle = NULL;
+            break;
+        }
+    }
+
+    // Wait for every thread that started, even if a later one failed
+    for (UINT32 index = 0; index < request->NumThreads; index++) {
+        SYNTHETIC_THREAD *thread = &threads[index];
+
+        if (thread->Handle) {
+            ZwWaitForSingleObject(thread->Handle, FALSE, NULL);
+            ZwClose(thread->Handle);
+        }
+        result->ProcessEvents    += thread->Events[SyntheticProcess];
+        result->ConnectionEvents += thread->Events[SyntheticConnection];
+        result->PacketEvents     += thread->Events[SyntheticPacket];
+        result->FailedEvents     += thread->FailedEvents;
+    }
+    result->ElapsedTime = ClockGetUptime() - startTime;
+    if (request->Flags & SYNTHETIC_FLAG_PROFILE_LOCKS) {
+        // Keep the profile for the caller, but stop adding to it
+        QmSetLockProfiling(lockProfileFlags);
+    }
+    if (result->ElapsedTime) {
+        result->EventsPerSecond = (result->ProcessEvents + result->ConnectionEvents +
+                result->PacketEvents) * 1000000 / result->ElapsedTime;
+    }
+
+    // Report the drops during the run.  Readers that registered during the run
+    // report every drop since they registered.
+    result->NumReaders = QmGetReaderDrops(result->Readers, SYNTHETIC_MAX_READERS);
+    for (UINT32 index = 0; index < result->NumReaders; index++) {
+        for (UINT32 start = 0; start < numStartDrops; start++) {
+            if (startDrops[start].ReaderId == result->Readers[index].ReaderId) {
+                result->Readers[index].DroppedBlocks -= startDrops[start].DroppedBlocks;
+                break;
+            }
+        }
+    }
+
+    DBGPRINT(D_INFO, "Generated %I64u synthetic events per second with %u threads",
+            result->EventsPerSecond, request->NumThreads);
+    ExFreePool(threads);
+    return status;
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // KPH_CONFIG_SYNTHETIC_EVENTS
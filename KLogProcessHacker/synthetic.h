@@ -0,0 +1,127 @@
+//----------------------------------------------------------------------------
+// Generates synthetic process, connection, and packet events for load
+// testing the queue manager
+//
+// The generator is only compiled when KPH_CONFIG_SYNTHETIC_EVENTS is defined.
+// Never define it for drivers that monitor real systems, since readers cannot
+// tell synthetic events from real ones.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef KPH_CONFIG_SYNTHETIC_EVENTS
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+// State for one generator thread
+struct SYNTHETIC_THREAD {
+    const SYNTHETIC_EVENTS_REQUEST *Request;           // Run parameters
+    UINT32                          Index;             // Thread index, which is part of every ID the thread uses
+    LONGLONG                        EndTime;           // Uptime in microseconds when the thread stops
+    UINT32                          Rate;              // Events per second for this thread (0 for unlimited)
+    UINT32                          Random;            // Random number generator state
+    UINT32                          NextId;            // Counter for process and connection IDs
+    UINT32                          OwnerId;           // ID of the process that owns the thread's connections
+    UINT32                          ProcessId;         // ID of the running synthetic process (0 if none)
+    UINT32                          ConnectionId;      // ID of the open connection for connection events (0 if none)
+    UINT32                          PacketConnection;  // ID of the connection that carries packet events
+    UINT64                          Events[3];         // Events enqueued for each event type
+    UINT64                          FailedEvents;      // Events the queue manager could not enqueue
+    HANDLE                          Handle;            // Thread handle (NULL if the thread was not created)
+};
+
+typedef struct SYNTHETIC_THREAD SYNTHETIC_THREAD;
+
+// Indexes into SYNTHETIC_THREAD.Events
+enum SYNTHETIC_EVENT_TYPE {
+    SyntheticProcess    = 0,
+    SyntheticConnection = 1,
+    SyntheticPacket     = 2,
+};
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Sets up a generator's state for a run
+///
+/// GenerateSyntheticEvents calls this and the routines below from its own
+/// threads.  They are separate so the host harness can drive generators from
+/// threads it times itself.
+///
+/// @param thread     Generator state to set up
+/// @param request    Run parameters, which must outlive the generator
+/// @param index      Thread index, less than SYNTHETIC_MAX_THREADS
+/// @param startTime  Uptime in microseconds when the run starts
+///
+/// @returns true if the generator has a share of the rate; false if the
+///          request has more threads than events per second
+bool InitializeSyntheticThread(
+    __out SYNTHETIC_THREAD               *thread,
+    __in  const SYNTHETIC_EVENTS_REQUEST *request,
+    __in  const UINT32                    index,
+    __in  const LONGLONG                  startTime);
+
+//----------------------------------------------------------------------------
+/// @brief Enqueues the start of the process that owns a generator's
+/// connections and the open of the connection that carries its packets
+///
+/// @param thread  Generator state from InitializeSyntheticThread
+void OpenSyntheticThread(__inout SYNTHETIC_THREAD *thread);
+
+//----------------------------------------------------------------------------
+/// @brief Enqueues one process, connection, or packet event, picked by the
+/// request's weights
+///
+/// @param thread  Generator state from OpenSyntheticThread
+void GenerateSyntheticEvent(__inout SYNTHETIC_THREAD *thread);
+
+//----------------------------------------------------------------------------
+/// @brief Enqueues the end of everything a generator opened
+///
+/// @param thread  Generator state from OpenSyntheticThread
+void CloseSyntheticThread(__inout SYNTHETIC_THREAD *thread);
+
+//----------------------------------------------------------------------------
+/// @brief Enqueues synthetic events from several threads and waits for them
+/// to finish
+///
+/// @param request  Number of threads, duration, rate, and event mix
+/// @param result   Structure to hold the events enqueued, the achieved rate,
+///                 and the blocks each reader dropped during the run
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS GenerateSyntheticEvents(
+    __in  const SYNTHETIC_EVENTS_REQUEST *request,
+    __out SYNTHETIC_EVENTS_RESULT        *result);
+
+#endif // KPH_CONFIG_SYNTHETIC_EVENTS
+
+#ifdef __cplusplus
+}; // extern "C"
+#endif
+
+#endif // SYNTHETIC_H
@@ -0,0 +1,140 @@
+//----------------------------------------------------------------------------
+// Host tests and throughput comparison for the clock's counter conversion
+//
+// Checks the multiply-shift conversion against exact 128-bit division over
+// counter frequencies from 1 kHz to 10 GHz, including the rates Windows
+// uses, for deltas up to the calibration's headroom.  Then prints how
+// fast each converts.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <time.h>
+
+#include "kph.h"
+#include "test.h"
+
+#define HEADROOM           64         // Seconds, as in clock.c
+#define RANDOM_FREQUENCIES 2000
+#define DELTAS_PER_CHECK   4096
+#define TIMED_CONVERSIONS  4000000
+
+//----------------------------------------------------------------------------
+static UINT64 GetRandom(UINT64 *state)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 11;
+}
+
+//----------------------------------------------------------------------------
+static LONGLONG ExactMicroseconds(const LONGLONG delta, const LONGLONG frequency)
+{
+    return (LONGLONG)((unsigned __int128)delta * 1000000 / (UINT64)frequency);
+}
+
+//----------------------------------------------------------------------------
+// The multiplier is rounded down by less than one, so the conversion is
+// never ahead of the exact time and falls behind by at most one microsecond
+// plus one for every 2^Shift ticks
+static LONGLONG CheckFrequency(const LONGLONG frequency, UINT64 *state)
+{
+    CLOCK_CALIBRATION calibration;
+    LONGLONG          maxError = 0;
+
+    SetClockScale(&calibration, frequency, HEADROOM);
+    CHECK(calibration.MaxDelta == frequency * HEADROOM);
+    CHECK((calibration.Shift > 0) && (calibration.Shift <= 32));
+
+    // The largest delta cannot overflow, and the next larger shift could
+    CHECK((unsigned __int128)calibration.MaxDelta * calibration.Multiplier <= MAXLONGLONG);
+    if (calibration.Shift < 32) {
+        const UINT64 larger = (1000000ULL << (calibration.Shift + 1)) / frequency;
+        CHECK((unsigned __int128)calibration.MaxDelta * larger > MAXLONGLONG);
+    }
+
+    for (UINT32 index = 0; index < DELTAS_PER_CHECK; index++) {
+        LONGLONG delta;
+        LONGLONG error;
+
+        if (index < 64) {
+            delta = index;
+        } else if (index < 128) {
+            delta = calibration.MaxDelta - (index - 64);
+        } else if (index < 192) {
+            delta = frequency * (index - 128);     // Whole seconds
+        } else {
+            delta = GetRandom(state) % (calibration.MaxDelta + 1);
+        }
+        error = ExactMicroseconds(delta, frequency) - ScaleCounterDelta(&calibration, delta);
+        CHECK(error >= 0);
+        CHECK(error <= (delta >> calibration.Shift) + 1);
+        maxError = max(maxError, error);
+    }
+    return maxError;
+}
+
+//----------------------------------------------------------------------------
+static double GetSeconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    // The 10 MHz rate Windows 10 reports for the invariant TSC, the ACPI PM
+    // timer, the HPET, a 1 kHz tick, and raw TSC rates
+    static const LONGLONG frequencies[] = {
+        10000000, 3579545, 14318180, 1000, 2400000000LL, 3700000000LL, 10000000000LL,
+    };
+    volatile LONGLONG frequency = 10000000;    // Keeps the compiler from folding the divide
+    CLOCK_CALIBRATION calibration;
+    LONGLONG          deltas[1024];
+    UINT64            state    = 1;
+    UINT64            checksum = 0;
+    double            start;
+    double            scaleTime;
+    double            divideTime;
+
+    for (UINT32 index = 0; index < sizeof(frequencies) / sizeof(frequencies[0]); index++) {
+        const LONGLONG maxError = CheckFrequency(frequencies[index], &state);
+
+        SetClockScale(&calibration, frequencies[index], HEADROOM);
+        printf("%12lld Hz: shift %2u, multiplier %12llu, at most %lld us behind over %d s\n",
+                (long long)frequencies[index], calibration.Shift,
+                (unsigned long long)calibration.Multiplier, (long long)maxError, HEADROOM);
+    }
+
+    // Windows reports 10 MHz on current systems, where the conversion must
+    // stay within a microsecond
+    CHECK(CheckFrequency(10000000, &state) <= 1);
+
+    for (UINT32 index = 0; index < RANDOM_FREQUENCIES; index++) {
+        CheckFrequency(1000 + GetRandom(&state) % 10000000000LL, &state);
+    }
+
+    SetClockScale(&calibration, 10000000, HEADROOM);
+    for (UINT32 index = 0; index < sizeof(deltas) / sizeof(deltas[0]); index++) {
+        deltas[index] = GetRandom(&state) % (calibration.MaxDelta + 1);
+    }
+    start = GetSeconds();
+    for (UINT32 index = 0; index < TIMED_CONVERSIONS; index++) {
+        checksum += ScaleCounterDelta(&calibration, deltas[index % 1024]);
+    }
+    scaleTime = GetSeconds() - start;
+    start = GetSeconds();
+    for (UINT32 index = 0; index < TIMED_CONVERSIONS; index++) {
+        checksum += ExactMicroseconds(deltas[index % 1024], frequency);
+    }
+    divideTime = GetSeconds() - start;
+
+    printf("Multiply-shift: %.2f ns per conversion\n", scaleTime / TIMED_CONVERSIONS * 1e9);
+    printf("128-bit divide: %.2f ns per conversion (checksum %llu)\n",
+            divideTime / TIMED_CONVERSIONS * 1e9, (unsigned long long)checksum);
+    return TEST_RESULT("clock");
+}
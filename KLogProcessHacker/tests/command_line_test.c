@@ -0,0 +1,275 @@
+//----------------------------------------------------------------------------
+// Host tests and throughput comparison for the command line parser
+//
+// Checks the driver's parser against a plain character-at-a-time parser on
+// known command lines and random ones built from the characters the rules
+// care about, then prints how fast each parses typical command lines.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "kph.h"
+#include "test.h"
+
+#define FUZZ_ITERATIONS   200000
+#define MAX_FUZZ_LENGTH   600
+#define MIN_PARSE_BYTES   (64 * 1024 * 1024)
+
+//----------------------------------------------------------------------------
+// Follows the same rules as ConvertCommandLineToArgv one character at a time,
+// writing to a separate buffer
+static UINT16 ReferenceConvert(const char *input, const UINT16 length, char *output)
+{
+    UINT16 inputIndex  = 0;
+    UINT16 outputIndex = 0;
+    bool   inQuote     = false;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    // The first argument only ends at a double quote if it starts with one,
+    // and otherwise at a space, tab, or newline
+    if (input[0] == '"') {
+        for (inputIndex = 1; (inputIndex < length) && (input[inputIndex] != '"'); inputIndex++) {
+            output[outputIndex++] = input[inputIndex];
+        }
+    } else {
+        for (; (inputIndex < length) && (input[inputIndex] != ' ') &&
+                (input[inputIndex] != '\t') && (input[inputIndex] != '\n'); inputIndex++) {
+            output[outputIndex++] = input[inputIndex];
+        }
+    }
+    if (inputIndex < length) {
+        output[outputIndex++] = '\0';
+        inputIndex++;
+    }
+
+    while (inputIndex < length) {
+        while ((inputIndex < length) &&
+                ((input[inputIndex] == ' ') || (input[inputIndex] == '\t'))) {
+            inputIndex++;
+        }
+        if (inputIndex >= length) {
+            break;
+        }
+        while (inputIndex < length) {
+            const char c = input[inputIndex];
+
+            if (c == '\\') {
+                UINT16 backslashes = 0;
+
+                while ((inputIndex < length) && (input[inputIndex] == '\\')) {
+                    backslashes++;
+                    inputIndex++;
+                }
+
+                // Backslashes before a double quote escape each other and the
+                // quote.  An unescaped quote is left for the next pass.
+                if ((inputIndex < length) && (input[inputIndex] == '"')) {
+                    for (UINT16 index = 0; index < backslashes / 2; index++) {
+                        output[outputIndex++] = '\\';
+                    }
+                    if (backslashes % 2) {
+                        output[outputIndex++] = '"';
+                        inputIndex++;
+                    }
+                } else {
+                    for (UINT16 index = 0; index < backslashes; index++) {
+                        output[outputIndex++] = '\\';
+                    }
+                }
+            } else if (c == '"') {
+                // Two double quotes in a double-quoted part are a literal one
+                if (inQuote && (inputIndex + 1 < length) && (input[inputIndex + 1] == '"')) {
+                    output[outputIndex++] = '"';
+                    inputIndex += 2;
+                    inQuote = false;
+                } else {
+                    inQuote = !inQuote;
+                    inputIndex++;
+                }
+            } else if (!inQuote && ((c == ' ') || (c == '\t'))) {
+                inputIndex++;
+                break;
+            } else {
+                output[outputIndex++] = c;
+                inputIndex++;
+            }
+        }
+        output[outputIndex++] = '\0';
+    }
+
+    if ((outputIndex == 0) || (output[outputIndex - 1] != '\0')) {
+        output[outputIndex++] = '\0';
+    }
+    return outputIndex;
+}
+
+//----------------------------------------------------------------------------
+static UINT16 ReferenceFindChar(const char *buffer, UINT16 index, const UINT16 length,
+        const char c0, const char c1, const char c2, const char c3)
+{
+    while ((index < length) && (buffer[index] != c0) && (buffer[index] != c1) &&
+            (buffer[index] != c2) && (buffer[index] != c3)) {
+        index++;
+    }
+    return index;
+}
+
+//----------------------------------------------------------------------------
+// The driver converts in place, so it needs a copy of the input with room for
+// the terminating null
+static bool IsSameConversion(const char *input, const UINT16 length)
+{
+    char   driver[MAX_FUZZ_LENGTH + 1];
+    char   reference[MAX_FUZZ_LENGTH + 1];
+    UINT16 driverLength;
+    UINT16 referenceLength;
+
+    memcpy(driver, input, length);
+    driverLength    = ConvertCommandLineToArgv(driver, length);
+    referenceLength = ReferenceConvert(input, length, reference);
+    if ((driverLength != referenceLength) || memcmp(driver, reference, driverLength)) {
+        fprintf(stderr, "Mismatch on command line [%.*s]\n", (int)length, input);
+        return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+static bool IsArgv(const char *commandLine, const char *argv, const UINT16 argvLength)
+{
+    char   buffer[256];
+    UINT16 length = (UINT16)strlen(commandLine);
+
+    memcpy(buffer, commandLine, length);
+    return (ConvertCommandLineToArgv(buffer, length) == argvLength) &&
+            !memcmp(buffer, argv, argvLength);
+}
+
+//----------------------------------------------------------------------------
+static UINT32 GetRandom(UINT32 *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return *state >> 8;
+}
+
+//----------------------------------------------------------------------------
+// Mostly plain characters, so runs are long enough for the word-at-a-time
+// scan, with the characters the rules care about mixed in
+static void FillRandom(char *buffer, const UINT16 length, UINT32 *state)
+{
+    static const char special[] = { ' ', '\t', '\n', '"', '"', '\\', '\\', '\0', (char)0xA0 };
+    const UINT32      density   = 1 + GetRandom(state) % 32;
+
+    for (UINT16 index = 0; index < length; index++) {
+        buffer[index] = (GetRandom(state) % density) ? (char)('a' + GetRandom(state) % 26) :
+                special[GetRandom(state) % sizeof(special)];
+    }
+}
+
+//----------------------------------------------------------------------------
+static double GetSeconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    static const char *typical[] = {
+        "\"C:\\Program Files\\Mozilla Firefox\\firefox.exe\" -contentproc --channel=\"5432."
+                "1.1234567\\1812312\" -childID 3 -isForBrowser -prefsLen 28745 "
+                "-prefMapSize 234567 -parentBuildID 20231201000000 -appDir "
+                "\"C:\\Program Files\\Mozilla Firefox\\browser\" 5432 true tab",
+        "C:\\Windows\\system32\\svchost.exe -k netsvcs -p -s Schedule",
+        "\"C:\\Windows\\System32\\WindowsPowerShell\\v1.0\\powershell.exe\" -NoProfile "
+                "-ExecutionPolicy Bypass -File \"C:\\Users\\user\\AppData\\Local\\Temp\\"
+                "install script.ps1\" -Verbose",
+        "C:\\Windows\\system32\\conhost.exe 0xffffffff -ForceV1",
+    };
+    char   buffer[MAX_FUZZ_LENGTH + 1];
+    char   output[MAX_FUZZ_LENGTH + 1];
+    UINT32 state    = 1;
+    UINT32 mismatch = 0;
+    UINT64 checksum = 0;
+    UINT64 bytes    = 0;
+    double driverTime;
+    double referenceTime;
+
+    // Cases from the documented C runtime rules
+    CHECK(IsArgv("", "", 0));
+    CHECK(IsArgv("a b c", "a\0b\0c", 6));
+    CHECK(IsArgv("\"a b\" c", "a b\0c", 6));
+    CHECK(IsArgv("a \"b c\" d", "a\0b c\0d", 8));
+    CHECK(IsArgv("a b\\\\\\\"c", "a\0b\\\"c", 7));
+    CHECK(IsArgv("a b\\\\\"c d\"", "a\0b\\c d", 8));
+    CHECK(IsArgv("a b\\c\\\\d", "a\0b\\c\\\\d", 9));
+    CHECK(IsArgv("a \"b\"\"c\" d", "a\0b\"c d", 8));
+    CHECK(IsArgv("C:\\dir\\x.exe\ta", "C:\\dir\\x.exe\0a", 15));
+    CHECK(IsArgv("\"C:\\a b\\x.exe\"y z", "C:\\a b\\x.exe\0y\0z", 17));
+    CHECK(IsArgv("a   ", "a", 2));
+
+    // Every starting index and length around the word size
+    for (UINT16 length = 0; length < 40; length++) {
+        FillRandom(buffer, length, &state);
+        for (UINT16 index = 0; index <= length; index++) {
+            CHECK(FindCommandLineChar(buffer, index, length, '"', '\\', ' ', '\t') ==
+                    ReferenceFindChar(buffer, index, length, '"', '\\', ' ', '\t'));
+            CHECK(FindCommandLineChar(buffer, index, length, (char)0xA0, (char)0xA0,
+                    '\0', '\0') == ReferenceFindChar(buffer, index, length, (char)0xA0,
+                    (char)0xA0, '\0', '\0'));
+        }
+    }
+
+    for (UINT32 iteration = 0; iteration < FUZZ_ITERATIONS; iteration++) {
+        const UINT16 length = (UINT16)(GetRandom(&state) %
+                ((iteration % 16) ? 64 : MAX_FUZZ_LENGTH));
+
+        FillRandom(buffer, length, &state);
+        if (!IsSameConversion(buffer, length) && (++mismatch >= 10)) {
+            break;
+        }
+    }
+    CHECK(mismatch == 0);
+
+    // Time both parsers on typical command lines, copying the input each time
+    // since the driver parses in place
+    {
+        const UINT32 passes = MIN_PARSE_BYTES / 512;
+        double       start  = GetSeconds();
+
+        for (UINT32 pass = 0; pass < passes; pass++) {
+            const char   *line   = typical[pass % (sizeof(typical) / sizeof(typical[0]))];
+            const UINT16  length = (UINT16)strlen(line);
+            memcpy(buffer, line, length);
+            checksum += ConvertCommandLineToArgv(buffer, length) + buffer[length / 2];
+            bytes    += length;
+        }
+        driverTime = GetSeconds() - start;
+
+        start = GetSeconds();
+        for (UINT32 pass = 0; pass < passes; pass++) {
+            const char   *line   = typical[pass % (sizeof(typical) / sizeof(typical[0]))];
+            const UINT16  length = (UINT16)strlen(line);
+            memcpy(buffer, line, length);
+            checksum += ReferenceConvert(buffer, length, output) + output[length / 2];
+        }
+        referenceTime = GetSeconds() - start;
+    }
+
+    printf("%u random command lines matched the reference parser\n", FUZZ_ITERATIONS);
+    printf("Driver parser:    %8.1f MB/s\n", bytes / driverTime / 1e6);
+    printf("Reference parser: %8.1f MB/s (checksum %llu)\n", bytes / referenceTime / 1e6,
+            (unsigned long long)checksum);
+    return TEST_RESULT("command_line");
+}
@@ -0,0 +1,382 @@
+//----------------------------------------------------------------------------
+// Host tests and throughput comparison for compact process records
+//
+// Converts a trace of process blocks with the driver's conversion, checks
+// that a reader gets the same process details from both formats, and
+// prints how fast a reader parses each format.  Pass the path of a PCAP-NG
+// file recorded from the driver to use it instead of the synthetic trace:
+//
+//   compact_record_test trace.pcapng
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "kph.h"
+#include "test.h"
+
+#define SYNTHETIC_PROCESSES  4096
+#define MIN_PARSE_BYTES      (64 * 1024 * 1024)
+
+// Process details a reader takes from either format
+typedef struct PROCESS_SUMMARY {
+    UINT32      Ended;
+    UINT32      ProcessId;
+    UINT32      ParentProcessId;
+    UINT32      ExitStatus;
+    const char *Strings[3];        // Path, raw args, SID
+    UINT16      Lengths[3];
+} PROCESS_SUMMARY;
+
+// Buffer that blocks or records are appended to
+typedef struct STREAM {
+    char   *Data;
+    UINT32  Length;
+    UINT32  Size;
+} STREAM;
+
+//----------------------------------------------------------------------------
+static char *Reserve(STREAM *stream, const UINT32 length)
+{
+    char *data;
+
+    if (stream->Length + length > stream->Size) {
+        stream->Size = (stream->Size + length) * 2;
+        stream->Data = realloc(stream->Data, stream->Size);
+        if (!stream->Data) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    data = stream->Data + stream->Length;
+    stream->Length += length;
+    return data;
+}
+
+//----------------------------------------------------------------------------
+static void AppendOption(
+    STREAM       *stream,
+    const UINT16  code,
+    const void   *value,
+    const UINT16  length)
+{
+    PCAP_NG_OPTION_HEADER *option = (PCAP_NG_OPTION_HEADER*)Reserve(stream,
+            sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(length));
+
+    option->OptionCode   = code;
+    option->OptionLength = length;
+    memset(option + 1, 0, PCAP_NG_PADDING(length));
+    memcpy(option + 1, value, length);
+}
+
+//----------------------------------------------------------------------------
+// Builds a process block laid out like the driver's, with an argv list and a
+// raw command line that hold the same arguments
+static void AppendProcessBlock(STREAM *stream, const UINT32 index, const bool ended)
+{
+    const UINT32            start  = stream->Length;
+    PCAP_NG_PROCESS_HEADER *header;
+    char                    path[128];
+    char                    args[256];
+    char                    argv[256];
+    const char             *sid    = "S-1-5-21-3623811015-3361044348-30300820-1013";
+    const UINT64            sequence = index * 2 + ended;
+    UINT32                  argvLength;
+
+    snprintf(path, sizeof(path), "C:\\Program Files\\Vendor %u\\bin\\tool%u.exe",
+            index % 37, index % 11);
+    snprintf(args, sizeof(args), "\"%s\" --input C:\\Users\\user\\data%u.txt --verbose",
+            path, index);
+    argvLength = (UINT32)snprintf(argv, sizeof(argv), "%s", path) + 1;
+    argvLength += (UINT32)snprintf(argv + argvLength, sizeof(argv) - argvLength,
+            "--input") + 1;
+    argvLength += (UINT32)snprintf(argv + argvLength, sizeof(argv) - argvLength,
+            "C:\\Users\\user\\data%u.txt", index) + 1;
+
+    header = (PCAP_NG_PROCESS_HEADER*)Reserve(stream, sizeof(PCAP_NG_PROCESS_HEADER));
+    header->BlockType                    = ProcessBlock;
+    header->ProcessId                    = 4 + index * 4;
+    header->TimestampHigh                = 0x0005;
+    header->TimestampLow                 = index;
+    header->ParentPidHeader.OptionCode   = 5;
+    header->ParentPidHeader.OptionLength = sizeof(UINT32);
+    header->ParentPid                    = 4 + (index / 8) * 4;
+    if (ended) {
+        const UINT32 event      = 0xFFFFFFFF;
+        const UINT32 exitStatus = index % 3;
+
+        AppendOption(stream, 2, &event, sizeof(event));
+        AppendOption(stream, 12, &exitStatus, sizeof(exitStatus));
+    }
+    AppendOption(stream, 3, path, (UINT16)strlen(path));
+    AppendOption(stream, 4, argv, (UINT16)argvLength);
+    AppendOption(stream, 10, sid, (UINT16)strlen(sid));
+    AppendOption(stream, 11, args, (UINT16)strlen(args));
+    AppendOption(stream, 259, &sequence, sizeof(sequence));
+    AppendOption(stream, 0, NULL, 0);
+    *(UINT32*)Reserve(stream, sizeof(UINT32)) = stream->Length - start;
+
+    // Reserve can move the stream, so find the header again
+    header = (PCAP_NG_PROCESS_HEADER*)(stream->Data + start);
+    header->BlockLength = stream->Length - start;
+}
+
+//----------------------------------------------------------------------------
+static bool LoadTrace(STREAM *stream, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    long  length;
+
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if ((length <= 0) ||
+            (fread(Reserve(stream, (UINT32)length), 1, length, file) != (size_t)length)) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// Converts each process block in a PCAP-NG stream, as a compact reader does
+static UINT32 ConvertTrace(const STREAM *trace, STREAM *records)
+{
+    UINT32 offset  = 0;
+    UINT32 count   = 0;
+
+    records->Length = 0;
+    while (offset + 2 * sizeof(UINT32) <= trace->Length) {
+        const char   *block       = trace->Data + offset;
+        const UINT32  blockLength = ((const UINT32*)block)[1];
+
+        if ((blockLength < 12) || (offset + blockLength > trace->Length)) {
+            break;
+        }
+        if ((((const UINT32*)block)[0] == ProcessBlock) &&
+                (blockLength >= sizeof(PCAP_NG_PROCESS_HEADER) + sizeof(UINT32))) {
+            const PCAP_NG_PROCESS_HEADER *header = (const PCAP_NG_PROCESS_HEADER*)block;
+            char   *record = Reserve(records, blockLength);
+            UINT32  length = BuildCompactRecord(block, blockLength, count,
+                    ((UINT64)header->TimestampHigh << 32) | header->TimestampLow, record);
+
+            CHECK(length <= blockLength);
+            CHECK(length % 4 == 0);
+            records->Length -= blockLength - length;
+            count++;
+        }
+        offset += blockLength;
+    }
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// Reads the process details from each process block in a PCAP-NG stream, the
+// way a PCAP-NG reader must: walk every block and every option
+static UINT32 ParsePcapNg(
+    const STREAM    *trace,
+    PROCESS_SUMMARY *summaries,
+    UINT64          *checksum)
+{
+    UINT32 offset = 0;
+    UINT32 count  = 0;
+
+    while (offset + 2 * sizeof(UINT32) <= trace->Length) {
+        const char   *block       = trace->Data + offset;
+        const UINT32  blockLength = ((const UINT32*)block)[1];
+
+        if ((blockLength < 12) || (offset + blockLength > trace->Length)) {
+            break;
+        }
+        if ((((const UINT32*)block)[0] == ProcessBlock) &&
+                (blockLength >= sizeof(PCAP_NG_PROCESS_HEADER) + sizeof(UINT32))) {
+            PROCESS_SUMMARY summary;
+            UINT32          option = 5 * sizeof(UINT32);
+
+            memset(&summary, 0, sizeof(summary));
+            summary.ProcessId = ((const UINT32*)block)[2];
+            while (option + sizeof(PCAP_NG_OPTION_HEADER) <= blockLength - sizeof(UINT32)) {
+                const PCAP_NG_OPTION_HEADER *header = (const PCAP_NG_OPTION_HEADER*)(block + option);
+                const char                  *value  = (const char*)(header + 1);
+
+                if (!header->OptionCode) {
+                    break;
+                }
+                switch (header->OptionCode) {
+                case 2:  summary.Ended = 1; break;
+                case 3:  summary.Strings[0] = value; summary.Lengths[0] = header->OptionLength; break;
+                case 5:  summary.ParentProcessId = *(const UINT32*)value; break;
+                case 10: summary.Strings[2] = value; summary.Lengths[2] = header->OptionLength; break;
+                case 11: summary.Strings[1] = value; summary.Lengths[1] = header->OptionLength; break;
+                case 12: summary.ExitStatus = *(const UINT32*)value; break;
+                }
+                option += sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(header->OptionLength);
+            }
+            *checksum += summary.ProcessId + summary.Lengths[0] + summary.Lengths[1];
+            if (summaries) {
+                summaries[count] = summary;
+            }
+            count++;
+        }
+        offset += blockLength;
+    }
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// Reads the process details from a stream of compact records
+static UINT32 ParseCompact(
+    const STREAM    *records,
+    PROCESS_SUMMARY *summaries,
+    UINT64          *checksum)
+{
+    UINT32 offset = 0;
+    UINT32 count  = 0;
+
+    while (offset + sizeof(COMPACT_RECORD) <= records->Length) {
+        const COMPACT_RECORD *record = (const COMPACT_RECORD*)(records->Data + offset);
+        PROCESS_SUMMARY       summary;
+        UINT32                string = sizeof(COMPACT_RECORD);
+
+        if ((record->RecordLength < sizeof(COMPACT_RECORD)) ||
+                (offset + record->RecordLength > records->Length)) {
+            break;
+        }
+        summary.Ended           = (record->RecordType == CompactProcessEnded);
+        summary.ProcessId       = record->ProcessId;
+        summary.ParentProcessId = record->ParentProcessId;
+        summary.ExitStatus      = record->ExitStatus;
+        for (UINT32 index = 0; index < 3; index++) {
+            summary.Lengths[index] = *(const UINT16*)((const char*)record + string);
+            summary.Strings[index] = summary.Lengths[index] ?
+                    (const char*)record + string + sizeof(UINT16) : NULL;
+            string += sizeof(UINT16) + summary.Lengths[index];
+        }
+        *checksum += summary.ProcessId + summary.Lengths[0] + summary.Lengths[1];
+        if (summaries) {
+            summaries[count] = summary;
+        }
+        offset += record->RecordLength;
+        count++;
+    }
+    return count;
+}
+
+//----------------------------------------------------------------------------
+static bool IsSameString(const PROCESS_SUMMARY *left, const PROCESS_SUMMARY *right,
+        const UINT32 index)
+{
+    return (left->Lengths[index] == right->Lengths[index]) &&
+            (!left->Lengths[index] ||
+             !memcmp(left->Strings[index], right->Strings[index], left->Lengths[index]));
+}
+
+//----------------------------------------------------------------------------
+static double GetSeconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//----------------------------------------------------------------------------
+// Parses the stream until at least MIN_PARSE_BYTES were parsed
+static double TimeParse(
+    UINT32      (*parse)(const STREAM*, PROCESS_SUMMARY*, UINT64*),
+    const STREAM *stream,
+    UINT64       *checksum)
+{
+    const UINT32 passes = MIN_PARSE_BYTES / stream->Length + 1;
+    const double start  = GetSeconds();
+
+    for (UINT32 pass = 0; pass < passes; pass++) {
+        parse(stream, NULL, checksum);
+    }
+    return (GetSeconds() - start) / passes;
+}
+
+//----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+    STREAM           trace   = { NULL, 0, 0 };
+    STREAM           records = { NULL, 0, 0 };
+    PROCESS_SUMMARY *pcapNg;
+    PROCESS_SUMMARY *compact;
+    UINT32           count;
+    UINT64           checksum = 0;
+    double           pcapNgTime;
+    double           compactTime;
+    double           convertTime;
+
+    if (argc > 1) {
+        if (!LoadTrace(&trace, argv[1])) {
+            return 1;
+        }
+    } else {
+        for (UINT32 index = 0; index < SYNTHETIC_PROCESSES; index++) {
+            AppendProcessBlock(&trace, index, false);
+            AppendProcessBlock(&trace, index, true);
+        }
+    }
+
+    count = ConvertTrace(&trace, &records);
+    CHECK(count > 0);
+
+    // A reader must get the same details from both formats
+    pcapNg  = calloc(count, sizeof(PROCESS_SUMMARY));
+    compact = calloc(count, sizeof(PROCESS_SUMMARY));
+    if (!pcapNg || !compact) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    CHECK(ParsePcapNg(&trace, pcapNg, &checksum) == count);
+    CHECK(ParseCompact(&records, compact, &checksum) == count);
+    for (UINT32 index = 0; index < count; index++) {
+        CHECK(pcapNg[index].Ended == compact[index].Ended);
+        CHECK(pcapNg[index].ProcessId == compact[index].ProcessId);
+        CHECK(pcapNg[index].ParentProcessId == compact[index].ParentProcessId);
+        CHECK(pcapNg[index].ExitStatus == compact[index].ExitStatus);
+        CHECK(IsSameString(&pcapNg[index], &compact[index], 0));
+        CHECK(IsSameString(&pcapNg[index], &compact[index], 1));
+        CHECK(IsSameString(&pcapNg[index], &compact[index], 2));
+    }
+
+    // Time the conversion the driver does for compact readers, then how fast
+    // a reader parses each format
+    {
+        const UINT32 passes = MIN_PARSE_BYTES / trace.Length + 1;
+        const double start  = GetSeconds();
+
+        for (UINT32 pass = 0; pass < passes; pass++) {
+            ConvertTrace(&trace, &records);
+        }
+        convertTime = (GetSeconds() - start) / passes;
+    }
+    pcapNgTime  = TimeParse(ParsePcapNg, &trace, &checksum);
+    compactTime = TimeParse(ParseCompact, &records, &checksum);
+
+    printf("%u process records (checksum %llu)\n", count, (unsigned long long)checksum);
+    printf("PCAP-NG: %10u bytes, %8.1f bytes/record, parsed at %8.2f M records/s\n",
+            trace.Length, (double)trace.Length / count, count / pcapNgTime / 1e6);
+    printf("Compact: %10u bytes, %8.1f bytes/record, parsed at %8.2f M records/s\n",
+            records.Length, (double)records.Length / count, count / compactTime / 1e6);
+    printf("Driver conversion to compact records: %.2f M records/s\n",
+            count / convertTime / 1e6);
+
+    free(pcapNg);
+    free(compact);
+    free(trace.Data);
+    free(records.Data);
+    return TEST_RESULT("compact_record");
+}
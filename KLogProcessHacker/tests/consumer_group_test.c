@@ -0,0 +1,88 @@
+//----------------------------------------------------------------------------
+// Host tests for the consumer group split
+//
+// Simulates the IDs a group sees and checks that each member gets a fair
+// share, and how many IDs change members when the group grows.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+#include "test.h"
+
+#define NUM_IDS    100000
+#define MAX_GROUP  8
+
+//----------------------------------------------------------------------------
+static void TestSingleMember(void)
+{
+    UINT32 id;
+
+    for (id = 0; id < NUM_IDS; id++) {
+        CHECK(GetConsumerGroupMember(id, 1) == 0);
+    }
+    CHECK(GetConsumerGroupMember(0xFFFFFFFF, 1) == 0);
+}
+
+//----------------------------------------------------------------------------
+// Process IDs are multiples of 4 and connection IDs count up from 1.  Each
+// member must get within 2% of an even share of either.
+static void TestFairness(const UINT32 first, const UINT32 step)
+{
+    UINT32 groupSize;
+
+    for (groupSize = 2; groupSize <= MAX_GROUP; groupSize++) {
+        UINT32 counts[MAX_GROUP] = {0};
+        UINT32 expected          = NUM_IDS / groupSize;
+        UINT32 member;
+        UINT32 index;
+
+        for (index = 0; index < NUM_IDS; index++) {
+            member = GetConsumerGroupMember(first + index * step, groupSize);
+            CHECK(member < groupSize);
+            if (member < groupSize) {
+                counts[member]++;
+            }
+        }
+        for (member = 0; member < groupSize; member++) {
+            CHECK(counts[member] > expected - expected / 50);
+            CHECK(counts[member] < expected + expected / 50);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// A reader that joins is added at the end of the group, so the existing
+// members keep their numbers.  About half of the IDs still move.
+static void TestJoinMovesHalf(void)
+{
+    UINT32 groupSize;
+
+    for (groupSize = 1; groupSize < MAX_GROUP; groupSize++) {
+        UINT32 moved = 0;
+        UINT32 index;
+
+        for (index = 0; index < NUM_IDS; index++) {
+            const UINT32 id = 4 + index * 4;
+
+            if (GetConsumerGroupMember(id, groupSize) !=
+                    GetConsumerGroupMember(id, groupSize + 1)) {
+                moved++;
+            }
+        }
+        CHECK(moved > NUM_IDS * 45 / 100);
+        CHECK(moved < NUM_IDS * 55 / 100);
+    }
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    TestSingleMember();
+    TestFairness(4, 4);
+    TestFairness(1, 1);
+    TestJoinMovesHalf();
+    return TEST_RESULT("consumer_group");
+}
@@ -0,0 +1,203 @@
+//----------------------------------------------------------------------------
+// Host tests for the hashed ID filter sets
+//
+// Also prints how long a lookup in a 10,000 ID filter takes, against the
+// linear scan of the ID list that the read path used to do for every block.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "kph.h"
+#include "test.h"
+
+#define BENCHMARK_IDS      10000
+#define LOOKUP_IDS         1024                  // IDs to look up, in turn
+#define HASHED_LOOKUPS     (4096 * LOOKUP_IDS)
+#define SCANNED_LOOKUPS    (20 * LOOKUP_IDS)
+
+//----------------------------------------------------------------------------
+static ID_FILTER *CreateFilter(const UINT32 *ids, const UINT32 numIds)
+{
+    ID_FILTER *filter = malloc(GetIdFilterSize(numIds));
+
+    if (filter) {
+        InitIdFilter(filter, ids, numIds);
+    }
+    return filter;
+}
+
+//----------------------------------------------------------------------------
+static void TestSlots(void)
+{
+    CHECK(GetIdFilterSlots(0) == 2);
+    CHECK(GetIdFilterSlots(1) == 2);
+    CHECK(GetIdFilterSlots(2) == 4);
+    CHECK(GetIdFilterSlots(3) == 8);
+    CHECK(GetIdFilterSlots(1000) == 2048);
+    CHECK(GetIdFilterSize(3) == FIELD_OFFSET(ID_FILTER, Slots) + 8 * sizeof(UINT32));
+}
+
+//----------------------------------------------------------------------------
+static void TestEmptyFilter(void)
+{
+    ID_FILTER *filter = CreateFilter(NULL, 0);
+
+    CHECK(filter && (filter->Count == 0));
+    if (filter) {
+        CHECK(!IsIdInFilter(filter, 0));
+        CHECK(!IsIdInFilter(filter, 4));
+        CHECK(!IsIdInFilter(filter, ID_FILTER_EMPTY));
+    }
+    free(filter);
+}
+
+//----------------------------------------------------------------------------
+// ID_FILTER_EMPTY marks unused slots, so the set keeps it out of the table
+static void TestDuplicatesAndEmptyId(void)
+{
+    static const UINT32 ids[] = { 8, 4, 8, ID_FILTER_EMPTY, 4, 0 };
+    ID_FILTER *filter = CreateFilter(ids, sizeof(ids) / sizeof(ids[0]));
+
+    CHECK(filter != NULL);
+    if (filter) {
+        CHECK(filter->Count == 3);
+        CHECK(filter->HasEmpty);
+        CHECK(IsIdInFilter(filter, 0));
+        CHECK(IsIdInFilter(filter, 4));
+        CHECK(IsIdInFilter(filter, 8));
+        CHECK(IsIdInFilter(filter, ID_FILTER_EMPTY));
+        CHECK(!IsIdInFilter(filter, 12));
+    }
+    free(filter);
+}
+
+//----------------------------------------------------------------------------
+// Process IDs are multiples of 4, which is the case the hash folds for
+static void TestLargeProcessIdSet(void)
+{
+    enum { NumIds = 50000 };
+    UINT32    *ids    = malloc(NumIds * sizeof(UINT32));
+    ID_FILTER *filter = NULL;
+    UINT32     found  = 0;
+
+    CHECK(ids != NULL);
+    if (ids) {
+        for (UINT32 index = 0; index < NumIds; index++) {
+            ids[index] = index * 8;
+        }
+        filter = CreateFilter(ids, NumIds);
+    }
+    CHECK(filter != NULL);
+    if (filter) {
+        CHECK(filter->Count == NumIds);
+        for (UINT32 id = 0; id < NumIds * 8; id += 4) {
+            const bool expected = (id % 8) == 0;
+            if (IsIdInFilter(filter, id) == expected) {
+                found++;
+            }
+        }
+        CHECK(found == NumIds * 2);
+    }
+    free(filter);
+    free(ids);
+}
+
+//----------------------------------------------------------------------------
+static UINT32 GetRandom(UINT32 *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return *state >> 8;
+}
+
+//----------------------------------------------------------------------------
+static double GetSeconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//----------------------------------------------------------------------------
+static bool IsIdInList(const UINT32 *ids, const UINT32 numIds, const UINT32 id)
+{
+    for (UINT32 index = 0; index < numIds; index++) {
+        if (ids[index] == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//----------------------------------------------------------------------------
+// Random process IDs below 400,000, so about half the lookups hit, and
+// lookups that miss scan the whole list
+static void BenchmarkLookups(void)
+{
+    UINT32    *ids     = malloc(BENCHMARK_IDS * sizeof(UINT32));
+    UINT32    *lookups = malloc(LOOKUP_IDS * sizeof(UINT32));
+    ID_FILTER *filter  = NULL;
+    UINT32     state   = 1;
+    UINT32     hits    = 0;
+    UINT32     scanned = 0;
+    double     start;
+    double     hashTime;
+    double     scanTime;
+
+    if (!ids || !lookups) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (UINT32 index = 0; index < BENCHMARK_IDS; index++) {
+        ids[index] = (GetRandom(&state) % 100000) * 4;
+    }
+    filter = CreateFilter(ids, BENCHMARK_IDS);
+    CHECK(filter != NULL);
+    if (!filter) {
+        return;
+    }
+
+    // Half from the list and half random, so the hit rate does not depend
+    // on how many random IDs repeat
+    for (UINT32 index = 0; index < LOOKUP_IDS; index++) {
+        lookups[index] = (index % 2) ? ids[GetRandom(&state) % BENCHMARK_IDS] :
+                (GetRandom(&state) % 100000) * 4;
+        CHECK(IsIdInFilter(filter, lookups[index]) ==
+                IsIdInList(ids, BENCHMARK_IDS, lookups[index]));
+    }
+
+    start = GetSeconds();
+    for (UINT32 index = 0; index < HASHED_LOOKUPS; index++) {
+        hits += IsIdInFilter(filter, lookups[index % LOOKUP_IDS]);
+    }
+    hashTime = GetSeconds() - start;
+    start = GetSeconds();
+    for (UINT32 index = 0; index < SCANNED_LOOKUPS; index++) {
+        scanned += IsIdInList(ids, BENCHMARK_IDS, lookups[index % LOOKUP_IDS]);
+    }
+    scanTime = GetSeconds() - start;
+    CHECK(hits / (HASHED_LOOKUPS / LOOKUP_IDS) == scanned / (SCANNED_LOOKUPS / LOOKUP_IDS));
+
+    printf("%u IDs, %u of %u lookups hit:\n", BENCHMARK_IDS, scanned, SCANNED_LOOKUPS);
+    printf("Hashed set:  %10.1f ns per lookup\n", hashTime / HASHED_LOOKUPS * 1e9);
+    printf("Linear scan: %10.1f ns per lookup\n", scanTime / SCANNED_LOOKUPS * 1e9);
+    free(filter);
+    free(lookups);
+    free(ids);
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    TestSlots();
+    TestEmptyFilter();
+    TestDuplicatesAndEmptyId();
+    TestLargeProcessIdSet();
+    BenchmarkLookups();
+    return TEST_RESULT("id_filter");
+}
@@ -0,0 +1,1227 @@
+//----------------------------------------------------------------------------
+// Host implementations of the kernel APIs declared in kernel/kph.h
+//
+// Spin locks and fast mutexes spin with sched_yield, so they also work on a
+// single processor.  One thread runs queued DPCs in order, another fires
+// timers once a millisecond, and each work item gets its own thread.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define HOST_PROCESSOR_COUNT  64        // Processors KeQueryMaximumProcessorCountEx reports
+#define HOST_COUNTER_FREQUENCY 10000000 // Performance counter ticks per second
+#define HOST_TIME_INCREMENT   156250    // Clock tick in 100ns units
+#define HOST_TIMER_PERIOD_NS  1000000   // Timer thread resolution
+#define HOST_REGISTRY_VALUES  16        // Registry values HostSetRegistryDword can hold
+#define HOST_REGISTRY_DATA    16        // Largest registry value in bytes
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+typedef struct HOST_REGISTRY_VALUE {
+    char   Name[32];
+    ULONG  Type;
+    ULONG  Length;
+    UINT8  Data[HOST_REGISTRY_DATA];
+} HOST_REGISTRY_VALUE;
+
+// What a system thread handle points to
+typedef struct HOST_SYSTEM_THREAD {
+    pthread_t       Thread;
+    KSTART_ROUTINE *Routine;
+    void           *Context;
+} HOST_SYSTEM_THREAD;
+
+typedef struct HOST_WORK_ITEM {
+    IO_WORKITEM         *WorkItem;
+    IO_WORKITEM_ROUTINE *Routine;
+    void                *Context;
+} HOST_WORK_ITEM;
+
+//----------------------------------------------------------------------------
+// Global variables
+//----------------------------------------------------------------------------
+
+static pthread_mutex_t     gDpcMutex        = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      gDpcQueued       = PTHREAD_COND_INITIALIZER;  // Signaled when a DPC is queued
+static pthread_cond_t      gDpcIdle         = PTHREAD_COND_INITIALIZER;  // Signaled when the DPC queue drains
+static LIST_ENTRY          gDpcQueue        = { &gDpcQueue, &gDpcQueue };
+static bool                gDpcRunning      = false;                     // True while a DPC routine runs
+static pthread_t           gDpcThread;
+static pthread_mutex_t     gTimerMutex      = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY          gTimerList       = { &gTimerList, &gTimerList };
+static pthread_t           gTimerThread;
+static volatile bool       gStopping        = false;                     // True once HostStopKernel runs
+static bool                gStarted         = false;                     // True once HostStartKernel runs
+static pthread_mutex_t     gEventMutex      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      gEventSet        = PTHREAD_COND_INITIALIZER;  // Broadcast when any event is set
+static pthread_mutex_t     gRegistryMutex   = PTHREAD_MUTEX_INITIALIZER;
+static HOST_REGISTRY_VALUE gRegistry[HOST_REGISTRY_VALUES];
+static UINT32              gRegistryCount   = 0;
+static volatile SIZE_T     gPoolBytes       = 0;
+static volatile SIZE_T     gPeakPoolBytes   = 0;
+static volatile LONG       gNextProcessor   = 0;
+static volatile LONG       gNextThreadId    = 4;
+static char                gProcess;                                     // Only process the harness has
+static POBJECT_TYPE        gEventObjectType = NULL;
+POBJECT_TYPE              *ExEventObjectType = &gEventObjectType;
+
+static __thread KIRQL      tIrql            = PASSIVE_LEVEL;
+static __thread LONG       tProcessor       = -1;
+static __thread LONG       tThreadId        = 0;
+static __thread char       tThread;                                      // Address is the thread's PETHREAD
+
+//----------------------------------------------------------------------------
+// Threads, IRQL, and time
+//----------------------------------------------------------------------------
+
+static inline KIRQL RaiseIrql(__in const KIRQL irql)
+{
+    const KIRQL oldIrql = tIrql;
+    if (irql > tIrql) {
+        tIrql = irql;
+    }
+    return oldIrql;
+}
+
+//----------------------------------------------------------------------------
+static inline LONGLONG GetMonotonicTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (LONGLONG)now.tv_sec * 10000000 + now.tv_nsec / 100;
+}
+
+//----------------------------------------------------------------------------
+KIRQL KeGetCurrentIrql(void)
+{
+    return tIrql;
+}
+
+//----------------------------------------------------------------------------
+// Threads take processor numbers in the order they first ask for one
+ULONG KeGetCurrentProcessorNumberEx(PROCESSOR_NUMBER *number)
+{
+    if (tProcessor < 0) {
+        tProcessor = (InterlockedIncrement(&gNextProcessor) - 1) % HOST_PROCESSOR_COUNT;
+    }
+    if (number) {
+        number->Group    = 0;
+        number->Number   = (UCHAR)tProcessor;
+        number->Reserved = 0;
+    }
+    return (ULONG)tProcessor;
+}
+
+//----------------------------------------------------------------------------
+ULONG KeQueryMaximumProcessorCountEx(USHORT groupNumber)
+{
+    UNREFERENCED_PARAMETER(groupNumber);
+    return HOST_PROCESSOR_COUNT;
+}
+
+//----------------------------------------------------------------------------
+LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER *frequency)
+{
+    LARGE_INTEGER counter;
+
+    if (frequency) {
+        frequency->QuadPart = HOST_COUNTER_FREQUENCY;
+    }
+    counter.QuadPart = GetMonotonicTime();
+    return counter;
+}
+
+//----------------------------------------------------------------------------
+void KeQuerySystemTime(LARGE_INTEGER *time)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    time->QuadPart = ((LONGLONG)now.tv_sec + 11644473600LL) * 10000000 +
+            now.tv_nsec / 100;
+}
+
+//----------------------------------------------------------------------------
+void KeQueryTickCount(LARGE_INTEGER *tickCount)
+{
+    tickCount->QuadPart = GetMonotonicTime() / HOST_TIME_INCREMENT;
+}
+
+//----------------------------------------------------------------------------
+ULONG KeQueryTimeIncrement(void)
+{
+    return HOST_TIME_INCREMENT;
+}
+
+//----------------------------------------------------------------------------
+PEPROCESS PsGetCurrentProcess(void)
+{
+    return (PEPROCESS)&gProcess;
+}
+
+//----------------------------------------------------------------------------
+PETHREAD PsGetCurrentThread(void)
+{
+    return (PETHREAD)&tThread;
+}
+
+//----------------------------------------------------------------------------
+HANDLE PsGetCurrentThreadId(void)
+{
+    if (!tThreadId) {
+        tThreadId = InterlockedExchangeAdd(&gNextThreadId, 4);
+    }
+    return (HANDLE)(ULONG_PTR)tThreadId;
+}
+
+//----------------------------------------------------------------------------
+// Only takes relative intervals
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE mode, BOOLEAN alertable,
+        LARGE_INTEGER *interval)
+{
+    const LONGLONG  wait  = (interval->QuadPart < 0) ? -interval->QuadPart : 0;
+    struct timespec delay = { (time_t)(wait / 10000000), (long)(wait % 10000000) * 100 };
+
+    UNREFERENCED_PARAMETER(mode);
+    UNREFERENCED_PARAMETER(alertable);
+    nanosleep(&delay, NULL);
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+static void* RunSystemThread(void *context)
+{
+    HOST_SYSTEM_THREAD *thread = (HOST_SYSTEM_THREAD*)context;
+
+    thread->Routine(thread->Context);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// The handle is the thread itself, so ZwWaitForSingleObject can join it and
+// ZwClose frees it
+NTSTATUS PsCreateSystemThread(HANDLE *threadHandle, ULONG access, void *objectAttributes,
+        HANDLE processHandle, void *clientId, KSTART_ROUTINE *startRoutine, void *startContext)
+{
+    HOST_SYSTEM_THREAD *thread = (HOST_SYSTEM_THREAD*)malloc(sizeof(HOST_SYSTEM_THREAD));
+
+    UNREFERENCED_PARAMETER(access);
+    UNREFERENCED_PARAMETER(objectAttributes);
+    UNREFERENCED_PARAMETER(processHandle);
+    UNREFERENCED_PARAMETER(clientId);
+    if (!thread) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    thread->Routine = startRoutine;
+    thread->Context = startContext;
+    if (pthread_create(&thread->Thread, NULL, RunSystemThread, thread)) {
+        free(thread);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    *threadHandle = (HANDLE)thread;
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS PsTerminateSystemThread(NTSTATUS exitStatus)
+{
+    UNREFERENCED_PARAMETER(exitStatus);
+    pthread_exit(NULL);
+}
+
+//----------------------------------------------------------------------------
+// Only closes thread handles from PsCreateSystemThread
+NTSTATUS ZwClose(HANDLE handle)
+{
+    free(handle);
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+// Only waits on thread handles from PsCreateSystemThread, without a timeout
+NTSTATUS ZwWaitForSingleObject(HANDLE handle, BOOLEAN alertable, LARGE_INTEGER *timeout)
+{
+    UNREFERENCED_PARAMETER(alertable);
+    UNREFERENCED_PARAMETER(timeout);
+    pthread_join(((HOST_SYSTEM_THREAD*)handle)->Thread, NULL);
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+void KeStackAttachProcess(PEPROCESS process, KAPC_STATE *apcState)
+{
+    UNREFERENCED_PARAMETER(process);
+    UNREFERENCED_PARAMETER(apcState);
+}
+
+//----------------------------------------------------------------------------
+void KeUnstackDetachProcess(KAPC_STATE *apcState)
+{
+    UNREFERENCED_PARAMETER(apcState);
+}
+
+//----------------------------------------------------------------------------
+// Spin locks and fast mutexes
+//----------------------------------------------------------------------------
+
+// The lock profiler reads the lock value, so keep it non-zero while held
+static inline void SpinAcquire(__in KSPIN_LOCK *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            sched_yield();
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+static inline void SpinRelease(__in KSPIN_LOCK *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+//----------------------------------------------------------------------------
+void KeAcquireInStackQueuedSpinLock(KSPIN_LOCK *lock, KLOCK_QUEUE_HANDLE *handle)
+{
+    handle->Lock    = lock;
+    handle->OldIrql = RaiseIrql(DISPATCH_LEVEL);
+    SpinAcquire(lock);
+}
+
+//----------------------------------------------------------------------------
+void KeAcquireSpinLock(KSPIN_LOCK *lock, KIRQL *oldIrql)
+{
+    *oldIrql = RaiseIrql(DISPATCH_LEVEL);
+    SpinAcquire(lock);
+}
+
+//----------------------------------------------------------------------------
+void KeInitializeSpinLock(KSPIN_LOCK *lock)
+{
+    *lock = 0;
+}
+
+//----------------------------------------------------------------------------
+void KeReleaseInStackQueuedSpinLock(KLOCK_QUEUE_HANDLE *handle)
+{
+    SpinRelease(handle->Lock);
+    tIrql = handle->OldIrql;
+}
+
+//----------------------------------------------------------------------------
+void KeReleaseSpinLock(KSPIN_LOCK *lock, KIRQL oldIrql)
+{
+    SpinRelease(lock);
+    tIrql = oldIrql;
+}
+
+//----------------------------------------------------------------------------
+void ExAcquireFastMutex(FAST_MUTEX *mutex)
+{
+    const KIRQL oldIrql = RaiseIrql(APC_LEVEL);
+    SpinAcquire(&mutex->Lock);
+    mutex->OldIrql = oldIrql;
+}
+
+//----------------------------------------------------------------------------
+void ExInitializeFastMutex(FAST_MUTEX *mutex)
+{
+    mutex->Lock    = 0;
+    mutex->OldIrql = PASSIVE_LEVEL;
+}
+
+//----------------------------------------------------------------------------
+void ExReleaseFastMutex(FAST_MUTEX *mutex)
+{
+    const KIRQL oldIrql = mutex->OldIrql;
+    SpinRelease(&mutex->Lock);
+    tIrql = oldIrql;
+}
+
+//----------------------------------------------------------------------------
+// Events
+//----------------------------------------------------------------------------
+
+void KeClearEvent(KEVENT *event)
+{
+    event->Signaled = 0;
+}
+
+//----------------------------------------------------------------------------
+void KeInitializeEvent(KEVENT *event, EVENT_TYPE type, BOOLEAN state)
+{
+    event->Type     = type;
+    event->Signaled = state ? 1 : 0;
+}
+
+//----------------------------------------------------------------------------
+LONG KeSetEvent(KEVENT *event, KPRIORITY increment, BOOLEAN wait)
+{
+    LONG previous;
+
+    UNREFERENCED_PARAMETER(increment);
+    UNREFERENCED_PARAMETER(wait);
+    pthread_mutex_lock(&gEventMutex);
+    previous        = event->Signaled;
+    event->Signaled = 1;
+    pthread_cond_broadcast(&gEventSet);
+    pthread_mutex_unlock(&gEventMutex);
+    return previous;
+}
+
+//----------------------------------------------------------------------------
+// Only waits on events, and only takes relative timeouts
+NTSTATUS KeWaitForSingleObject(void *object, KWAIT_REASON reason,
+        KPROCESSOR_MODE mode, BOOLEAN alertable, LARGE_INTEGER *timeout)
+{
+    KEVENT          *event  = (KEVENT*)object;
+    NTSTATUS         status = STATUS_SUCCESS;
+    struct timespec  deadline;
+
+    UNREFERENCED_PARAMETER(reason);
+    UNREFERENCED_PARAMETER(mode);
+    UNREFERENCED_PARAMETER(alertable);
+    if (timeout) {
+        const LONGLONG wait = (timeout->QuadPart < 0) ? -timeout->QuadPart : 0;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += wait / 10000000;
+        deadline.tv_nsec += (wait % 10000000) * 100;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&gEventMutex);
+    while (!event->Signaled) {
+        if (!timeout) {
+            pthread_cond_wait(&gEventSet, &gEventMutex);
+        } else if (pthread_cond_timedwait(&gEventSet, &gEventMutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (!event->Signaled) {
+        status = STATUS_TIMEOUT;
+    } else if (event->Type == SynchronizationEvent) {
+        event->Signaled = 0;
+    }
+    pthread_mutex_unlock(&gEventMutex);
+    return status;
+}
+
+//----------------------------------------------------------------------------
+// DPCs and timers
+//----------------------------------------------------------------------------
+
+static void* RunDpcs(void *unused)
+{
+    UNREFERENCED_PARAMETER(unused);
+
+    pthread_mutex_lock(&gDpcMutex);
+    for (;;) {
+        KDPC *dpc;
+
+        while (IsListEmpty(&gDpcQueue) && !gStopping) {
+            pthread_cond_wait(&gDpcQueued, &gDpcMutex);
+        }
+        if (IsListEmpty(&gDpcQueue)) {
+            break;
+        }
+        dpc = CONTAINING_RECORD(RemoveHeadList(&gDpcQueue), KDPC, DpcListEntry);
+        dpc->Inserted = 0;
+        gDpcRunning   = true;
+        pthread_mutex_unlock(&gDpcMutex);
+
+        tIrql = DISPATCH_LEVEL;
+        dpc->DeferredRoutine(dpc, dpc->DeferredContext, NULL, NULL);
+        tIrql = PASSIVE_LEVEL;
+
+        pthread_mutex_lock(&gDpcMutex);
+        gDpcRunning = false;
+        if (IsListEmpty(&gDpcQueue)) {
+            pthread_cond_broadcast(&gDpcIdle);
+        }
+    }
+    pthread_mutex_unlock(&gDpcMutex);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+static void* RunTimers(void *unused)
+{
+    const struct timespec period = { 0, HOST_TIMER_PERIOD_NS };
+
+    UNREFERENCED_PARAMETER(unused);
+    while (!gStopping) {
+        const LONGLONG  now = GetMonotonicTime();
+        LIST_ENTRY     *entry;
+
+        nanosleep(&period, NULL);
+        pthread_mutex_lock(&gTimerMutex);
+        entry = gTimerList.Flink;
+        while (entry != &gTimerList) {
+            KTIMER *timer = CONTAINING_RECORD(entry, KTIMER, TimerListEntry);
+
+            entry = entry->Flink;
+            if (timer->DueTime > now) {
+                continue;
+            }
+            if (timer->Period) {
+                timer->DueTime = now + (LONGLONG)timer->Period * 10000;
+            } else {
+                RemoveEntryList(&timer->TimerListEntry);
+                timer->Inserted = false;
+            }
+            if (timer->Dpc) {
+                KeInsertQueueDpc(timer->Dpc, NULL, NULL);
+            }
+        }
+        pthread_mutex_unlock(&gTimerMutex);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+BOOLEAN KeCancelTimer(KTIMER *timer)
+{
+    BOOLEAN inserted;
+
+    pthread_mutex_lock(&gTimerMutex);
+    inserted = timer->Inserted;
+    if (inserted) {
+        RemoveEntryList(&timer->TimerListEntry);
+        timer->Inserted = false;
+    }
+    pthread_mutex_unlock(&gTimerMutex);
+    return inserted;
+}
+
+//----------------------------------------------------------------------------
+// Waits until the queue is empty and no DPC routine is running
+void KeFlushQueuedDpcs(void)
+{
+    pthread_mutex_lock(&gDpcMutex);
+    while (gStarted && (!IsListEmpty(&gDpcQueue) || gDpcRunning)) {
+        pthread_cond_wait(&gDpcIdle, &gDpcMutex);
+    }
+    pthread_mutex_unlock(&gDpcMutex);
+}
+
+//----------------------------------------------------------------------------
+void KeInitializeDpc(KDPC *dpc, PKDEFERRED_ROUTINE routine, void *context)
+{
+    InitializeListHead(&dpc->DpcListEntry);
+    dpc->DeferredRoutine = routine;
+    dpc->DeferredContext = context;
+    dpc->Inserted        = 0;
+}
+
+//----------------------------------------------------------------------------
+void KeInitializeTimer(KTIMER *timer)
+{
+    InitializeListHead(&timer->TimerListEntry);
+    timer->DueTime  = 0;
+    timer->Period   = 0;
+    timer->Dpc      = NULL;
+    timer->Inserted = false;
+}
+
+//----------------------------------------------------------------------------
+BOOLEAN KeInsertQueueDpc(KDPC *dpc, void *systemArgument1, void *systemArgument2)
+{
+    UNREFERENCED_PARAMETER(systemArgument1);
+    UNREFERENCED_PARAMETER(systemArgument2);
+
+    pthread_mutex_lock(&gDpcMutex);
+    if (dpc->Inserted) {
+        pthread_mutex_unlock(&gDpcMutex);
+        return FALSE;
+    }
+    dpc->Inserted = 1;
+    InsertTailList(&gDpcQueue, &dpc->DpcListEntry);
+    pthread_cond_signal(&gDpcQueued);
+    pthread_mutex_unlock(&gDpcMutex);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// Negative due times are relative and positive ones are absolute system times
+BOOLEAN KeSetTimerEx(KTIMER *timer, LARGE_INTEGER dueTime, LONG period, KDPC *dpc)
+{
+    const LONGLONG now = GetMonotonicTime();
+    BOOLEAN        inserted;
+
+    pthread_mutex_lock(&gTimerMutex);
+    inserted = timer->Inserted;
+    if (dueTime.QuadPart < 0) {
+        timer->DueTime = now - dueTime.QuadPart;
+    } else {
+        LARGE_INTEGER systemTime;
+        KeQuerySystemTime(&systemTime);
+        timer->DueTime = now + max(dueTime.QuadPart - systemTime.QuadPart, 0);
+    }
+    timer->Period = period;
+    timer->Dpc    = dpc;
+    if (!inserted) {
+        InsertTailList(&gTimerList, &timer->TimerListEntry);
+        timer->Inserted = true;
+    }
+    pthread_mutex_unlock(&gTimerMutex);
+    return inserted;
+}
+
+//----------------------------------------------------------------------------
+// Pool and lookaside lists
+//----------------------------------------------------------------------------
+
+// Allocations of a page or more are page aligned like the real pool, and the
+// size sits just before the buffer so frees can account for it
+static inline SIZE_T GetPoolAlignment(__in const SIZE_T size)
+{
+    return (size >= PAGE_SIZE) ? PAGE_SIZE : 16;
+}
+
+//----------------------------------------------------------------------------
+void *ExAllocatePoolWithTag(POOL_TYPE poolType, SIZE_T size, ULONG tag)
+{
+    const SIZE_T  alignment = GetPoolAlignment(size);
+    const SIZE_T  total     = alignment + ((size + alignment - 1) & ~(alignment - 1));
+    char         *buffer;
+    SIZE_T        bytes;
+    SIZE_T        peak;
+
+    UNREFERENCED_PARAMETER(poolType);
+    UNREFERENCED_PARAMETER(tag);
+    buffer = aligned_alloc(alignment, total);
+    if (!buffer) {
+        return NULL;
+    }
+    buffer += alignment;
+    ((SIZE_T*)buffer)[-1] = size;
+
+    bytes = __sync_add_and_fetch(&gPoolBytes, total);
+    peak  = gPeakPoolBytes;
+    while ((bytes > peak) &&
+            !__sync_bool_compare_and_swap(&gPeakPoolBytes, peak, bytes)) {
+        peak = gPeakPoolBytes;
+    }
+    return buffer;
+}
+
+//----------------------------------------------------------------------------
+void ExFreePool(void *buffer)
+{
+    const SIZE_T size      = ((SIZE_T*)buffer)[-1];
+    const SIZE_T alignment = GetPoolAlignment(size);
+
+    __sync_sub_and_fetch(&gPoolBytes,
+            alignment + ((size + alignment - 1) & ~(alignment - 1)));
+    free((char*)buffer - alignment);
+}
+
+//----------------------------------------------------------------------------
+void *ExAllocateFromLookasideListEx(LOOKASIDE_LIST_EX *lookaside)
+{
+    return ExAllocatePoolWithTag(NonPagedPool, lookaside->Size, lookaside->Tag);
+}
+
+//----------------------------------------------------------------------------
+void ExDeleteLookasideListEx(LOOKASIDE_LIST_EX *lookaside)
+{
+    UNREFERENCED_PARAMETER(lookaside);
+}
+
+//----------------------------------------------------------------------------
+void ExFreeToLookasideListEx(LOOKASIDE_LIST_EX *lookaside, void *entry)
+{
+    UNREFERENCED_PARAMETER(lookaside);
+    ExFreePool(entry);
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS ExInitializeLookasideListEx(LOOKASIDE_LIST_EX *lookaside, void *allocate,
+        void *free, POOL_TYPE poolType, ULONG flags, SIZE_T size, ULONG tag,
+        USHORT depth)
+{
+    UNREFERENCED_PARAMETER(allocate);
+    UNREFERENCED_PARAMETER(free);
+    UNREFERENCED_PARAMETER(poolType);
+    UNREFERENCED_PARAMETER(flags);
+    UNREFERENCED_PARAMETER(depth);
+    lookaside->Size = size;
+    lookaside->Tag  = tag;
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+// Objects and memory descriptor lists
+//----------------------------------------------------------------------------
+
+// The harness passes KEVENT pointers as handles
+NTSTATUS ObReferenceObjectByHandle(HANDLE handle, ACCESS_MASK access,
+        POBJECT_TYPE type, KPROCESSOR_MODE mode, void **object, void *information)
+{
+    UNREFERENCED_PARAMETER(access);
+    UNREFERENCED_PARAMETER(type);
+    UNREFERENCED_PARAMETER(mode);
+    UNREFERENCED_PARAMETER(information);
+    if (!handle) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    *object = handle;
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+void ObReferenceObject(void *object)
+{
+    UNREFERENCED_PARAMETER(object);
+}
+
+//----------------------------------------------------------------------------
+void ObDereferenceObject(void *object)
+{
+    UNREFERENCED_PARAMETER(object);
+}
+
+//----------------------------------------------------------------------------
+PMDL IoAllocateMdl(void *address, ULONG length, BOOLEAN secondary,
+        BOOLEAN chargeQuota, void *irp)
+{
+    MDL *mdl = (MDL*)calloc(1, sizeof(MDL));
+
+    UNREFERENCED_PARAMETER(secondary);
+    UNREFERENCED_PARAMETER(chargeQuota);
+    UNREFERENCED_PARAMETER(irp);
+    if (mdl) {
+        mdl->Buffer = address;
+        mdl->Length = length;
+    }
+    return mdl;
+}
+
+//----------------------------------------------------------------------------
+void IoFreeMdl(PMDL mdl)
+{
+    free(mdl);
+}
+
+//----------------------------------------------------------------------------
+void MmBuildMdlForNonPagedPool(PMDL mdl)
+{
+    UNREFERENCED_PARAMETER(mdl);
+}
+
+//----------------------------------------------------------------------------
+// There is only one address space, so mapping returns the buffer itself
+void *MmMapLockedPagesSpecifyCache(PMDL mdl, KPROCESSOR_MODE mode,
+        MEMORY_CACHING_TYPE cacheType, void *address, ULONG bugCheck, ULONG priority)
+{
+    UNREFERENCED_PARAMETER(mode);
+    UNREFERENCED_PARAMETER(cacheType);
+    UNREFERENCED_PARAMETER(address);
+    UNREFERENCED_PARAMETER(bugCheck);
+    UNREFERENCED_PARAMETER(priority);
+    return mdl->Buffer;
+}
+
+//----------------------------------------------------------------------------
+void MmUnmapLockedPages(void *address, PMDL mdl)
+{
+    UNREFERENCED_PARAMETER(address);
+    UNREFERENCED_PARAMETER(mdl);
+}
+
+//----------------------------------------------------------------------------
+// IRPs, cancel-safe queues, and work items
+//----------------------------------------------------------------------------
+
+void IoCompleteRequest(IRP *irp, CCHAR priorityBoost)
+{
+    UNREFERENCED_PARAMETER(priorityBoost);
+    if (irp->UserEvent) {
+        KeSetEvent(irp->UserEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS IoCsqInitializeEx(IO_CSQ *csq, IO_CSQ_INSERT_IRP_EX *insertIrp,
+        IO_CSQ_REMOVE_IRP *removeIrp, IO_CSQ_PEEK_NEXT_IRP *peekNextIrp,
+        IO_CSQ_ACQUIRE_LOCK *acquireLock, IO_CSQ_RELEASE_LOCK *releaseLock,
+        IO_CSQ_COMPLETE_CANCELED_IRP *completeCanceledIrp)
+{
+    csq->InsertIrp           = insertIrp;
+    csq->RemoveIrp           = removeIrp;
+    csq->PeekNextIrp         = peekNextIrp;
+    csq->AcquireLock         = acquireLock;
+    csq->ReleaseLock         = releaseLock;
+    csq->CompleteCanceledIrp = completeCanceledIrp;
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+void IoCsqInsertIrp(IO_CSQ *csq, IRP *irp, IO_CSQ_IRP_CONTEXT *context)
+{
+    IoCsqInsertIrpEx(csq, irp, context, NULL);
+}
+
+//----------------------------------------------------------------------------
+// The harness never cancels IRPs, so there is no cancel routine to set
+NTSTATUS IoCsqInsertIrpEx(IO_CSQ *csq, IRP *irp, IO_CSQ_IRP_CONTEXT *context,
+        void *insertContext)
+{
+    NTSTATUS status;
+    KIRQL    irql;
+
+    UNREFERENCED_PARAMETER(context);
+    csq->AcquireLock(csq, &irql);
+    status = csq->InsertIrp(csq, irp, insertContext);
+    csq->ReleaseLock(csq, irql);
+    return status;
+}
+
+//----------------------------------------------------------------------------
+IRP *IoCsqRemoveNextIrp(IO_CSQ *csq, void *peekContext)
+{
+    IRP   *irp;
+    KIRQL  irql;
+
+    csq->AcquireLock(csq, &irql);
+    irp = csq->PeekNextIrp(csq, NULL, peekContext);
+    if (irp) {
+        csq->RemoveIrp(csq, irp);
+    }
+    csq->ReleaseLock(csq, irql);
+    return irp;
+}
+
+//----------------------------------------------------------------------------
+IO_WORKITEM *IoAllocateWorkItem(DEVICE_OBJECT *deviceObject)
+{
+    IO_WORKITEM *workItem = (IO_WORKITEM*)calloc(1, sizeof(IO_WORKITEM));
+    if (workItem) {
+        workItem->DeviceObject = deviceObject;
+    }
+    return workItem;
+}
+
+//----------------------------------------------------------------------------
+void IoFreeWorkItem(IO_WORKITEM *workItem)
+{
+    free(workItem);
+}
+
+//----------------------------------------------------------------------------
+static void* RunWorkItem(void *context)
+{
+    HOST_WORK_ITEM work = *(HOST_WORK_ITEM*)context;
+
+    free(context);
+    work.Routine(work.WorkItem->DeviceObject, work.Context);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+void IoQueueWorkItem(IO_WORKITEM *workItem, IO_WORKITEM_ROUTINE *routine,
+        WORK_QUEUE_TYPE queueType, void *context)
+{
+    HOST_WORK_ITEM *work = (HOST_WORK_ITEM*)malloc(sizeof(HOST_WORK_ITEM));
+    pthread_t       thread;
+
+    UNREFERENCED_PARAMETER(queueType);
+    if (!work) {
+        abort();
+    }
+    work->WorkItem = workItem;
+    work->Routine  = routine;
+    work->Context  = context;
+    if (pthread_create(&thread, NULL, RunWorkItem, work)) {
+        abort();
+    }
+    pthread_detach(thread);
+}
+
+//----------------------------------------------------------------------------
+// Strings, registry, and system information
+//----------------------------------------------------------------------------
+
+static inline WCHAR UpcaseChar(__in const WCHAR c)
+{
+    return ((c >= 'a') && (c <= 'z')) ? (WCHAR)(c - 'a' + 'A') : c;
+}
+
+//----------------------------------------------------------------------------
+static HOST_REGISTRY_VALUE* FindRegistryValue(__in const WCHAR *name)
+{
+    UINT32 i;
+
+    for (i = 0; i < gRegistryCount; i++) {
+        const char  *valueName = gRegistry[i].Name;
+        const WCHAR *c         = name;
+
+        while (*valueName && (*c == (WCHAR)*valueName)) {
+            valueName++;
+            c++;
+        }
+        if (!*valueName && !*c) {
+            return &gRegistry[i];
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+static HOST_REGISTRY_VALUE* AddRegistryValue(__in const char *name)
+{
+    HOST_REGISTRY_VALUE *value;
+
+    if (gRegistryCount >= HOST_REGISTRY_VALUES) {
+        return NULL;
+    }
+    value = &gRegistry[gRegistryCount++];
+    snprintf(value->Name, sizeof(value->Name), "%s", name);
+    return value;
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS ExUuidCreate(UUID *uuid)
+{
+    UINT8 *bytes = (UINT8*)uuid;
+    SIZE_T i;
+
+    for (i = 0; i < sizeof(UUID); i++) {
+        bytes[i] = (UINT8)rand();
+    }
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+int HostWcscmp(const WCHAR *first, const WCHAR *second)
+{
+    while (*first && (*first == *second)) {
+        first++;
+        second++;
+    }
+    return (int)*first - (int)*second;
+}
+
+//----------------------------------------------------------------------------
+// Nothing is looked up by name, so callers take their fallback paths
+void *KphGetSystemRoutineAddress(PWSTR systemRoutineName)
+{
+    UNREFERENCED_PARAMETER(systemRoutineName);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+LONG RtlCompareUnicodeString(const UNICODE_STRING *first, const UNICODE_STRING *second,
+        BOOLEAN caseInsensitive)
+{
+    const USHORT firstLength  = first->Length / sizeof(WCHAR);
+    const USHORT secondLength = second->Length / sizeof(WCHAR);
+    USHORT       i;
+
+    for (i = 0; (i < firstLength) && (i < secondLength); i++) {
+        WCHAR a = first->Buffer[i];
+        WCHAR b = second->Buffer[i];
+        if (caseInsensitive) {
+            a = UpcaseChar(a);
+            b = UpcaseChar(b);
+        }
+        if (a != b) {
+            return (LONG)a - (LONG)b;
+        }
+    }
+    return (LONG)firstLength - (LONG)secondLength;
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS RtlCreateRegistryKey(ULONG relativeTo, PWSTR path)
+{
+    UNREFERENCED_PARAMETER(relativeTo);
+    UNREFERENCED_PARAMETER(path);
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS RtlGetVersion(RTL_OSVERSIONINFOW *versionInfo)
+{
+    const ULONG size = versionInfo->dwOSVersionInfoSize;
+
+    memset(versionInfo, 0, size);
+    versionInfo->dwOSVersionInfoSize = size;
+    versionInfo->dwMajorVersion      = 10;
+    versionInfo->dwMinorVersion      = 0;
+    versionInfo->dwBuildNumber       = 19045;
+    versionInfo->dwPlatformId        = 2;
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+// Same multiplier as the x65599 algorithm the kernel defaults to
+NTSTATUS RtlHashUnicodeString(const UNICODE_STRING *string, BOOLEAN caseInsensitive,
+        ULONG algorithm, ULONG *hash)
+{
+    USHORT i;
+
+    UNREFERENCED_PARAMETER(algorithm);
+    *hash = 0;
+    for (i = 0; i < string->Length / sizeof(WCHAR); i++) {
+        const WCHAR c = caseInsensitive ? UpcaseChar(string->Buffer[i]) : string->Buffer[i];
+        *hash = *hash * 65599 + c;
+    }
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+BOOLEAN RtlIsNtDdiVersionAvailable(ULONG version)
+{
+    UNREFERENCED_PARAMETER(version);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// Every key holds the same values, so only the value names matter
+NTSTATUS RtlQueryRegistryValues(ULONG relativeTo, PCWSTR path,
+        RTL_QUERY_REGISTRY_TABLE *queryTable, void *context, void *environment)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    UNREFERENCED_PARAMETER(relativeTo);
+    UNREFERENCED_PARAMETER(path);
+    UNREFERENCED_PARAMETER(environment);
+    pthread_mutex_lock(&gRegistryMutex);
+    for (; queryTable->QueryRoutine || queryTable->Name; queryTable++) {
+        const HOST_REGISTRY_VALUE *value = FindRegistryValue(queryTable->Name);
+        if (!value) {
+            if (queryTable->Flags & RTL_QUERY_REGISTRY_REQUIRED) {
+                status = STATUS_OBJECT_NAME_NOT_FOUND;
+                break;
+            }
+            continue;
+        }
+        status = queryTable->QueryRoutine(queryTable->Name, value->Type,
+                (void*)value->Data, value->Length, context, queryTable->EntryContext);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gRegistryMutex);
+    return status;
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS RtlStringCbPrintfA(char *destination, size_t size, const char *format, ...)
+{
+    va_list args;
+    int     length;
+
+    va_start(args, format);
+    length = vsnprintf(destination, size, format, args);
+    va_end(args);
+    return ((length < 0) || ((size_t)length >= size)) ? STATUS_BUFFER_OVERFLOW :
+            STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS RtlStringCbPrintfExA(char *destination, size_t size, char **end,
+        size_t *remaining, ULONG flags, const char *format, ...)
+{
+    va_list args;
+    int     length;
+    size_t  written;
+
+    UNREFERENCED_PARAMETER(flags);
+    va_start(args, format);
+    length = vsnprintf(destination, size, format, args);
+    va_end(args);
+    written = (length < 0) ? 0 : min((size_t)length, size ? size - 1 : 0);
+    if (end) {
+        *end = destination + written;
+    }
+    if (remaining) {
+        *remaining = size - written;
+    }
+    return ((length < 0) || ((size_t)length >= size)) ? STATUS_BUFFER_OVERFLOW :
+            STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+// Lengths are in bytes.  Stops at the first character that does not fit.
+NTSTATUS RtlUnicodeToUTF8N(char *destination, ULONG destinationLength,
+        ULONG *resultLength, const WCHAR *source, ULONG sourceLength)
+{
+    const ULONG count  = sourceLength / sizeof(WCHAR);
+    ULONG       length = 0;
+    ULONG       i;
+
+    for (i = 0; i < count; i++) {
+        UINT32 c = source[i];
+        UINT8  bytes[4];
+        ULONG  size;
+        ULONG  j;
+
+        if ((c >= 0xD800) && (c < 0xDC00) && (i + 1 < count) &&
+                (source[i + 1] >= 0xDC00) && (source[i + 1] < 0xE000)) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (source[++i] - 0xDC00);
+        } else if ((c >= 0xD800) && (c < 0xE000)) {
+            c = 0xFFFD;
+        }
+        if (c < 0x80) {
+            bytes[0] = (UINT8)c;
+            size     = 1;
+        } else if (c < 0x800) {
+            bytes[0] = (UINT8)(0xC0 | (c >> 6));
+            bytes[1] = (UINT8)(0x80 | (c & 0x3F));
+            size     = 2;
+        } else if (c < 0x10000) {
+            bytes[0] = (UINT8)(0xE0 | (c >> 12));
+            bytes[1] = (UINT8)(0x80 | ((c >> 6) & 0x3F));
+            bytes[2] = (UINT8)(0x80 | (c & 0x3F));
+            size     = 3;
+        } else {
+            bytes[0] = (UINT8)(0xF0 | (c >> 18));
+            bytes[1] = (UINT8)(0x80 | ((c >> 12) & 0x3F));
+            bytes[2] = (UINT8)(0x80 | ((c >> 6) & 0x3F));
+            bytes[3] = (UINT8)(0x80 | (c & 0x3F));
+            size     = 4;
+        }
+        if (destination) {
+            if (length + size > destinationLength) {
+                *resultLength = length;
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+            for (j = 0; j < size; j++) {
+                destination[length + j] = (char)bytes[j];
+            }
+        }
+        length += size;
+    }
+    *resultLength = length;
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS RtlWriteRegistryValue(ULONG relativeTo, PCWSTR path, PCWSTR valueName,
+        ULONG valueType, void *valueData, ULONG valueLength)
+{
+    HOST_REGISTRY_VALUE *value;
+    char                 name[32];
+    SIZE_T               i;
+
+    UNREFERENCED_PARAMETER(relativeTo);
+    UNREFERENCED_PARAMETER(path);
+    if (valueLength > HOST_REGISTRY_DATA) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    for (i = 0; valueName[i] && (i < sizeof(name) - 1); i++) {
+        name[i] = (char)valueName[i];
+    }
+    name[i] = '\0';
+
+    pthread_mutex_lock(&gRegistryMutex);
+    value = FindRegistryValue(valueName);
+    if (!value) {
+        value = AddRegistryValue(name);
+    }
+    if (value) {
+        value->Type   = valueType;
+        value->Length = valueLength;
+        memcpy(value->Data, valueData, valueLength);
+    }
+    pthread_mutex_unlock(&gRegistryMutex);
+    return value ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+//----------------------------------------------------------------------------
+// Process monitor
+//----------------------------------------------------------------------------
+
+// The harness has no process monitor, so its cache never sees a lookup
+void GetLoadedPidCacheStatistics(
+    __out UINT64 *hits,
+    __out UINT64 *misses,
+    __out UINT64 *bypassed)
+{
+    *hits     = 0;
+    *misses   = 0;
+    *bypassed = 0;
+}
+
+//----------------------------------------------------------------------------
+// Host control
+//----------------------------------------------------------------------------
+
+SIZE_T HostPeakPoolBytes(void)
+{
+    return gPeakPoolBytes;
+}
+
+//----------------------------------------------------------------------------
+SIZE_T HostPoolBytes(void)
+{
+    return gPoolBytes;
+}
+
+//----------------------------------------------------------------------------
+void HostSetRegistryDword(__in const char *name, __in const UINT32 value)
+{
+    HOST_REGISTRY_VALUE *entry = NULL;
+    UINT32               i;
+
+    pthread_mutex_lock(&gRegistryMutex);
+    for (i = 0; i < gRegistryCount; i++) {
+        if (!strcmp(gRegistry[i].Name, name)) {
+            entry = &gRegistry[i];
+            break;
+        }
+    }
+    if (!entry) {
+        entry = AddRegistryValue(name);
+    }
+    if (entry) {
+        entry->Type   = REG_DWORD;
+        entry->Length = sizeof(UINT32);
+        memcpy(entry->Data, &value, sizeof(UINT32));
+    }
+    pthread_mutex_unlock(&gRegistryMutex);
+}
+
+//----------------------------------------------------------------------------
+void HostStartKernel(void)
+{
+    gStopping = false;
+    if (pthread_create(&gDpcThread, NULL, RunDpcs, NULL) ||
+            pthread_create(&gTimerThread, NULL, RunTimers, NULL)) {
+        fprintf(stderr, "Cannot start kernel threads\n");
+        abort();
+    }
+    gStarted = true;
+}
+
+//----------------------------------------------------------------------------
+void HostStopKernel(void)
+{
+    pthread_mutex_lock(&gDpcMutex);
+    gStopping = true;
+    pthread_cond_signal(&gDpcQueued);
+    pthread_mutex_unlock(&gDpcMutex);
+    pthread_join(gTimerThread, NULL);
+    pthread_join(gDpcThread, NULL);
+    gStarted = false;
+}
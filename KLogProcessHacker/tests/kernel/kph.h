@@ -0,0 +1,573 @@
+//----------------------------------------------------------------------------
+// Host stand-in for kph.h that is complete enough to build the queue manager
+// and read interface themselves
+//
+// Builds on the plain C stand-in in ../shim and adds user-mode versions of
+// the kernel APIs those files call: spin locks, fast mutexes, events, DPCs,
+// timers, work items, lookaside lists, IRPs and cancel-safe queues, and the
+// few Rtl string and registry routines.  kernel.c implements them with POSIX
+// threads.  The harness only emulates what the driver relies on:
+//
+// * Spin locks raise a per-thread IRQL to DISPATCH_LEVEL, and DPCs and timers
+//   run on their own threads, so nothing runs nested inside a held lock
+// * Each thread gets its own processor number, so per-processor data is never
+//   shared between threads
+// * Build with -fshort-wchar, so wchar_t and L"" literals match WCHAR
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#ifndef KERNEL_KPH_H
+#define KERNEL_KPH_H
+
+#include "../shim/kph.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+//----------------------------------------------------------------------------
+// Types
+//----------------------------------------------------------------------------
+
+typedef void               VOID;
+typedef void              *PVOID;
+typedef char               CHAR;
+typedef char               CCHAR;
+typedef unsigned char      UCHAR;
+typedef unsigned char     *PUCHAR;
+typedef uint16_t           USHORT;
+typedef uint16_t           WCHAR;
+typedef WCHAR             *PWCH;
+typedef WCHAR             *PWSTR;
+typedef const WCHAR       *PCWSTR;
+typedef ULONG             *PULONG;
+typedef uint64_t           ULONG64;
+typedef uint64_t           ULONGLONG;
+typedef intptr_t           LONG_PTR;
+typedef SIZE_T            *PSIZE_T;
+typedef UCHAR              KIRQL;
+typedef KIRQL             *PKIRQL;
+typedef LONG               KPRIORITY;
+typedef CCHAR              KPROCESSOR_MODE;
+typedef ULONG              ACCESS_MASK;
+typedef HANDLE            *PHANDLE;
+typedef LARGE_INTEGER     *PLARGE_INTEGER;
+
+_Static_assert(sizeof(wchar_t) == sizeof(WCHAR), "Build with -fshort-wchar");
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCH   Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+//----------------------------------------------------------------------------
+// Constants
+//----------------------------------------------------------------------------
+
+#define TRUE  1
+#define FALSE 0
+
+#define PASSIVE_LEVEL  0
+#define APC_LEVEL      1
+#define DISPATCH_LEVEL 2
+
+#define STATUS_SUCCESS                ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW        ((NTSTATUS)0x80000005L)
+#define STATUS_NOT_SUPPORTED          ((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_PARAMETER      ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_SUCH_FILE           ((NTSTATUS)0xC000000FL)
+#define STATUS_INVALID_DEVICE_REQUEST ((NTSTATUS)0xC0000010L)
+#define STATUS_ACCESS_DENIED          ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL       ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND  ((NTSTATUS)0xC0000034L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_CANCELLED              ((NTSTATUS)0xC0000120L)
+#define STATUS_RETRY                  ((NTSTATUS)0xC000022DL)
+#define NT_SUCCESS(status)            (((NTSTATUS)(status)) >= 0)
+
+#define _UI16_MAX   0xFFFFu
+#define _UI32_MAX   0xFFFFFFFFu
+#define _UI64_MAX   0xFFFFFFFFFFFFFFFFull
+#define MAXLONGLONG INT64_MAX
+
+#define PAGE_SIZE           0x1000
+#define ROUND_TO_PAGES(size) (((ULONG_PTR)(size) + PAGE_SIZE - 1) & ~((ULONG_PTR)PAGE_SIZE - 1))
+
+#define NTAPI
+#define DECLSPEC_CACHEALIGN        __attribute__((aligned(64)))
+#define FORCEINLINE                static inline
+#define UNREFERENCED_PARAMETER(p)  ((void)(p))
+#define RTL_NUMBER_OF(array)       (sizeof(array) / sizeof((array)[0]))
+#define RTL_CONSTANT_STRING(s)     { sizeof(s) - sizeof((s)[0]), sizeof(s), (PWCH)(s) }
+#define C_ASSERT(expression)       _Static_assert((expression), #expression)
+
+// The C library works on 4-byte wchar_t, so the driver's 2-byte strings need
+// their own comparison
+#define wcscmp(first, second) HostWcscmp((first), (second))
+int HostWcscmp(const WCHAR *first, const WCHAR *second);
+
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+// Structured exception handling cannot fault here, so the handler never runs
+#define __try                    if (1)
+#define __except(filter)         else if (0)
+#define EXCEPTION_EXECUTE_HANDLER 1
+
+#define AF_INET      2
+#define AF_INET6     23
+#define IPPROTO_TCP  6
+#define IPPROTO_UDP  17
+
+#define METHOD_NEITHER 3
+
+#define __out_ecount(count)
+#define __drv_dispatchType(type)
+#define _Dispatch_type_(type)
+
+//----------------------------------------------------------------------------
+// Interlocked operations
+//----------------------------------------------------------------------------
+
+#define InterlockedIncrement64(target)  __sync_add_and_fetch((target), 1)
+#define InterlockedDecrement64(target)  __sync_sub_and_fetch((target), 1)
+#define InterlockedExchangeAdd(target, value)   __sync_fetch_and_add((target), (value))
+#define InterlockedExchangeAdd64(target, value) __sync_fetch_and_add((target), (value))
+#define InterlockedCompareExchange64(target, exchange, comparand) \
+    __sync_val_compare_and_swap((target), (comparand), (exchange))
+#define InterlockedExchange(target, value) __atomic_exchange_n((target), (value), __ATOMIC_SEQ_CST)
+#define KeMemoryBarrier() __sync_synchronize()
+
+//----------------------------------------------------------------------------
+// Doubly linked lists the shim does not have
+//----------------------------------------------------------------------------
+
+static inline void InsertHeadList(LIST_ENTRY *head, LIST_ENTRY *entry)
+{
+    entry->Flink       = head->Flink;
+    entry->Blink       = head;
+    head->Flink->Blink = entry;
+    head->Flink        = entry;
+}
+
+//----------------------------------------------------------------------------
+// Spin locks, mutexes, events, DPCs, and timers
+//----------------------------------------------------------------------------
+
+typedef ULONG_PTR KSPIN_LOCK;
+typedef KSPIN_LOCK *PKSPIN_LOCK;
+
+typedef struct _KLOCK_QUEUE_HANDLE {
+    KSPIN_LOCK *Lock;
+    KIRQL       OldIrql;
+} KLOCK_QUEUE_HANDLE, *PKLOCK_QUEUE_HANDLE;
+
+typedef struct _FAST_MUTEX {
+    KSPIN_LOCK Lock;
+    KIRQL      OldIrql;
+} FAST_MUTEX;
+
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent,
+} EVENT_TYPE;
+
+// All events share one mutex and condition variable in kernel.c
+typedef struct _KEVENT {
+    EVENT_TYPE    Type;
+    volatile LONG Signaled;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+struct _KDPC;
+typedef void KDEFERRED_ROUTINE(
+    struct _KDPC *dpc,
+    void         *deferredContext,
+    void         *systemArgument1,
+    void         *systemArgument2);
+typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+
+typedef struct _KDPC {
+    LIST_ENTRY          DpcListEntry;
+    PKDEFERRED_ROUTINE  DeferredRoutine;
+    void               *DeferredContext;
+    volatile LONG       Inserted;
+} KDPC, *PKDPC, *PRKDPC;
+
+typedef struct _KTIMER {
+    LIST_ENTRY  TimerListEntry;
+    LONGLONG    DueTime;   // Host monotonic time in 100ns units (0 if not set)
+    LONG        Period;    // Milliseconds (0 if one-shot)
+    KDPC       *Dpc;
+    bool        Inserted;
+} KTIMER, *PKTIMER;
+
+typedef enum _KWAIT_REASON { Executive } KWAIT_REASON;
+
+#define KernelMode 0
+#define UserMode   1
+
+#define IO_NO_INCREMENT 0
+
+void KeAcquireInStackQueuedSpinLock(KSPIN_LOCK *lock, KLOCK_QUEUE_HANDLE *handle);
+void KeReleaseInStackQueuedSpinLock(KLOCK_QUEUE_HANDLE *handle);
+void KeAcquireSpinLock(KSPIN_LOCK *lock, KIRQL *oldIrql);
+void KeReleaseSpinLock(KSPIN_LOCK *lock, KIRQL oldIrql);
+void KeInitializeSpinLock(KSPIN_LOCK *lock);
+KIRQL KeGetCurrentIrql(void);
+
+void ExInitializeFastMutex(FAST_MUTEX *mutex);
+void ExAcquireFastMutex(FAST_MUTEX *mutex);
+void ExReleaseFastMutex(FAST_MUTEX *mutex);
+
+void KeInitializeEvent(KEVENT *event, EVENT_TYPE type, BOOLEAN state);
+LONG KeSetEvent(KEVENT *event, KPRIORITY increment, BOOLEAN wait);
+void KeClearEvent(KEVENT *event);
+NTSTATUS KeWaitForSingleObject(void *object, KWAIT_REASON reason,
+        KPROCESSOR_MODE mode, BOOLEAN alertable, LARGE_INTEGER *timeout);
+
+void KeInitializeDpc(KDPC *dpc, PKDEFERRED_ROUTINE routine, void *context);
+BOOLEAN KeInsertQueueDpc(KDPC *dpc, void *systemArgument1, void *systemArgument2);
+void KeFlushQueuedDpcs(void);
+
+void KeInitializeTimer(KTIMER *timer);
+BOOLEAN KeSetTimerEx(KTIMER *timer, LARGE_INTEGER dueTime, LONG period, KDPC *dpc);
+BOOLEAN KeCancelTimer(KTIMER *timer);
+
+//----------------------------------------------------------------------------
+// Processors and time
+//----------------------------------------------------------------------------
+
+#define ALL_PROCESSOR_GROUPS 0xFFFF
+
+typedef struct _PROCESSOR_NUMBER {
+    USHORT Group;
+    UCHAR  Number;
+    UCHAR  Reserved;
+} PROCESSOR_NUMBER;
+
+ULONG KeQueryMaximumProcessorCountEx(USHORT groupNumber);
+ULONG KeGetCurrentProcessorNumberEx(PROCESSOR_NUMBER *number);
+LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER *frequency);
+void KeQueryTickCount(LARGE_INTEGER *tickCount);
+ULONG KeQueryTimeIncrement(void);
+void KeQuerySystemTime(LARGE_INTEGER *time);
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE mode, BOOLEAN alertable,
+        LARGE_INTEGER *interval);
+
+//----------------------------------------------------------------------------
+// Pool and lookaside lists
+//----------------------------------------------------------------------------
+
+typedef enum _POOL_TYPE {
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolNx = 512,
+} POOL_TYPE;
+
+typedef struct _LOOKASIDE_LIST_EX {
+    SIZE_T Size;
+    ULONG  Tag;
+} LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX;
+
+void *ExAllocatePoolWithTag(POOL_TYPE poolType, SIZE_T size, ULONG tag);
+void ExFreePool(void *buffer);
+NTSTATUS ExInitializeLookasideListEx(LOOKASIDE_LIST_EX *lookaside, void *allocate,
+        void *free, POOL_TYPE poolType, ULONG flags, SIZE_T size, ULONG tag,
+        USHORT depth);
+void ExDeleteLookasideListEx(LOOKASIDE_LIST_EX *lookaside);
+void *ExAllocateFromLookasideListEx(LOOKASIDE_LIST_EX *lookaside);
+void ExFreeToLookasideListEx(LOOKASIDE_LIST_EX *lookaside, void *entry);
+
+//----------------------------------------------------------------------------
+// Processes, objects, and memory descriptor lists
+//----------------------------------------------------------------------------
+
+typedef struct _KPROCESS *PEPROCESS;
+typedef struct _KTHREAD  *PETHREAD;
+typedef struct _OBJECT_TYPE *POBJECT_TYPE;
+
+typedef struct _KAPC_STATE {
+    void *Reserved;
+} KAPC_STATE;
+
+typedef struct _MDL {
+    void  *Buffer;
+    SIZE_T Length;
+} MDL, *PMDL;
+
+typedef enum _MEMORY_CACHING_TYPE { MmNonCached, MmCached } MEMORY_CACHING_TYPE;
+
+#define NormalPagePriority  16
+#define MdlMappingNoWrite   0x80000000
+#define MdlMappingNoExecute 0x40000000
+#define EVENT_MODIFY_STATE  0x0002
+#define SYNCHRONIZE         0x00100000
+#define THREAD_ALL_ACCESS   0x001FFFFF
+
+typedef void KSTART_ROUTINE(void *startContext);
+
+extern POBJECT_TYPE *ExEventObjectType;
+
+PEPROCESS PsGetCurrentProcess(void);
+PETHREAD PsGetCurrentThread(void);
+HANDLE PsGetCurrentThreadId(void);
+void KeStackAttachProcess(PEPROCESS process, KAPC_STATE *apcState);
+void KeUnstackDetachProcess(KAPC_STATE *apcState);
+NTSTATUS PsCreateSystemThread(HANDLE *threadHandle, ULONG access, void *objectAttributes,
+        HANDLE processHandle, void *clientId, KSTART_ROUTINE *startRoutine, void *startContext);
+NTSTATUS PsTerminateSystemThread(NTSTATUS exitStatus);
+NTSTATUS ZwWaitForSingleObject(HANDLE handle, BOOLEAN alertable, LARGE_INTEGER *timeout);
+NTSTATUS ZwClose(HANDLE handle);
+NTSTATUS ObReferenceObjectByHandle(HANDLE handle, ACCESS_MASK access,
+        POBJECT_TYPE type, KPROCESSOR_MODE mode, void **object, void *information);
+void ObReferenceObject(void *object);
+void ObDereferenceObject(void *object);
+PMDL IoAllocateMdl(void *address, ULONG length, BOOLEAN secondary,
+        BOOLEAN chargeQuota, void *irp);
+void IoFreeMdl(PMDL mdl);
+void MmBuildMdlForNonPagedPool(PMDL mdl);
+void *MmMapLockedPagesSpecifyCache(PMDL mdl, KPROCESSOR_MODE mode,
+        MEMORY_CACHING_TYPE cacheType, void *address, ULONG bugCheck, ULONG priority);
+void MmUnmapLockedPages(void *address, PMDL mdl);
+
+//----------------------------------------------------------------------------
+// Devices, IRPs, cancel-safe queues, and work items
+//----------------------------------------------------------------------------
+
+#define FO_SYNCHRONOUS_IO 0x00000002
+
+typedef struct _DEVICE_OBJECT {
+    void *DeviceExtension;
+} DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+typedef struct _FILE_OBJECT {
+    UNICODE_STRING  FileName;
+    ULONG           Flags;
+    void           *FsContext2;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _IO_STATUS_BLOCK {
+    NTSTATUS  Status;
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK;
+
+typedef struct _IO_STACK_LOCATION {
+    union {
+        struct {
+            ULONG Length;
+        } Read;
+        struct {
+            ULONG OutputBufferLength;
+            ULONG InputBufferLength;
+            ULONG IoControlCode;
+        } DeviceIoControl;
+    } Parameters;
+    FILE_OBJECT *FileObject;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+typedef struct _IRP {
+    union {
+        void *SystemBuffer;
+    } AssociatedIrp;
+    IO_STATUS_BLOCK    IoStatus;
+    KEVENT            *UserEvent;  // Set when the IRP completes (NULL if none)
+    IO_STACK_LOCATION  Stack;      // The only stack location
+    struct {
+        struct {
+            LIST_ENTRY ListEntry;
+            PETHREAD   Thread;
+        } Overlay;
+    } Tail;
+} IRP, *PIRP;
+
+typedef NTSTATUS DRIVER_DISPATCH(DEVICE_OBJECT *deviceObject, IRP *irp);
+typedef NTSTATUS DRIVER_INITIALIZE(void *driverObject, UNICODE_STRING *registryPath);
+
+struct _IO_CSQ;
+typedef NTSTATUS IO_CSQ_INSERT_IRP_EX(struct _IO_CSQ *csq, IRP *irp, void *insertContext);
+typedef void IO_CSQ_REMOVE_IRP(struct _IO_CSQ *csq, IRP *irp);
+typedef IRP *IO_CSQ_PEEK_NEXT_IRP(struct _IO_CSQ *csq, IRP *irp, void *peekContext);
+typedef void IO_CSQ_ACQUIRE_LOCK(struct _IO_CSQ *csq, KIRQL *irql);
+typedef void IO_CSQ_RELEASE_LOCK(struct _IO_CSQ *csq, KIRQL irql);
+typedef void IO_CSQ_COMPLETE_CANCELED_IRP(struct _IO_CSQ *csq, IRP *irp);
+
+typedef struct _IO_CSQ {
+    IO_CSQ_INSERT_IRP_EX         *InsertIrp;
+    IO_CSQ_REMOVE_IRP            *RemoveIrp;
+    IO_CSQ_PEEK_NEXT_IRP         *PeekNextIrp;
+    IO_CSQ_ACQUIRE_LOCK          *AcquireLock;
+    IO_CSQ_RELEASE_LOCK          *ReleaseLock;
+    IO_CSQ_COMPLETE_CANCELED_IRP *CompleteCanceledIrp;
+} IO_CSQ;
+
+typedef struct _IO_CSQ_IRP_CONTEXT IO_CSQ_IRP_CONTEXT;
+
+typedef enum _WORK_QUEUE_TYPE { CriticalWorkQueue, DelayedWorkQueue } WORK_QUEUE_TYPE;
+typedef void IO_WORKITEM_ROUTINE(DEVICE_OBJECT *deviceObject, void *context);
+
+typedef struct _IO_WORKITEM {
+    DEVICE_OBJECT       *DeviceObject;
+    IO_WORKITEM_ROUTINE *Routine;
+    void                *Context;
+} IO_WORKITEM, *PIO_WORKITEM;
+
+static inline IO_STACK_LOCATION *IoGetCurrentIrpStackLocation(IRP *irp)
+{
+    return &irp->Stack;
+}
+
+static inline BOOLEAN IoIsOperationSynchronous(IRP *irp)
+{
+    return (irp->Stack.FileObject->Flags & FO_SYNCHRONOUS_IO) != 0;
+}
+
+void IoCompleteRequest(IRP *irp, CCHAR priorityBoost);
+NTSTATUS IoCsqInitializeEx(IO_CSQ *csq, IO_CSQ_INSERT_IRP_EX *insertIrp,
+        IO_CSQ_REMOVE_IRP *removeIrp, IO_CSQ_PEEK_NEXT_IRP *peekNextIrp,
+        IO_CSQ_ACQUIRE_LOCK *acquireLock, IO_CSQ_RELEASE_LOCK *releaseLock,
+        IO_CSQ_COMPLETE_CANCELED_IRP *completeCanceledIrp);
+void IoCsqInsertIrp(IO_CSQ *csq, IRP *irp, IO_CSQ_IRP_CONTEXT *context);
+NTSTATUS IoCsqInsertIrpEx(IO_CSQ *csq, IRP *irp, IO_CSQ_IRP_CONTEXT *context,
+        void *insertContext);
+IRP *IoCsqRemoveNextIrp(IO_CSQ *csq, void *peekContext);
+IO_WORKITEM *IoAllocateWorkItem(DEVICE_OBJECT *deviceObject);
+void IoFreeWorkItem(IO_WORKITEM *workItem);
+void IoQueueWorkItem(IO_WORKITEM *workItem, IO_WORKITEM_ROUTINE *routine,
+        WORK_QUEUE_TYPE queueType, void *context);
+
+//----------------------------------------------------------------------------
+// Strings, registry, and system information
+//----------------------------------------------------------------------------
+
+#define HASH_STRING_ALGORITHM_DEFAULT 0
+
+#define REG_NONE   0
+#define REG_BINARY 3
+#define REG_DWORD  4
+
+#define RTL_REGISTRY_ABSOLUTE       0
+#define RTL_QUERY_REGISTRY_REQUIRED 0x00000004
+
+#define NTDDI_WIN8 0x06020000
+
+// The driver defines its query routines with unsigned long, which is ULONG on
+// Windows but wider here
+typedef NTSTATUS RTL_QUERY_REGISTRY_ROUTINE(PWSTR valueName, unsigned long valueType,
+        void *valueData, unsigned long valueLength, void *context, void *entryContext);
+typedef RTL_QUERY_REGISTRY_ROUTINE *PRTL_QUERY_REGISTRY_ROUTINE;
+
+typedef struct _RTL_QUERY_REGISTRY_TABLE {
+    PRTL_QUERY_REGISTRY_ROUTINE  QueryRoutine;
+    ULONG                        Flags;
+    PWSTR                        Name;
+    void                        *EntryContext;
+    ULONG                        DefaultType;
+    void                        *DefaultData;
+    ULONG                        DefaultLength;
+} RTL_QUERY_REGISTRY_TABLE;
+
+typedef struct _RTL_OSVERSIONINFOW {
+    ULONG dwOSVersionInfoSize;
+    ULONG dwMajorVersion;
+    ULONG dwMinorVersion;
+    ULONG dwBuildNumber;
+    ULONG dwPlatformId;
+    WCHAR szCSDVersion[128];
+} RTL_OSVERSIONINFOW;
+
+typedef struct _RTL_OSVERSIONINFOEXW {
+    ULONG  dwOSVersionInfoSize;
+    ULONG  dwMajorVersion;
+    ULONG  dwMinorVersion;
+    ULONG  dwBuildNumber;
+    ULONG  dwPlatformId;
+    WCHAR  szCSDVersion[128];
+    USHORT wServicePackMajor;
+    USHORT wServicePackMinor;
+    USHORT wSuiteMask;
+    UCHAR  wProductType;
+    UCHAR  wReserved;
+} RTL_OSVERSIONINFOEXW;
+
+typedef struct _GUID {
+    UINT32 Data1;
+    UINT16 Data2;
+    UINT16 Data3;
+    UINT8  Data4[8];
+} GUID, UUID;
+
+NTSTATUS RtlUnicodeToUTF8N(char *destination, ULONG destinationLength,
+        ULONG *resultLength, const WCHAR *source, ULONG sourceLength);
+NTSTATUS RtlStringCbPrintfA(char *destination, size_t size, const char *format, ...);
+NTSTATUS RtlStringCbPrintfExA(char *destination, size_t size, char **end,
+        size_t *remaining, ULONG flags, const char *format, ...);
+NTSTATUS RtlHashUnicodeString(const UNICODE_STRING *string, BOOLEAN caseInsensitive,
+        ULONG algorithm, ULONG *hash);
+LONG RtlCompareUnicodeString(const UNICODE_STRING *first, const UNICODE_STRING *second,
+        BOOLEAN caseInsensitive);
+NTSTATUS RtlGetVersion(RTL_OSVERSIONINFOW *versionInfo);
+BOOLEAN RtlIsNtDdiVersionAvailable(ULONG version);
+NTSTATUS RtlQueryRegistryValues(ULONG relativeTo, PCWSTR path,
+        RTL_QUERY_REGISTRY_TABLE *queryTable, void *context, void *environment);
+NTSTATUS RtlCreateRegistryKey(ULONG relativeTo, PWSTR path);
+NTSTATUS RtlWriteRegistryValue(ULONG relativeTo, PCWSTR path, PCWSTR valueName,
+        ULONG valueType, void *valueData, ULONG valueLength);
+NTSTATUS ExUuidCreate(UUID *uuid);
+void *KphGetSystemRoutineAddress(PWSTR systemRoutineName);
+
+//----------------------------------------------------------------------------
+// Driver headers, in the same order as kph.h
+//----------------------------------------------------------------------------
+
+#include "llrb_clear.h"
+#include "debug_print.h"
+#include "system_id.h"
+#include "clock.h"
+#include "latency.h"
+#include "trace.h"
+#include "synthetic.h"
+#include "queue_manager.h"
+
+//----------------------------------------------------------------------------
+// Process monitor routines the queue manager calls, which kernel.c stands in
+// for
+//----------------------------------------------------------------------------
+
+void GetLoadedPidCacheStatistics(
+    __out UINT64 *hits,
+    __out UINT64 *misses,
+    __out UINT64 *bypassed);
+
+//----------------------------------------------------------------------------
+// Host control of the stand-ins
+//----------------------------------------------------------------------------
+
+/// @brief Starts the DPC, timer, and work item threads
+void HostStartKernel(void);
+
+/// @brief Runs the queued DPCs and stops the threads
+void HostStopKernel(void);
+
+/// @brief Sets a DWORD registry value that RtlQueryRegistryValues returns
+/// for any key
+///
+/// @param name   Value name
+/// @param value  Value data
+void HostSetRegistryDword(__in const char *name, __in const UINT32 value);
+
+/// @returns Bytes currently allocated from the pool stand-ins
+SIZE_T HostPoolBytes(void);
+
+/// @returns Most bytes ever allocated at once from the pool stand-ins
+SIZE_T HostPeakPoolBytes(void);
+
+#endif // KERNEL_KPH_H
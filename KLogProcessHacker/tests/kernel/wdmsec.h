@@ -0,0 +1,2 @@
+// Host stand-in for <wdmsec.h>, whose declarations are in kph.h
+#include "kph.h"
@@ -0,0 +1,2 @@
+// Host stand-in for <ws2def.h>, whose declarations are in kph.h
+#include "kph.h"
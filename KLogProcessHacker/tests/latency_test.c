@@ -0,0 +1,91 @@
+//----------------------------------------------------------------------------
+// Host tests for the latency histogram buckets
+//
+// Checks GetLatencyBucket against the bucket layout ioctls.h documents for
+// readers, at zero, every bucket edge, every power of 2, and the largest
+// duration, then prints how long a lookup takes.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <time.h>
+
+#include "kph.h"
+#include "test.h"
+
+#define TIMED_LOOKUPS 5000000
+
+//----------------------------------------------------------------------------
+// First duration in a bucket, as ioctls.h documents it
+static UINT64 GetBucketStart(const UINT32 bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    return (UINT64)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) <<
+            (bucket / LATENCY_SUB_BUCKETS - 1);
+}
+
+//----------------------------------------------------------------------------
+static double GetSeconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    const UINT64 lastStart = GetBucketStart(LATENCY_BUCKETS - 1);
+    UINT64       checksum  = 0;
+    UINT64       ticks     = 1;
+    double       start;
+
+    CHECK(GetLatencyBucket(0) == 0);
+    CHECK(GetLatencyBucket(_UI64_MAX) == LATENCY_BUCKETS - 1);
+
+    // Each bucket holds exactly the durations from its start up to the next
+    // bucket's start, and the last one holds everything longer
+    for (UINT32 bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        CHECK(GetLatencyBucket(GetBucketStart(bucket)) == bucket);
+        if (bucket + 1 < LATENCY_BUCKETS) {
+            CHECK(GetLatencyBucket(GetBucketStart(bucket + 1) - 1) == bucket);
+        }
+    }
+
+    // A power of 2 starts the first bucket of its group, and the duration
+    // just below it ends the group before
+    for (UINT32 bit = 0; bit < 64; bit++) {
+        const UINT64 power  = 1ULL << bit;
+        const UINT32 bucket = GetLatencyBucket(power);
+
+        if (power < LATENCY_SUB_BUCKETS) {
+            CHECK(bucket == power);
+        } else if (power <= lastStart) {
+            CHECK(bucket == (bit - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS);
+            CHECK(GetLatencyBucket(power - 1) == bucket - 1);
+        } else {
+            CHECK(bucket == LATENCY_BUCKETS - 1);
+        }
+        CHECK(GetLatencyBucket(power | (power - 1)) >= bucket);
+    }
+
+    // Buckets are never wider than 1 / LATENCY_SUB_BUCKETS of their start
+    for (UINT32 bucket = LATENCY_SUB_BUCKETS; bucket + 1 < LATENCY_BUCKETS; bucket++) {
+        CHECK((GetBucketStart(bucket + 1) - GetBucketStart(bucket)) * LATENCY_SUB_BUCKETS <=
+                GetBucketStart(bucket));
+    }
+
+    start = GetSeconds();
+    for (UINT32 index = 0; index < TIMED_LOOKUPS; index++) {
+        ticks     = ticks * 6364136223846793005ULL + 1442695040888963407ULL;
+        checksum += GetLatencyBucket(ticks >> (index & 63));
+    }
+    printf("GetLatencyBucket: %.2f ns per lookup (checksum %llu)\n",
+            (GetSeconds() - start) / TIMED_LOOKUPS * 1e9, (unsigned long long)checksum);
+    return TEST_RESULT("latency");
+}
@@ -0,0 +1,1044 @@
+//----------------------------------------------------------------------------
+// Replays an event trace through the queue manager and read interface
+//
+// Builds queue_manager.c and read_interface.c unchanged against the kernel
+// stand-in in kernel/.  Producer threads feed the trace's process,
+// connection, and packet events to QmEnqueue*, while readers open the
+// device and read with DispatchRead like a user-mode client.  Prints events
+// per second, enqueue and delivery latency percentiles, the throughput of
+// each synchronous reader's reads, and peak memory, and fails if a result
+// regresses past a threshold:
+//
+//   replay [options] [trace.pcapng]
+//
+// Without a trace, generates sessions of a process start, a connection open,
+// packets, a connection close, and a process end.  Use -w to record what the
+// first reader reads, which replays with the same events.  With -s, each
+// producer drives one of synthetic.c's generators instead, so the events are
+// the ones IOCTL_KPH_GENERATE_SYNTHETIC_EVENTS enqueues.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kph.h"
+#include "read_interface_priv.h"
+
+#define MAX_PRODUCERS      64
+#define MAX_READERS        16
+#define READ_LENGTH        (64 * 1024)
+#define SESSION_PACKETS    8            // Packets in each generated session
+#define IDLE_TIMEOUT       (-100000)    // Readers wait 10ms for the data event before reading again
+
+// Event types in a trace
+enum REPLAY_EVENT_TYPE {
+    ReplayProcess,
+    ReplayConnection,
+    ReplayPacket,
+};
+
+// One event to feed to the queue manager
+typedef struct REPLAY_EVENT {
+    UINT8           Type;
+    bool            Started;         // Process started or connection opened
+    UINT8           Protocol;
+    UINT16          AddressFamily;
+    UINT16          Port;
+    UINT32          Producer;        // Thread that enqueues the event
+    UINT32          ProcessId;
+    UINT32          ParentPid;
+    UINT32          ConnectionId;
+    UINT32          Direction;
+    UINT32          CapturedLength;
+    UINT32          PacketLength;
+    const UINT8    *Data;            // Packet data
+    UNICODE_STRING  Path;
+    UNICODE_STRING  Args;
+    UNICODE_STRING  Sid;
+} REPLAY_EVENT;
+
+typedef struct REPLAY_TRACE {
+    REPLAY_EVENT *Events;
+    UINT32        Count;
+    UINT32        Size;
+} REPLAY_TRACE;
+
+// Sorted samples for percentiles
+typedef struct SAMPLES {
+    UINT32 *Values;
+    UINT64  Count;
+    UINT64  Size;
+} SAMPLES;
+
+typedef struct PRODUCER {
+    pthread_t  Thread;
+    UINT32     Index;
+    UINT64     Events;
+    UINT64     FailedEvents;
+    SAMPLES    Enqueue;          // Nanoseconds per QmEnqueue* call
+} PRODUCER;
+
+typedef struct READER {
+    pthread_t      Thread;
+    UINT32         Index;
+    UINT32         SnapLength;
+    FILE_OBJECT    FileObject;
+    KEVENT         DataEvent;
+    KEVENT         ReadDone;     // Set when an overlapped read completes
+    UINT8          Buffer[READ_LENGTH];
+    UINT8         *Stream;       // Bytes read that do not make a whole block yet
+    UINT32         StreamLength;
+    UINT64         Blocks;
+    UINT64         Bytes;
+    UINT64         DroppedBlocks;
+    double         ReadSeconds;  // Time in synchronous DispatchRead calls that returned blocks
+    SAMPLES        Delivery;     // Microseconds from block timestamp to read
+    FILE          *Output;       // Where to record blocks (NULL if not recording)
+    STATISTICS_V2  Statistics;   // Statistics just before closing
+} READER;
+
+// Results that -O writes and -B compares against
+typedef struct RESULTS {
+    double EventsPerSecond;
+    double EnqueueP99;           // Nanoseconds
+    double DeliveryP99;          // Microseconds
+    double PeakPoolKb;
+} RESULTS;
+
+static DEVICE_EXTENSION  gDeviceExtension;
+static DEVICE_OBJECT     gDevice          = { &gDeviceExtension };
+static REPLAY_TRACE      gTrace;
+static pthread_barrier_t gStartBarrier;
+static volatile bool     gProducersDone   = false;
+static bool              gOverlapped      = false;
+static UINT32            gRate            = 0;     // Events per second for all producers (0 for unlimited)
+static UINT32            gNumProducers    = 2;
+static UINT32            gIterations      = 1;
+static UINT32            gSyntheticEvents = 0;     // Events for -s (0 to replay a trace)
+static SYNTHETIC_EVENTS_REQUEST gSynthetic;        // Event mix for -s
+static UINT8             gPacketData[1500];        // Shared by every generated packet
+static WCHAR             gGeneratedPath[] = L"\\SystemRoot\\replay.exe";
+static WCHAR             gGeneratedArgs[] = L"replay.exe --generated";
+
+//----------------------------------------------------------------------------
+static double GetSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//----------------------------------------------------------------------------
+static void *Allocate(const size_t size)
+{
+    void *buffer = calloc(1, size);
+    if (!buffer) {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    return buffer;
+}
+
+//----------------------------------------------------------------------------
+static void AddSample(SAMPLES *samples, const UINT64 value)
+{
+    if (samples->Count < samples->Size) {
+        samples->Values[samples->Count] = (UINT32)min(value, (UINT64)_UI32_MAX);
+    }
+    samples->Count++;
+}
+
+//----------------------------------------------------------------------------
+static int CompareSamples(const void *first, const void *second)
+{
+    const UINT32 a = *(const UINT32*)first;
+    const UINT32 b = *(const UINT32*)second;
+    return (a > b) - (a < b);
+}
+
+//----------------------------------------------------------------------------
+// Merges the samples and sorts them, so GetPercentile can index them
+static void MergeSamples(SAMPLES *merged, SAMPLES *samples, const size_t stride,
+        const UINT32 count)
+{
+    UINT64 total = 0;
+
+    for (UINT32 index = 0; index < count; index++) {
+        const SAMPLES *source = (const SAMPLES*)((char*)samples + index * stride);
+        total += min(source->Count, source->Size);
+    }
+    merged->Values = Allocate(max(total, 1) * sizeof(UINT32));
+    merged->Size   = total;
+    merged->Count  = 0;
+    for (UINT32 index = 0; index < count; index++) {
+        const SAMPLES *source = (const SAMPLES*)((char*)samples + index * stride);
+        const UINT64   kept   = min(source->Count, source->Size);
+        memcpy(merged->Values + merged->Count, source->Values, kept * sizeof(UINT32));
+        merged->Count += kept;
+    }
+    qsort(merged->Values, merged->Count, sizeof(UINT32), CompareSamples);
+}
+
+//----------------------------------------------------------------------------
+static UINT32 GetPercentile(const SAMPLES *samples, const double percent)
+{
+    UINT64 index;
+
+    if (!samples->Count) {
+        return 0;
+    }
+    index = (UINT64)(percent / 100 * (samples->Count - 1) + 0.5);
+    return samples->Values[index];
+}
+
+//----------------------------------------------------------------------------
+static void PrintPercentiles(const char *name, const SAMPLES *samples)
+{
+    printf("%-22s p50 %8u  p90 %8u  p99 %8u  p99.9 %8u  max %8u\n", name,
+            GetPercentile(samples, 50), GetPercentile(samples, 90),
+            GetPercentile(samples, 99), GetPercentile(samples, 99.9),
+            GetPercentile(samples, 100));
+}
+
+//----------------------------------------------------------------------------
+// Trace loading and generation
+//----------------------------------------------------------------------------
+
+static REPLAY_EVENT *AddEvent(const UINT8 type, const UINT32 processId)
+{
+    REPLAY_EVENT *event;
+
+    if (gTrace.Count == gTrace.Size) {
+        gTrace.Size   = max(gTrace.Size * 2, 4096);
+        gTrace.Events = realloc(gTrace.Events, gTrace.Size * sizeof(REPLAY_EVENT));
+        if (!gTrace.Events) {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+    }
+    event = &gTrace.Events[gTrace.Count++];
+    memset(event, 0, sizeof(REPLAY_EVENT));
+    event->Type      = type;
+    event->ProcessId = processId;
+    return event;
+}
+
+//----------------------------------------------------------------------------
+// Only decodes characters in the basic multilingual plane, which covers the
+// paths and arguments the driver records
+static void SetString(UNICODE_STRING *string, const char *utf8, UINT32 length,
+        const bool argv)
+{
+    WCHAR  *buffer = Allocate((length + 1) * sizeof(WCHAR));
+    UINT32  count  = 0;
+
+    // Argument lists are null-separated, so join them back into a command line
+    while (length && !utf8[length - 1]) {
+        length--;
+    }
+    for (UINT32 index = 0; index < length; index++) {
+        const UINT8 c = (UINT8)utf8[index];
+        if (c < 0x80) {
+            buffer[count++] = (argv && !c) ? ' ' : c;
+        } else if (((c & 0xE0) == 0xC0) && (index + 1 < length)) {
+            buffer[count++] = (WCHAR)(((c & 0x1F) << 6) | (utf8[index + 1] & 0x3F));
+            index += 1;
+        } else if (((c & 0xF0) == 0xE0) && (index + 2 < length)) {
+            buffer[count++] = (WCHAR)(((c & 0x0F) << 12) |
+                    ((utf8[index + 1] & 0x3F) << 6) | (utf8[index + 2] & 0x3F));
+            index += 2;
+        } else {
+            buffer[count++] = 0xFFFD;
+        }
+    }
+    string->Buffer        = buffer;
+    string->Length        = (USHORT)(count * sizeof(WCHAR));
+    string->MaximumLength = (USHORT)((count + 1) * sizeof(WCHAR));
+}
+
+//----------------------------------------------------------------------------
+// Takes the address family, protocol, and local port from the IP header
+static void SetPacketAddress(REPLAY_EVENT *event)
+{
+    const UINT8 *data   = event->Data;
+    UINT32       offset = 0;
+
+    event->AddressFamily = AF_INET;
+    event->Protocol      = IPPROTO_TCP;
+    if ((event->CapturedLength >= 20) && ((data[0] >> 4) == 4)) {
+        event->Protocol = data[9];
+        offset          = (data[0] & 0x0F) * 4;
+    } else if ((event->CapturedLength >= 40) && ((data[0] >> 4) == 6)) {
+        event->AddressFamily = AF_INET6;
+        event->Protocol      = data[6];
+        offset               = 40;
+    }
+    if (offset && (offset + 4 <= event->CapturedLength)) {
+        const UINT8 *port = data + offset + ((event->Direction == Outbound) ? 0 : 2);
+        event->Port = (UINT16)((port[0] << 8) | port[1]);
+    }
+}
+
+//----------------------------------------------------------------------------
+static void AddProcessBlock(const char *block, const UINT32 length)
+{
+    const PCAP_NG_PROCESS_HEADER *header = (const PCAP_NG_PROCESS_HEADER*)block;
+    REPLAY_EVENT                 *event  = AddEvent(ReplayProcess, header->ProcessId);
+    bool                          rawArgs = false;
+    UINT32                        offset  = sizeof(PCAP_NG_PROCESS_HEADER);
+
+    event->Started   = true;
+    event->ParentPid = header->ParentPid;
+    while (offset + sizeof(PCAP_NG_OPTION_HEADER) <= length - sizeof(UINT32)) {
+        const PCAP_NG_OPTION_HEADER *option = (const PCAP_NG_OPTION_HEADER*)(block + offset);
+        const char                  *value  = (const char*)(option + 1);
+
+        if (!option->OptionCode) {
+            break;
+        }
+        switch (option->OptionCode) {
+        case 2:
+            event->Started = false;
+            break;
+        case 3:
+            SetString(&event->Path, value, option->OptionLength, false);
+            break;
+        case 4:
+            if (!rawArgs) {
+                free(event->Args.Buffer);
+                SetString(&event->Args, value, option->OptionLength, true);
+            }
+            break;
+        case 10:
+            SetString(&event->Sid, value, option->OptionLength, false);
+            break;
+        case 11:
+            free(event->Args.Buffer);
+            SetString(&event->Args, value, option->OptionLength, false);
+            rawArgs = true;
+            break;
+        }
+        offset += sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(option->OptionLength);
+    }
+}
+
+//----------------------------------------------------------------------------
+static void AddConnectionBlock(const char *block, const UINT32 length)
+{
+    const PCAP_NG_CONNECTION_HEADER *header = (const PCAP_NG_CONNECTION_HEADER*)block;
+    const PCAP_NG_OPTION_HEADER     *option = (const PCAP_NG_OPTION_HEADER*)(header + 1);
+    REPLAY_EVENT                    *event  = AddEvent(ReplayConnection, header->ProcessId);
+
+    event->ConnectionId = header->ConnectionId;
+    event->Started      = !((sizeof(PCAP_NG_CONNECTION_HEADER) + sizeof(PCAP_NG_OPTION_HEADER) <
+            length) && (option->OptionCode == 2));
+}
+
+//----------------------------------------------------------------------------
+static void AddPacketBlock(const char *block, const UINT32 length)
+{
+    const PCAP_NG_PACKET_HEADER *header = (const PCAP_NG_PACKET_HEADER*)block;
+    const PCAP_NG_PACKET_FOOTER *footer;
+    REPLAY_EVENT                *event;
+
+    if (sizeof(PCAP_NG_PACKET_HEADER) + PCAP_NG_PADDING(header->CapturedLength) +
+            sizeof(PCAP_NG_PACKET_FOOTER) != length) {
+        return; // Not a packet block from the driver
+    }
+    footer = (const PCAP_NG_PACKET_FOOTER*)(block + sizeof(PCAP_NG_PACKET_HEADER) +
+            PCAP_NG_PADDING(header->CapturedLength));
+    event = AddEvent(ReplayPacket, footer->ProcessId);
+    event->ConnectionId   = footer->ConnectionId;
+    event->Direction      = footer->Flags;
+    event->CapturedLength = header->CapturedLength;
+    event->PacketLength   = header->PacketLength;
+    event->Data           = (const UINT8*)(header + 1);
+    SetPacketAddress(event);
+}
+
+//----------------------------------------------------------------------------
+// The file stays loaded, since packet events point into it
+static bool LoadTrace(const char *path)
+{
+    FILE   *file = fopen(path, "rb");
+    char   *data;
+    long    size;
+    UINT32  offset = 0;
+
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = Allocate(size + 1);
+    if (fread(data, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    while (offset + 12 <= (UINT32)size) {
+        const UINT32 type   = *(const UINT32*)(data + offset);
+        const UINT32 length = *(const UINT32*)(data + offset + 4);
+
+        if ((length < 12) || (length & 3) || (length > (UINT32)size - offset)) {
+            fprintf(stderr, "Bad block at offset %u in %s\n", offset, path);
+            return false;
+        }
+        switch (type) {
+        case ProcessBlock:
+            AddProcessBlock(data + offset, length);
+            break;
+        case ConnectionBlock:
+            AddConnectionBlock(data + offset, length);
+            break;
+        case PacketBlock:
+            AddPacketBlock(data + offset, length);
+            break;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+static void InitString(UNICODE_STRING *string, WCHAR *buffer, const size_t size)
+{
+    string->Buffer        = buffer;
+    string->Length        = (USHORT)(size - sizeof(WCHAR));
+    string->MaximumLength = (USHORT)size;
+}
+
+//----------------------------------------------------------------------------
+// Each session runs in order on one producer, since its process ID picks the
+// producer
+static void GenerateTrace(const UINT32 numEvents)
+{
+    UINT32 random = 12345;
+
+    // An IPv4 header and TCP header to local port 9
+    gPacketData[0]  = 0x45;
+    gPacketData[9]  = IPPROTO_TCP;
+    gPacketData[21] = 9;
+
+    for (UINT32 session = 0; gTrace.Count < numEvents; session++) {
+        const UINT32  processId    = 1000 + session * 4;
+        const UINT32  connectionId = session + 1;
+        REPLAY_EVENT *event;
+
+        event = AddEvent(ReplayProcess, processId);
+        event->Started   = true;
+        event->ParentPid = 4;
+        InitString(&event->Path, gGeneratedPath, sizeof(gGeneratedPath));
+        InitString(&event->Args, gGeneratedArgs, sizeof(gGeneratedArgs));
+
+        event = AddEvent(ReplayConnection, processId);
+        event->Started      = true;
+        event->ConnectionId = connectionId;
+
+        for (UINT32 packet = 0; packet < SESSION_PACKETS; packet++) {
+            random = random * 1664525 + 1013904223;
+            event = AddEvent(ReplayPacket, processId);
+            event->ConnectionId   = connectionId;
+            event->Direction      = (packet & 1) ? Inbound : Outbound;
+            event->CapturedLength = 64 + (random >> 8) % (sizeof(gPacketData) - 64);
+            event->PacketLength   = event->CapturedLength;
+            event->Data           = gPacketData;
+            SetPacketAddress(event);
+        }
+
+        event = AddEvent(ReplayConnection, processId);
+        event->ConnectionId = connectionId;
+
+        AddEvent(ReplayProcess, processId);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Producers
+//----------------------------------------------------------------------------
+
+static NTSTATUS EnqueueEvent(const REPLAY_EVENT *event)
+{
+    BLOCK_NODE *blockNode;
+    char       *data;
+
+    switch (event->Type) {
+    case ReplayProcess:
+        return QmEnqueueProcessBlock(event->Started, event->ProcessId, event->ParentPid,
+                event->Path.Buffer ? (UNICODE_STRING*)&event->Path : NULL,
+                event->Args.Buffer ? (UNICODE_STRING*)&event->Args : NULL,
+                event->Sid.Buffer ? (UNICODE_STRING*)&event->Sid : NULL, NULL, NULL);
+    case ReplayConnection:
+        return QmEnqueueConnectionBlock(event->Started, event->ConnectionId,
+                event->ProcessId);
+    default:
+        blockNode = QmAllocatePacketBlock(event->CapturedLength, &data);
+        if (!blockNode) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        memcpy(data, event->Data, event->CapturedLength);
+        return QmEnqueuePacketBlock(blockNode, event->Direction, event->CapturedLength,
+                event->PacketLength, event->ConnectionId, event->AddressFamily,
+                event->Protocol, event->Port);
+    }
+}
+
+//----------------------------------------------------------------------------
+static void WaitForRate(const PRODUCER *producer, const UINT32 rate, const double start)
+{
+    while (rate && (producer->Events > (GetSeconds() - start) * rate)) {
+        const struct timespec delay = { 0, 100000 };
+        nanosleep(&delay, NULL);
+    }
+}
+
+//----------------------------------------------------------------------------
+static void *RunProducer(void *context)
+{
+    PRODUCER     *producer = (PRODUCER*)context;
+    const UINT32  rate     = gRate / gNumProducers;
+    double        start;
+
+    pthread_barrier_wait(&gStartBarrier);
+    start = GetSeconds();
+    for (UINT32 iteration = 0; iteration < gIterations; iteration++) {
+        for (UINT32 index = 0; index < gTrace.Count; index++) {
+            const REPLAY_EVENT *event = &gTrace.Events[index];
+            double              before;
+
+            if (event->Producer != producer->Index) {
+                continue;
+            }
+            WaitForRate(producer, rate, start);
+            before = GetSeconds();
+            if (!NT_SUCCESS(EnqueueEvent(event))) {
+                producer->FailedEvents++;
+            }
+            AddSample(&producer->Enqueue, (UINT64)((GetSeconds() - before) * 1e9));
+            producer->Events++;
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// Times each event a generator enqueues.  Opening and closing the generator's
+// process and connection are not timed or counted.
+static void *RunSyntheticProducer(void *context)
+{
+    PRODUCER         *producer = (PRODUCER*)context;
+    const UINT32      rate     = gRate / gNumProducers;
+    const UINT32      count    = gSyntheticEvents / gNumProducers +
+            ((producer->Index < gSyntheticEvents % gNumProducers) ? 1 : 0);
+    SYNTHETIC_THREAD  thread;
+    double            start;
+
+    InitializeSyntheticThread(&thread, &gSynthetic, producer->Index, ClockGetUptime());
+    pthread_barrier_wait(&gStartBarrier);
+    OpenSyntheticThread(&thread);
+    start = GetSeconds();
+    for (UINT32 index = 0; index < count; index++) {
+        double before;
+
+        WaitForRate(producer, rate, start);
+        before = GetSeconds();
+        GenerateSyntheticEvent(&thread);
+        AddSample(&producer->Enqueue, (UINT64)((GetSeconds() - before) * 1e9));
+        producer->Events++;
+    }
+    CloseSyntheticThread(&thread);
+    producer->FailedEvents = thread.FailedEvents;
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// Readers
+//----------------------------------------------------------------------------
+
+static NTSTATUS CallDriver(DRIVER_DISPATCH *dispatch, READER *reader, IRP *irp)
+{
+    irp->Stack.FileObject      = &reader->FileObject;
+    irp->Tail.Overlay.Thread   = PsGetCurrentThread();
+    return dispatch(&gDevice, irp);
+}
+
+//----------------------------------------------------------------------------
+static NTSTATUS ReaderIoctl(READER *reader, const UINT32 code, void *buffer,
+        const UINT32 inputLength, const UINT32 outputLength)
+{
+    IRP irp;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.AssociatedIrp.SystemBuffer = buffer;
+    irp.Stack.Parameters.DeviceIoControl.IoControlCode      = code;
+    irp.Stack.Parameters.DeviceIoControl.InputBufferLength  = inputLength;
+    irp.Stack.Parameters.DeviceIoControl.OutputBufferLength = outputLength;
+    CallDriver(DispatchDeviceControl, reader, &irp);
+    return irp.IoStatus.Status;
+}
+
+//----------------------------------------------------------------------------
+static bool OpenReader(READER *reader)
+{
+    UINT64 event = (UINT64)(ULONG_PTR)&reader->DataEvent;
+    IRP    irp;
+
+    memset(&irp, 0, sizeof(irp));
+    reader->FileObject.Flags = gOverlapped ? 0 : FO_SYNCHRONOUS_IO;
+    KeInitializeEvent(&reader->DataEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&reader->ReadDone, NotificationEvent, FALSE);
+    if (!NT_SUCCESS(CallDriver(DispatchCreate, reader, &irp))) {
+        fprintf(stderr, "Cannot open reader %u: %08X\n", reader->Index, irp.IoStatus.Status);
+        return false;
+    }
+    if (!NT_SUCCESS(ReaderIoctl(reader, IOCTL_KPH_SET_SNAP_LENGTH, &reader->SnapLength,
+            sizeof(UINT32), 0)) ||
+            !NT_SUCCESS(ReaderIoctl(reader, IOCTL_KPH_SET_DATA_EVENT_64, &event,
+            sizeof(UINT64), 0))) {
+        fprintf(stderr, "Cannot set up reader %u\n", reader->Index);
+        return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+static void CloseReader(READER *reader)
+{
+    IRP irp;
+
+    ReaderIoctl(reader, IOCTL_KPH_GET_STATISTICS_V2, &reader->Statistics, 0,
+            sizeof(STATISTICS_V2));
+    for (UINT32 type = 0; type < NumStatisticsBlockTypes; type++) {
+        reader->DroppedBlocks += reader->Statistics.ReaderDroppedBlocks[type];
+    }
+
+    memset(&irp, 0, sizeof(irp));
+    CallDriver(DispatchCleanup, reader, &irp);
+    memset(&irp, 0, sizeof(irp));
+    CallDriver(DispatchClose, reader, &irp);
+}
+
+//----------------------------------------------------------------------------
+// Blocks can span reads, so keep the partial block for the next read
+static void ParseBlocks(READER *reader, const UINT8 *buffer, const UINT32 length)
+{
+    LARGE_INTEGER now;
+    UINT32        offset = 0;
+
+    if (reader->Output) {
+        fwrite(buffer, 1, length, reader->Output);
+    }
+    reader->Bytes += length;
+    memcpy(reader->Stream + reader->StreamLength, buffer, length);
+    reader->StreamLength += length;
+
+    ClockGetTimestamp(&now, NULL);
+    while (offset + 8 <= reader->StreamLength) {
+        const UINT32 *header = (const UINT32*)(reader->Stream + offset);
+        const UINT32  type   = header[0];
+        const UINT32  size   = header[1];
+        UINT32        timestamp = 0;
+
+        if ((size < 12) || (size & 3)) {
+            fprintf(stderr, "Reader %u read a bad block length %u after %llu blocks\n",
+                    reader->Index, size, (unsigned long long)reader->Blocks);
+            exit(2);
+        }
+        if (offset + size > reader->StreamLength) {
+            break;
+        }
+        switch (type) {
+        case ProcessBlock:
+        case PacketBlock:
+            timestamp = 3;
+            break;
+        case ConnectionBlock:
+            timestamp = 4;
+            break;
+        }
+        if (timestamp) {
+            const LONGLONG blockTime = ((LONGLONG)header[timestamp] << 32) |
+                    header[timestamp + 1];
+            AddSample(&reader->Delivery, (UINT64)max(now.QuadPart - blockTime, 0));
+        }
+        reader->Blocks++;
+        offset += size;
+    }
+    reader->StreamLength -= offset;
+    memmove(reader->Stream, reader->Stream + offset, reader->StreamLength);
+}
+
+//----------------------------------------------------------------------------
+// Like a user-mode client, waits with a timeout.  The driver only sets the
+// data event when a block goes into an empty ring buffer, so a reader that
+// misses it must read again rather than wait for the next one.
+static bool WaitForBlocks(KEVENT *event)
+{
+    LARGE_INTEGER timeout;
+
+    timeout.QuadPart = IDLE_TIMEOUT;
+    return (KeWaitForSingleObject(event, Executive, UserMode, FALSE, &timeout) !=
+            STATUS_TIMEOUT);
+}
+
+//----------------------------------------------------------------------------
+static void *RunReader(void *context)
+{
+    READER *reader  = (READER*)context;
+    bool    pending = false;
+    IRP     irp;
+
+    for (;;) {
+        // Once the producers are done before a read, a read that finds no
+        // blocks means the reader has them all
+        const bool done = gProducersDone;
+
+        memset(&irp, 0, sizeof(irp));
+        irp.AssociatedIrp.SystemBuffer = reader->Buffer;
+        irp.Stack.Parameters.Read.Length = READ_LENGTH;
+        if (gOverlapped) {
+            // The read DPC completes the read once there are blocks
+            KeClearEvent(&reader->ReadDone);
+            irp.UserEvent = &reader->ReadDone;
+            CallDriver(DispatchRead, reader, &irp);
+            while (!WaitForBlocks(&reader->ReadDone)) {
+                if (gProducersDone) {
+                    pending = true;
+                    break;
+                }
+            }
+            if (pending) {
+                break;
+            }
+        } else {
+            const double before = GetSeconds();
+
+            CallDriver(DispatchRead, reader, &irp);
+            if (!irp.IoStatus.Information) {
+                if (done) {
+                    break;
+                }
+                WaitForBlocks(&reader->DataEvent);
+                continue;
+            }
+            reader->ReadSeconds += GetSeconds() - before;
+        }
+        if (NT_SUCCESS(irp.IoStatus.Status) && irp.IoStatus.Information) {
+            ParseBlocks(reader, reader->Buffer, (UINT32)irp.IoStatus.Information);
+        }
+    }
+
+    // Closing the reader cancels the read that is still pending
+    CloseReader(reader);
+    if (pending) {
+        KeWaitForSingleObject(&reader->ReadDone, Executive, UserMode, FALSE, NULL);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// Results
+//----------------------------------------------------------------------------
+
+static bool WriteResults(const char *path, const RESULTS *results)
+{
+    FILE *file = fopen(path, "w");
+
+    if (!file) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return false;
+    }
+    fprintf(file, "events_per_second %.0f\n", results->EventsPerSecond);
+    fprintf(file, "enqueue_p99_ns %.0f\n", results->EnqueueP99);
+    fprintf(file, "delivery_p99_us %.0f\n", results->DeliveryP99);
+    fprintf(file, "peak_pool_kb %.0f\n", results->PeakPoolKb);
+    fclose(file);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// Fails if the result is worse than the limit, or worse than the baseline by
+// more than the allowed percentage
+static bool CheckResult(const char *name, const double value, const double limit,
+        const double baseline, const double percent, const bool higherIsBetter)
+{
+    bool passed = true;
+
+    if (limit && (higherIsBetter ? (value < limit) : (value > limit))) {
+        printf("Regression: %s is %.0f, past the limit of %.0f\n", name, value, limit);
+        passed = false;
+    }
+    if (baseline) {
+        const double allowed = higherIsBetter ? baseline * (1 - percent / 100) :
+                baseline * (1 + percent / 100);
+        if (higherIsBetter ? (value < allowed) : (value > allowed)) {
+            printf("Regression: %s is %.0f, more than %.0f%% worse than the baseline %.0f\n",
+                    name, value, percent, baseline);
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+//----------------------------------------------------------------------------
+static bool ReadBaseline(const char *path, RESULTS *baseline)
+{
+    FILE   *file = fopen(path, "r");
+    char    name[64];
+    double  value;
+
+    if (!file) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return false;
+    }
+    while (fscanf(file, "%63s %lf", name, &value) == 2) {
+        if (!strcmp(name, "events_per_second")) {
+            baseline->EventsPerSecond = value;
+        } else if (!strcmp(name, "enqueue_p99_ns")) {
+            baseline->EnqueueP99 = value;
+        } else if (!strcmp(name, "delivery_p99_us")) {
+            baseline->DeliveryP99 = value;
+        } else if (!strcmp(name, "peak_pool_kb")) {
+            baseline->PeakPoolKb = value;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+static void Usage(void)
+{
+    fprintf(stderr,
+        "Usage: replay [options] [trace.pcapng]\n"
+        "  -g events   Generate this many events instead of replaying a trace\n"
+        "  -s events   Enqueue this many events from synthetic.c's generators, one per\n"
+        "              producer, in a 1:2:13 process, connection, and 96-byte packet mix\n"
+        "  -i count    Replay the trace this many times (default 1)\n"
+        "  -p threads  Producer threads (default 2)\n"
+        "  -r readers  Readers (default 1)\n"
+        "  -n lengths  Comma-separated snap lengths, one per reader in turn (default 0)\n"
+        "  -o          Read with overlapped reads instead of synchronous reads\n"
+        "  -R rate     Events per second for all producers (default unlimited)\n"
+        "  -q blocks   Ring buffer size in blocks\n"
+        "  -w file     Record the blocks the first reader reads\n"
+        "  -O file     Write the results to a file\n"
+        "  -B file     Compare against results written by -O\n"
+        "  -x percent  Regression allowed against -B (default 20)\n"
+        "  -m rate     Fail below this many events per second\n"
+        "  -l usec     Fail above this p99 delivery latency in microseconds\n"
+        "  -k kbytes   Fail above this peak pool use in KB\n");
+}
+
+//----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+    PRODUCER  *producers;
+    READER    *readers;
+    RESULTS    results;
+    RESULTS    baseline        = { 0, 0, 0, 0 };
+    RESULTS    limits          = { 0, 0, 0, 0 };
+    SAMPLES    enqueue;
+    SAMPLES    delivery;
+    UINT32     snapLengths[MAX_READERS] = { 0 };
+    UINT32     numSnapLengths  = 1;
+    UINT32     numReaders      = 1;
+    UINT32     generate        = 0;
+    UINT64     numEvents;
+    UINT64     events          = 0;
+    UINT64     failedEvents    = 0;
+    UINT64     driverPeak      = 0;
+    double     percent         = 20;
+    double     start;
+    double     elapsed;
+    const char *recordPath     = NULL;
+    const char *resultsPath    = NULL;
+    const char *baselinePath   = NULL;
+    bool       passed          = true;
+    int        option;
+
+    while ((option = getopt(argc, argv, "g:s:i:p:r:n:oR:q:w:O:B:x:m:l:k:")) != -1) {
+        switch (option) {
+        case 'g': generate       = (UINT32)strtoul(optarg, NULL, 0); break;
+        case 's': gSyntheticEvents = (UINT32)strtoul(optarg, NULL, 0); break;
+        case 'i': gIterations    = (UINT32)strtoul(optarg, NULL, 0); break;
+        case 'p': gNumProducers  = (UINT32)strtoul(optarg, NULL, 0); break;
+        case 'r': numReaders     = (UINT32)strtoul(optarg, NULL, 0); break;
+        case 'o': gOverlapped    = true; break;
+        case 'R': gRate          = (UINT32)strtoul(optarg, NULL, 0); break;
+        case 'q': HostSetRegistryDword("RingBufferSize", (UINT32)strtoul(optarg, NULL, 0)); break;
+        case 'w': recordPath     = optarg; break;
+        case 'O': resultsPath    = optarg; break;
+        case 'B': baselinePath   = optarg; break;
+        case 'x': percent        = strtod(optarg, NULL); break;
+        case 'm': limits.EventsPerSecond = strtod(optarg, NULL); break;
+        case 'l': limits.DeliveryP99     = strtod(optarg, NULL); break;
+        case 'k': limits.PeakPoolKb      = strtod(optarg, NULL); break;
+        case 'n':
+        {
+            char *next = optarg;
+            for (numSnapLengths = 0; (numSnapLengths < MAX_READERS) && *next;
+                    numSnapLengths++) {
+                snapLengths[numSnapLengths] = (UINT32)strtoul(next, &next, 0);
+                if (*next == ',') {
+                    next++;
+                }
+            }
+            break;
+        }
+        default:
+            Usage();
+            return 2;
+        }
+    }
+    if (!gNumProducers || (gNumProducers > MAX_PRODUCERS) || !numReaders ||
+            (numReaders > MAX_READERS) || !numSnapLengths || !gIterations ||
+            ((optind < argc) + (generate != 0) + (gSyntheticEvents != 0) != 1)) {
+        Usage();
+        return 2;
+    }
+    if (baselinePath && !ReadBaseline(baselinePath, &baseline)) {
+        return 2;
+    }
+    if (gSyntheticEvents) {
+        gSynthetic.NumThreads       = gNumProducers;
+        gSynthetic.ProcessWeight    = 1;
+        gSynthetic.ConnectionWeight = 2;
+        gSynthetic.PacketWeight     = 13;
+        gSynthetic.PacketLength     = 96;
+    } else if (generate) {
+        GenerateTrace(generate);
+    } else if (!LoadTrace(argv[optind])) {
+        return 2;
+    }
+    numEvents = gSyntheticEvents ? gSyntheticEvents : (UINT64)gTrace.Count * gIterations;
+    for (UINT32 index = 0; index < gTrace.Count; index++) {
+        gTrace.Events[index].Producer = GetConsumerGroupMember(
+                gTrace.Events[index].ProcessId, gNumProducers);
+    }
+
+    // Start the driver in the order DriverEntry does
+    HostStartKernel();
+    if (!NT_SUCCESS(InitializeClock(&gDevice)) || !NT_SUCCESS(InitializeLatency(&gDevice)) ||
+            !NT_SUCCESS(InitializeTrace(&gDevice)) ||
+            !NT_SUCCESS(InitializeQueueManager(&gDevice)) ||
+            !NT_SUCCESS(InitializeReadInterface(&gDevice))) {
+        fprintf(stderr, "Cannot initialize the driver\n");
+        return 2;
+    }
+
+    readers = Allocate(numReaders * sizeof(READER));
+    for (UINT32 index = 0; index < numReaders; index++) {
+        READER *reader = &readers[index];
+
+        reader->Index           = index;
+        reader->SnapLength      = snapLengths[index % numSnapLengths];
+        reader->Stream          = Allocate(2 * READ_LENGTH + 65536);
+        reader->Delivery.Size   = numEvents + 4096;
+        reader->Delivery.Values = Allocate(reader->Delivery.Size * sizeof(UINT32));
+        if (!index && recordPath) {
+            reader->Output = fopen(recordPath, "wb");
+            if (!reader->Output) {
+                fprintf(stderr, "Cannot write %s\n", recordPath);
+                return 2;
+            }
+        }
+        if (!OpenReader(reader) || pthread_create(&reader->Thread, NULL, RunReader, reader)) {
+            return 2;
+        }
+    }
+
+    producers = Allocate(gNumProducers * sizeof(PRODUCER));
+    pthread_barrier_init(&gStartBarrier, NULL, gNumProducers + 1);
+    for (UINT32 index = 0; index < gNumProducers; index++) {
+        PRODUCER *producer = &producers[index];
+
+        producer->Index          = index;
+        producer->Enqueue.Size   = numEvents;
+        producer->Enqueue.Values = Allocate(max(producer->Enqueue.Size, 1) * sizeof(UINT32));
+        if (pthread_create(&producer->Thread, NULL,
+                gSyntheticEvents ? RunSyntheticProducer : RunProducer, producer)) {
+            return 2;
+        }
+    }
+    pthread_barrier_wait(&gStartBarrier);
+    start = GetSeconds();
+    for (UINT32 index = 0; index < gNumProducers; index++) {
+        pthread_join(producers[index].Thread, NULL);
+        events       += producers[index].Events;
+        failedEvents += producers[index].FailedEvents;
+    }
+    elapsed        = GetSeconds() - start;
+    gProducersDone = true;
+    for (UINT32 index = 0; index < numReaders; index++) {
+        pthread_join(readers[index].Thread, NULL);
+        if (readers[index].Output) {
+            fclose(readers[index].Output);
+        }
+    }
+    for (UINT32 tag = 0; tag < NumMemoryTags; tag++) {
+        driverPeak += readers[0].Statistics.Memory[tag].PeakBytes;
+    }
+
+    MergeSamples(&enqueue, &producers[0].Enqueue, sizeof(PRODUCER), gNumProducers);
+    MergeSamples(&delivery, &readers[0].Delivery, sizeof(READER), numReaders);
+    results.EventsPerSecond = elapsed ? events / elapsed : 0;
+    results.EnqueueP99      = GetPercentile(&enqueue, 99);
+    results.DeliveryP99     = GetPercentile(&delivery, 99);
+    results.PeakPoolKb      = HostPeakPoolBytes() / 1024.0;
+
+    printf("Replayed %llu events (%llu failed) with %u producers in %.3f s: %.0f events/s\n",
+            (unsigned long long)events, (unsigned long long)failedEvents, gNumProducers,
+            elapsed, results.EventsPerSecond);
+    PrintPercentiles("Enqueue latency (ns)", &enqueue);
+    PrintPercentiles("Delivery latency (us)", &delivery);
+    // Overlapped reads copy in the read DPC, so only synchronous reads are timed
+    for (UINT32 index = 0; index < numReaders; index++) {
+        const READER *reader = &readers[index];
+
+        printf("Reader %u: snap length %u, %llu blocks, %llu bytes, %llu dropped", index,
+                reader->SnapLength, (unsigned long long)reader->Blocks,
+                (unsigned long long)reader->Bytes, (unsigned long long)reader->DroppedBlocks);
+        if (reader->ReadSeconds) {
+            printf(", reads %.1f MB/s, %.0f blocks/s", reader->Bytes / reader->ReadSeconds / 1e6,
+                    reader->Blocks / reader->ReadSeconds);
+        }
+        printf("\n");
+    }
+    printf("Peak memory: %.0f KB host pool, %llu KB sum of driver tag peaks\n",
+            results.PeakPoolKb, (unsigned long long)(driverPeak / 1024));
+
+    if (!NT_SUCCESS(DeinitializeReadInterface()) || !NT_SUCCESS(DeinitializeQueueManager()) ||
+            !NT_SUCCESS(DeinitializeTrace()) || !NT_SUCCESS(DeinitializeLatency()) ||
+            !NT_SUCCESS(DeinitializeClock())) {
+        fprintf(stderr, "Cannot deinitialize the driver\n");
+        return 2;
+    }
+    HostStopKernel();
+
+    if (resultsPath && !WriteResults(resultsPath, &results)) {
+        return 2;
+    }
+    passed &= CheckResult("events_per_second", results.EventsPerSecond,
+            limits.EventsPerSecond, baseline.EventsPerSecond, percent, true);
+    passed &= CheckResult("enqueue_p99_ns", results.EnqueueP99, 0,
+            baseline.EnqueueP99, percent, false);
+    passed &= CheckResult("delivery_p99_us", results.DeliveryP99, limits.DeliveryP99,
+            baseline.DeliveryP99, percent, false);
+    passed &= CheckResult("peak_pool_kb", results.PeakPoolKb, limits.PeakPoolKb,
+            baseline.PeakPoolKb, percent, false);
+    if (failedEvents) {
+        printf("Regression: %llu events failed to enqueue\n", (unsigned long long)failedEvents);
+        passed = false;
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+//----------------------------------------------------------------------------
+// Host tests for the lock-free ring buffer
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "kph.h"
+#include "test.h"
+
+#define RING_LENGTH         64
+#define PRODUCERS           4
+#define BLOCKS_PER_PRODUCER 100000
+
+static RING_BUFFER   gRing;
+static void         *gSlots[RING_LENGTH];
+
+//----------------------------------------------------------------------------
+// Blocks are never NULL, so store each value plus one as the block pointer
+static void *ToBlock(const UINT32 value)
+{
+    return (void *)(ULONG_PTR)(value + 1);
+}
+
+static UINT32 FromBlock(const void *block)
+{
+    return (UINT32)(ULONG_PTR)block - 1;
+}
+
+//----------------------------------------------------------------------------
+static void TestFillAndDrain(void)
+{
+    UINT32 value;
+
+    InitRingBuffer(&gRing, gSlots, sizeof(gSlots));
+    CHECK(gRing.Length == RING_LENGTH);
+    CHECK(IsRingBufferEmpty(&gRing));
+    CHECK(RingBufferDequeue(&gRing) == NULL);
+
+    for (value = 0; value < RING_LENGTH; value++) {
+        CHECK(RingBufferEnqueue(&gRing, ToBlock(value)));
+    }
+    CHECK(IsRingBufferFull(&gRing));
+    CHECK(GetRingBufferCount(&gRing) == RING_LENGTH);
+    CHECK(!RingBufferEnqueue(&gRing, ToBlock(RING_LENGTH)));
+
+    for (value = 0; value < RING_LENGTH; value++) {
+        void *block = RingBufferDequeue(&gRing);
+        CHECK(block && (FromBlock(block) == value));
+    }
+    CHECK(IsRingBufferEmpty(&gRing));
+}
+
+//----------------------------------------------------------------------------
+// The indexes only roll over correctly because the length is a power of 2
+static void TestIndexRollover(void)
+{
+    UINT32 value;
+
+    InitRingBuffer(&gRing, gSlots, sizeof(gSlots));
+    gRing.Front = 0xFFFFFFFF - RING_LENGTH / 2;
+    gRing.Back  = gRing.Front;
+
+    for (value = 0; value < RING_LENGTH * 4; value++) {
+        void *block;
+
+        CHECK(RingBufferEnqueue(&gRing, ToBlock(value)));
+        CHECK(GetRingBufferCount(&gRing) == 1);
+        block = RingBufferDequeue(&gRing);
+        CHECK(block && (FromBlock(block) == value));
+    }
+    CHECK(gRing.Front < RING_LENGTH * 4);
+    CHECK(IsRingBufferEmpty(&gRing));
+}
+
+//----------------------------------------------------------------------------
+static void *Produce(void *context)
+{
+    const UINT32 producer = (UINT32)(ULONG_PTR)context;
+
+    for (UINT32 index = 0; index < BLOCKS_PER_PRODUCER; index++) {
+        const UINT32 value = producer * BLOCKS_PER_PRODUCER + index;
+        while (!RingBufferEnqueue(&gRing, ToBlock(value))) {
+            sched_yield(); // Full, so let the consumer run
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// Several producers and one consumer, as in EnqueueBlock and QmDequeueBlock
+static void TestConcurrentProducers(void)
+{
+    pthread_t        threads[PRODUCERS];
+    UINT32           next[PRODUCERS] = { 0 };
+    UINT32           received        = 0;
+    struct timespec  start;
+    struct timespec  end;
+    double           seconds;
+
+    InitRingBuffer(&gRing, gSlots, sizeof(gSlots));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (UINT32 producer = 0; producer < PRODUCERS; producer++) {
+        pthread_create(&threads[producer], NULL, Produce, (void *)(ULONG_PTR)producer);
+    }
+
+    while (received < PRODUCERS * BLOCKS_PER_PRODUCER) {
+        void *block = RingBufferDequeue(&gRing);
+        if (block) {
+            const UINT32 value    = FromBlock(block);
+            const UINT32 producer = value / BLOCKS_PER_PRODUCER;
+
+            // Each producer's blocks arrive in the order it added them
+            CHECK(producer < PRODUCERS);
+            if (producer < PRODUCERS) {
+                CHECK(value % BLOCKS_PER_PRODUCER == next[producer]);
+                next[producer] = value % BLOCKS_PER_PRODUCER + 1;
+            }
+            received++;
+        } else {
+            sched_yield();
+        }
+    }
+
+    for (UINT32 producer = 0; producer < PRODUCERS; producer++) {
+        pthread_join(threads[producer], NULL);
+        CHECK(next[producer] == BLOCKS_PER_PRODUCER);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    CHECK(IsRingBufferEmpty(&gRing));
+
+    seconds = (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("ring_buffer: %u blocks from %d producers in %.3f s (%.0f blocks/s)\n",
+            received, PRODUCERS, seconds, received / seconds);
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    TestFillAndDrain();
+    TestIndexRollover();
+    TestConcurrentProducers();
+    return TEST_RESULT("ring_buffer");
+}
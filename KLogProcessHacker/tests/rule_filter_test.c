@@ -0,0 +1,220 @@
+//----------------------------------------------------------------------------
+// Host tests for rule program validation and evaluation
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+#include "test.h"
+
+// A rule program with room for its strings after the rules
+static union {
+    RULE_PROGRAM Program;
+    char         Buffer[1024];
+} gProgram;
+
+static UINT32 gProgramLength;
+
+//----------------------------------------------------------------------------
+static void StartProgram(const UINT32 numRules, const UINT32 defaultAction)
+{
+    memset(&gProgram, 0, sizeof(gProgram));
+    gProgram.Program.NumRules      = numRules;
+    gProgram.Program.DefaultAction = defaultAction;
+    gProgramLength = FIELD_OFFSET(RULE_PROGRAM, Rules) + numRules * sizeof(RULE);
+}
+
+//----------------------------------------------------------------------------
+static void SetRule(
+    const UINT32  index,
+    const UINT8   field,
+    const UINT8   match,
+    const UINT8   action,
+    const UINT8   flags,
+    const UINT32  value,
+    const char   *string)
+{
+    RULE *rule = &gProgram.Program.Rules[index];
+
+    rule->Field  = field;
+    rule->Match  = match;
+    rule->Action = action;
+    rule->Flags  = flags;
+    rule->Value  = value;
+    if (string) {
+        rule->StringOffset = gProgramLength;
+        rule->StringLength = (UINT32)strlen(string);
+        memcpy(gProgram.Buffer + gProgramLength, string, rule->StringLength);
+        gProgramLength += rule->StringLength;
+    }
+}
+
+//----------------------------------------------------------------------------
+static RULE_EVENT MakeEvent(const char *path, const char *commandLine, const UINT32 parentPid)
+{
+    RULE_EVENT event;
+
+    memset(&event, 0, sizeof(event));
+    event.Path              = path;
+    event.PathLength        = (UINT32)strlen(path);
+    event.CommandLine       = commandLine;
+    event.CommandLineLength = (UINT32)strlen(commandLine);
+    event.ParentPid         = parentPid;
+    event.PathHash          = HashRulePath(path, event.PathLength);
+    return event;
+}
+
+//----------------------------------------------------------------------------
+static void TestHashRulePath(void)
+{
+    static const char lower[] = "c:\\windows\\system32\\svchost.exe";
+    static const char mixed[] = "C:\\Windows\\System32\\SVCHOST.EXE";
+
+    CHECK(HashRulePath("", 0) == 0x811C9DC5);
+    CHECK(HashRulePath("a", 1) == 0xE40C292C);
+    CHECK(HashRulePath(lower, sizeof(lower) - 1) == HashRulePath(mixed, sizeof(mixed) - 1));
+}
+
+//----------------------------------------------------------------------------
+static void TestValidate(void)
+{
+    StartProgram(0, RuleActionKeep);
+    CHECK(ValidateRuleProgram(&gProgram.Program, gProgramLength));
+    CHECK(!ValidateRuleProgram(&gProgram.Program, FIELD_OFFSET(RULE_PROGRAM, Rules) - 1));
+    CHECK(!ValidateRuleProgram(&gProgram.Program, RULE_PROGRAM_MAX_LENGTH + 1));
+
+    gProgram.Program.DefaultAction = RuleActionDrop + 1;
+    CHECK(!ValidateRuleProgram(&gProgram.Program, gProgramLength));
+
+    // The rules must fit in the buffer
+    StartProgram(2, RuleActionKeep);
+    SetRule(0, RuleFieldPath, RuleMatchPrefix, RuleActionDrop, 0, 0, "c:");
+    SetRule(1, RuleFieldParentPid, RuleMatchEquals, RuleActionDrop, 0, 4, NULL);
+    CHECK(ValidateRuleProgram(&gProgram.Program, gProgramLength));
+    CHECK(!ValidateRuleProgram(&gProgram.Program,
+            FIELD_OFFSET(RULE_PROGRAM, Rules) + sizeof(RULE)));
+
+    // Strings must be inside the program
+    gProgram.Program.Rules[0].StringLength = gProgramLength;
+    CHECK(!ValidateRuleProgram(&gProgram.Program, gProgramLength));
+    gProgram.Program.Rules[0].StringLength = 2;
+
+    // Unknown fields, matches and flags are rejected
+    gProgram.Program.Rules[1].Field = RuleFieldPathHash + 1;
+    CHECK(!ValidateRuleProgram(&gProgram.Program, gProgramLength));
+    gProgram.Program.Rules[1].Field = RuleFieldParentPid;
+    gProgram.Program.Rules[1].Match = RuleMatchContains + 1;
+    CHECK(!ValidateRuleProgram(&gProgram.Program, gProgramLength));
+    gProgram.Program.Rules[1].Match = RuleMatchEquals;
+    gProgram.Program.Rules[1].Flags = 0x80;
+    CHECK(!ValidateRuleProgram(&gProgram.Program, gProgramLength));
+
+    // The last rule cannot continue a group
+    gProgram.Program.Rules[1].Flags = RULE_FLAG_AND_NEXT;
+    CHECK(!ValidateRuleProgram(&gProgram.Program, gProgramLength));
+
+    StartProgram(RULE_PROGRAM_MAX_RULES + 1, RuleActionKeep);
+    CHECK(!ValidateRuleProgram(&gProgram.Program, sizeof(gProgram)));
+}
+
+//----------------------------------------------------------------------------
+static void TestStringMatches(void)
+{
+    const RULE_EVENT event = MakeEvent("C:\\Windows\\System32\\cmd.exe", "cmd /c dir", 4);
+
+    StartProgram(1, RuleActionKeep);
+    SetRule(0, RuleFieldPath, RuleMatchEquals, RuleActionDrop, 0, 0,
+            "C:\\Windows\\System32\\cmd.exe");
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+
+    StartProgram(1, RuleActionKeep);
+    SetRule(0, RuleFieldPath, RuleMatchEquals, RuleActionDrop, 0, 0, "c:\\windows\\system32\\CMD.EXE");
+    CHECK(!IsRuleEventDropped(&gProgram.Program, &event));
+    gProgram.Program.Rules[0].Flags = RULE_FLAG_IGNORE_CASE;
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+
+    StartProgram(1, RuleActionKeep);
+    SetRule(0, RuleFieldPath, RuleMatchPrefix, RuleActionDrop, 0, 0, "C:\\Windows\\");
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+
+    StartProgram(1, RuleActionKeep);
+    SetRule(0, RuleFieldPath, RuleMatchSuffix, RuleActionDrop, 0, 0, "\\cmd.exe");
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+
+    StartProgram(1, RuleActionKeep);
+    SetRule(0, RuleFieldCommandLine, RuleMatchContains, RuleActionDrop, 0, 0, "/c");
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+
+    // A string longer than the attribute never matches
+    StartProgram(1, RuleActionKeep);
+    SetRule(0, RuleFieldCommandLine, RuleMatchContains, RuleActionDrop, 0, 0,
+            "cmd /c dir /s /b");
+    CHECK(!IsRuleEventDropped(&gProgram.Program, &event));
+
+    // Missing attributes have a length of zero
+    StartProgram(1, RuleActionKeep);
+    SetRule(0, RuleFieldSid, RuleMatchPrefix, RuleActionDrop, 0, 0, "S-1-5-18");
+    CHECK(!IsRuleEventDropped(&gProgram.Program, &event));
+}
+
+//----------------------------------------------------------------------------
+static void TestNumberMatchesAndOrder(void)
+{
+    const RULE_EVENT event = MakeEvent("C:\\Windows\\System32\\svchost.exe", "", 600);
+
+    StartProgram(1, RuleActionKeep);
+    SetRule(0, RuleFieldPathHash, RuleMatchEquals, RuleActionDrop, 0, event.PathHash, NULL);
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+
+    // The first matching rule decides, and the default applies if none match
+    StartProgram(2, RuleActionDrop);
+    SetRule(0, RuleFieldParentPid, RuleMatchEquals, RuleActionKeep, 0, 600, NULL);
+    SetRule(1, RuleFieldPath, RuleMatchSuffix, RuleActionDrop, 0, 0, "svchost.exe");
+    CHECK(!IsRuleEventDropped(&gProgram.Program, &event));
+    gProgram.Program.Rules[0].Value = 4;
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+    gProgram.Program.Rules[1].Action = RuleActionKeep;
+    CHECK(!IsRuleEventDropped(&gProgram.Program, &event));
+    gProgram.Program.Rules[1].StringLength = 3; // "svc" is not a suffix
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+}
+
+//----------------------------------------------------------------------------
+// Rules joined with RULE_FLAG_AND_NEXT only match together, and the last
+// rule of the group decides
+static void TestGroups(void)
+{
+    const RULE_EVENT event = MakeEvent("C:\\Tools\\agent.exe", "agent --quiet", 4);
+
+    StartProgram(3, RuleActionKeep);
+    SetRule(0, RuleFieldPath, RuleMatchPrefix, RuleActionKeep, RULE_FLAG_AND_NEXT, 0, "C:\\Tools\\");
+    SetRule(1, RuleFieldCommandLine, RuleMatchContains, RuleActionDrop, 0, 0, "--verbose");
+    SetRule(2, RuleFieldParentPid, RuleMatchEquals, RuleActionDrop, 0, 8, NULL);
+    CHECK(ValidateRuleProgram(&gProgram.Program, gProgramLength));
+    CHECK(!IsRuleEventDropped(&gProgram.Program, &event));
+
+    // Second rule of the group matches too
+    memcpy(gProgram.Buffer + gProgram.Program.Rules[1].StringOffset, "--quiet  ", 9);
+    gProgram.Program.Rules[1].StringLength = 7;
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+
+    // A failed first rule skips the whole group, and the next group decides
+    gProgram.Program.Rules[0].StringLength = 1;
+    memcpy(gProgram.Buffer + gProgram.Program.Rules[0].StringOffset, "D", 1);
+    CHECK(!IsRuleEventDropped(&gProgram.Program, &event));
+    gProgram.Program.Rules[2].Value = 4;
+    CHECK(IsRuleEventDropped(&gProgram.Program, &event));
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    TestHashRulePath();
+    TestValidate();
+    TestStringMatches();
+    TestNumberMatchesAndOrder();
+    TestGroups();
+    return TEST_RESULT("rule_filter");
+}
@@ -0,0 +1,160 @@
+//----------------------------------------------------------------------------
+// Host stand-in for kph.h, so the queue manager pieces that only need plain
+// C and the list macros build and run outside the kernel
+//
+// Only defines what those pieces use.  Anything that needs a real kernel
+// API does not belong in the host build.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#ifndef KPH_H
+#define KPH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+//----------------------------------------------------------------------------
+// Types
+//----------------------------------------------------------------------------
+
+typedef uint8_t   UINT8;
+typedef uint16_t  UINT16;
+typedef uint32_t  UINT32;
+typedef uint64_t  UINT64;
+typedef int32_t   INT32;
+typedef int64_t   INT64;
+typedef int32_t   LONG;
+typedef uint32_t  ULONG;
+typedef int64_t   LONG64;
+typedef int64_t   LONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef size_t    SIZE_T;
+typedef int32_t   NTSTATUS;
+typedef void     *HANDLE;
+typedef uint8_t   BOOLEAN;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        UINT32 LowPart;
+        INT32  HighPart;
+    };
+    INT64 QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY;
+
+//----------------------------------------------------------------------------
+// Annotations
+//----------------------------------------------------------------------------
+
+#define __in
+#define __in_opt
+#define __inout
+#define __out
+#define __out_opt
+#define __checkReturn
+#define __in_bcount(size)
+#define __out_bcount(size)
+#define __drv_in(annotation)
+#define __drv_aliasesMem
+#define __drv_requiresIRQL(irql)
+
+//----------------------------------------------------------------------------
+// Memory and structure macros
+//----------------------------------------------------------------------------
+
+#define FIELD_OFFSET(type, field) offsetof(type, field)
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((char *)(address) - offsetof(type, field)))
+#define RtlCopyMemory(dest, src, length)   memcpy((dest), (src), (length))
+#define RtlFillMemory(dest, length, value) memset((dest), (value), (length))
+#define RtlMoveMemory(dest, src, length)   memmove((dest), (src), (length))
+#define RtlZeroMemory(dest, length)        memset((dest), 0, (length))
+#define UNALIGNED
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+// The GCC builtins work on any integer width, so the driver's UINT32 ring
+// indexes need no casts
+#define InterlockedIncrement(target) __sync_add_and_fetch((target), 1)
+#define InterlockedDecrement(target) __sync_sub_and_fetch((target), 1)
+#define InterlockedCompareExchange(target, exchange, comparand) \
+    __sync_val_compare_and_swap((target), (comparand), (exchange))
+#define InterlockedCompareExchangePointer(target, exchange, comparand) \
+    __sync_val_compare_and_swap((target), (comparand), (exchange))
+
+#define CTL_CODE(type, function, method, access) \
+    (((type) << 16) | ((access) << 14) | ((function) << 2) | (method))
+#define METHOD_BUFFERED     0
+#define FILE_ANY_ACCESS     0
+#define FILE_READ_ACCESS    1
+#define FILE_WRITE_ACCESS   2
+#define FILE_DEVICE_UNKNOWN 0x22
+
+static inline char RtlFindLeastSignificantBit(UINT64 set)
+{
+    return set ? (char)__builtin_ctzll(set) : -1;
+}
+
+//----------------------------------------------------------------------------
+// Doubly linked lists
+//----------------------------------------------------------------------------
+
+static inline void InitializeListHead(LIST_ENTRY *head)
+{
+    head->Flink = head;
+    head->Blink = head;
+}
+
+static inline bool IsListEmpty(const LIST_ENTRY *head)
+{
+    return head->Flink == head;
+}
+
+static inline void InsertTailList(LIST_ENTRY *head, LIST_ENTRY *entry)
+{
+    entry->Flink       = head;
+    entry->Blink       = head->Blink;
+    head->Blink->Flink = entry;
+    head->Blink        = entry;
+}
+
+static inline bool RemoveEntryList(LIST_ENTRY *entry)
+{
+    entry->Blink->Flink = entry->Flink;
+    entry->Flink->Blink = entry->Blink;
+    return entry->Flink == entry->Blink;
+}
+
+static inline LIST_ENTRY *RemoveHeadList(LIST_ENTRY *head)
+{
+    LIST_ENTRY *entry = head->Flink;
+    RemoveEntryList(entry);
+    return entry;
+}
+
+//----------------------------------------------------------------------------
+// Driver headers the host build covers, in the same order as kph.h
+//----------------------------------------------------------------------------
+
+#include "ring_buffer.h"
+#include "id_filter.h"
+#include "consumer_group.h"
+#include "rule_filter.h"
+#include "timer_wheel.h"
+#include "ioctls.h"
+#include "pcap_ng.h"
+#include "compact_record.h"
+#include "command_line.h"
+
+#endif // KPH_H
@@ -0,0 +1,263 @@
+//----------------------------------------------------------------------------
+// Host tests and lock hold times for initial blocks from a large tree
+//
+// Starts 50,000 processes with a connection for every fourth one, then
+// registers readers and reads their initial blocks a chunk at a time.  The
+// first reader reads with nothing changing, and the trees lock profile shows
+// the longest hold while its snapshot walks the trees, next to one walk of
+// the whole trees under the lock.  The second reader reads while processes
+// end and start and connections close part way through, and must still get
+// each running process and open connection exactly once.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <stdlib.h>
+
+#include "kph.h"
+#include "queue_manager_priv.h"
+#include "test.h"
+
+#define NUM_PROCESSES     50000
+#define NUM_CONNECTIONS   (NUM_PROCESSES / 4)
+#define NEW_PROCESSES     1000      // Started while the second reader reads
+#define FIRST_PID         1000
+#define EXTRA_PID         4         // Started between the readers
+#define RING_BUFFER_SIZE  (PAGE_SIZE << 5)
+#define MAX_PID           (FIRST_PID + (NUM_PROCESSES + NEW_PROCESSES) * 4)
+
+// Blocks one reader got for each process and connection
+typedef struct RECEIVED {
+    UINT8 Started[MAX_PID / 4];
+    UINT8 Ended[MAX_PID / 4];
+    UINT8 Opened[NUM_CONNECTIONS + 1];
+    UINT8 Closed[NUM_CONNECTIONS + 1];
+} RECEIVED;
+
+typedef struct TREES_HOLDS {
+    UINT64 Acquisitions;
+    double MaxHold;              // Microseconds
+    double AverageHold;          // Microseconds
+} TREES_HOLDS;
+
+static DEVICE_OBJECT gDevice = { NULL };
+static RECEIVED      gReceived;
+static char          gProfileBuffer[FIELD_OFFSET(LOCK_PROFILE, Sites) +
+        2 * LOCK_PROFILE_MAX_SITES * sizeof(LOCK_SITE_PROFILE)];
+
+//----------------------------------------------------------------------------
+static UINT32 GetPid(const UINT32 index)
+{
+    return FIRST_PID + index * 4;
+}
+
+//----------------------------------------------------------------------------
+// Ended and closed blocks carry option 2 first
+static bool IsEndBlock(const BLOCK_NODE *blockNode)
+{
+    const char                  *buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+    const PCAP_NG_OPTION_HEADER *option = (const PCAP_NG_OPTION_HEADER*)(buffer +
+            ((blockNode->BlockType == ProcessBlock) ? sizeof(PCAP_NG_PROCESS_HEADER) :
+            sizeof(PCAP_NG_CONNECTION_HEADER)));
+
+    return option->OptionCode == 2;
+}
+
+//----------------------------------------------------------------------------
+// Returns the number of blocks read, and stops after limit blocks
+static UINT32 ReadBlocks(READER_INFO *reader, const UINT32 limit)
+{
+    UINT32 count = 0;
+
+    while (count < limit) {
+        BLOCK_NODE *blockNode = QmDequeueBlock(reader);
+
+        if (!blockNode) {
+            break;
+        }
+        if (blockNode->BlockType == ProcessBlock) {
+            const UINT32 slot = blockNode->ProcessId / 4;
+
+            CHECK(slot < MAX_PID / 4);
+            if (slot < MAX_PID / 4) {
+                (IsEndBlock(blockNode) ? gReceived.Ended : gReceived.Started)[slot]++;
+            }
+        } else if (blockNode->BlockType == ConnectionBlock) {
+            const UINT32 id = blockNode->ConnectionId;
+
+            CHECK(id && (id <= NUM_CONNECTIONS));
+            if (id && (id <= NUM_CONNECTIONS)) {
+                (IsEndBlock(blockNode) ? gReceived.Closed : gReceived.Opened)[id]++;
+            }
+        }
+        QmCleanupBlock(blockNode);
+        count++;
+    }
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// Gets the trees lock holds since the last reset, in microseconds
+static void GetTreesHolds(TREES_HOLDS *holds)
+{
+    LOCK_PROFILE *profile   = (LOCK_PROFILE*)gProfileBuffer;
+    UINT64        maxTicks  = 0;
+    UINT64        holdTicks = 0;
+
+    QmGetLockProfile(profile, sizeof(gProfileBuffer));
+    CHECK(profile->LostSites == 0);
+    holds->Acquisitions = 0;
+    for (UINT32 index = 0; index < profile->NumSites; index++) {
+        const LOCK_SITE_PROFILE *site = &profile->Sites[index];
+
+        if (site->Lock == TraceLockTrees) {
+            holds->Acquisitions += site->Acquisitions;
+            holdTicks           += site->HoldTicks;
+            maxTicks             = max(maxTicks, site->MaxHoldTicks);
+        }
+    }
+    holds->MaxHold     = (double)maxTicks * 1e6 / profile->Frequency;
+    holds->AverageHold = (double)holdTicks * 1e6 / profile->Frequency /
+            max(holds->Acquisitions, 1);
+}
+
+//----------------------------------------------------------------------------
+static READER_INFO *OpenReader(void)
+{
+    READER_INFO *reader = calloc(1, sizeof(READER_INFO));
+
+    CHECK(reader && NT_SUCCESS(QmRegisterReader(reader)));
+    memset(&gReceived, 0, sizeof(gReceived));
+    return reader;
+}
+
+//----------------------------------------------------------------------------
+static void CloseReader(READER_INFO *reader)
+{
+    CHECK(reader->Snapshot.DroppedBlocks == 0);
+    for (UINT32 type = 0; type < NumStatisticsBlockTypes; type++) {
+        CHECK(reader->DroppedBlocks[type] == 0);
+    }
+    CHECK(NT_SUCCESS(QmDeregisterReader(reader)));
+    free(reader);
+}
+
+//----------------------------------------------------------------------------
+// Nothing changes while the reader reads, so it gets every process and
+// connection once.  Compares the longest hold to one walk of the whole trees.
+static void TestUnchanged(void)
+{
+    LARGEST_BLOCKS  largest;
+    READER_INFO    *reader;
+    TREES_HOLDS     chunks;
+    TREES_HOLDS     walk;
+
+    QmSetLockProfiling(LOCK_PROFILE_FLAG_ENABLE | LOCK_PROFILE_FLAG_RESET);
+    reader = OpenReader();
+    ReadBlocks(reader, _UI32_MAX);
+    CHECK(!reader->Snapshot.Active);
+    GetTreesHolds(&chunks);
+
+    QmSetLockProfiling(LOCK_PROFILE_FLAG_ENABLE | LOCK_PROFILE_FLAG_RESET);
+    QmGetLargestBlocks(&largest, sizeof(largest));
+    GetTreesHolds(&walk);
+    QmSetLockProfiling(0);
+    CHECK(largest.TotalBlocks == NUM_PROCESSES + NUM_CONNECTIONS);
+
+    for (UINT32 index = 0; index < NUM_PROCESSES; index++) {
+        CHECK(gReceived.Started[GetPid(index) / 4] == 1);
+    }
+    for (UINT32 id = 1; id <= NUM_CONNECTIONS; id++) {
+        CHECK(gReceived.Opened[id] == 1);
+    }
+    CloseReader(reader);
+
+    // Each chunk visits 256 of the 62,500 tree nodes.  The longest hold can
+    // include a preemption, so only the average must be a small part of a walk.
+    CHECK(chunks.Acquisitions >= (NUM_PROCESSES + NUM_CONNECTIONS) / 256);
+    CHECK(chunks.MaxHold < walk.MaxHold);
+    CHECK(chunks.AverageHold < walk.MaxHold / 25);
+    printf("%u processes, %u connections: trees lock held %.1f us on average and %.1f us "
+            "at most over %llu acquisitions, %.1f us for one walk of the trees\n",
+            NUM_PROCESSES, NUM_CONNECTIONS, chunks.AverageHold, chunks.MaxHold,
+            (unsigned long long)chunks.Acquisitions, walk.MaxHold);
+}
+
+//----------------------------------------------------------------------------
+// Part way through, ends every tenth process on either side of the cursor,
+// closes every other connection, and starts processes past the cursor.
+// Ended processes still get their started block once, and processes started
+// after the reader registered only arrive live.
+static void TestChanging(void)
+{
+    READER_INFO *reader;
+
+    // Keeps the reader from sharing the first reader's finished snapshot
+    CHECK(NT_SUCCESS(QmEnqueueProcessBlock(true, EXTRA_PID, 4, NULL, NULL, NULL, NULL, NULL)));
+
+    reader = OpenReader();
+    CHECK(ReadBlocks(reader, (NUM_PROCESSES + NUM_CONNECTIONS) / 2) ==
+            (NUM_PROCESSES + NUM_CONNECTIONS) / 2);
+    CHECK(reader->Snapshot.Active);
+    for (UINT32 index = 0; index < NUM_PROCESSES; index += 10) {
+        CHECK(NT_SUCCESS(QmEnqueueProcessBlock(false, GetPid(index), 4, NULL, NULL, NULL,
+                NULL, NULL)));
+    }
+    for (UINT32 id = 1; id <= NUM_CONNECTIONS; id += 2) {
+        CHECK(NT_SUCCESS(QmEnqueueConnectionBlock(false, id, GetPid((id - 1) * 4))));
+    }
+    for (UINT32 index = NUM_PROCESSES; index < NUM_PROCESSES + NEW_PROCESSES; index++) {
+        CHECK(NT_SUCCESS(QmEnqueueProcessBlock(true, GetPid(index), 4, NULL, NULL, NULL,
+                NULL, NULL)));
+    }
+    ReadBlocks(reader, _UI32_MAX);
+    CHECK(!reader->Snapshot.Active);
+
+    CHECK(gReceived.Started[EXTRA_PID / 4] == 1);
+    for (UINT32 index = 0; index < NUM_PROCESSES + NEW_PROCESSES; index++) {
+        const UINT32 slot = GetPid(index) / 4;
+
+        CHECK(gReceived.Started[slot] == 1);
+        CHECK(gReceived.Ended[slot] == (((index < NUM_PROCESSES) && !(index % 10)) ? 1 : 0));
+    }
+    for (UINT32 id = 1; id <= NUM_CONNECTIONS; id++) {
+        CHECK(gReceived.Opened[id] == 1);
+        CHECK(gReceived.Closed[id] == ((id & 1) ? 1 : 0));
+    }
+    CloseReader(reader);
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    HostStartKernel();
+    HostSetRegistryDword("RingBufferSize", RING_BUFFER_SIZE);
+    if (!NT_SUCCESS(InitializeClock(&gDevice)) || !NT_SUCCESS(InitializeLatency(&gDevice)) ||
+            !NT_SUCCESS(InitializeTrace(&gDevice)) ||
+            !NT_SUCCESS(InitializeQueueManager(&gDevice))) {
+        fprintf(stderr, "Cannot initialize the driver\n");
+        return 1;
+    }
+
+    // Each connection belongs to the process at four times its index, so
+    // the trees interleave by timestamp
+    for (UINT32 index = 0; index < NUM_PROCESSES; index++) {
+        CHECK(NT_SUCCESS(QmEnqueueProcessBlock(true, GetPid(index), 4, NULL, NULL, NULL,
+                NULL, NULL)));
+        if (!(index % 4)) {
+            CHECK(NT_SUCCESS(QmEnqueueConnectionBlock(true, index / 4 + 1, GetPid(index))));
+        }
+    }
+
+    TestUnchanged();
+    TestChanging();
+
+    CHECK(NT_SUCCESS(DeinitializeQueueManager()));
+    CHECK(NT_SUCCESS(DeinitializeTrace()));
+    CHECK(NT_SUCCESS(DeinitializeLatency()));
+    CHECK(NT_SUCCESS(DeinitializeClock()));
+    HostStopKernel();
+    return TEST_RESULT("snapshot");
+}
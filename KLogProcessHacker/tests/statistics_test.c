@@ -0,0 +1,182 @@
+//----------------------------------------------------------------------------
+// Host tests and cost comparison for the per-processor event counters
+//
+// Enqueues process and connection events from several threads, which the
+// kernel stand-in puts on different processors, and checks that
+// SumStatistics adds up every processor's counters.  Then times the counter
+// updates one packet makes on the enqueue path, in the shared STATISTICS
+// that every processor used to update and in the driver's per-processor
+// counters.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kph.h"
+#include "queue_manager_priv.h"
+#include "test.h"
+
+#define NUM_THREADS        4
+#define EVENTS_PER_THREAD  2000
+#define TIMED_PACKETS      1000000   // Per thread
+#define PACKET_LENGTH      96
+
+typedef struct COUNTER_THREAD {
+    pthread_t Thread;
+    bool      Shared;        // Update gSharedStatistics instead of the driver's counters
+    UINT32    Packets;
+} COUNTER_THREAD;
+
+static DEVICE_OBJECT     gDevice = { NULL };
+static STATISTICS        gSharedStatistics;
+static pthread_barrier_t gStartBarrier;
+
+//----------------------------------------------------------------------------
+static double GetSeconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//----------------------------------------------------------------------------
+// Each thread starts and ends its own processes, and opens and closes
+// connections that belong to them
+static void *EnqueueEvents(void *context)
+{
+    const UINT32 base = 1000 + (UINT32)(ULONG_PTR)context * EVENTS_PER_THREAD * 4;
+
+    pthread_barrier_wait(&gStartBarrier);
+    for (UINT32 index = 0; index < EVENTS_PER_THREAD; index++) {
+        const UINT32 pid = base + index * 4;
+
+        CHECK(NT_SUCCESS(QmEnqueueProcessBlock(true, pid, 4, NULL, NULL, NULL, NULL, NULL)));
+        CHECK(NT_SUCCESS(QmEnqueueConnectionBlock(true, pid, pid)));
+    }
+    for (UINT32 index = 0; index < EVENTS_PER_THREAD / 2; index++) {
+        const UINT32 pid = base + index * 4;
+
+        CHECK(NT_SUCCESS(QmEnqueueConnectionBlock(false, pid, pid)));
+        CHECK(NT_SUCCESS(QmEnqueueProcessBlock(false, pid, 4, NULL, NULL, NULL, NULL, NULL)));
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// The updates EnqueueBlock makes for a packet, before and after the counters
+// moved to each processor
+static void *CountPackets(void *context)
+{
+    COUNTER_THREAD *thread = (COUNTER_THREAD*)context;
+
+    pthread_barrier_wait(&gStartBarrier);
+    if (thread->Shared) {
+        for (UINT32 index = 0; index < thread->Packets; index++) {
+            InterlockedIncrement64((LONG64*)&gSharedStatistics.CapturedPackets);
+            InterlockedExchangeAdd64((LONG64*)&gSharedStatistics.CapturedPacketBytes,
+                    PACKET_LENGTH);
+        }
+    } else {
+        for (UINT32 index = 0; index < thread->Packets; index++) {
+            STATISTICS_CPU *statistics = GetStatisticsCpu();
+
+            InterlockedIncrement64(&statistics->CapturedPackets);
+            InterlockedExchangeAdd64(&statistics->CapturedPacketBytes, PACKET_LENGTH);
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// Returns nanoseconds per packet for all the threads together, so more
+// threads only lower it on as many processors
+static double TimeCounters(const UINT32 numThreads, const bool shared)
+{
+    COUNTER_THREAD threads[NUM_THREADS];
+    double         start;
+
+    pthread_barrier_init(&gStartBarrier, NULL, numThreads + 1);
+    for (UINT32 index = 0; index < numThreads; index++) {
+        threads[index].Shared  = shared;
+        threads[index].Packets = TIMED_PACKETS;
+        pthread_create(&threads[index].Thread, NULL, CountPackets, &threads[index]);
+    }
+    pthread_barrier_wait(&gStartBarrier);
+    start = GetSeconds();
+    for (UINT32 index = 0; index < numThreads; index++) {
+        pthread_join(threads[index].Thread, NULL);
+    }
+    pthread_barrier_destroy(&gStartBarrier);
+    return (GetSeconds() - start) / ((double)numThreads * TIMED_PACKETS) * 1e9;
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    const UINT64 started = (UINT64)NUM_THREADS * EVENTS_PER_THREAD;
+    const UINT64 ended   = (UINT64)NUM_THREADS * (EVENTS_PER_THREAD / 2);
+    pthread_t    threads[NUM_THREADS];
+    STATISTICS   statistics;
+    UINT64       packets;
+    UINT64       packetBytes;
+
+    HostStartKernel();
+    if (!NT_SUCCESS(InitializeClock(&gDevice)) || !NT_SUCCESS(InitializeLatency(&gDevice)) ||
+            !NT_SUCCESS(InitializeTrace(&gDevice)) ||
+            !NT_SUCCESS(InitializeQueueManager(&gDevice))) {
+        fprintf(stderr, "Cannot initialize the driver\n");
+        return 1;
+    }
+
+    pthread_barrier_init(&gStartBarrier, NULL, NUM_THREADS);
+    for (UINT32 index = 0; index < NUM_THREADS; index++) {
+        pthread_create(&threads[index], NULL, EnqueueEvents, (void*)(ULONG_PTR)index);
+    }
+    for (UINT32 index = 0; index < NUM_THREADS; index++) {
+        pthread_join(threads[index], NULL);
+    }
+    pthread_barrier_destroy(&gStartBarrier);
+
+    // Ended processes and closed connections stay counted until the queue
+    // manager removes them
+    SumStatistics(&statistics);
+    CHECK((UINT64)statistics.ProcessStartEvents == started);
+    CHECK((UINT64)statistics.ProcessEndEvents == ended);
+    CHECK((UINT64)statistics.ConnectionOpenEvents == started);
+    CHECK((UINT64)statistics.ConnectionCloseEvents == ended);
+    CHECK((UINT64)statistics.NumProcesses <= started);
+    CHECK((UINT64)statistics.NumProcesses >= started - ended);
+    CHECK((UINT64)statistics.NumConnections <= started);
+    CHECK((UINT64)statistics.NumConnections >= started - ended);
+
+    // Packets counted on every processor add up too
+    packets     = statistics.CapturedPackets;
+    packetBytes = statistics.CapturedPacketBytes;
+    printf("Counter updates for one packet, %ld processors online:\n",
+            sysconf(_SC_NPROCESSORS_ONLN));
+    for (UINT32 numThreads = 1; numThreads <= NUM_THREADS; numThreads *= 2) {
+        const double shared = TimeCounters(numThreads, true);
+        const double perCpu = TimeCounters(numThreads, false);
+
+        printf("%u thread%s: shared %6.2f ns, per-processor %6.2f ns\n",
+                numThreads, (numThreads > 1) ? "s" : " ", shared, perCpu);
+        packets     += (UINT64)numThreads * TIMED_PACKETS;
+        packetBytes += (UINT64)numThreads * TIMED_PACKETS * PACKET_LENGTH;
+    }
+    SumStatistics(&statistics);
+    CHECK(statistics.CapturedPackets == packets);
+    CHECK(statistics.CapturedPacketBytes == packetBytes);
+
+    CHECK(NT_SUCCESS(DeinitializeQueueManager()));
+    CHECK(NT_SUCCESS(DeinitializeTrace()));
+    CHECK(NT_SUCCESS(DeinitializeLatency()));
+    CHECK(NT_SUCCESS(DeinitializeClock()));
+    HostStopKernel();
+    return TEST_RESULT("statistics");
+}
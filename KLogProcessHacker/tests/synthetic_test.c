@@ -0,0 +1,177 @@
+//----------------------------------------------------------------------------
+// Host tests for the synthetic event generator
+//
+// Drives generators from the test thread to check the IDs and event mix
+// they enqueue, then runs GenerateSyntheticEvents on the kernel stand-in's
+// system threads the way IOCTL_KPH_GENERATE_SYNTHETIC_EVENTS does, and
+// prints the rate it reaches.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+#include "test.h"
+
+#define DIRECT_EVENTS  20000
+
+static DEVICE_OBJECT gDevice = { NULL };
+
+//----------------------------------------------------------------------------
+static SYNTHETIC_EVENTS_REQUEST GetRequest(const UINT32 numThreads, const UINT32 duration,
+        const UINT32 rate)
+{
+    SYNTHETIC_EVENTS_REQUEST request;
+
+    memset(&request, 0, sizeof(request));
+    request.NumThreads       = numThreads;
+    request.Duration         = duration;
+    request.Rate             = rate;
+    request.ProcessWeight    = 1;
+    request.ConnectionWeight = 2;
+    request.PacketWeight     = 13;
+    request.PacketLength     = 96;
+    return request;
+}
+
+//----------------------------------------------------------------------------
+// IDs carry the generator's index above the counter, and process IDs are
+// multiples of 4
+static bool IsGeneratorId(const UINT32 id, const UINT32 index, const bool processId)
+{
+    return ((id & 0xFFF00000) == (0xF0000000 | (index << 20))) &&
+            (!processId || !(id & 3));
+}
+
+//----------------------------------------------------------------------------
+static void TestDirect(void)
+{
+    SYNTHETIC_EVENTS_REQUEST request = GetRequest(3, 0, 0);
+    SYNTHETIC_THREAD         thread;
+    UINT64                   events;
+
+    // Each generator has its own IDs, and the mix follows the weights
+    CHECK(InitializeSyntheticThread(&thread, &request, 2, 1000));
+    OpenSyntheticThread(&thread);
+    CHECK(IsGeneratorId(thread.OwnerId, 2, true));
+    CHECK(IsGeneratorId(thread.PacketConnection, 2, false));
+    CHECK(thread.OwnerId != thread.PacketConnection);
+    for (UINT32 index = 0; index < DIRECT_EVENTS; index++) {
+        GenerateSyntheticEvent(&thread);
+        if (thread.ProcessId) {
+            CHECK(IsGeneratorId(thread.ProcessId, 2, true));
+        }
+        if (thread.ConnectionId) {
+            CHECK(IsGeneratorId(thread.ConnectionId, 2, false));
+        }
+    }
+    events = thread.Events[SyntheticProcess] + thread.Events[SyntheticConnection] +
+            thread.Events[SyntheticPacket];
+    CHECK(events == DIRECT_EVENTS);
+    CHECK(thread.FailedEvents == 0);
+    CHECK(thread.Events[SyntheticProcess] > DIRECT_EVENTS / 16 * 8 / 10);
+    CHECK(thread.Events[SyntheticProcess] < DIRECT_EVENTS / 16 * 12 / 10);
+    CHECK(thread.Events[SyntheticPacket] > DIRECT_EVENTS / 16 * 13 * 9 / 10);
+
+    // Closing ends the running process and connection too
+    CloseSyntheticThread(&thread);
+    CHECK(!thread.ProcessId && !thread.ConnectionId);
+    CHECK(thread.FailedEvents == 0);
+
+    // Only packets with a packet weight alone
+    request.ProcessWeight    = 0;
+    request.ConnectionWeight = 0;
+    CHECK(InitializeSyntheticThread(&thread, &request, 0, 2000));
+    OpenSyntheticThread(&thread);
+    for (UINT32 index = 0; index < 100; index++) {
+        GenerateSyntheticEvent(&thread);
+    }
+    CloseSyntheticThread(&thread);
+    CHECK(thread.Events[SyntheticPacket] == 100);
+    CHECK(thread.Events[SyntheticProcess] + thread.Events[SyntheticConnection] == 0);
+}
+
+//----------------------------------------------------------------------------
+// The rate splits across generators with the remainder going to the first
+// ones, and generators past the rate get no share
+static void TestRateShares(void)
+{
+    SYNTHETIC_EVENTS_REQUEST request = GetRequest(7, 100, 1000);
+    SYNTHETIC_THREAD         thread;
+    UINT32                   total   = 0;
+
+    for (UINT32 index = 0; index < request.NumThreads; index++) {
+        CHECK(InitializeSyntheticThread(&thread, &request, index, 0));
+        CHECK((thread.Rate == 142) || (thread.Rate == 143));
+        CHECK(thread.EndTime == 100000);
+        total += thread.Rate;
+    }
+    CHECK(total == request.Rate);
+
+    request.Rate = 5;
+    CHECK(InitializeSyntheticThread(&thread, &request, 4, 0));
+    CHECK(!InitializeSyntheticThread(&thread, &request, 5, 0));
+}
+
+//----------------------------------------------------------------------------
+static void TestGenerate(void)
+{
+    SYNTHETIC_EVENTS_REQUEST request = GetRequest(0, 50, 0);
+    SYNTHETIC_EVENTS_RESULT  result;
+    UINT64                   events;
+
+    CHECK(GenerateSyntheticEvents(&request, &result) == STATUS_INVALID_PARAMETER);
+    request.NumThreads = SYNTHETIC_MAX_THREADS + 1;
+    CHECK(GenerateSyntheticEvents(&request, &result) == STATUS_INVALID_PARAMETER);
+    request.NumThreads = 2;
+    request.Duration   = SYNTHETIC_MAX_DURATION + 1;
+    CHECK(GenerateSyntheticEvents(&request, &result) == STATUS_INVALID_PARAMETER);
+    request.Duration      = 50;
+    request.ProcessWeight = request.ConnectionWeight = request.PacketWeight = 0;
+    CHECK(GenerateSyntheticEvents(&request, &result) == STATUS_INVALID_PARAMETER);
+
+    // Paced at 2000 events per second for 200ms.  Threads stop at the first
+    // batch past the end, so allow a batch each.
+    request = GetRequest(2, 200, 2000);
+    CHECK(NT_SUCCESS(GenerateSyntheticEvents(&request, &result)));
+    events = result.ProcessEvents + result.ConnectionEvents + result.PacketEvents;
+    CHECK(result.FailedEvents == 0);
+    CHECK(result.ElapsedTime >= 200000);
+    CHECK(events >= 200);
+    CHECK(events <= 400 + 2 * (16 + 4));
+    printf("Paced: %llu events in %lld us (%llu/s)\n", (unsigned long long)events,
+            (long long)result.ElapsedTime, (unsigned long long)result.EventsPerSecond);
+
+    request = GetRequest(2, 200, 0);
+    CHECK(NT_SUCCESS(GenerateSyntheticEvents(&request, &result)));
+    CHECK(result.FailedEvents == 0);
+    CHECK(result.EventsPerSecond > 2000);
+    printf("Unlimited: %llu events in %lld us (%llu/s)\n",
+            (unsigned long long)(result.ProcessEvents + result.ConnectionEvents +
+            result.PacketEvents), (long long)result.ElapsedTime,
+            (unsigned long long)result.EventsPerSecond);
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    HostStartKernel();
+    if (!NT_SUCCESS(InitializeClock(&gDevice)) || !NT_SUCCESS(InitializeLatency(&gDevice)) ||
+            !NT_SUCCESS(InitializeTrace(&gDevice)) ||
+            !NT_SUCCESS(InitializeQueueManager(&gDevice))) {
+        fprintf(stderr, "Cannot initialize the driver\n");
+        return 1;
+    }
+
+    TestDirect();
+    TestRateShares();
+    TestGenerate();
+
+    CHECK(NT_SUCCESS(DeinitializeQueueManager()));
+    CHECK(NT_SUCCESS(DeinitializeTrace()));
+    CHECK(NT_SUCCESS(DeinitializeLatency()));
+    CHECK(NT_SUCCESS(DeinitializeClock()));
+    HostStopKernel();
+    return TEST_RESULT("synthetic");
+}
@@ -0,0 +1,31 @@
+//----------------------------------------------------------------------------
+// Minimal checks for the host tests
+//
+// Each test program returns nonzero if any check failed, so CTest reports it.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+static int gTestFailures = 0;
+
+#define CHECK(condition)                                                     \
+    do {                                                                     \
+        if (!(condition)) {                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #condition);                                             \
+            gTestFailures++;                                                 \
+        }                                                                    \
+    } while (0)
+
+#define TEST_RESULT(name)                                                    \
+    (printf("%s: %s\n", (name), gTestFailures ? "FAILED" : "ok"),            \
+     gTestFailures ? 1 : 0)
+
+#endif // TEST_H
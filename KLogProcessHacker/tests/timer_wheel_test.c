@@ -0,0 +1,385 @@
+//----------------------------------------------------------------------------
+// Host tests for the hierarchical timer wheel
+//
+// Also prints what the queue manager's connection close timers cost at
+// 100,000 closes per second, with each connection held for a second, on the
+// wheel and with a timer per connection kept in expiry order.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "kph.h"
+#include "test.h"
+
+#define NUM_TIMERS 2000
+
+// Connection close benchmark, with the queue manager's 10ms tick
+#define CLOSES_PER_SECOND  100000
+#define TICKS_PER_SECOND   100
+#define HOLD_TICKS         TICKS_PER_SECOND   // Closed connections are held for a second
+#define BENCHMARK_SECONDS  5
+#define CLOSES_PER_TICK    (CLOSES_PER_SECOND / TICKS_PER_SECOND)
+#define MAX_HELD           (CLOSES_PER_TICK * (HOLD_TICKS + 1))
+
+struct TEST_TIMER {
+    TIMER_WHEEL_ENTRY Entry;
+    UINT64            Expiry;     // Tick the timer was scheduled for
+    UINT64            ExpiredAt;  // Wheel tick when the timer expired (0 if not yet)
+    UINT32            Expired;    // Number of times the timer expired
+};
+
+typedef struct TEST_TIMER TEST_TIMER;
+
+static TIMER_WHEEL gWheel;
+static TEST_TIMER  gTimers[NUM_TIMERS];
+static UINT64      gLastExpiry;
+static bool        gInOrder;
+static TEST_TIMER *gSibling;     // Timer that CancelSibling cancels
+static UINT64      gCloseExpired;
+static bool        gCloseOnTime;
+
+//----------------------------------------------------------------------------
+static void ExpireTestTimer(TIMER_WHEEL_ENTRY *entry)
+{
+    TEST_TIMER *timer = CONTAINING_RECORD(entry, TEST_TIMER, Entry);
+
+    CHECK(!IsTimerWheelEntryScheduled(entry));
+    timer->ExpiredAt = gWheel.CurrentTick;
+    timer->Expired++;
+    if (entry->Expiry < gLastExpiry) {
+        gInOrder = false;
+    }
+    gLastExpiry = entry->Expiry;
+}
+
+//----------------------------------------------------------------------------
+static void Reschedule(TIMER_WHEEL_ENTRY *entry)
+{
+    TEST_TIMER *timer = CONTAINING_RECORD(entry, TEST_TIMER, Entry);
+
+    if (++timer->Expired < 3) {
+        ScheduleTimerWheelEntry(&gWheel, entry, gWheel.CurrentTick + 100, Reschedule);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Like ExpireExitHistory, reschedules for a delay that can already have
+// passed, which the wheel moves to the next tick
+static void RescheduleNow(TIMER_WHEEL_ENTRY *entry)
+{
+    TEST_TIMER *timer = CONTAINING_RECORD(entry, TEST_TIMER, Entry);
+
+    timer->ExpiredAt = gWheel.CurrentTick;
+    if (++timer->Expired < 10) {
+        ScheduleTimerWheelEntry(&gWheel, entry, gWheel.CurrentTick, RescheduleNow);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Cancels another timer, which may be in the slot that is expiring
+static void CancelSibling(TIMER_WHEEL_ENTRY *entry)
+{
+    ExpireTestTimer(entry);
+    CancelTimerWheelEntry(&gWheel, &gSibling->Entry);
+}
+
+//----------------------------------------------------------------------------
+static void ExpireClose(TIMER_WHEEL_ENTRY *entry)
+{
+    gCloseOnTime &= (entry->Expiry == gWheel.CurrentTick);
+    gCloseExpired++;
+}
+
+//----------------------------------------------------------------------------
+// Random timers across every level expire on exactly their tick, in order
+static void TestRandomTimers(void)
+{
+    const UINT64 start = 1000;
+    UINT64       tick  = start;
+
+    memset(gTimers, 0, sizeof(gTimers));
+    InitTimerWheel(&gWheel, start);
+    srand(12345);
+    for (UINT32 index = 0; index < NUM_TIMERS; index++) {
+        const UINT32 level = index % TIMER_WHEEL_LEVELS;
+        const UINT64 range = 1ULL << ((level + 1) * TIMER_WHEEL_SLOT_BITS);
+
+        gTimers[index].Expiry = start + 1 + ((UINT64)rand() * rand()) % (range - 1);
+        ScheduleTimerWheelEntry(&gWheel, &gTimers[index].Entry, gTimers[index].Expiry,
+                ExpireTestTimer);
+    }
+    CHECK(gWheel.Count == NUM_TIMERS);
+
+    // Cancel every tenth timer
+    for (UINT32 index = 0; index < NUM_TIMERS; index += 10) {
+        CancelTimerWheelEntry(&gWheel, &gTimers[index].Entry);
+        CHECK(!IsTimerWheelEntryScheduled(&gTimers[index].Entry));
+    }
+    CancelTimerWheelEntry(&gWheel, &gTimers[0].Entry); // Already cancelled
+
+    gLastExpiry = 0;
+    gInOrder    = true;
+    while (gWheel.Count) {
+        tick += 1 + rand() % 50;
+        while (gWheel.CurrentTick < tick) {
+            AdvanceTimerWheel(&gWheel, tick);
+        }
+    }
+    CHECK(gInOrder);
+
+    for (UINT32 index = 0; index < NUM_TIMERS; index++) {
+        const TEST_TIMER *timer = &gTimers[index];
+
+        if (index % 10 == 0) {
+            CHECK(timer->Expired == 0);
+        } else {
+            CHECK(timer->Expired == 1);
+            CHECK(timer->ExpiredAt == timer->Expiry);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+static void TestEdges(void)
+{
+    TEST_TIMER *timer = &gTimers[0];
+
+    memset(gTimers, 0, sizeof(gTimers));
+    InitTimerWheel(&gWheel, 50);
+
+    // Timers for the current tick or earlier expire on the next tick
+    ScheduleTimerWheelEntry(&gWheel, &timer->Entry, 10, ExpireTestTimer);
+    CHECK(timer->Entry.Expiry == 51);
+    CHECK(AdvanceTimerWheel(&gWheel, 51) == 1);
+    CHECK(timer->ExpiredAt == 51);
+
+    // Timers beyond the limit expire at the limit
+    ScheduleTimerWheelEntry(&gWheel, &timer->Entry, 51 + TIMER_WHEEL_MAX_TICKS * 2,
+            ExpireTestTimer);
+    CHECK(timer->Entry.Expiry == 51 + TIMER_WHEEL_MAX_TICKS);
+
+    // Rescheduling moves the timer instead of adding it twice
+    ScheduleTimerWheelEntry(&gWheel, &timer->Entry, 60, ExpireTestTimer);
+    CHECK(gWheel.Count == 1);
+
+    // One call advances at most TIMER_WHEEL_MAX_ADVANCE ticks while timers
+    // are scheduled
+    ScheduleTimerWheelEntry(&gWheel, &gTimers[1].Entry, 51 + TIMER_WHEEL_MAX_ADVANCE * 3,
+            ExpireTestTimer);
+    CHECK(AdvanceTimerWheel(&gWheel, 51 + TIMER_WHEEL_MAX_ADVANCE * 3) == 1);
+    CHECK(gWheel.CurrentTick == 51 + TIMER_WHEEL_MAX_ADVANCE);
+    CHECK(timer->ExpiredAt == 60);
+
+    // An empty wheel skips straight to the tick
+    CancelTimerWheelEntry(&gWheel, &gTimers[1].Entry);
+    CHECK(AdvanceTimerWheel(&gWheel, 1000000) == 0);
+    CHECK(gWheel.CurrentTick == 1000000);
+
+    // Routines can schedule their own timer again
+    ScheduleTimerWheelEntry(&gWheel, &gTimers[2].Entry, 1000010, Reschedule);
+    while (gWheel.Count) {
+        AdvanceTimerWheel(&gWheel, gWheel.CurrentTick + 7);
+    }
+    CHECK(gTimers[2].Expired == 3);
+}
+
+//----------------------------------------------------------------------------
+// The timer is rescheduled from inside the routine, so it must neither expire
+// twice on one tick nor keep one call from returning
+static void TestRescheduleSelf(void)
+{
+    TEST_TIMER *timer = &gTimers[0];
+
+    memset(gTimers, 0, sizeof(gTimers));
+    InitTimerWheel(&gWheel, 100);
+    ScheduleTimerWheelEntry(&gWheel, &timer->Entry, 101, RescheduleNow);
+
+    // One call over many ticks expires the timer once on each of them
+    CHECK(AdvanceTimerWheel(&gWheel, 104) == 4);
+    CHECK(timer->Expired == 4);
+    CHECK(timer->ExpiredAt == 104);
+    CHECK(IsTimerWheelEntryScheduled(&timer->Entry));
+    CHECK(timer->Entry.Expiry == 105);
+
+    // Also across a level 1 cascade, and it stops when the routine stops
+    // rescheduling
+    CHECK(AdvanceTimerWheel(&gWheel, 1000) == 6);
+    CHECK(timer->Expired == 10);
+    CHECK(timer->ExpiredAt == 110);
+    CHECK(!IsTimerWheelEntryScheduled(&timer->Entry));
+    CHECK(gWheel.Count == 0);
+}
+
+//----------------------------------------------------------------------------
+// Cancelling a timer that was taken from the same slot keeps it from
+// expiring, and cancelling one that already expired does nothing
+static void TestCancelSibling(void)
+{
+    TEST_TIMER *first  = &gTimers[0];
+    TEST_TIMER *second = &gTimers[1];
+    TEST_TIMER *third  = &gTimers[2];
+
+    memset(gTimers, 0, sizeof(gTimers));
+    InitTimerWheel(&gWheel, 0);
+
+    // Timers in a slot expire in the order they were scheduled
+    ScheduleTimerWheelEntry(&gWheel, &first->Entry, 5, CancelSibling);
+    ScheduleTimerWheelEntry(&gWheel, &second->Entry, 5, ExpireTestTimer);
+    ScheduleTimerWheelEntry(&gWheel, &third->Entry, 5, ExpireTestTimer);
+    gSibling = second;
+    CHECK(AdvanceTimerWheel(&gWheel, 5) == 2);
+    CHECK(first->Expired == 1);
+    CHECK(second->Expired == 0);
+    CHECK(!IsTimerWheelEntryScheduled(&second->Entry));
+    CHECK(third->Expired == 1);
+    CHECK(gWheel.Count == 0);
+
+    // The last timer in the slot cancels the first, which already expired
+    memset(gTimers, 0, sizeof(gTimers));
+    ScheduleTimerWheelEntry(&gWheel, &first->Entry, 70, ExpireTestTimer);
+    ScheduleTimerWheelEntry(&gWheel, &second->Entry, 70, CancelSibling);
+    ScheduleTimerWheelEntry(&gWheel, &third->Entry, 200, ExpireTestTimer);
+    gSibling = first;
+    CHECK(AdvanceTimerWheel(&gWheel, 70) == 2);
+    CHECK(first->Expired == 1);
+    CHECK(second->Expired == 1);
+    CHECK(gWheel.Count == 1);
+
+    // The only other timer in the slot, after both cascade from level 1.
+    // Rescheduling the third timer puts it after the first.
+    ScheduleTimerWheelEntry(&gWheel, &first->Entry, 200, CancelSibling);
+    ScheduleTimerWheelEntry(&gWheel, &third->Entry, 200, ExpireTestTimer);
+    gSibling = third;
+    CHECK(AdvanceTimerWheel(&gWheel, 200) == 1);
+    CHECK(third->Expired == 0);
+    CHECK(first->Expired == 2);
+    CHECK(gWheel.Count == 0);
+}
+
+//----------------------------------------------------------------------------
+static double GetSeconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//----------------------------------------------------------------------------
+// A timer per connection, kept in a binary heap ordered by expiry so the
+// next one to fire is always at the top
+static void PushHeap(UINT64 *heap, UINT32 *count, const UINT64 expiry)
+{
+    UINT32 index = (*count)++;
+
+    while (index && (heap[(index - 1) / 2] > expiry)) {
+        heap[index] = heap[(index - 1) / 2];
+        index       = (index - 1) / 2;
+    }
+    heap[index] = expiry;
+}
+
+//----------------------------------------------------------------------------
+static void PopHeap(UINT64 *heap, UINT32 *count)
+{
+    const UINT64 last  = heap[--(*count)];
+    UINT32       index = 0;
+
+    for (;;) {
+        UINT32 child = index * 2 + 1;
+
+        if (child >= *count) {
+            break;
+        }
+        if ((child + 1 < *count) && (heap[child + 1] < heap[child])) {
+            child++;
+        }
+        if (heap[child] >= last) {
+            break;
+        }
+        heap[index] = heap[child];
+        index       = child;
+    }
+    heap[index] = last;
+}
+
+//----------------------------------------------------------------------------
+// Closes CLOSES_PER_TICK connections and expires the ones that were closed
+// HOLD_TICKS ago on every tick, then prints the cost of each against the
+// 10 microseconds a close gets at 100,000 per second
+static void BenchmarkCloses(void)
+{
+    const UINT32  ticks    = BENCHMARK_SECONDS * TICKS_PER_SECOND;
+    const UINT64  closes   = (UINT64)ticks * CLOSES_PER_TICK;
+    TEST_TIMER   *timers   = calloc(MAX_HELD, sizeof(TEST_TIMER));
+    UINT64       *heap     = calloc(MAX_HELD, sizeof(UINT64));
+    UINT32        heapSize = 0;
+    UINT64        popped   = 0;
+    UINT32        next     = 0;
+    double        start;
+    double        wheelTime;
+    double        heapTime;
+
+    if (!timers || !heap) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    // Timers are reused round robin, since a connection's block node is
+    // freed when its timer expires
+    InitTimerWheel(&gWheel, 0);
+    gCloseExpired = 0;
+    gCloseOnTime  = true;
+    start = GetSeconds();
+    for (UINT32 tick = 1; tick <= ticks; tick++) {
+        for (UINT32 close = 0; close < CLOSES_PER_TICK; close++) {
+            ScheduleTimerWheelEntry(&gWheel, &timers[next].Entry, gWheel.CurrentTick + HOLD_TICKS,
+                    ExpireClose);
+            next = (next + 1) % MAX_HELD;
+        }
+        AdvanceTimerWheel(&gWheel, tick);
+    }
+    wheelTime = GetSeconds() - start;
+    CHECK(gCloseOnTime);
+    CHECK(gCloseExpired == closes - (UINT64)(HOLD_TICKS - 1) * CLOSES_PER_TICK);
+    CHECK(gWheel.Count == (HOLD_TICKS - 1) * CLOSES_PER_TICK);
+
+    start = GetSeconds();
+    for (UINT32 tick = 1; tick <= ticks; tick++) {
+        for (UINT32 close = 0; close < CLOSES_PER_TICK; close++) {
+            PushHeap(heap, &heapSize, tick - 1 + HOLD_TICKS);
+        }
+        while (heapSize && (heap[0] <= tick)) {
+            PopHeap(heap, &heapSize);
+            popped++;
+        }
+    }
+    heapTime = GetSeconds() - start;
+    CHECK(popped == gCloseExpired);
+
+    printf("%u closes per second held %u ms, %u held at once:\n", CLOSES_PER_SECOND,
+            HOLD_TICKS * 1000 / TICKS_PER_SECOND, (HOLD_TICKS - 1) * CLOSES_PER_TICK);
+    printf("%-28s %6.1f ns per close, %5.2f%% of a processor\n", "Timer wheel:",
+            wheelTime / closes * 1e9, wheelTime / BENCHMARK_SECONDS * 100);
+    printf("%-28s %6.1f ns per close, %5.2f%% of a processor\n",
+            "Timer per connection (heap):", heapTime / closes * 1e9,
+            heapTime / BENCHMARK_SECONDS * 100);
+    free(heap);
+    free(timers);
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    TestRandomTimers();
+    TestEdges();
+    TestRescheduleSelf();
+    TestCancelSibling();
+    BenchmarkCloses();
+    return TEST_RESULT("timer_wheel");
+}
@@ -0,0 +1,52 @@
+//----------------------------------------------------------------------------
+// Prints a binary trace dump saved from IOCTL_KPH_GET_TRACE
+//
+//   trace_decode dump.bin
+//
+// The file holds the bytes the IOCTL returned, starting with the TRACE_DUMP
+// header.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <stdlib.h>
+
+#include "trace_decoder.h"
+
+//----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+    FILE *file;
+    char *data;
+    long  size;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: trace_decode dump.bin\n");
+        return 2;
+    }
+    file = fopen(argv[1], "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 2;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = malloc(size ? size : 1);
+    if (!data || (fread(data, 1, size, file) != (size_t)size)) {
+        fprintf(stderr, "Cannot read %s\n", argv[1]);
+        fclose(file);
+        return 2;
+    }
+    fclose(file);
+
+    if (!DecodeTraceDump(data, (size_t)size, stdout)) {
+        fprintf(stderr, "%s is not a whole trace dump\n", argv[1]);
+        free(data);
+        return 1;
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,114 @@
+//----------------------------------------------------------------------------
+// Decodes the binary trace dump that IOCTL_KPH_GET_TRACE returns
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <stdlib.h>
+
+#include "trace_decoder.h"
+
+//----------------------------------------------------------------------------
+static const char *GetLockName(const UINT32 lock)
+{
+    switch (lock) {
+    case TraceLockTrees:
+        return "trees";
+    case TraceLockReaderList:
+        return "reader list";
+    default:
+        return "unknown";
+    }
+}
+
+//----------------------------------------------------------------------------
+// Each processor's records are already oldest first, so a stable sort by
+// timestamp keeps their order when timestamps tie
+static int CompareRecords(const void *first, const void *second)
+{
+    const TRACE_RECORD *a = *(const TRACE_RECORD* const*)first;
+    const TRACE_RECORD *b = *(const TRACE_RECORD* const*)second;
+
+    if (a->Timestamp != b->Timestamp) {
+        return (a->Timestamp < b->Timestamp) ? -1 : 1;
+    }
+    return (a < b) ? -1 : (a > b);
+}
+
+//----------------------------------------------------------------------------
+int FormatTraceEvent(
+    __in  const TRACE_RECORD *record,
+    __out char               *buffer,
+    __in  const size_t        size)
+{
+    const UINT32 *args = record->Args;
+
+    switch (record->EventId) {
+    case TraceLockAcquired:
+        return snprintf(buffer, size, "Acquired %s lock at line %u", GetLockName(args[0]),
+                args[1]);
+    case TraceLockReleased:
+        return snprintf(buffer, size, "Released %s lock at line %u", GetLockName(args[0]),
+                args[1]);
+    case TracePacketHeld:
+        return snprintf(buffer, size, "Holding packet block for connection %08X", args[0]);
+    case TracePacketReleased:
+        return snprintf(buffer, size, "Releasing packet block for connection %08X", args[0]);
+    case TraceConnectionHeld:
+        return snprintf(buffer, size, "Holding closed connection %08X for 1 second", args[0]);
+    case TraceConnectionRemoved:
+        return snprintf(buffer, size, "Removing closed connection %08X", args[0]);
+    case TraceBlockDropped:
+        return snprintf(buffer, size, "Dropped block for reader %d with type %08X and sequence %llu",
+                (INT32)args[0], args[1], ((unsigned long long)args[3] << 32) | args[2]);
+    default:
+        return snprintf(buffer, size, "Unknown event %u (%08X %08X %08X %08X)",
+                record->EventId, args[0], args[1], args[2], args[3]);
+    }
+}
+
+//----------------------------------------------------------------------------
+bool DecodeTraceDump(
+    __in_bcount(length) const void *dump,
+    __in                const size_t length,
+    __in                FILE        *output)
+{
+    const TRACE_DUMP    *header = (const TRACE_DUMP*)dump;
+    const TRACE_RECORD **sorted;
+    char                 message[256];
+
+    if ((length < FIELD_OFFSET(TRACE_DUMP, Records)) ||
+            (header->NumRecords > (length - FIELD_OFFSET(TRACE_DUMP, Records)) /
+            sizeof(TRACE_RECORD)) || !header->Frequency) {
+        return false;
+    }
+
+    fprintf(output, "%u records, %u lost, counter at %llu Hz\n", header->NumRecords,
+            header->LostRecords, (unsigned long long)header->Frequency);
+    if (!header->NumRecords) {
+        return true;
+    }
+
+    sorted = malloc(header->NumRecords * sizeof(TRACE_RECORD*));
+    if (!sorted) {
+        return false;
+    }
+    for (UINT32 index = 0; index < header->NumRecords; index++) {
+        sorted[index] = &header->Records[index];
+    }
+    qsort(sorted, header->NumRecords, sizeof(TRACE_RECORD*), CompareRecords);
+
+    for (UINT32 index = 0; index < header->NumRecords; index++) {
+        const TRACE_RECORD *record = sorted[index];
+        const double        usec   = (double)(record->Timestamp - sorted[0]->Timestamp) *
+                1e6 / header->Frequency;
+
+        FormatTraceEvent(record, message, sizeof(message));
+        fprintf(output, "%14.3f us  cpu %3u  thread %6u  %s\n", usec, record->Cpu,
+                record->ThreadId, message);
+    }
+    free(sorted);
+    return true;
+}
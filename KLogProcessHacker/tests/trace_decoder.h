@@ -0,0 +1,53 @@
+//----------------------------------------------------------------------------
+// Decodes the binary trace dump that IOCTL_KPH_GET_TRACE returns
+//
+// The driver stores an event ID and four numbers for each tracepoint.  This
+// formats them with the strings listed with the TRACE_EVENT enumeration in
+// ioctls.h and merges the processors' records into one timeline.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#ifndef TRACE_DECODER_H
+#define TRACE_DECODER_H
+
+#include <stdio.h>
+
+#include "kph.h"
+
+//----------------------------------------------------------------------------
+/// @brief Formats the message for a trace record
+///
+/// Unknown event IDs, such as from a newer driver or a torn record, format as
+/// the ID and the raw arguments.
+///
+/// @param record  Record to format
+/// @param buffer  Buffer to hold the message
+/// @param size    Size of the buffer in bytes
+///
+/// @returns Number of characters the whole message needs, as snprintf does
+int FormatTraceEvent(
+    __in  const TRACE_RECORD *record,
+    __out char               *buffer,
+    __in  const size_t        size);
+
+//----------------------------------------------------------------------------
+/// @brief Prints a trace dump as one line per record, oldest first
+///
+/// Each line has the microseconds since the oldest record, the processor,
+/// the thread, and the message.  Records from different processors are
+/// merged by timestamp.
+///
+/// @param dump    Trace dump as IOCTL_KPH_GET_TRACE returns it
+/// @param length  Number of bytes the IOCTL returned
+/// @param output  Where to print the records
+///
+/// @returns True if successful; false if the dump is truncated or malformed
+bool DecodeTraceDump(
+    __in_bcount(length) const void *dump,
+    __in                const size_t length,
+    __in                FILE        *output);
+
+#endif // TRACE_DECODER_H
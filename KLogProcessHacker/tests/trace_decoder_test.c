@@ -0,0 +1,136 @@
+//----------------------------------------------------------------------------
+// Host tests for the trace dump decoder
+//
+// Records events with the driver's trace.c on two threads, which the kernel
+// stand-in puts on different processors, dumps them with GetTraceDump, and
+// checks the decoded timeline.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "trace_decoder.h"
+#include "test.h"
+
+#define RING_RECORDS     1024   // TRACE_RING_RECORDS in trace.c
+#define BUSY_EVENTS      1500   // More than a ring holds, so some are lost
+#define DUMP_RECORDS     4096
+
+//----------------------------------------------------------------------------
+static void *TraceBusyThread(void *context)
+{
+    UNREFERENCED_PARAMETER(context);
+    for (UINT32 index = 0; index < BUSY_EVENTS; index++) {
+        TraceEvent(TraceLockAcquired, TraceLockTrees, index, 0, 0);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+static void *TraceEachThread(void *context)
+{
+    UNREFERENCED_PARAMETER(context);
+    TraceEvent(TraceLockReleased, TraceLockReaderList, 2001, 0, 0);
+    TraceEvent(TracePacketHeld, 0xABCD, 0, 0, 0);
+    TraceEvent(TracePacketReleased, 0xABCD, 0, 0, 0);
+    TraceEvent(TraceConnectionHeld, 0x1234, 0, 0, 0);
+    TraceEvent(TraceConnectionRemoved, 0x1234, 0, 0, 0);
+    TraceEvent(TraceBlockDropped, 3, PacketBlock, 5, 1);
+    TraceEvent(99, 1, 2, 3, 4);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+static bool IsMessage(const UINT16 eventId, const UINT32 arg0, const UINT32 arg1,
+        const char *expected)
+{
+    TRACE_RECORD record;
+    char         message[128];
+
+    memset(&record, 0, sizeof(record));
+    record.EventId = eventId;
+    record.Args[0] = arg0;
+    record.Args[1] = arg1;
+    FormatTraceEvent(&record, message, sizeof(message));
+    return !strcmp(message, expected);
+}
+
+//----------------------------------------------------------------------------
+int main(void)
+{
+    const UINT32   dumpSize = FIELD_OFFSET(TRACE_DUMP, Records) + DUMP_RECORDS *
+            sizeof(TRACE_RECORD);
+    DEVICE_OBJECT  device   = { NULL };
+    TRACE_DUMP    *dump     = calloc(1, dumpSize);
+    pthread_t      thread;
+    char          *text     = NULL;
+    size_t         textSize = 0;
+    FILE          *output;
+    UINT32         length;
+    UINT32         lines    = 0;
+    double         previous = 0;
+
+    CHECK(IsMessage(TraceLockAcquired, TraceLockTrees, 812, "Acquired trees lock at line 812"));
+    CHECK(IsMessage(TraceLockReleased, TraceLockReaderList, 7,
+            "Released reader list lock at line 7"));
+    CHECK(IsMessage(TraceConnectionHeld, 0xBEEF, 0,
+            "Holding closed connection 0000BEEF for 1 second"));
+    CHECK(IsMessage(TraceBlockDropped, 0xFFFFFFFF, ConnectionBlock,
+            "Dropped block for reader -1 with type 00000102 and sequence 0"));
+    CHECK(IsMessage(0, 1, 2, "Unknown event 0 (00000001 00000002 00000000 00000000)"));
+
+    // The busy thread runs first, so its kept records come before the others
+    if (!dump || !NT_SUCCESS(InitializeTrace(&device))) {
+        fprintf(stderr, "Cannot set up the trace\n");
+        return 1;
+    }
+    pthread_create(&thread, NULL, TraceBusyThread, NULL);
+    pthread_join(thread, NULL);
+    pthread_create(&thread, NULL, TraceEachThread, NULL);
+    pthread_join(thread, NULL);
+
+    length = GetTraceDump(dump, dumpSize);
+    CHECK(dump->NumRecords == RING_RECORDS + 7);
+    CHECK(dump->LostRecords == BUSY_EVENTS - RING_RECORDS);
+    CHECK(length == FIELD_OFFSET(TRACE_DUMP, Records) + dump->NumRecords * sizeof(TRACE_RECORD));
+
+    output = open_memstream(&text, &textSize);
+    CHECK(DecodeTraceDump(dump, length, output));
+    fclose(output);
+    CHECK(!strncmp(text, "1031 records, 476 lost, counter at ", 35));
+    CHECK(strstr(text, "Acquired trees lock at line 476\n") != NULL);
+    CHECK(strstr(text, "Acquired trees lock at line 475\n") == NULL);
+    CHECK(strstr(text, "Holding packet block for connection 0000ABCD\n") != NULL);
+    CHECK(strstr(text, "Dropped block for reader 3 with type 00000006 and sequence 4294967301\n") != NULL);
+    CHECK(strstr(text, "Unknown event 99 (00000001 00000002 00000003 00000004)\n") != NULL);
+
+    // Records come out oldest first, and the busy thread's last record comes
+    // before the other thread's first
+    for (char *line = strchr(text, '\n'); line && line[1]; line = strchr(line + 1, '\n')) {
+        const double usec = strtod(line + 1, NULL);
+        CHECK(usec >= previous);
+        previous = usec;
+        lines++;
+    }
+    CHECK(lines == dump->NumRecords);
+    CHECK(strstr(text, "line 1499\n") < strstr(text, "Released reader list lock"));
+    free(text);
+
+    // The decoder rejects dumps cut short, and the driver counts records that
+    // do not fit as lost
+    output = fopen("/dev/null", "w");
+    CHECK(!DecodeTraceDump(dump, length - 1, output));
+    CHECK(!DecodeTraceDump(dump, FIELD_OFFSET(TRACE_DUMP, Records) - 1, output));
+    fclose(output);
+    length = GetTraceDump(dump, FIELD_OFFSET(TRACE_DUMP, Records) + 10 * sizeof(TRACE_RECORD));
+    CHECK(dump->NumRecords == 10);
+    CHECK(dump->LostRecords == BUSY_EVENTS + 7 - 10);
+
+    CHECK(NT_SUCCESS(DeinitializeTrace()));
+    free(dump);
+    return TEST_RESULT("trace_decoder");
+}
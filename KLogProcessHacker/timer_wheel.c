@@ -0,0 +1,164 @@
+//----------------------------------------------------------------------------
+// Hierarchical timer wheel that expires timers in bulk on a periodic tick
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Puts a timer in the slot for its expiry, relative to the current tick
+// The expiry must not be before the current tick.  Each level holds the
+// timers that are less than a full turn of the level above away, so a timer
+// never lands in a slot that has already come due this turn.
+static void InsertTimerWheelEntry(
+    __inout TIMER_WHEEL       *wheel,
+    __inout TIMER_WHEEL_ENTRY *entry)
+{
+    UINT64 delta = entry->Expiry - wheel->CurrentTick;
+    UINT32 level;
+
+    if (delta > TIMER_WHEEL_MAX_TICKS) {
+        delta         = TIMER_WHEEL_MAX_TICKS;
+        entry->Expiry = wheel->CurrentTick + delta;
+    }
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+            break;
+        }
+    }
+    InsertTailList(&wheel->Slots[level][(entry->Expiry >> (level * TIMER_WHEEL_SLOT_BITS)) &
+            (TIMER_WHEEL_SLOTS - 1)], &entry->ListEntry);
+}
+
+//----------------------------------------------------------------------------
+// Moves the timers in one slot to the end of a list
+static void TakeTimerWheelSlot(
+    __inout LIST_ENTRY *slot,
+    __inout LIST_ENTRY *list)
+{
+    if (!IsListEmpty(slot)) {
+        LIST_ENTRY *first = slot->Flink;
+        LIST_ENTRY *last  = slot->Blink;
+
+        first->Blink       = list->Blink;
+        list->Blink->Flink = first;
+        last->Flink        = list;
+        list->Blink        = last;
+        InitializeListHead(slot);
+    }
+}
+
+//----------------------------------------------------------------------------
+UINT32 AdvanceTimerWheel(
+    __inout TIMER_WHEEL  *wheel,
+    __in    const UINT64  tick)
+{
+    const UINT64 end     = min(tick, wheel->CurrentTick + TIMER_WHEEL_MAX_ADVANCE);
+    UINT32       expired = 0;
+
+    while (wheel->CurrentTick < end) {
+        LIST_ENTRY list;
+        UINT64     current;
+
+        // Nothing can expire in between, so skip ahead after a long idle
+        if (!wheel->Count) {
+            wheel->CurrentTick = tick;
+            break;
+        }
+        current = ++wheel->CurrentTick;
+
+        // Cascade each level whose turn starts on this tick, lowest first, so
+        // timers moving down never land in a slot that already cascaded
+        InitializeListHead(&list);
+        for (UINT32 level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (current & ((1ULL << (level * TIMER_WHEEL_SLOT_BITS)) - 1)) {
+                break;
+            }
+            TakeTimerWheelSlot(&wheel->Slots[level][(current >> (level * TIMER_WHEEL_SLOT_BITS)) &
+                    (TIMER_WHEEL_SLOTS - 1)], &list);
+            while (!IsListEmpty(&list)) {
+                InsertTimerWheelEntry(wheel, CONTAINING_RECORD(RemoveHeadList(&list),
+                        TIMER_WHEEL_ENTRY, ListEntry));
+            }
+        }
+
+        // Take the whole slot first, since routines can schedule and cancel
+        // other timers
+        TakeTimerWheelSlot(&wheel->Slots[0][current & (TIMER_WHEEL_SLOTS - 1)], &list);
+        while (!IsListEmpty(&list)) {
+            TIMER_WHEEL_ENTRY *entry = CONTAINING_RECORD(RemoveHeadList(&list),
+                    TIMER_WHEEL_ENTRY, ListEntry);
+
+            entry->ListEntry.Flink = NULL;
+            entry->ListEntry.Blink = NULL;
+            wheel->Count--;
+            expired++;
+            entry->Routine(entry);
+        }
+    }
+    return expired;
+}
+
+//----------------------------------------------------------------------------
+void CancelTimerWheelEntry(
+    __inout TIMER_WHEEL       *wheel,
+    __inout TIMER_WHEEL_ENTRY *entry)
+{
+    if (IsTimerWheelEntryScheduled(entry)) {
+        RemoveEntryList(&entry->ListEntry);
+        entry->ListEntry.Flink = NULL;
+        entry->ListEntry.Blink = NULL;
+        wheel->Count--;
+    }
+}
+
+//----------------------------------------------------------------------------
+void InitTimerWheel(
+    __out TIMER_WHEEL  *wheel,
+    __in  const UINT64  tick)
+{
+    wheel->CurrentTick = tick;
+    wheel->Count       = 0;
+    for (UINT32 level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (UINT32 slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            InitializeListHead(&wheel->Slots[level][slot]);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+void ScheduleTimerWheelEntry(
+    __inout TIMER_WHEEL         *wheel,
+    __inout TIMER_WHEEL_ENTRY   *entry,
+    __in    const UINT64         expiry,
+    __in    TIMER_WHEEL_ROUTINE *routine)
+{
+    CancelTimerWheelEntry(wheel, entry);
+
+    // The current tick's slot has already come due
+    entry->Expiry  = (expiry > wheel->CurrentTick) ? expiry : wheel->CurrentTick + 1;
+    entry->Routine = routine;
+    InsertTimerWheelEntry(wheel, entry);
+    wheel->Count++;
+}
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,143 @@
+//----------------------------------------------------------------------------
+// Hierarchical timer wheel that expires timers in bulk on a periodic tick
+//
+// Timers live in TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots.  Each
+// level 0 slot holds the timers for one tick, and each slot of a higher level
+// covers a whole turn of the level below it.  Whenever a level wraps, the next
+// slot of the level above is cascaded down.  Scheduling and cancelling are
+// O(1), and advancing the wheel only visits the slots that come due.
+//
+// The wheel does no locking.  The owner serializes every call with its own
+// lock, and expiry routines run with that lock held.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+#define TIMER_WHEEL_SLOT_BITS 6                            // Number of bits that select a slot within a level
+#define TIMER_WHEEL_SLOTS     (1 << TIMER_WHEEL_SLOT_BITS) // Number of slots in each level
+#define TIMER_WHEEL_LEVELS    4                            // Number of levels
+
+// Timers further away than this many ticks expire at the limit instead
+#define TIMER_WHEEL_MAX_TICKS ((1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1)
+
+// Most ticks one call advances a wheel that has timers, so catching up after a
+// long idle does not hold the owner's lock for long
+#define TIMER_WHEEL_MAX_ADVANCE (TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS)
+
+struct TIMER_WHEEL_ENTRY;
+
+// Routine the wheel calls when a timer expires
+// The timer is no longer scheduled, so the routine can schedule it again.
+typedef void TIMER_WHEEL_ROUTINE(__in struct TIMER_WHEEL_ENTRY *entry);
+
+// A timer, usually embedded in the structure it expires
+// Zeroed memory is a timer that is not scheduled.
+struct TIMER_WHEEL_ENTRY {
+    LIST_ENTRY           ListEntry;  // Slot list entry (Flink is NULL if not scheduled)
+    UINT64               Expiry;     // Tick the timer expires on
+    TIMER_WHEEL_ROUTINE *Routine;    // Routine to call when the timer expires
+};
+
+typedef struct TIMER_WHEEL_ENTRY TIMER_WHEEL_ENTRY;
+
+struct TIMER_WHEEL {
+    UINT64     CurrentTick;  // Tick the wheel was last advanced to
+    UINT32     Count;        // Number of scheduled timers
+    LIST_ENTRY Slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // Timers in each slot
+};
+
+typedef struct TIMER_WHEEL TIMER_WHEEL;
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Checks if a timer is scheduled
+///
+/// @param entry  Timer to check
+///
+/// @returns True if the timer is scheduled; false otherwise
+static inline bool IsTimerWheelEntryScheduled(__in const TIMER_WHEEL_ENTRY *entry)
+{
+    return entry->ListEntry.Flink != NULL;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Advances the wheel, calling the routine for each timer that expires
+///
+/// Timers expire in tick order.  Timers that expire on the same tick expire
+/// in no particular order.  Advances at most TIMER_WHEEL_MAX_ADVANCE ticks
+/// while timers are scheduled, so call it again if it falls behind.
+///
+/// @param wheel  Timer wheel to advance
+/// @param tick   Current tick
+///
+/// @returns Number of timers that expired
+UINT32 AdvanceTimerWheel(
+    __inout TIMER_WHEEL  *wheel,
+    __in    const UINT64  tick);
+
+//----------------------------------------------------------------------------
+/// @brief Cancels a timer
+///
+/// Does nothing if the timer is not scheduled.
+///
+/// @param wheel  Timer wheel the timer is scheduled on
+/// @param entry  Timer to cancel
+void CancelTimerWheelEntry(
+    __inout TIMER_WHEEL       *wheel,
+    __inout TIMER_WHEEL_ENTRY *entry);
+
+//----------------------------------------------------------------------------
+/// @brief Initializes an empty timer wheel
+///
+/// @param wheel  Timer wheel to initialize
+/// @param tick   Current tick
+void InitTimerWheel(
+    __out TIMER_WHEEL  *wheel,
+    __in  const UINT64  tick);
+
+//----------------------------------------------------------------------------
+/// @brief Schedules a timer, rescheduling it if it is already scheduled
+///
+/// Timers for the current tick or earlier expire on the next tick.
+///
+/// @param wheel    Timer wheel to schedule the timer on
+/// @param entry    Timer to schedule
+/// @param expiry   Tick to expire the timer on
+/// @param routine  Routine to call when the timer expires
+void ScheduleTimerWheelEntry(
+    __inout TIMER_WHEEL         *wheel,
+    __inout TIMER_WHEEL_ENTRY   *entry,
+    __in    const UINT64         expiry,
+    __in    TIMER_WHEEL_ROUTINE *routine);
+
+#ifdef __cplusplus
+}; // extern "C"
+#endif
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,144 @@
+//----------------------------------------------------------------------------
+// Per-processor rings of fixed-size binary trace records
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "kph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+#define TRACE_RING_RECORDS 1024 // Records in each processor's ring (must be a power of 2)
+
+// Per-processor trace ring
+// Aligned to a cache line so processors do not share lines.
+struct DECLSPEC_CACHEALIGN TRACE_CPU {
+    volatile LONG Next;                         // Number of records ever added to this ring
+    TRACE_RECORD  Records[TRACE_RING_RECORDS];  // Ring of records
+};
+
+typedef struct TRACE_CPU TRACE_CPU;
+
+//----------------------------------------------------------------------------
+// Global variables
+//----------------------------------------------------------------------------
+
+static TRACE_CPU    *gTraceCpus     = NULL;    // Trace ring for each processor
+static ULONG         gTraceCpuCount = 0;       // Number of processors with trace rings
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS DeinitializeTrace(void)
+{
+    if (gTraceCpus) {
+        const ULONG cpuCount = gTraceCpuCount;
+
+        // Stop new records before freeing the rings
+        gTraceCpuCount = 0;
+        KeMemoryBarrier();
+        FreePages(gTraceCpus, cpuCount * sizeof(TRACE_CPU), MemoryTrace);
+        gTraceCpus = NULL;
+    }
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+UINT32 GetTraceDump(
+    __out_bcount(dumpLength) TRACE_DUMP *dump,
+    __in                     const UINT32 dumpLength)
+{
+    const UINT32  maxRecords = (dumpLength - FIELD_OFFSET(TRACE_DUMP, Records)) /
+            sizeof(TRACE_RECORD);
+    LARGE_INTEGER frequency;
+
+    KeQueryPerformanceCounter(&frequency);
+    dump->Frequency   = frequency.QuadPart;
+    dump->NumRecords  = 0;
+    dump->LostRecords = 0;
+
+    for (ULONG cpu = 0; cpu < gTraceCpuCount; cpu++) {
+        const UINT32 next  = (UINT32)gTraceCpus[cpu].Next;
+        const UINT32 count = min(next, TRACE_RING_RECORDS);
+
+        for (UINT32 record = next - count; record != next; record++) {
+            if (dump->NumRecords == maxRecords) {
+                dump->LostRecords++;
+                continue;
+            }
+            dump->Records[dump->NumRecords++] =
+                    gTraceCpus[cpu].Records[record & (TRACE_RING_RECORDS - 1)];
+        }
+        dump->LostRecords += next - count;
+    }
+    return FIELD_OFFSET(TRACE_DUMP, Records) + dump->NumRecords * sizeof(TRACE_RECORD);
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS InitializeTrace(__in DEVICE_OBJECT *device)
+{
+    ULONG cpuCount;
+
+    UNREFERENCED_PARAMETER(device);
+
+    cpuCount   = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    gTraceCpus = AllocatePages(cpuCount * sizeof(TRACE_CPU), MemoryTrace);
+    if (!gTraceCpus) {
+        DBGPRINT(D_ERR, "Cannot allocate processor trace rings");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(gTraceCpus, cpuCount * sizeof(TRACE_CPU));
+    gTraceCpuCount = cpuCount;
+    return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+// Callers at passive level can move to another processor after reading the
+// processor number, so slots are claimed with an interlocked increment.  The
+// ring still belongs to one processor, so the increment is not contended.
+void TraceEvent(
+    __in const UINT16 eventId,
+    __in const UINT32 arg0,
+    __in const UINT32 arg1,
+    __in const UINT32 arg2,
+    __in const UINT32 arg3)
+{
+    const ULONG   cpu = KeGetCurrentProcessorNumberEx(NULL);
+    TRACE_RECORD *record;
+
+    if (cpu >= gTraceCpuCount) {
+        return;
+    }
+    record = &gTraceCpus[cpu].Records[(UINT32)(InterlockedIncrement(&gTraceCpus[cpu].Next) - 1) &
+            (TRACE_RING_RECORDS - 1)];
+    record->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    record->EventId   = eventId;
+    record->Cpu       = (UINT16)cpu;
+    record->ThreadId  = (UINT32)(ULONG_PTR)PsGetCurrentThreadId();
+    record->Args[0]   = arg0;
+    record->Args[1]   = arg1;
+    record->Args[2]   = arg2;
+    record->Args[3]   = arg3;
+}
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,87 @@
+//----------------------------------------------------------------------------
+// Per-processor rings of fixed-size binary trace records
+//
+// Tracepoints store an event ID and up to four numbers instead of formatting
+// a string, so they are cheap enough for hot paths and release builds.  The
+// format string for each event ID is listed with the TRACE_EVENT enumeration
+// in ioctls.h, so dumps are formatted offline.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef TRACE_H
+#define TRACE_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Frees the per-processor trace rings
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS DeinitializeTrace(void);
+
+//----------------------------------------------------------------------------
+/// @brief Copies the trace records from every processor
+///
+/// Records are copied oldest first for each processor, one processor after
+/// another.  Records written while copying may be torn or missing.
+///
+/// @param dump        Buffer to hold the dump header and records
+/// @param dumpLength  Size of the buffer in bytes, which must hold at least
+///                    the dump header
+///
+/// @returns Number of bytes copied
+UINT32 GetTraceDump(
+    __out_bcount(dumpLength) TRACE_DUMP *dump,
+    __in                     const UINT32 dumpLength);
+
+//----------------------------------------------------------------------------
+/// @brief Allocates the per-processor trace rings
+///
+/// @param device  WDM device object for this driver
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS InitializeTrace(__in DEVICE_OBJECT *device);
+
+//----------------------------------------------------------------------------
+/// @brief Adds a trace record to the current processor's ring
+///
+/// Overwrites the processor's oldest record once the ring is full.
+///
+/// @param eventId  Trace event ID
+/// @param arg0     First event argument
+/// @param arg1     Second event argument
+/// @param arg2     Third event argument
+/// @param arg3     Fourth event argument
+void TraceEvent(
+    __in const UINT16 eventId,
+    __in const UINT32 arg0,
+    __in const UINT32 arg1,
+    __in const UINT32 arg2,
+    __in const UINT32 arg3);
+
+#ifdef __cplusplus
+}; // extern "C"
+#endif
+
+#endif // TRACE_H
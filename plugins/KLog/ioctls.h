@@ -37,10 +37,187 @@ enum IOCTL_FUNCTIONS {
     IoctlSetDataEvent,
     IoctlOpenConnections,
     IoctlGetStatistics,
+    IoctlSetImageEvents,
+    IoctlGetSequenceRange,
+    IoctlGetExitHistory,
+    IoctlSetReadWatermark,
+    IoctlSetRecordFormat,
+    IoctlSetFilterModes,
+    IoctlSetRuleProgram,
+    IoctlSetConsumerGroup,
+    IoctlGetStatisticsV2,
+    IoctlSetLatencyTracking,
+    IoctlGetLatency,
+    IoctlGetTrace,
+    IoctlGenerateSyntheticEvents,
+    IoctlMapSharedStatistics,
+    IoctlGetLargestBlocks,
+    IoctlSetLockProfiling,
+    IoctlGetLockProfile,
     IoctlFlag   = 0x800, // Start of user-defined IOCTL function range
     IoctlFlag64 = 0xC00, // Used for IOCTLs that require a 64-bit version
 };
 
+// Formats a reader can read blocks in
+enum RECORD_FORMAT {
+    RecordFormatPcapNg  = 0, // PCAP-NG blocks
+    RecordFormatCompact = 1, // Compact process records
+};
+
+// Ways a reader can filter blocks by process or connection ID
+enum FILTER_MODE {
+    FilterModeExclude = 0, // Drop blocks with IDs in the list
+    FilterModeInclude = 1, // Drop blocks with IDs not in the list
+};
+
+// Process attributes a rule can match
+enum RULE_FIELD {
+    RuleFieldPath        = 0, // Executable path (string)
+    RuleFieldCommandLine = 1, // Raw command line (string)
+    RuleFieldSid         = 2, // User SID (string)
+    RuleFieldParentPid   = 3, // Parent process ID (number)
+    RuleFieldPathHash    = 4, // Hash of the executable path (number)
+};
+
+// Ways a rule can match a string attribute
+enum RULE_MATCH {
+    RuleMatchEquals   = 0, // Attribute equals the string
+    RuleMatchPrefix   = 1, // Attribute starts with the string
+    RuleMatchSuffix   = 2, // Attribute ends with the string
+    RuleMatchContains = 3, // Attribute contains the string
+};
+
+// What to do with a process block that matches a rule
+enum RULE_ACTION {
+    RuleActionKeep = 0, // Return the block to the reader
+    RuleActionDrop = 1, // Do not return the block to the reader
+};
+
+// Rule flags
+#define RULE_FLAG_IGNORE_CASE 0x01 // Compare ASCII letters without regard to case
+#define RULE_FLAG_AND_NEXT    0x02 // Only match if the next rule also matches
+
+// Compact record types
+enum COMPACT_RECORD_TYPE {
+    CompactProcessStarted = 1, // Process started
+    CompactProcessEnded   = 2, // Process ended
+};
+
+// Compact record flags
+#define COMPACT_FLAG_EXIT_STATUS 0x0001 // ExitStatus holds the process exit status
+#define COMPACT_FLAG_SUBSYSTEM   0x0002 // Subsystem process, such as a WSL process, whose ExitStatus is a Linux wait status
+
+// Extended statistics version that this header describes
+#define STATISTICS_V2_VERSION 4
+
+// Block types the extended statistics count separately
+enum STATISTICS_BLOCK_TYPE {
+    StatisticsConnectionBlocks = 0, // Connection blocks
+    StatisticsImageBlocks      = 1, // Image load blocks
+    StatisticsPacketBlocks     = 2, // Packet blocks
+    StatisticsProcessBlocks    = 3, // Process blocks
+    NumStatisticsBlockTypes    = 4,
+};
+
+// Memory the driver accounts separately, each with its own pool tag
+//
+// Not accounted: the process node and reader context lookaside lists, the
+// KProcessHacker client state, and buffers freed before the routine that
+// allocates them returns.
+enum MEMORY_TAG_TYPE {
+    MemoryBlockNodes        = 0,  // Block nodes ('bQpK')
+    MemoryConnectionBlocks  = 1,  // Connection block data too large for a block node ('cQpK')
+    MemoryExitHistory       = 2,  // Exit history ('hQpK')
+    MemoryIdFilters         = 3,  // Reader process and connection ID filters ('fQpK')
+    MemoryImageBlocks       = 4,  // Image load block data too large for a block node ('mQpK')
+    MemoryImagePaths        = 5,  // Interned image paths and the path IDs each reader received ('nQpK')
+    MemoryInterfaceBlocks   = 6,  // Interface description block data ('iQpK')
+    MemoryOpenConnections   = 7,  // Open connection nodes ('oQpK')
+    MemoryPacketBlocks      = 8,  // Packet block data too large for a block node ('kQpK')
+    MemoryProcessBlocks     = 9,  // Process block data too large for a block node ('pQpK')
+    MemoryRingBuffers       = 10, // Reader ring buffers and sequence numbers ('rQpK')
+    MemoryRulePrograms      = 11, // Reader rule programs ('uQpK')
+    MemorySectionBlocks     = 12, // Section header block data ('sQpK')
+    MemorySharedStatistics  = 13, // Shared statistics page ('wQpK')
+    MemorySnapshots         = 14, // Shared initial block snapshots ('tQpK')
+    MemoryStatistics        = 15, // Per-processor event counters ('vQpK')
+    MemoryCompactRecords    = 16, // Reader compact record buffers ('eQpK', version 4)
+    MemoryClock             = 17, // Per-processor clock state ('gQpK', version 4)
+    MemoryImageSets         = 18, // Kernel images already reported as image loads ('jQpK', version 4)
+    MemoryLatency           = 19, // Per-processor latency histograms ('qQpK', version 4)
+    MemoryLoadedPidCaches   = 20, // Per-processor loaded process ID caches ('dQpK', version 4)
+    MemoryTrace             = 21, // Per-processor trace rings ('xQpK', version 4)
+    NumMemoryTags           = 22,
+};
+
+// Where the queue manager holds a block that the largest blocks IOCTL found
+enum LARGEST_BLOCK_LOCATION {
+    LargestBlockConnectionTree = 0, // Open connections
+    LargestBlockExitHistory    = 1, // Exit history
+    LargestBlockPacketTree     = 2, // Held packets
+    LargestBlockProcessTree    = 3, // Running processes
+};
+
+// Durations the driver keeps latency histograms for
+enum LATENCY_HISTOGRAM_TYPE {
+    LatencyProcessCallback    = 0, // Process notify callback
+    LatencyImageCallback      = 1, // Load image notify routine
+    LatencyBlockBuild         = 2, // Building a process, connection, or image load block
+    LatencyTreesLockWait      = 3, // Waiting for the trees lock
+    LatencyTreesLockHold      = 4, // Holding the trees lock
+    LatencyReaderListLockWait = 5, // Waiting for the reader list lock
+    LatencyReaderListLockHold = 6, // Holding the reader list lock
+    NumLatencyHistograms      = 7,
+};
+
+// Latency histogram layout
+// Buckets below LATENCY_SUB_BUCKETS hold one tick each.  Above that, bucket b
+// starts at (LATENCY_SUB_BUCKETS + b % LATENCY_SUB_BUCKETS) << (b / LATENCY_SUB_BUCKETS - 1)
+// ticks and is 1 << (b / LATENCY_SUB_BUCKETS - 1) ticks wide.  The last bucket
+// also counts every longer duration.
+#define LATENCY_SUB_BUCKET_BITS 3   // Number of bits that select a bucket within a power of 2
+#define LATENCY_BUCKETS         192 // Number of buckets in each histogram
+
+// Latency tracking flags
+#define LATENCY_FLAG_ENABLE 0x01 // Record latencies (disables recording if clear)
+#define LATENCY_FLAG_RESET  0x02 // Clear the histograms first
+
+// Lock profiling flags
+#define LOCK_PROFILE_FLAG_ENABLE 0x01 // Profile lock call sites (disables profiling if clear)
+#define LOCK_PROFILE_FLAG_RESET  0x02 // Clear the call site profiles first
+
+// Maximum call sites profiled for each lock
+#define LOCK_PROFILE_MAX_SITES 64
+
+// Binary trace events and the format strings for their arguments
+enum TRACE_EVENT {
+    TraceLockAcquired      = 1, // "Acquired %s lock at line %u" (TRACE_LOCK, line)
+    TraceLockReleased      = 2, // "Released %s lock at line %u" (TRACE_LOCK, line)
+    TracePacketHeld        = 3, // "Holding packet block for connection %08X"
+    TracePacketReleased    = 4, // "Releasing packet block for connection %08X"
+    TraceConnectionHeld    = 5, // "Holding closed connection %08X for 1 second"
+    TraceConnectionRemoved = 6, // "Removing closed connection %08X"
+    TraceBlockDropped      = 7, // "Dropped block for reader %d with type %08X and sequence %I64u" (reader, type, sequence low, sequence high)
+};
+
+// Locks named by lock trace events
+enum TRACE_LOCK {
+    TraceLockTrees      = 0, // "trees"
+    TraceLockReaderList = 1, // "reader list"
+};
+
+// Synthetic event generator limits
+#define SYNTHETIC_MAX_DURATION 60000 // Maximum milliseconds to generate events for
+#define SYNTHETIC_MAX_READERS  16    // Maximum readers to report drops for
+#define SYNTHETIC_MAX_THREADS  64    // Maximum generator threads
+
+// Synthetic event flags
+#define SYNTHETIC_FLAG_PROFILE_LOCKS 0x01 // Reset lock profiling and enable it for the run
+
+// Shared statistics page layout
+#define SHARED_STATISTICS_VERSION     1  // Version of the shared statistics layout
+#define SHARED_STATISTICS_MAX_READERS 32 // Maximum readers in the shared statistics page
+
 #pragma pack(push, 4) // Ensure structures are 4 byte aligned
 
 struct CONNECTION_RECORD {
@@ -79,6 +256,196 @@ struct STATISTICS {
     LONG   ConnectionCloseEvents;  // Total number of connection close events
 };
 
+struct MEMORY_TAG_STATISTICS {
+    UINT32 Tag;                    // Pool tag
+    UINT32 Allocations;            // Allocations currently live with this tag
+    UINT32 PeakAllocations;        // Most allocations ever live at once
+    UINT32 BlockNodes;             // Block nodes in use for blocks of this type (0 if not a block type)
+    UINT32 PeakBlockNodes;         // Most block nodes ever in use at once for blocks of this type
+    UINT32 Reserved;               // Reserved (0)
+    UINT64 Bytes;                  // Bytes currently allocated with this tag
+    UINT64 PeakBytes;              // Most bytes ever allocated at once with this tag
+};
+
+struct STATISTICS_V2 {
+    UINT32 Version;                // Extended statistics version (STATISTICS_V2_VERSION)
+    UINT32 Length;                 // Number of bytes the driver filled in
+    UINT32 ReaderId;               // Reader's ID
+    UINT32 ReaderQueuedBlocks;     // Blocks waiting in the reader's ring buffer
+    UINT32 ReaderPeakQueuedBlocks; // Most blocks the reader's ring buffer has held at once
+    UINT32 ReaderBufferSize;       // Reader's ring buffer size
+    UINT64 ReaderDroppedBlocks[NumStatisticsBlockTypes]; // Blocks lost to a full ring buffer, by block type
+    UINT64 ReaderReadBlocks;       // Blocks the reader has read, including initial blocks
+    UINT64 ReaderReadBytes;        // PCAP-NG bytes of the blocks the reader has read
+    UINT64 ReaderIdleTime;         // Microseconds since the reader last read a block, or since it registered
+    UINT32 ReaderSnapshotBlocks;   // Blocks in the snapshot the reader is receiving so far (0 if none)
+    UINT32 ReaderSnapshotSent;     // Snapshot blocks already sent to the reader
+    UINT32 ProcessTreeCount;       // Running processes the driver is tracking
+    UINT32 ConnectionTreeCount;    // Open connections the driver is tracking
+    UINT32 ExitHistoryCount;       // Exited processes in the exit history
+    UINT32 AllocatedBlocks;        // Blocks currently allocated
+    UINT64 AllocatedBlockBytes;    // Bytes of block data currently allocated outside block nodes
+    struct MEMORY_TAG_STATISTICS Memory[NumMemoryTags]; // Memory use by pool tag (version 2)
+    UINT64 LoadedPidCacheHits;     // Image loads answered by the per-CPU loaded process ID cache (version 3)
+    UINT64 LoadedPidCacheMisses;   // Image loads that searched the process tree after missing the cache (version 3)
+    UINT64 LoadedPidCacheBypassed; // Image loads that skipped the cache because image events were enabled (version 3)
+    UINT64 ReaderSnapshotDropped;  // Initial blocks the reader lost because they could not be queued (version 4)
+};
+
+struct SEQUENCE_RANGE {
+    UINT64 Oldest;                 // Oldest sequence number retained in the reader's ring buffer
+    UINT64 Newest;                 // Newest sequence number retained in the reader's ring buffer
+    UINT64 Dropped;                // Newest sequence number dropped because the ring buffer was full (0 if none)
+};
+
+struct EXIT_HISTORY_QUERY {
+    UINT64 StartTime;              // Earliest process end time to return (microseconds since 1970-01-01)
+    UINT64 EndTime;                // Latest process end time to return (microseconds since 1970-01-01)
+};
+
+struct COMPACT_RECORD {
+    UINT32 RecordLength;           // Length of the record, including strings and padding
+    UINT16 RecordType;             // Compact record type
+    UINT16 Flags;                  // Compact record flags
+    UINT64 Sequence;               // Block sequence number
+    UINT64 Timestamp;              // Microseconds since 1970-01-01
+    UINT32 ProcessId;              // Process ID
+    UINT32 ParentProcessId;        // Parent process ID
+    UINT32 ExitStatus;             // Exit status if COMPACT_FLAG_EXIT_STATUS is set
+};
+
+struct FILTER_MODES {
+    UINT32 ConnectionIdMode;       // Filter mode for the connection ID list
+    UINT32 ProcessIdMode;          // Filter mode for the process ID list
+};
+
+struct RULE {
+    UINT8  Field;                  // Process attribute to match
+    UINT8  Match;                  // How to match a string attribute (numbers must be equal)
+    UINT8  Action;                 // Action to take if the rule matches
+    UINT8  Flags;                  // Rule flags
+    UINT32 Value;                  // Number to match
+    UINT32 StringOffset;           // Offset of the UTF-8 string to match from the start of the program
+    UINT32 StringLength;           // Length in bytes of the string to match
+};
+
+struct RULE_PROGRAM {
+    UINT32      NumRules;          // Number of rules
+    UINT32      DefaultAction;     // Action to take if no rule matches
+    struct RULE Rules[1];          // Rules, followed by the strings they match
+};
+
+struct LATENCY_HISTOGRAMS {
+    UINT64 Frequency;              // Performance counter ticks per second, which durations are counted in
+    UINT32 Enabled;                // Nonzero while latency tracking is enabled
+    UINT32 Reserved;               // Reserved (0)
+    UINT64 Histograms[NumLatencyHistograms][LATENCY_BUCKETS]; // Driver-wide counts for each bucket
+    UINT64 ReaderDequeue[LATENCY_BUCKETS]; // Counts of the time from enqueue to dequeue for the reader's blocks
+};
+
+struct TRACE_RECORD {
+    UINT64 Timestamp;              // Performance counter when the event occurred
+    UINT16 EventId;                // Trace event ID
+    UINT16 Cpu;                    // Processor the event occurred on
+    UINT32 ThreadId;               // Thread the event occurred on
+    UINT32 Args[4];                // Event arguments
+};
+
+struct TRACE_DUMP {
+    UINT64              Frequency;    // Performance counter ticks per second
+    UINT32              NumRecords;   // Number of records in the dump
+    UINT32              LostRecords;  // Number of records overwritten or not copied
+    struct TRACE_RECORD Records[1];   // Records, oldest first for each processor
+};
+
+struct READER_DROPS {
+    UINT32 ReaderId;               // Reader ID
+    UINT32 Reserved;               // Reserved (0)
+    UINT64 DroppedBlocks;          // Number of blocks dropped for the reader
+};
+
+struct SYNTHETIC_EVENTS_REQUEST {
+    UINT32 NumThreads;             // Number of generator threads
+    UINT32 Duration;               // Milliseconds to generate events for
+    UINT32 Rate;                   // Target events per second across all threads (0 for as fast as possible)
+    UINT32 ProcessWeight;          // Relative share of process start and end events
+    UINT32 ConnectionWeight;       // Relative share of connection open and close events
+    UINT32 PacketWeight;           // Relative share of packet events
+    UINT32 PacketLength;           // Bytes of data in each packet block
+    UINT32 Flags;                  // Synthetic event flags
+};
+
+struct SYNTHETIC_EVENTS_RESULT {
+    UINT64              ProcessEvents;    // Number of process blocks enqueued
+    UINT64              ConnectionEvents; // Number of connection blocks enqueued
+    UINT64              PacketEvents;     // Number of packet blocks enqueued
+    UINT64              FailedEvents;     // Number of events the queue manager could not enqueue
+    UINT64              ElapsedTime;      // Microseconds the run took
+    UINT64              EventsPerSecond;  // Achieved events per second
+    UINT32              NumReaders;       // Number of readers in the array
+    UINT32              Reserved;         // Reserved (0)
+    struct READER_DROPS Readers[SYNTHETIC_MAX_READERS]; // Blocks dropped for each reader during the run
+};
+
+struct SHARED_READER_STATISTICS {
+    UINT32 ReaderId;               // Reader's ID
+    UINT32 BufferSize;             // Reader's ring buffer size
+    UINT32 QueuedBlocks;           // Number of blocks waiting in the reader's ring buffer
+    UINT32 PeakQueuedBlocks;       // Most blocks ever waiting in the reader's ring buffer
+    UINT64 DroppedBlocks;          // Number of blocks dropped because the reader's ring buffer was full
+    UINT64 ReadBlocks;             // Number of blocks the reader read
+    UINT64 ReadBytes;              // Number of bytes the reader read
+    INT64  LastReadTime;           // Driver uptime in microseconds when the reader last read a block
+};
+
+struct SHARED_STATISTICS {
+    UINT32            Version;     // Layout version (SHARED_STATISTICS_VERSION)
+    UINT32            Length;      // Size of the structure in bytes
+    volatile LONG     Sequence;    // Odd while the driver is updating the page
+    UINT32            UpdatePeriod; // Milliseconds between updates
+    INT64             UpdateTime;  // Driver uptime in microseconds when the page was last updated
+    struct STATISTICS Statistics;  // Driver statistics, with the reader fields set to 0
+    UINT32            NumReaders;  // Number of readers in the array
+    UINT32            Reserved;    // Reserved (0)
+    struct SHARED_READER_STATISTICS Readers[SHARED_STATISTICS_MAX_READERS]; // Registered readers
+};
+
+struct LARGEST_BLOCK {
+    UINT32 BlockType;              // PCAP-NG block type
+    UINT32 BlockLength;            // Block length in bytes
+    UINT32 ProcessId;              // Process ID (0xFFFFFFFF if none)
+    UINT32 ConnectionId;           // Connection ID (0xFFFFFFFF if none)
+    UINT32 Location;               // Where the queue manager holds the block (LARGEST_BLOCK_LOCATION)
+    LONG   RefCount;               // Block reference count
+    UINT32 Tag;                    // Pool tag of the block's data buffer
+    UINT32 Reserved;               // Reserved (0)
+    UINT64 Sequence;               // Sequence number (0 if not enqueued to any reader)
+};
+
+struct LARGEST_BLOCKS {
+    UINT32               NumBlocks;    // Number of blocks in the array
+    UINT32               TotalBlocks;  // Number of blocks the driver looked at
+    struct LARGEST_BLOCK Blocks[1];    // Blocks, largest first
+};
+
+struct LOCK_SITE_PROFILE {
+    UINT32 Lock;                   // Lock the call site acquires (TRACE_LOCK)
+    UINT32 Line;                   // Line in queue_manager.c that acquires the lock
+    UINT64 Acquisitions;           // Number of times the call site acquired the lock
+    UINT64 ContendedAcquisitions;  // Acquisitions that found the lock held or other processors waiting
+    UINT64 SpinTicks;              // Total time spent waiting for the lock
+    UINT64 MaxSpinTicks;           // Longest time spent waiting for the lock
+    UINT64 HoldTicks;              // Total time the call site held the lock
+    UINT64 MaxHoldTicks;           // Longest time the call site held the lock
+};
+
+struct LOCK_PROFILE {
+    UINT64                   Frequency;  // Performance counter ticks per second, which times are counted in
+    UINT32                   NumSites;   // Number of call sites in the array
+    UINT32                   LostSites;  // Call sites not profiled because a lock's table was full or the buffer was too small
+    struct LOCK_SITE_PROFILE Sites[1];   // Call sites, grouped by lock
+};
+
 #pragma pack(pop)
 
 //----------------------------------------------------------------------------
@@ -102,12 +469,14 @@ struct STATISTICS {
 #define IOCTL_KPH_MARK_RESTART CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
     IoctlRestart, METHOD_NEITHER, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
 
-/// @brief Registers connection IDs to filter packet blocks for
+/// @brief Registers connection IDs to filter blocks for
 ///
 /// * The reader passes a list of 32-bit connection IDs to filter in the buffer
 /// * An empty list disables connection ID filtering
-/// * Read operations will not return any packet block that has the filtered
-///   connection ID
+/// * Read operations will not return any connection or packet block that has
+///   a filtered connection ID.  In include mode, they only return connection
+///   and packet blocks that have a listed connection ID.  Other blocks do not
+///   have connection IDs, so this filter does not affect them.
 /// * Filtered IDs are on a per-reader basis, so different readers can filter
 ///   blocks for different IDs
 /// * Readers can use the SIO_QUERY_WFP_ALE_ENDPOINT_HANDLE Windows Socket API
@@ -115,12 +484,13 @@ struct STATISTICS {
 #define IOCTL_KPH_FILTER_CONNECTIONS CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
     IoctlFilterConnections, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
 
-/// @brief Registers process IDs to filter packet blocks for
+/// @brief Registers process IDs to filter blocks for
 ///
 /// * The reader passes a list of 32-bit process IDs to filter in the buffer
 /// * An empty list disables process ID filtering
-/// * Read operations will not return any packet block that has the filtered
-///   process ID
+/// * Read operations will not return any connection, image load, packet, or
+///   process block that has a filtered process ID.  In include mode, they
+///   only return those blocks if they have a listed process ID.
 /// * Filtered IDs are on a per-reader basis, so different readers can filter
 ///   blocks for different IDs
 #define IOCTL_KPH_FILTER_PROCESSES CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
@@ -172,6 +542,268 @@ struct STATISTICS {
 #define IOCTL_KPH_GET_STATISTICS CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
     IoctlGetStatistics, METHOD_BUFFERED, FILE_READ_ACCESS)
 
+/// @brief Enables or disables image load blocks for the reader
+///
+/// * The reader passes a 32-bit value in the buffer: nonzero enables image
+///   load blocks and 0 disables them
+/// * Image load blocks are disabled by default, and the driver does no work to
+///   collect image loads while no reader has them enabled
+/// * Each process reports a given image once, even if it loads the image many
+///   times.  Drivers are reported with process ID 0 and the kernel image flag.
+/// * Each block carries an interned path ID.  The path itself is included the
+///   first time the reader receives the ID after enabling image load blocks or
+///   restarting.  A block dropped because the ring buffer is full or filtered
+///   out does not count, so the next block with that ID carries the path.
+/// * Fails with STATUS_INSUFFICIENT_RESOURCES if the driver cannot allocate
+///   the memory to track which paths the reader received
+#define IOCTL_KPH_SET_IMAGE_EVENTS CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlSetImageEvents, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Gets the range of block sequence numbers the reader still holds
+///
+/// * The reader passes a buffer, which must be large enough to hold a sequence
+///   range structure
+/// * Connection, image load, packet, and process blocks carry a 64-bit
+///   sequence number in option 259.  Sequence numbers increase by one for
+///   each block the driver enqueues, in the order the blocks are enqueued.
+///   Blocks enqueued while no reader was registered have sequence number 0,
+///   and the initial blocks keep the sequence numbers they were enqueued with.
+/// * Oldest is greater than Newest when the reader's ring buffer is empty
+/// * A gap between consecutive blocks means the reader missed blocks, unless
+///   the reader filtered them (for example by not enabling image load blocks).
+///   Dropped changes whenever the reader loses a block to a full ring buffer.
+#define IOCTL_KPH_GET_SEQUENCE_RANGE CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlGetSequenceRange, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/// @brief Gets recently exited processes from the driver's exit history
+///
+/// * The reader passes an exit history query structure in the buffer, which
+///   selects processes by the timestamp of their process ended block
+/// * The driver returns the process started and ended blocks for each selected
+///   process, oldest first, in the same PCAP-NG format as read operations
+/// * The driver only returns whole pairs of blocks.  If the buffer is too small
+///   to hold every selected process, the driver returns STATUS_BUFFER_OVERFLOW
+///   along with the pairs that fit.
+/// * The history holds a limited number of the most recently exited processes
+///   and forgets processes that exited more than ten minutes ago.  The same
+///   processes follow the running processes in the initial blocks.
+#define IOCTL_KPH_GET_EXIT_HISTORY CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlGetExitHistory, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/// @brief Sets how many blocks complete the reader's pending overlapped reads
+///
+/// * The reader passes a buffer containing a 32-bit watermark (0 and 1 both
+///   mean any block)
+/// * A read on a handle opened for overlapped I/O does not return zero bytes
+///   when there are no blocks.  Instead the read stays pending until the
+///   reader's ring buffer holds at least the watermark number of blocks, the
+///   reader restarts, or the reader cancels the read.  Reads on synchronous
+///   handles still return zero bytes when there are no blocks.
+/// * A watermark above 1 saves completions when blocks arrive steadily, but
+///   blocks below the watermark wait until more blocks arrive
+#define IOCTL_KPH_SET_READ_WATERMARK CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlSetReadWatermark, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Sets the format the reader reads blocks in
+///
+/// * The reader passes a buffer containing a 32-bit record format
+/// * The new format starts at the next block boundary
+/// * RecordFormatPcapNg returns PCAP-NG blocks (the default)
+/// * RecordFormatCompact returns one compact record for each process started
+///   and process ended block.  The driver stops queuing every other block for
+///   the reader, so they do not take up ring buffer slots, and drops those
+///   already queued when it reads them.  After switching back to
+///   RecordFormatPcapNg, restart the reader to get a complete PCAP-NG stream.
+/// * Each compact record starts with a fixed-size compact record header.
+///   Three strings follow the header: the executable path, the raw command
+///   line, and the user SID.
+///   Each string is a 16-bit length followed by that many bytes of UTF-8,
+///   without a null terminator.  Empty strings have a length of 0.  Records
+///   are padded to a multiple of 4 bytes, and RecordLength includes the
+///   padding.
+#define IOCTL_KPH_SET_RECORD_FORMAT CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlSetRecordFormat, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Sets whether the connection and process ID filters include or
+/// exclude the listed IDs
+///
+/// * The reader passes a filter modes structure in the buffer
+/// * Both filters exclude the listed IDs until the reader sets their modes
+/// * The driver applies the filters when it adds blocks to the reader's ring
+///   buffer, so filtered blocks do not take up space in the ring buffer.  The
+///   driver also applies them to the initial blocks.
+#define IOCTL_KPH_SET_FILTER_MODES CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlSetFilterModes, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Sets the rule program that selects which process blocks the reader
+/// receives
+///
+/// * The reader passes a rule program in the buffer.  An empty buffer removes
+///   the reader's rule program.
+/// * The driver checks the rules in order for each process started and process
+///   ended block, and takes the action of the first rule that matches.  If no
+///   rule matches, it takes the default action.  Rules joined with
+///   RULE_FLAG_AND_NEXT match only if all of them match, and take the action
+///   of the last rule.
+/// * Process ended blocks match the attributes of the process started block,
+///   so a reader receives both blocks for a process or neither
+/// * The path hash is the 32-bit FNV-1a hash of the UTF-8 path with ASCII
+///   letters converted to lower case
+/// * Rules do not affect other blocks.  They apply to the initial blocks too.
+/// * Programs can hold up to 1024 rules and 64 KB
+#define IOCTL_KPH_SET_RULE_PROGRAM CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlSetRuleProgram, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Sets the consumer group the reader belongs to
+///
+/// * The reader passes a 32-bit consumer group ID in the buffer.  Group 0
+///   means no group, which is the default.
+/// * Readers in the same group split the blocks between them instead of each
+///   receiving every block.  The driver sends each block to one member, which
+///   it picks from the block's process ID, so all blocks for a process go to
+///   the same member in order.  Blocks without a process ID are split by
+///   connection ID.
+/// * The split is a fixed hash of the ID over the number of members, not a
+///   shared queue.  Members are renumbered whenever a reader joins or leaves
+///   the group, so from then on the blocks for a process can go to another
+///   member, even partway through the process's life.  About half of the
+///   processes move when a reader joins or the newest member leaves.
+/// * Blocks already queued to a member that leaves the group, or closes its
+///   handle, are discarded with the member's ring buffer.  They are not
+///   passed to the other members.  Members that must not lose blocks should
+///   drain their ring buffer before leaving.
+/// * Each member still applies its own filters, snap length, and rule
+///   program to the blocks it is sent.  Members should use the same settings
+///   so the group as a whole receives every block it wants.
+/// * The split applies to the initial blocks too, so each member should get
+///   its own initial blocks after joining
+/// * Sequence numbers have gaps for blocks sent to other members
+#define IOCTL_KPH_SET_CONSUMER_GROUP CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlSetConsumerGroup, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Gets extended statistics about the reader's health and the
+/// driver's memory use
+///
+/// * The reader passes a buffer, which must be large enough to hold at least
+///   the Version and Length fields
+/// * The driver fills in as much of the extended statistics structure as fits
+///   and sets Length to the number of bytes it filled in.  Later versions only
+///   add fields to the end, so older readers keep working.
+/// * Peak queued blocks and the dropped, read, and idle counters cover the
+///   reader's whole registration.  They are not reset on restart.
+/// * Version 2 adds live and peak memory use for each queue manager pool
+///   tag, and block nodes in use by block type
+/// * Version 3 adds the loaded process ID cache counters, which the original
+///   statistics structure cannot grow to hold
+/// * Version 4 adds memory tag types after MemoryStatistics for the compact
+///   records and the memory the driver allocates outside the queue manager.
+///   The memory array grows, so the version 3 counters move.
+/// * The original statistics IOCTL is unchanged
+#define IOCTL_KPH_GET_STATISTICS_V2 CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlGetStatisticsV2, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/// @brief Enables, disables, or resets latency tracking
+///
+/// * The reader passes 32-bit latency tracking flags in the buffer
+/// * Latency tracking is disabled when the driver loads, since it reads the
+///   performance counter several times for each event
+/// * Tracking is driver-wide.  Resetting clears the driver-wide histograms and
+///   the calling reader's histogram.
+#define IOCTL_KPH_SET_LATENCY_TRACKING CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlSetLatencyTracking, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Gets the latency histograms
+///
+/// * The reader passes a buffer, which must be large enough to hold a latency
+///   histograms structure
+/// * Histograms count durations in performance counter ticks
+/// * The enqueue to dequeue histogram only counts live blocks, not initial
+///   blocks
+#define IOCTL_KPH_GET_LATENCY CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlGetLatency, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/// @brief Gets the binary trace records
+///
+/// * The reader passes a buffer, which must be large enough to hold at least
+///   the trace dump header
+/// * The driver copies as many records as fit, oldest first for each
+///   processor, and counts the rest as lost
+/// * Each processor keeps its most recent 1024 records.  Records written
+///   during the copy may be torn.
+#define IOCTL_KPH_GET_TRACE CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlGetTrace, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/// @brief Generates synthetic events for load testing
+///
+/// * Only drivers built with KPH_CONFIG_SYNTHETIC_EVENTS support this IOCTL.
+///   Other drivers fail it with STATUS_INVALID_DEVICE_REQUEST.
+/// * The reader passes a synthetic events request.  The IOCTL returns when
+///   the run ends, with the results in the same buffer.
+/// * Each thread starts and ends processes and opens and closes connections
+///   with IDs at or above 0xF0000000, and sends packets on a connection that
+///   stays open for the whole run
+/// * Drops are counted across all block types.  Readers see the synthetic
+///   events like any others.
+/// * With SYNTHETIC_FLAG_PROFILE_LOCKS, the driver clears the lock profile
+///   and profiles the locks for the run only.  Get the contention report with
+///   IOCTL_KPH_GET_LOCK_PROFILE afterwards.
+#define IOCTL_KPH_GENERATE_SYNTHETIC_EVENTS CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlGenerateSyntheticEvents, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Maps the shared statistics page into the caller's process
+///
+/// * The driver returns the 64-bit address of a read-only shared statistics
+///   structure.  Calling this again on the same handle returns the same
+///   address.
+/// * The address is only valid in the process that first called this on the
+///   handle.  Calls from other processes, for example through a duplicated
+///   handle, fail with STATUS_ACCESS_DENIED.
+/// * The mapping lasts until the handle is closed or the process exits
+/// * The driver updates the page every UpdatePeriod milliseconds while any
+///   handle has it mapped.  To get a consistent copy, read Sequence, copy the
+///   structure, then read Sequence again.  Retry if Sequence was odd or
+///   changed.
+/// * Check Version and Length before using the structure.  Later versions
+///   only add fields to the end.
+/// * Requires Windows 8 or later, which can map the page read-only.  Other
+///   systems fail this IOCTL with STATUS_NOT_SUPPORTED.
+#define IOCTL_KPH_MAP_SHARED_STATISTICS CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlMapSharedStatistics, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/// @brief Gets the largest blocks the queue manager holds, for debugging
+/// memory use
+///
+/// * The reader passes a buffer, which must be large enough to hold at least
+///   the largest blocks header.  The driver returns as many blocks as fit.
+/// * The driver looks at running processes, open connections, held packets,
+///   and the exit history.  Blocks that are only queued to readers are not
+///   included.
+/// * The blocks can change as soon as the IOCTL returns
+#define IOCTL_KPH_GET_LARGEST_BLOCKS CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlGetLargestBlocks, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/// @brief Enables, disables, or resets lock profiling
+///
+/// * The reader passes 32-bit lock profiling flags in the buffer
+/// * Profiling is disabled when the driver loads.  While disabled, each lock
+///   acquisition only checks a flag.
+/// * Profiling is driver-wide.  It counts acquisitions, contended
+///   acquisitions, spin time, and hold time for each line that acquires the
+///   trees lock or the reader list lock.
+#define IOCTL_KPH_SET_LOCK_PROFILING CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlSetLockProfiling, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Gets the lock call site profiles
+///
+/// * The reader passes a buffer, which must be large enough to hold at least
+///   the lock profile header.  Room for 2 * LOCK_PROFILE_MAX_SITES call sites
+///   always holds every site.
+/// * Hold time is charged to the call site that acquired the lock
+/// * A lock is contended if another processor held or was waiting for it
+///   just before the call site queued for it
+#define IOCTL_KPH_GET_LOCK_PROFILE CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+    IoctlGetLockProfile, METHOD_BUFFERED, FILE_READ_ACCESS)
+
 #ifdef _X86_
 #define IOCTL_KPH_SET_DATA_EVENT  IOCTL_KPH_SET_DATA_EVENT_32
 #else
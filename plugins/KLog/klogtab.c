@@ -35,6 +35,7 @@ BOOLEAN KLogTreeNewCreated = FALSE;
 HWND KLogTreeNewHandle;
 
 static HANDLE gDriver = INVALID_HANDLE_VALUE;
+static BOOLEAN gCompactRecords = FALSE;
 static ULONG PhCsKLogAutoScroll = 0;
 static PPH_MAIN_TAB_PAGE KLogPage;
 static ULONG KLogTreeNewSortColumn;
@@ -54,7 +55,6 @@ static PH_CALLBACK_REGISTRATION SearchChangedRegistration;
 static PWE_KLOG_NODE gPrevBottomNode = NULL;
 
 static BTnode *gBTroot = NULL;
-static BTnode *gBTExitCodesRoot = NULL;
 static LLnode *gBacklogLL = NULL;
 PPH_STRING gExited = NULL;
 
@@ -94,6 +94,12 @@ VOID initDriver()
         PhShowMessage(KLogTreeNewHandle, MB_ICONERROR | MB_OK, L"KLog: Cannot send IOCTL to get snap length");
     }
 
+    // Only process records are needed, so ask for compact records instead of
+    // PCAP-NG blocks. Older drivers reject the IOCTL and keep sending PCAP-NG.
+    UINT32 recordFormat = RecordFormatCompact;
+    gCompactRecords = DeviceIoControl(gDriver, IOCTL_KPH_SET_RECORD_FORMAT, &recordFormat,
+        sizeof(UINT32), NULL, 0, &bytesReturned, NULL);
+
     // Discard first chunk.
     char buffer[bufferSize];
     do
@@ -365,40 +371,47 @@ void add2BT(PWE_KLOG_NODE childNode)
     }
 }
 
-void addExitCode(HANDLE pid, NTSTATUS exitcode)
+BOOLEAN GetExitCodeOption(DWORD *block, DWORD blockLength, NTSTATUS *exitcode)
 {
-    BTnode *node;
+    char *blockData = (char *)block;
+    DWORD optionsEnd;
+    DWORD offset = 20; // Options start after the block type, length, PID and timestamp
+    BOOLEAN found = FALSE;
+    BOOLEAN subsystem = FALSE;
+
+    // The smallest process block holds the header, the parent PID option and
+    // the trailing block length
+    if (blockLength < 32)
+        return FALSE;
 
-    node = BTsearch(gBTExitCodesRoot, pid);
+    optionsEnd = blockLength - 4;
 
-    if (!node)
+    while (offset + 4 <= optionsEnd)
     {
-        BTinsert(&gBTExitCodesRoot, BTnewExitCode(pid, exitcode));
-    }
-    else
-    {
-        node->exitcode = exitcode;
-    }
-}
+        WORD code = *(WORD *)&blockData[offset];
+        WORD len = *(WORD *)&blockData[offset + 2];
 
-void StoreExitCode(PPH_PROCESS_ITEM processItem)
-{
-    if (processItem->QueryHandle)
-    {
-        PROCESS_EXTENDED_BASIC_INFORMATION basicInfo;
-        NTSTATUS exitcode;
+        if (code == 0 || len > optionsEnd - offset - 4)
+            break;
 
-        if (NT_SUCCESS(PhGetProcessExtendedBasicInformation(processItem->QueryHandle, &basicInfo)))
+        if (code == 12 && len == sizeof(NTSTATUS))
         {
-            // The exit code for Linux processes is located in the lower 8-bits.
-            if (basicInfo.IsSubsystemProcess)
-                exitcode = basicInfo.BasicInfo.ExitStatus >> 8;
-            else
-                exitcode = basicInfo.BasicInfo.ExitStatus;
-
-            addExitCode(processItem->ProcessId, exitcode);
+            *exitcode = *(NTSTATUS *)&blockData[offset + 4];
+            found = TRUE;
+        }
+        else if (code == 16)
+        {
+            subsystem = TRUE;
         }
+
+        offset += 4 + ((len + 3) & ~3);
     }
+
+    // The exit code for Linux processes is located in the lower 8-bits.
+    if (found && subsystem)
+        *exitcode >>= 8;
+
+    return found;
 }
 
 VOID WepAddChildKLogNode(
@@ -407,7 +420,8 @@ VOID WepAddChildKLogNode(
     DWORD PID,
     DWORD ParentPID,
     wchar_t *Wexecutable,
-    wchar_t *Wcmdline
+    wchar_t *Wcmdline,
+    NTSTATUS *exitcode
 )
 {
     PWE_KLOG_NODE childNode;
@@ -432,10 +446,10 @@ VOID WepAddChildKLogNode(
     {
         childNode->aklog.startexit = 1;
 
-        if (btnode = BTsearch(gBTExitCodesRoot, PID))
+        if (exitcode)
         {
-            childNode->aklog.exitcode = btnode->exitcode;
-            _itow_s(btnode->exitcode, childNode->aklog.ExitCodestring, 12, 10);
+            childNode->aklog.exitcode = *exitcode;
+            _itow_s(*exitcode, childNode->aklog.ExitCodestring, 12, 10);
         }
 
         if (btnode = BTsearch(gBTroot, PID))
@@ -488,6 +502,82 @@ VOID WepAddChildKLogNode(
         childNode->Node.Visible = PhApplyTreeNewFiltersToNode(&FilterSupport, &childNode->Node);
 }
 
+wchar_t *CompactStringToWide(char *string, WORD len)
+{
+    wchar_t *Wstring;
+    int requiredSize;
+
+    requiredSize = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, string, len, NULL, 0);
+    Wstring = (wchar_t *)malloc((requiredSize + 1) * sizeof(wchar_t));
+    if (Wstring)
+    {
+        requiredSize = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, string, len,
+            Wstring, requiredSize);
+        Wstring[requiredSize] = L'\0';
+    }
+
+    return Wstring;
+}
+
+VOID WepAddCompactKLogNodes(
+    _In_ PPH_TREENEW_CONTEXT Context,
+    char *buff,
+    DWORD bytesread
+    )
+{
+    DWORD offset = 0;
+
+    TreeNew_SetRedraw(KLogTreeNewHandle, FALSE);
+
+    while (offset + sizeof(struct COMPACT_RECORD) <= bytesread)
+    {
+        struct COMPACT_RECORD *record = (struct COMPACT_RECORD *)&buff[offset];
+        char *strings[3]; // Path, command line, SID
+        WORD lengths[3];
+        DWORD pos = offset + sizeof(struct COMPACT_RECORD);
+        int n;
+
+        if (record->RecordLength < sizeof(struct COMPACT_RECORD) || record->RecordLength > bytesread - offset)
+            break;
+
+        for (n = 0; n < 3; n++)
+        {
+            lengths[n] = *(WORD *)&buff[pos];
+            strings[n] = &buff[pos + sizeof(WORD)];
+            pos += sizeof(WORD) + lengths[n];
+        }
+
+        if (record->RecordType == CompactProcessEnded)
+        {
+            NTSTATUS exitcode = (NTSTATUS)record->ExitStatus;
+
+            // The exit code for Linux processes is located in the lower 8-bits.
+            if (record->Flags & COMPACT_FLAG_SUBSYSTEM)
+                exitcode >>= 8;
+
+            WepAddChildKLogNode(Context, record->Timestamp, record->ProcessId, record->ParentProcessId,
+                NULL, NULL, (record->Flags & COMPACT_FLAG_EXIT_STATUS) ? &exitcode : NULL);
+        }
+        else if (record->RecordType == CompactProcessStarted)
+        {
+            wchar_t *Wexecutable = CompactStringToWide(strings[0], lengths[0]);
+            wchar_t *Wcmdline = CompactStringToWide(strings[1], lengths[1]);
+
+            if (Wexecutable && Wcmdline)
+                WepAddChildKLogNode(Context, record->Timestamp, record->ProcessId, record->ParentProcessId,
+                    Wexecutable, Wcmdline, NULL);
+
+            free(Wexecutable);
+            free(Wcmdline);
+        }
+
+        offset += record->RecordLength;
+    }
+
+    TreeNew_NodesStructured(KLogTreeNewHandle);
+    TreeNew_SetRedraw(KLogTreeNewHandle, TRUE);
+}
+
 VOID WepAddChildKLogNodes(
     _In_ PPH_TREENEW_CONTEXT Context,
     char *buff,
@@ -504,10 +594,18 @@ VOID WepAddChildKLogNodes(
     DWORD timestamp_low;
     DWORD PID = 0;
     DWORD ParentPID = 0;
+    DWORD blockLength;
+    DWORD blockEnd = 0;
     WORD *execpos = NULL;
     DWORD i;
     int requiredSize;
 
+    if (gCompactRecords)
+    {
+        WepAddCompactKLogNodes(Context, buff, bytesread);
+        return;
+    }
+
     if (bufd[0] != 257)
         return;
 
@@ -525,10 +623,18 @@ VOID WepAddChildKLogNodes(
             PID = bufd[i / 2 + 2];
             ParentPID = bufd[i / 2 + 6];
 
-            if (bufd[i / 2 + 1] == 44 && bufd[i / 2 + 8] == 0xffffffff)
+            blockLength = bufd[i / 2 + 1];
+            blockEnd = i + blockLength / 2;
+
+            // Process ended blocks carry option 2 set to 0xffffffff right
+            // after the parent PID, followed by the exit status and counters
+            if (bufd[i / 2 + 7] == 0x00040002 && bufd[i / 2 + 8] == 0xffffffff)
             {
-                WepAddChildKLogNode(Context, timestamp, PID, ParentPID, NULL, NULL);
-                i += 21;
+                NTSTATUS exitcode;
+
+                WepAddChildKLogNode(Context, timestamp, PID, ParentPID, NULL, NULL,
+                    GetExitCodeOption(&bufd[i / 2], blockLength, &exitcode) ? &exitcode : NULL);
+                i += blockLength / 2 - 1;
             }
             else
                 execpos = &bufw[i + 15];
@@ -551,10 +657,15 @@ VOID WepAddChildKLogNodes(
                 *execpos, Wexecutable, requiredSize);
             Wexecutable[requiredSize] = L'\0';
 
-            WepAddChildKLogNode(Context, timestamp, PID, ParentPID, Wexecutable, Wcmdline);
+            WepAddChildKLogNode(Context, timestamp, PID, ParentPID, Wexecutable, Wcmdline, NULL);
 
             i += len / 2;
 
+            // Skip the remaining options, such as the sequence number, since
+            // their values could look like option headers
+            if (blockEnd > i + 1)
+                i = blockEnd - 1;
+
             free(Wexecutable);
             free(Wcmdline);
         }
@@ -749,7 +860,7 @@ VOID EtInitializeKLogTreeList(
     wchar_t *msg;
     if (gDriver == INVALID_HANDLE_VALUE)
         WepAddChildKLogNode(context, time(NULL) * 1000000LL, 0, 0,
-            msg = L"*** The modified kprocesshacker.sys driver is not started! ***",  msg);
+            msg = L"*** The modified kprocesshacker.sys driver is not started! ***",  msg, NULL);
 
     EtLoadSettingsKLogTreeList();
 }
@@ -801,9 +912,6 @@ void CleanupDriver()
 
     BTfree(gBTroot);
     gBTroot = NULL;
-
-    BTfree(gBTExitCodesRoot);
-    gBTExitCodesRoot = NULL;
 }
 
 VOID EtRemoveKLogNode(
@@ -305,6 +305,5 @@ VOID EtSaveSettingsKLogTreeList(
     );
 
 void CleanupDriver();
-void StoreExitCode(PPH_PROCESS_ITEM processItem);
 
 #endif
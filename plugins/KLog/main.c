@@ -44,7 +44,6 @@ PPH_PLUGIN PluginInstance;
 PH_CALLBACK_REGISTRATION PluginUnloadCallbackRegistration;
 PH_CALLBACK_REGISTRATION MainWindowShowingCallbackRegistration;
 PH_CALLBACK_REGISTRATION ProcessesUpdatedCallbackRegistration;
-PH_CALLBACK_REGISTRATION ProcessRemovedCallbackRegistration;
 
 static HANDLE ModuleProcessId;
 
@@ -80,15 +79,6 @@ LRESULT CALLBACK MainWndPluginSubclassProc(
     return DefSubclassProc(hWnd, uMsg, wParam, lParam);
 }
 
-VOID NTAPI ProcessRemovedHandler(
-    _In_opt_ PVOID Parameter,
-    _In_opt_ PVOID Context
-)
-{
-    PPH_PROCESS_ITEM processItem = Parameter;
-    StoreExitCode(processItem);
-}
-
 LOGICAL DllMain(
     _In_ HINSTANCE Instance,
     _In_ ULONG Reason,
@@ -130,8 +120,6 @@ LOGICAL DllMain(
                 NULL,
                 &ProcessesUpdatedCallbackRegistration
                 );
-            PhRegisterCallback(&PhProcessRemovedEvent, ProcessRemovedHandler, 
-                NULL, &ProcessRemovedCallbackRegistration);
 
             {
                 static PH_SETTING_CREATE settings[] =